@@ -552,6 +552,34 @@ arc_lookup(arc_t *cache, const void *key, size_t len, void **valuep, int async)
     return NULL;
 }
 
+arc_resource_t
+arc_lookup_cached(arc_t *cache, const void *key, size_t len, void **valuep)
+{
+    arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, len, NULL, retain_obj_cb, cache);
+    if (!obj)
+        return NULL;
+
+    arc_state_t *state = ATOMIC_READ(obj->state);
+    if (state != &cache->mru && state != &cache->mfu) {
+        // being fetched or only a ghost entry
+        release_ref(cache->refcnt, obj->node);
+        return NULL;
+    }
+
+    if (!ATOMIC_READ(cache->mode) || UNLIKELY(state != &cache->mfu)) {
+        if (UNLIKELY(arc_move(cache, obj, &cache->mfu) == -1)) {
+            release_ref(cache->refcnt, obj->node);
+            return NULL;
+        }
+        arc_balance(cache);
+    }
+
+    if (valuep)
+        *valuep = obj->ptr;
+
+    return obj;
+}
+
 static void *
 update_obj_cb(void *data, size_t dlen, void *user)
 {
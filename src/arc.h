@@ -82,6 +82,21 @@ void arc_destroy(arc_t *cache);
  */
 arc_resource_t arc_lookup(arc_t *cache, const void *key, size_t klen, void **valuep, int async);
 
+/**
+ * @brief Lookup an object in the cache without fetching it.
+ *
+ * Unlike arc_lookup() nothing is allocated or fetched if the object
+ * is not cached (or if it's only in one of the ghost lists)
+ *
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param key    : The key
+ * @param klen   : The length of the key
+ * @param valuep : a reference to the pointer where to copy the retrieved value
+ * @return An opaque ARC resource which needs to be released using arc_release_resource()
+ *         or NULL if the object is not cached
+ */
+arc_resource_t arc_lookup_cached(arc_t *cache, const void *key, size_t klen, void **valuep);
+
 int arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen);
 
 /**
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/socket.h>
 
 #include "shardcache.h"
 #include "shardcache_internal.h"
@@ -53,14 +54,97 @@ arc_ops_fetch_from_peer_notify_listener_error(void *item, uint32_t idx, void *us
     return -1;
 }
 
+// set while the thread loads keys on behalf of a peer failing over to us
+static __thread int arc_ops_local_load = 0;
+
+void
+arc_ops_load_locally(int enabled)
+{
+    arc_ops_local_load = enabled;
+}
+
+#define ARC_OPS_HEDGE_MIN_DELAY 1000 // (in microsecs) never hedge earlier than this
+#define ARC_OPS_HEDGE_BURST     10   // max hedges which can be sent in a row
+
+typedef struct __shc_fetch_async_s shc_fetch_async_t;
+
+// an attempt to fetch the object from one of the addresses of the owner
 typedef struct
 {
-    cached_object_t *obj;
-    shardcache_t *cache;
+    shc_fetch_async_t *fetch;
     char *peer_addr;
     int fd;
+    uint32_t caps;
+    int hedge; // 1 if this is the hedged attempt
+    struct timeval start;
 } shc_fetch_async_arg_t;
 
+// NOTE: accessed only with the object locked
+struct __shc_fetch_async_s
+{
+    cached_object_t *obj;
+    arc_resource_t res;
+    shardcache_t *cache;
+    int refcnt;                         // attempts running + pending hedge timer
+    shc_fetch_async_arg_t *attempts[2]; // the attempts still running
+    int winner;                         // the attempt which answered first (-1 if none yet)
+    char *hedge_addr;                   // where to send the hedged request
+    unsigned char flags;                // SHC_GET_FLAG_* sent with the requests
+    peer_breaker_t *breaker;            // the circuit breaker guarding the owner
+    shardcache_node_t *node;            // a copy of the owner, holding the addresses
+    struct timeval start;
+};
+
+static void
+arc_ops_fetch_destroy(shc_fetch_async_t *fetch)
+{
+    shardcache_node_destroy(fetch->node);
+    free(fetch);
+}
+
+// the attempt is over, returns 1 if the fetch should be released as well
+static int
+arc_ops_fetch_attempt_done(shc_fetch_async_arg_t *arg)
+{
+    shc_fetch_async_t *fetch = arg->fetch;
+    ATOMIC_DECREMENT(fetch->cache->remote_requests);
+    fetch->attempts[arg->hedge] = NULL;
+    free(arg);
+    return (--fetch->refcnt == 0);
+}
+
+// account the time to the first byte of the response to the attempt
+// (called once per attempt, when the first response arrives)
+static void
+arc_ops_fetch_attempt_sample(shardcache_t *cache, shc_fetch_async_arg_t *arg, int error)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, &arg->start, &diff);
+    connections_pool_sample(cache->connections_pool, arg->peer_addr,
+                            (uint64_t)diff.tv_sec * 1000000 + diff.tv_usec, error);
+}
+
+// track the 95th percentile of the time needed to get the first byte of a
+// remote fetch: the estimate moves up 19 steps when a sample is above it and
+// down by one step otherwise, so it settles where 1 sample out of 20 exceeds it
+static void
+arc_ops_track_fetch_latency(shardcache_t *cache, struct timeval *start)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    uint64_t sample = (uint64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+
+    uint64_t estimate = ATOMIC_READ(cache->fetch_latency);
+    uint64_t step = (estimate >> 8) + 1;
+    if (sample > estimate)
+        estimate += step * 19;
+    else
+        estimate -= (step < estimate) ? step : estimate;
+    ATOMIC_SET(cache->fetch_latency, estimate);
+}
+
 static int
 arc_ops_fetch_from_peer_async_cb(char *peer,
                                  void *key,
@@ -71,29 +155,74 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
                                  void *priv)
 {
     shc_fetch_async_arg_t *arg = (shc_fetch_async_arg_t *)priv;
-    cached_object_t *obj = arg->obj;
-    shardcache_t *cache = arg->cache;
+    shc_fetch_async_t *fetch = arg->fetch;
+    cached_object_t *obj = fetch->obj;
+    arc_resource_t res = fetch->res;
+    shardcache_t *cache = fetch->cache;
     char *peer_addr = arg->peer_addr;
     int fd = arg->fd;
     int total_len = 0;
+    int release = 0;
 
     MUTEX_LOCK(&obj->lock);
 
+    if (fetch->winner != arg->hedge) {
+        shc_fetch_async_arg_t *other = fetch->attempts[!arg->hedge];
+        if (fetch->winner >= 0 || (status == -1 && other)) {
+            // this attempt lost the race (or failed while
+            // the other one is still running), just discard it.
+            // NOTE: a cancelled attempt is not a failure, the time
+            //       it has been waiting is still a lower bound
+            //       of the latency of its address though
+            int failed = (status == -1 && fetch->winner < 0);
+            arc_ops_fetch_attempt_sample(cache, arg, failed);
+            if (failed)
+                peer_breaker_failure(fetch->breaker);
+            if (fd >= 0)
+                close(fd);
+            release = arc_ops_fetch_attempt_done(arg);
+            MUTEX_UNLOCK(&obj->lock);
+            arc_release_resource(cache->arc, res);
+            if (release)
+                arc_ops_fetch_destroy(fetch);
+            return -1;
+        }
+
+        // first response, the other attempt (if any) is cancelled
+        fetch->winner = arg->hedge;
+        arc_ops_fetch_attempt_sample(cache, arg, (status == -1));
+        if (status == -1)
+            peer_breaker_failure(fetch->breaker);
+        else
+            peer_breaker_success(fetch->breaker);
+        if (status != -1)
+            arc_ops_track_fetch_latency(cache, &fetch->start);
+        if (arg->hedge)
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_HEDGES_WON].value);
+        if (other && other->fd >= 0)
+            shutdown(other->fd, SHUT_RDWR);
+    }
+
     if (!obj->res) {
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
         if (fd >= 0)
             close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
+        release = arc_ops_fetch_attempt_done(arg);
         MUTEX_UNLOCK(&obj->lock);
+        if (release)
+            arc_ops_fetch_destroy(fetch);
         return -1;
     }
     if (!obj->listeners) {
         if (fd >= 0)
             close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
+        release = arc_ops_fetch_attempt_done(arg);
         MUTEX_UNLOCK(&obj->lock);
-        free(arg);
-        arc_release_resource(cache->arc, obj->res);
+        arc_release_resource(cache->arc, res);
+        if (release)
+            arc_ops_fetch_destroy(fetch);
         return -1;
     }
     if (status == -1) {
@@ -101,25 +230,30 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         if (fd >= 0)
             close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
+        release = arc_ops_fetch_attempt_done(arg);
         MUTEX_UNLOCK(&obj->lock);
-        arc_drop_resource(cache->arc, obj->res);
-        free(arg);
+        arc_drop_resource(cache->arc, res);
+        if (release)
+            arc_ops_fetch_destroy(fetch);
         return -1;
     } else if (status == 1) {
 
         if (fd >= 0)
-            shardcache_release_connection_for_peer(cache, peer_addr, fd);
-        free(arg);
+            shardcache_release_connection_for_peer_caps(cache, peer_addr, fd, arg->caps);
+        release = arc_ops_fetch_attempt_done(arg);
 
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         int drop = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) || COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) || !obj->dlen);
 
         MUTEX_UNLOCK(&obj->lock);
 
+        if (release)
+            arc_ops_fetch_destroy(fetch);
+
         if (drop)
-            arc_drop_resource(cache->arc, obj->res);
+            arc_drop_resource(cache->arc, res);
         else
-            arc_release_resource(cache->arc, obj->res);
+            arc_release_resource(cache->arc, res);
 
         return 0;
     } else if (len) {
@@ -169,9 +303,110 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
     }
 }
 
+// the pending hedge timer doesn't need the fetch anymore
+static void
+arc_ops_fetch_hedge_release(void *priv)
+{
+    shc_fetch_async_t *fetch = (shc_fetch_async_t *)priv;
+    cached_object_t *obj = fetch->obj;
+    shardcache_t *cache = fetch->cache;
+    arc_resource_t res = fetch->res;
+
+    MUTEX_LOCK(&obj->lock);
+    int release = (--fetch->refcnt == 0);
+    MUTEX_UNLOCK(&obj->lock);
+
+    arc_release_resource(cache->arc, res);
+    if (release)
+        arc_ops_fetch_destroy(fetch);
+}
+
+// the first byte didn't arrive in time, send the same request to another
+// address of the owner: the first attempt answering wins the race.
+// NOTE: hedged requests are only sent on the peer links so that
+//       the async i/o thread never blocks connecting to the peer
+static void
+arc_ops_fetch_hedge(iomux_t *iomux, void *priv)
+{
+    shc_fetch_async_t *fetch = (shc_fetch_async_t *)priv;
+    cached_object_t *obj = fetch->obj;
+    shardcache_t *cache = fetch->cache;
+
+    MUTEX_LOCK(&obj->lock);
+    if (fetch->winner >= 0 || !fetch->attempts[0]) {
+        MUTEX_UNLOCK(&obj->lock);
+        return;
+    }
+
+    // the hedge rate is capped: each remote fetch gives a fraction of a
+    // hedge to the budget and each hedged request takes a whole one
+    int budget = ATOMIC_READ(cache->hedge_budget);
+    while (budget >= 100 && !ATOMIC_CAS(cache->hedge_budget, budget, budget - 100))
+        budget = ATOMIC_READ(cache->hedge_budget);
+    if (budget < 100) {
+        MUTEX_UNLOCK(&obj->lock);
+        return;
+    }
+
+    shc_fetch_async_arg_t *arg = calloc(1, sizeof(shc_fetch_async_arg_t));
+    arg->fetch = fetch;
+    arg->peer_addr = fetch->hedge_addr;
+    arg->fd = -1;
+    arg->hedge = 1;
+    gettimeofday(&arg->start, NULL);
+    arc_retain_resource(cache->arc, fetch->res);
+    fetch->attempts[1] = arg;
+    fetch->refcnt++;
+
+    connections_pool_request(cache->connections_pool, arg->peer_addr);
+    ATOMIC_INCREMENT(cache->remote_requests);
+    if (peer_links_fetch(cache->peer_links,
+                         arg->peer_addr,
+                         obj->key,
+                         obj->klen,
+                         fetch->flags,
+                         arc_ops_fetch_from_peer_async_cb,
+                         arg) != 0)
+    {
+        ATOMIC_DECREMENT(cache->remote_requests);
+        connections_pool_sample(cache->connections_pool, arg->peer_addr, 0, 1);
+        fetch->attempts[1] = NULL;
+        fetch->refcnt--;
+        free(arg);
+        MUTEX_UNLOCK(&obj->lock);
+        arc_release_resource(cache->arc, fetch->res);
+        return;
+    }
+    MUTEX_UNLOCK(&obj->lock);
+
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_HEDGES].value);
+}
+
+// the item couldn't be requested to its owner
+static void
+arc_ops_fetch_from_peer_failed(shardcache_t *cache, cached_object_t *obj)
+{
+    // if the storage is flagged as 'global' we don't want to notify the listeners yet
+    // because an attempt of fetching form the local storage will be done in arc_ops_fetch()
+    if (!cache->storage.global) {
+        if (obj->listeners) {
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
+            list_clear(obj->listeners);
+        }
+
+        COBJ_SET_FLAG(obj, COBJ_FLAG_EVICTED);
+    }
+}
 
+// if 'untracked' is true the peer is not the owner, which can't know
+// that we got a copy, so the object won't be kept in the cache.
+// The SHC_GET_FLAG_* 'flags' can be sent only by the asynchronous fetches
 static int
-arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
+arc_ops_fetch_from_peer(shardcache_t *cache,
+                        cached_object_t *obj,
+                        char *peer,
+                        int untracked,
+                        unsigned char flags)
 {
     int rc = -1;
     if (shardcache_log_level() >= LOG_DEBUG) {
@@ -181,72 +416,158 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
     }
 
     shardcache_node_t *node = shardcache_node_select(cache, peer);
-    if (!peer) {
+    if (!node) {
         SHC_ERROR("Can't find address for node %s\n", peer);
         return rc;
     }
-    char *peer_addr = shardcache_node_get_address(node);
+    peer_breaker_t *breaker = peer_breakers_get(cache->peer_breakers, peer);
+    int num_addresses = shardcache_node_num_addresses(node);
+    int index = connections_pool_select(cache->connections_pool, node);
+    char *peer_addr = shardcache_node_get_address_at_index(node, index);
 
     // another peer is responsible for this item, let's get the value from there
 
-    int fd = shardcache_get_connection_for_peer(cache, peer_addr);
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
-        shc_fetch_async_arg_t *arg = malloc(sizeof(shc_fetch_async_arg_t));
-        arg->obj = obj;
-        arg->cache = cache;
+        shc_fetch_async_t *fetch = calloc(1, sizeof(shc_fetch_async_t));
+        fetch->obj = obj;
+        fetch->res = obj->res;
+        fetch->cache = cache;
+        fetch->winner = -1;
+        fetch->refcnt = 1;
+        fetch->breaker = breaker;
+        fetch->flags = flags;
+        fetch->node = node;
+        gettimeofday(&fetch->start, NULL);
+
+        shc_fetch_async_arg_t *arg = calloc(1, sizeof(shc_fetch_async_arg_t));
+        arg->fetch = fetch;
         arg->peer_addr = peer_addr;
-        arg->fd = fd;
-        async_read_wrk_t *wrk = NULL;
+        arg->fd = -1;
+        arg->caps = 0;
+        arg->start = fetch->start;
+        fetch->attempts[0] = arg;
         arc_retain_resource(cache->arc, obj->res);
-        rc = fetch_from_peer_async(peer_addr,
-                                   (char *)cache->auth,
-                                   SHC_HDR_CSIGNATURE_SIP,
-                                   obj->key,
-                                   obj->klen,
-                                   0,
-                                   0,
-                                   arc_ops_fetch_from_peer_async_cb,
-                                   arg,
-                                   fd,
-                                   &wrk);
-        if (rc == 0) {
-            // Keep the remote object in the cache only 10% of the time.
-            // This is the same logic applied by groupcache to determine hot keys.
-            // Better approaches are possible but maybe unnecessary.
-            if (!cache->force_caching && random() % 10 != 0)
+
+        // Keep the remote object in the cache only 10% of the time.
+        // This is the same logic applied by groupcache to determine hot keys.
+        // Better approaches are possible but maybe unnecessary.
+        // (NOTE: the flag must be set before sending the request since
+        //  the response might be handled before we get back here)
+        if (untracked || (!cache->force_caching && random() % 10 != 0))
+            COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+        else
+            COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
+
+        // pipeline the request on one of the links to the peer
+        // and use a dedicated connection only if not possible
+        // (the attempt counts as a remote request until it's done,
+        //  see arc_ops_fetch_attempt_done())
+        connections_pool_request(cache->connections_pool, peer_addr);
+        ATOMIC_INCREMENT(cache->remote_requests);
+        rc = peer_links_fetch(cache->peer_links,
+                              peer_addr,
+                              obj->key,
+                              obj->klen,
+                              flags,
+                              arc_ops_fetch_from_peer_async_cb,
+                              arg);
+        if (rc != 0) {
+            async_read_wrk_t *wrk = NULL;
+            arg->fd = shardcache_get_connection_for_peer_caps(cache, peer_addr, &arg->caps);
+            // without a session we didn't tell the owner who we are,
+            // so it can't notify us when the copy gets evicted
+            if (!arg->caps && shardcache_tracked_evictions_enabled(cache))
                 COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
-            else
-                COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
+            rc = fetch_from_peer_async_flags(peer_addr,
+                                             (char *)cache->auth,
+                                             SHC_CONNECTION_SIG_HDR(arg->caps, SHC_HDR_CSIGNATURE_SIP),
+                                             obj->key,
+                                             obj->klen,
+                                             flags,
+                                             arc_ops_fetch_from_peer_async_cb,
+                                             arg,
+                                             arg->fd,
+                                             &wrk);
+            if (rc == 0)
+                shardcache_queue_async_read_wrk(cache, wrk);
+        }
 
-            shardcache_queue_async_read_wrk(cache, wrk);
-        } else {
-            // if the storage is flagged as 'global' we don't want to notify the listeners yet
-            // because an attempt of fetching form the local storage will be done in arc_ops_fetch()
-            if (!cache->storage.global) {
-                if (obj->listeners) {
-                    list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
-                    list_clear(obj->listeners);
-                }
+        // if the owner has more addresses, hedge the request in case
+        // the first byte doesn't arrive within the usual latency
+        int hedge_rate = ATOMIC_READ(cache->hedged_fetches);
+        if (rc == 0 && hedge_rate > 0 && num_addresses > 1) {
+            if (ATOMIC_READ(cache->hedge_budget) < 100 * ARC_OPS_HEDGE_BURST)
+                ATOMIC_INCREASE(cache->hedge_budget, hedge_rate);
+
+            uint64_t delay = ATOMIC_READ(cache->fetch_latency);
+            if (delay < ARC_OPS_HEDGE_MIN_DELAY)
+                delay = ARC_OPS_HEDGE_MIN_DELAY;
+            struct timeval timeout = { delay / 1000000, delay % 1000000 };
+
+            fetch->hedge_addr = shardcache_node_get_address_at_index(node,
+                                    (index + 1 + random() % (num_addresses - 1)) % num_addresses);
+            fetch->refcnt++;
+            arc_retain_resource(cache->arc, obj->res);
+            shardcache_schedule_async(cache, &timeout, arc_ops_fetch_hedge,
+                                      fetch, arc_ops_fetch_hedge_release);
+        }
 
-                COBJ_SET_FLAG(obj, COBJ_FLAG_EVICTED);
-            }
-            if (fd >= 0)
-                close(fd);
+        if (rc != 0) {
+            ATOMIC_DECREMENT(cache->remote_requests);
+            connections_pool_sample(cache->connections_pool, peer_addr, 0, 1);
+            peer_breaker_failure(breaker);
+            arc_ops_fetch_from_peer_failed(cache, obj);
+            if (arg->fd >= 0)
+                close(arg->fd);
             arc_release_resource(cache->arc, obj->res);
 
             free(arg);
+            arc_ops_fetch_destroy(fetch);
         }
     } else { 
+        struct timeval start, now, elapsed;
+        gettimeofday(&start, NULL);
+        connections_pool_request(cache->connections_pool, peer_addr);
+        ATOMIC_INCREMENT(cache->remote_requests);
+        uint32_t caps = 0;
+        int fd = shardcache_get_connection_for_peer_caps(cache, peer_addr, &caps);
         fbuf_t value = FBUF_STATIC_INITIALIZER;
-        rc = fetch_from_peer(peer_addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, obj->key, obj->klen, &value, fd);
+        uint64_t version = 0;
+        if (caps & SHC_CAP_CONDITIONAL) {
+            // a conditional get of version 0 returns the value together with
+            // the version assigned by the owner, so that the copy can be
+            // revalidated once expired (see shardcache_revalidate_copy())
+            rc = fetch_from_peer_if_modified(peer_addr, (char *)cache->auth,
+                                             SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                             obj->key, obj->klen, &version, &value, fd);
+            // not modified means that the owner doesn't have the key
+            if (rc == 1)
+                rc = 0;
+        } else {
+            rc = fetch_from_peer(peer_addr, (char *)cache->auth,
+                                 SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                 obj->key, obj->klen, &value, fd);
+        }
+        // the whole response is read at once, its time is the best estimate
+        // of the time to the first byte
+        gettimeofday(&now, NULL);
+        timersub(&now, &start, &elapsed);
+        ATOMIC_DECREMENT(cache->remote_requests);
+        connections_pool_sample(cache->connections_pool, peer_addr,
+                                (uint64_t)elapsed.tv_sec * 1000000 + elapsed.tv_usec, (rc != 0));
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         if (rc == 0) {
-            shardcache_release_connection_for_peer(cache, peer_addr, fd);
+            peer_breaker_success(breaker);
+            shardcache_release_connection_for_peer_caps(cache, peer_addr, fd, caps);
             if (fbuf_used(&value)) {
                 obj->data = fbuf_data(&value);
                 obj->dlen = fbuf_used(&value);
+                obj->version = untracked ? 0 : version;
                 COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
-                if (!cache->force_caching && rand() % 10 != 0)
+                // without a session the owner doesn't know who got the copy
+                if (!caps && shardcache_tracked_evictions_enabled(cache))
+                    untracked = 1;
+                if (untracked || (!cache->force_caching && rand() % 10 != 0))
                     COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
                 else
                     COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
@@ -254,9 +575,11 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
         } else {
             // if succeded the fbuf buffer has been moved to the obj structure
             // but otherwise we have to release it
+            peer_breaker_failure(breaker);
             fbuf_destroy(&value);
             close(fd);
         }
+        shardcache_node_destroy(node);
     }
 
     return rc;
@@ -277,6 +600,7 @@ arc_ops_init(const void *key, size_t len, int async, arc_resource_t res, void *p
         obj->key = obj->kbuf;
     memcpy(obj->key, key, obj->klen);
     obj->data = NULL;
+    obj->version = 0;
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_COMPLETE);
     obj->res = res;
     if (async) {
@@ -317,6 +641,7 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     }
 
     COBJ_SET_FLAG(obj, COBJ_FLAG_FETCHING);
+    obj->version = 0;
 
     ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
 
@@ -327,18 +652,56 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     size_t node_len = sizeof(node_name);
     memset(node_name, 0, node_len);
     // if we are not the owner try asking to the peer responsible for this data
+    int untracked = 0;
     if (!shardcache_test_ownership(cache, obj->key, obj->klen, node_name, &node_len))
     {
         int done = 1;
-        int ret = arc_ops_fetch_from_peer(cache, obj, node_name);
-        if (ret == -1) {
+        int ret = -1;
+        int failover = -1;
+        int skipped = 0;
+        // copies not obtained from the owner can't be kept if the
+        // owners notify the evictions only to the peers they served
+        int tracked = shardcache_tracked_evictions_enabled(cache);
+        peer_breaker_t *breaker = peer_breakers_get(cache->peer_breakers, node_name);
+        if (arc_ops_local_load) {
+            // a peer failed over to us because the owner is unreachable,
+            // asking the owner would just send the request back to it
+            failover = 1;
+        } else if (peer_breaker_allow(breaker)) {
+            ret = arc_ops_fetch_from_peer(cache, obj, node_name, 0, 0);
+        } else {
+            // the circuit to the owner is open, don't wait for it to time out
+            skipped = 1;
+            SHC_DEBUG2("Circuit to peer %s is open, failing over", node_name);
+            if (ATOMIC_READ(cache->breaker_failover)) {
+                char failover_name[1024];
+                size_t failover_len = sizeof(failover_name);
+                failover = shardcache_test_failover_ownership(cache, obj->key, obj->klen,
+                                                              node_name, failover_name,
+                                                              &failover_len);
+                if (failover == 0 && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
+                    // the next node can't be told not to forward the request
+                    // to the owner, fall back to the global storage instead
+                    failover = -1;
+                } else if (failover == 0) {
+                    ret = arc_ops_fetch_from_peer(cache, obj, failover_name,
+                                                  tracked, SHC_GET_FLAG_LOCAL);
+                }
+            }
+        }
+
+        if (failover == 1) {
+            // we are the next node on the continuum, use the local storage
+            done = 0;
+            untracked = tracked;
+        } else if (ret == -1) {
             int check = shardcache_test_migration_ownership(cache,
                                                             obj->key,
                                                             obj->klen,
                                                             node_name,
                                                             &node_len);
             if (check == 0) {
-                ret = arc_ops_fetch_from_peer(cache, obj, node_name);
+                ret = arc_ops_fetch_from_peer(cache, obj, node_name, 0, 0);
             }
 
             if (check == 1 || (ret == -1 && cache->storage.global)) {
@@ -346,7 +709,12 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
                 // migration context, we don't want to return earlier
                 SHC_WARNING("Can't fetch data from peer, falling back to the global storage");
                 done = 0;
+                if (check != 1)
+                    untracked = tracked;
                 COBJ_UNSET_FLAG(obj, COBJ_FLAG_EVICTED);
+            } else if (ret == -1 && skipped && failover == -1 && COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
+                // the peer has been skipped, nobody else is going to notify the listeners
+                arc_ops_fetch_from_peer_failed(cache, obj);
             }
         }
         if (done) {
@@ -386,7 +754,9 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
                shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
                (unsigned long)obj->dlen, keystr);
     } else if (cache->use_persistent_storage && cache->storage.fetch) {
+        ATOMIC_INCREMENT(cache->storage_requests);
         int rc = cache->storage.fetch(obj->key, obj->klen, &obj->data, &obj->dlen, cache->storage.priv);
+        ATOMIC_DECREMENT(cache->storage_requests);
         if (rc == -1) {
             if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
                 list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
@@ -436,14 +806,14 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
                    COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
 
-    if (cache->expire_time > 0 && !evicted && !cache->lazy_expiration)
+    if (cache->expire_time > 0 && !evicted && !untracked && !cache->lazy_expiration)
         shardcache_schedule_expiration(cache, obj->key, obj->klen, cache->expire_time, 0);
 
     MUTEX_UNLOCK(&obj->lock);
 
     ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
 
-    return evicted;
+    return (evicted || untracked);
 }
 
 
@@ -460,6 +830,7 @@ arc_ops_store(void *item, void *data, size_t size, void *priv)
     obj->data = (size > sizeof(obj->dbuf)) ? malloc(size) : obj->dbuf;
     memcpy(obj->data, data, size);
     obj->dlen = size;
+    obj->version = 0;
 
     MUTEX_UNLOCK(&obj->lock);
 }
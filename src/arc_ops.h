@@ -25,6 +25,10 @@ typedef struct {
     struct timeval ts; // the timestamp of when the object has been loaded
                        // into the cache
 
+    uint64_t version; // version of the data used by the CAS commands, assigned on demand
+                      // by the owner (0 if not assigned yet or, for copies of keys owned
+                      // by other nodes, if the version given by the owner isn't known)
+
     linked_list_t *listeners; // list of listeners which will be notified
                               // while the object data is being retreived
 
@@ -35,6 +39,7 @@ typedef struct {
     #define COBJ_FLAG_EVICT    (1<<3)
     #define COBJ_FLAG_DROP     (1<<4)
     #define COBJ_FLAG_FETCHING (1<<5)
+    #define COBJ_FLAG_READ     (1<<6) // served since it was (re)validated
 
     pthread_mutex_t lock; // All operations on this structure should be
                           // synchronized using this lock
@@ -57,5 +62,9 @@ int arc_ops_fetch(void *item, size_t *size, void * priv);
 void arc_ops_evict(void *item, void *priv);
 void arc_ops_store(void *item, void *data, size_t size, void *priv);
 
+// make the keys loaded by the calling thread be fetched from the local
+// storage, even if owned by another node (see shardcache_get_async_local())
+void arc_ops_load_locally(int enabled);
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,379 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <atomic_defs.h>
+
+#include "compression.h"
+#include "messaging.h"
+#include "shardcache.h"
+
+// fast compression, the point is saving bandwidth without adding latency
+#define SHC_ZSTD_LEVEL 1
+
+static int _threshold = SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT;
+
+static uint64_t _counters[SHC_COMPRESSION_NUM_COUNTERS];
+
+struct __shc_decompressor_s {
+    unsigned char hdr[SHC_COMPRESSION_BLOCK_HDR_LEN];
+    int hoff;
+    int algo;
+    uint32_t raw_len;
+    uint32_t data_len;
+    uint32_t doff;
+    char in[SHC_COMPRESSION_BLOCK_SIZE];
+    char out[SHC_COMPRESSION_BLOCK_SIZE];
+};
+
+int
+shc_compression_supported(int algo)
+{
+    switch(algo) {
+        case SHARDCACHE_COMPRESSION_NONE:
+            return 1;
+#ifdef HAVE_LZ4
+        case SHARDCACHE_COMPRESSION_LZ4:
+            return 1;
+#endif
+#ifdef HAVE_ZSTD
+        case SHARDCACHE_COMPRESSION_ZSTD:
+            return 1;
+#endif
+        default:
+            break;
+    }
+    return 0;
+}
+
+uint32_t
+shc_compression_cap(int algo)
+{
+    if (!shc_compression_supported(algo))
+        return 0;
+
+    switch(algo) {
+        case SHARDCACHE_COMPRESSION_LZ4:
+            return SHC_CAP_LZ4;
+        case SHARDCACHE_COMPRESSION_ZSTD:
+            return SHC_CAP_ZSTD;
+        default:
+            break;
+    }
+    return 0;
+}
+
+uint32_t
+shc_compression_caps()
+{
+    return shc_compression_cap(SHARDCACHE_COMPRESSION_LZ4) |
+           shc_compression_cap(SHARDCACHE_COMPRESSION_ZSTD);
+}
+
+int
+shc_compression_select(uint32_t caps)
+{
+    // lz4 is preferred (if both have been negotiated) since it's faster
+    if (caps & shc_compression_cap(SHARDCACHE_COMPRESSION_LZ4))
+        return SHARDCACHE_COMPRESSION_LZ4;
+    if (caps & shc_compression_cap(SHARDCACHE_COMPRESSION_ZSTD))
+        return SHARDCACHE_COMPRESSION_ZSTD;
+    return SHARDCACHE_COMPRESSION_NONE;
+}
+
+int
+shc_compression_threshold(int new_value)
+{
+    int old_value = ATOMIC_READ(_threshold);
+
+    if (new_value >= 0)
+        ATOMIC_SET(_threshold, new_value);
+
+    return old_value;
+}
+
+uint64_t *
+shc_compression_counter(int index)
+{
+    if (index < 0 || index >= SHC_COMPRESSION_NUM_COUNTERS)
+        return NULL;
+    return &_counters[index];
+}
+
+static inline uint64_t
+elapsed_usecs(struct timeval *start)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    return diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+// compress 'len' bytes into 'dst', returns the compressed size
+// or 0 if the data doesn't fit in 'dlen' bytes once compressed
+static size_t
+compress_block(int algo, char *src, size_t len, char *dst, size_t dlen)
+{
+    switch(algo) {
+#ifdef HAVE_LZ4
+        case SHARDCACHE_COMPRESSION_LZ4:
+        {
+            int rc = LZ4_compress_default(src, dst, len, dlen);
+            return rc > 0 ? rc : 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case SHARDCACHE_COMPRESSION_ZSTD:
+        {
+            size_t rc = ZSTD_compress(dst, dlen, src, len, SHC_ZSTD_LEVEL);
+            return ZSTD_isError(rc) ? 0 : rc;
+        }
+#endif
+        default:
+            break;
+    }
+    return 0;
+}
+
+static int
+decompress_block(int algo, char *src, size_t len, char *dst, size_t dlen)
+{
+    switch(algo) {
+        case SHARDCACHE_COMPRESSION_NONE:
+            if (len != dlen)
+                return -1;
+            memcpy(dst, src, len);
+            return 0;
+#ifdef HAVE_LZ4
+        case SHARDCACHE_COMPRESSION_LZ4:
+            return (LZ4_decompress_safe(src, dst, len, dlen) == (int)dlen) ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+        case SHARDCACHE_COMPRESSION_ZSTD:
+            return (ZSTD_decompress(dst, dlen, src, len) == dlen) ? 0 : -1;
+#endif
+        default:
+            break;
+    }
+    return -1;
+}
+
+static inline void
+block_header(char *hdr, int algo, uint32_t raw_len, uint32_t data_len)
+{
+    uint32_t raw_len_nbo = htonl(raw_len);
+    uint32_t data_len_nbo = htonl(data_len);
+    hdr[0] = algo;
+    memcpy(hdr + 1, &raw_len_nbo, sizeof(uint32_t));
+    memcpy(hdr + 5, &data_len_nbo, sizeof(uint32_t));
+}
+
+int
+shc_compress(int algo, void *data, size_t len, fbuf_t *out)
+{
+    if (!shc_compression_supported(algo))
+        return -1;
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    size_t initial_len = fbuf_used(out);
+    size_t offset = 0;
+    while (offset < len) {
+        size_t raw_len = len - offset;
+        if (raw_len > SHC_COMPRESSION_BLOCK_SIZE)
+            raw_len = SHC_COMPRESSION_BLOCK_SIZE;
+
+        // reserve room for the uncompressed data, if the compressed one
+        // isn't smaller the block is sent uncompressed
+        // (fbuf keeps the data null-terminated, hence the extra byte)
+        size_t used = fbuf_used(out);
+        if (fbuf_extend(out, used + SHC_COMPRESSION_BLOCK_HDR_LEN + raw_len + 1) != 0) {
+            fbuf_set_used(out, initial_len);
+            return -1;
+        }
+
+        char *hdr = fbuf_data(out) + used;
+        char *src = (char *)data + offset;
+        size_t data_len = 0;
+        if (algo != SHARDCACHE_COMPRESSION_NONE)
+            data_len = compress_block(algo, src, raw_len,
+                                      hdr + SHC_COMPRESSION_BLOCK_HDR_LEN, raw_len - 1);
+        if (data_len) {
+            block_header(hdr, algo, raw_len, data_len);
+        } else {
+            data_len = raw_len;
+            memcpy(hdr + SHC_COMPRESSION_BLOCK_HDR_LEN, src, raw_len);
+            block_header(hdr, SHARDCACHE_COMPRESSION_NONE, raw_len, data_len);
+        }
+        fbuf_set_used(out, used + SHC_COMPRESSION_BLOCK_HDR_LEN + data_len);
+        offset += raw_len;
+    }
+
+    uint64_t raw = ATOMIC_INCREASE(_counters[SHC_COMPRESSION_COUNTER_RAW_BYTES], len);
+    uint64_t compressed = ATOMIC_INCREASE(_counters[SHC_COMPRESSION_COUNTER_COMPRESSED_BYTES],
+                                          fbuf_used(out) - initial_len);
+    if (raw)
+        ATOMIC_SET(_counters[SHC_COMPRESSION_COUNTER_RATIO], (compressed * 1000) / raw);
+    ATOMIC_INCREASE(_counters[SHC_COMPRESSION_COUNTER_COMPRESS_USECS], elapsed_usecs(&start));
+
+    return 0;
+}
+
+static int
+parse_block_header(unsigned char *hdr, int *algo, uint32_t *raw_len, uint32_t *data_len)
+{
+    uint32_t len;
+    *algo = hdr[0];
+    memcpy(&len, hdr + 1, sizeof(uint32_t));
+    *raw_len = ntohl(len);
+    memcpy(&len, hdr + 5, sizeof(uint32_t));
+    *data_len = ntohl(len);
+
+    if (!shc_compression_supported(*algo) ||
+        *raw_len > SHC_COMPRESSION_BLOCK_SIZE ||
+        *data_len > *raw_len ||
+        (*algo == SHARDCACHE_COMPRESSION_NONE && *data_len != *raw_len))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int
+shc_decompress(void *data, size_t len, size_t maxlen, fbuf_t *out)
+{
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    size_t initial_len = fbuf_used(out);
+    unsigned char *p = data;
+    while (len) {
+        int algo;
+        uint32_t raw_len, data_len;
+        if (len < SHC_COMPRESSION_BLOCK_HDR_LEN ||
+            parse_block_header(p, &algo, &raw_len, &data_len) != 0 ||
+            len - SHC_COMPRESSION_BLOCK_HDR_LEN < data_len ||
+            fbuf_used(out) - initial_len + raw_len > maxlen)
+        {
+            fbuf_set_used(out, initial_len);
+            return -1;
+        }
+        p += SHC_COMPRESSION_BLOCK_HDR_LEN;
+        len -= SHC_COMPRESSION_BLOCK_HDR_LEN;
+
+        size_t used = fbuf_used(out);
+        if (fbuf_extend(out, used + raw_len + 1) != 0 ||
+            decompress_block(algo, (char *)p, data_len, fbuf_data(out) + used, raw_len) != 0)
+        {
+            fbuf_set_used(out, initial_len);
+            return -1;
+        }
+        fbuf_set_used(out, used + raw_len);
+        p += data_len;
+        len -= data_len;
+    }
+
+    ATOMIC_INCREASE(_counters[SHC_COMPRESSION_COUNTER_DECOMPRESSED], fbuf_used(out) - initial_len);
+    ATOMIC_INCREASE(_counters[SHC_COMPRESSION_COUNTER_DECOMPRESS_USECS], elapsed_usecs(&start));
+
+    return 0;
+}
+
+shc_decompressor_t *
+shc_decompressor_create()
+{
+    return calloc(1, sizeof(shc_decompressor_t));
+}
+
+void
+shc_decompressor_destroy(shc_decompressor_t *dc)
+{
+    free(dc);
+}
+
+void
+shc_decompressor_reset(shc_decompressor_t *dc)
+{
+    dc->hoff = 0;
+    dc->doff = 0;
+    dc->data_len = 0;
+}
+
+int
+shc_decompressor_idle(shc_decompressor_t *dc)
+{
+    return (dc->hoff == 0);
+}
+
+int
+shc_decompressor_feed(shc_decompressor_t *dc,
+                      void *data,
+                      size_t len,
+                      shc_decompressor_cb_t cb,
+                      void *priv)
+{
+    char *p = data;
+    while (len) {
+        if (dc->hoff < SHC_COMPRESSION_BLOCK_HDR_LEN) {
+            size_t copy = SHC_COMPRESSION_BLOCK_HDR_LEN - dc->hoff;
+            if (copy > len)
+                copy = len;
+            memcpy(dc->hdr + dc->hoff, p, copy);
+            dc->hoff += copy;
+            p += copy;
+            len -= copy;
+            if (dc->hoff < SHC_COMPRESSION_BLOCK_HDR_LEN)
+                break;
+            if (parse_block_header(dc->hdr, &dc->algo, &dc->raw_len, &dc->data_len) != 0)
+                return -1;
+            dc->doff = 0;
+            if (dc->data_len == 0) {
+                dc->hoff = 0;
+                continue;
+            }
+        }
+
+        size_t copy = dc->data_len - dc->doff;
+        if (copy > len)
+            copy = len;
+
+        if (dc->algo == SHARDCACHE_COMPRESSION_NONE) {
+            // uncompressed data can be passed through as it comes
+            if (cb(p, copy, priv) != 0)
+                return -1;
+        } else {
+            memcpy(dc->in + dc->doff, p, copy);
+        }
+        dc->doff += copy;
+        p += copy;
+        len -= copy;
+
+        if (dc->doff == dc->data_len) {
+            if (dc->algo != SHARDCACHE_COMPRESSION_NONE) {
+                struct timeval start;
+                gettimeofday(&start, NULL);
+                if (decompress_block(dc->algo, dc->in, dc->data_len, dc->out, dc->raw_len) != 0)
+                    return -1;
+                ATOMIC_INCREASE(_counters[SHC_COMPRESSION_COUNTER_DECOMPRESSED], dc->raw_len);
+                ATOMIC_INCREASE(_counters[SHC_COMPRESSION_COUNTER_DECOMPRESS_USECS],
+                                elapsed_usecs(&start));
+                if (cb(dc->out, dc->raw_len, priv) != 0)
+                    return -1;
+            }
+            dc->hoff = 0;
+        }
+    }
+    return 0;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,86 @@
+#ifndef __SHARDCACHE_COMPRESSION_H__
+#define __SHARDCACHE_COMPRESSION_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <fbuf.h>
+
+/* Compressed records are sent as a sequence of blocks, each one holding
+ * up to SHC_COMPRESSION_BLOCK_SIZE bytes of the original data:
+ *
+ *   <ALGORITHM><RAW_LENGTH><DATA_LENGTH><DATA>
+ *
+ * ALGORITHM is one of the SHARDCACHE_COMPRESSION_* values (NONE if the data
+ * wasn't compressible) and both lengths are 32bit in network byte order.
+ * Blocks are independent so they can be produced and consumed one at a time
+ * while streaming a value (see docs/protocol.txt)
+ */
+#define SHC_COMPRESSION_BLOCK_SIZE    32768
+#define SHC_COMPRESSION_BLOCK_HDR_LEN 9
+
+// the algorithms supported by this build (LZ4 and ZSTD are
+// enabled at compile time with HAVE_LZ4 and HAVE_ZSTD)
+int shc_compression_supported(int algo);
+
+// the capability to negotiate to receive data compressed with 'algo'
+// (0 if the algorithm is not supported by this build)
+uint32_t shc_compression_cap(int algo);
+
+// all the compression capabilities supported by this build
+uint32_t shc_compression_caps();
+
+// the algorithm to use to compress the messages sent on
+// a connection where the capabilities 'caps' have been negotiated
+int shc_compression_select(uint32_t caps);
+
+// minimum size of the records worth compressing (-1 only queries the actual value)
+int shc_compression_threshold(int new_value);
+
+// append to 'out' the blocks encoding 'len' bytes of data
+int shc_compress(int algo, void *data, size_t len, fbuf_t *out);
+
+// decode a sequence of complete blocks appending the original data to 'out'
+// (fails if more than 'maxlen' bytes would be produced)
+int shc_decompress(void *data, size_t len, size_t maxlen, fbuf_t *out);
+
+// incremental decoder for blocks received in arbitrary pieces,
+// 'cb' is called with the original data of each decoded block
+typedef struct __shc_decompressor_s shc_decompressor_t;
+
+typedef int (*shc_decompressor_cb_t)(void *data, size_t len, void *priv);
+
+shc_decompressor_t *shc_decompressor_create();
+void shc_decompressor_destroy(shc_decompressor_t *dc);
+// discard any partially received block
+void shc_decompressor_reset(shc_decompressor_t *dc);
+// returns 0 on success, -1 if the data is corrupted or the callback failed
+int shc_decompressor_feed(shc_decompressor_t *dc,
+                          void *data,
+                          size_t len,
+                          shc_decompressor_cb_t cb,
+                          void *priv);
+// returns 1 if there is no partially received block
+int shc_decompressor_idle(shc_decompressor_t *dc);
+
+// process-wide compression counters (exported in the stats)
+#define SHC_COMPRESSION_COUNTER_RAW_BYTES        0
+#define SHC_COMPRESSION_COUNTER_COMPRESSED_BYTES 1
+#define SHC_COMPRESSION_COUNTER_RATIO            2
+#define SHC_COMPRESSION_COUNTER_COMPRESS_USECS   3
+#define SHC_COMPRESSION_COUNTER_DECOMPRESSED     4
+#define SHC_COMPRESSION_COUNTER_DECOMPRESS_USECS 5
+#define SHC_COMPRESSION_NUM_COUNTERS             6
+
+#define SHC_COMPRESSION_COUNTER_LABELS_ARRAY \
+        { "compression_raw_bytes", "compression_compressed_bytes", \
+          "compression_ratio_permille", "compression_usecs", \
+          "decompression_bytes", "decompression_usecs" }
+
+// pointer to the value of a compression counter
+// (to be registered with shardcache_counter_add())
+uint64_t *shc_compression_counter(int index);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
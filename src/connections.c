@@ -218,12 +218,7 @@ int read_socket(int fd, char *buf, int len, int ignore_timeout) {
 int
 open_connection(const char *host, int port, unsigned int timeout)
 {
-    int val = 1;
     struct sockaddr_in sockaddr;
-    int sock;
-    int secs = timeout/1000;
-    int msecs = (timeout%1000) * 1000; // struct timeval wants microsecs
-    struct timeval tv = { secs, msecs * 1000 };
 
     errno = EINVAL;
     if (host == NULL || !*host || port == 0)
@@ -233,12 +228,42 @@ open_connection(const char *host, int port, unsigned int timeout)
     if (string2sockaddr(host, port, &sockaddr) == -1)
         return -1;
 
-    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    return open_connection_sockaddr(&sockaddr, timeout);
+}
+
+static int
+open_tcp_socket(void)
+{
+    int val = 1;
+    int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock == -1)
         return -1;
 
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val,  sizeof(val));
+    return sock;
+}
+
+/*!
+ * \brief Open a TCP connection to an already resolved address.
+ * \param sockaddr the address to connect to
+ * \param timeout timeout in milliseconds for connection (send and receive)
+ *        0 to use the system default
+ * \returns file handle on success, or -1 otherwise (errno is set).
+ */
+int
+open_connection_sockaddr(struct sockaddr_in *sockaddr, unsigned int timeout)
+{
+    int sock;
+    int secs = timeout/1000;
+    int msecs = (timeout%1000) * 1000; // struct timeval wants microsecs
+    struct timeval tv = { secs, msecs * 1000 };
+    char *host = inet_ntoa(sockaddr->sin_addr);
+    int port = ntohs(sockaddr->sin_port);
+
+    sock = open_tcp_socket();
+    if (sock == -1)
+        return -1;
 
     if (timeout > 0) {
         if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1
@@ -262,7 +287,7 @@ open_connection(const char *host, int port, unsigned int timeout)
         flags |= O_NONBLOCK;
         fcntl(sock, F_SETFL, flags);
 
-        int rc = connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+        int rc = connect(sock, (struct sockaddr *)sockaddr, sizeof(struct sockaddr_in));
         if (rc == 0 || errno == EISCONN) {
             flags &= ~O_NONBLOCK;
             fcntl(sock, F_SETFL, flags);
@@ -334,7 +359,7 @@ open_connection(const char *host, int port, unsigned int timeout)
         return -1;
     }
 
-    if (connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1) {
+    if (connect(sock, (struct sockaddr *)sockaddr, sizeof(struct sockaddr_in)) == -1) {
         shutdown(sock, SHUT_RDWR);
         close(sock);
         return -1;
@@ -344,6 +369,41 @@ open_connection(const char *host, int port, unsigned int timeout)
     return sock;
 }
 
+/*!
+ * \brief Start connecting to an already resolved address without blocking.
+ * \param sockaddr the address to connect to
+ * \param in_progress set to 1 if the connection is still being established
+ *        (the socket becomes writable once done), 0 if already connected
+ * \returns the (non-blocking) file handle on success, or -1 otherwise (errno is set).
+ */
+int
+open_connection_nonblocking(struct sockaddr_in *sockaddr, int *in_progress)
+{
+    int sock = open_tcp_socket();
+    if (sock == -1)
+        return -1;
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    *in_progress = 0;
+    if (connect(sock, (struct sockaddr *)sockaddr, sizeof(struct sockaddr_in)) != 0) {
+        if (errno != EINPROGRESS) {
+            int err = errno;
+            close(sock);
+            errno = err;
+            return -1;
+        }
+        *in_progress = 1;
+    }
+
+    return sock;
+}
+
 /*!
  * \brief Open a UNIX domain socket.
  * \param filename filename for socket
@@ -1,3 +1,5 @@
+#include <netinet/in.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -7,6 +9,9 @@ extern "C" {
 
 int open_socket(const char *host, int port);
 int open_connection(const char *host, int port, unsigned int timeout);
+int open_connection_sockaddr(struct sockaddr_in *sockaddr, unsigned int timeout);
+int open_connection_nonblocking(struct sockaddr_in *sockaddr, int *in_progress);
+int string2sockaddr(const char *host, int port, struct sockaddr_in *sockaddr);
 int open_lsocket(const char *filename);
 int open_fifo(const char *filename);
 
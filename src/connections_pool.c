@@ -1,38 +1,102 @@
 #include <unistd.h>
+#include <stdio.h>
 #include <pthread.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 
 #include <fbuf.h>
 #include <hashtable.h>
-#include <queue.h>
+#include <linklist.h>
 
 #include <atomic_defs.h>
 
 #include "connections_pool.h"
 #include "messaging.h"
+#include "shardcache_node.h"
+#include "counters.h"
 
 #include <errno.h>
 
 
 #include <time.h>
-#include <sys/resource.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define CONNECTIONS_PEER_NUM_COUNTERS 3
+
+// seconds after which the capabilities are negotiated again with a peer
+// which didn't support any (it might have been upgraded in the meanwhile)
+#define CONNECTIONS_POOL_V1_RETRY 60
+
+// seconds without any new sample after which the latency of an address
+// is halved (so that addresses avoided because of past troubles are
+// eventually tried again, but not before a while)
+#define CONNECTIONS_POOL_LATENCY_HALF_LIFE 10
+
+// state kept for each address
+typedef struct {
+    linked_list_t *spare;  // the spare connections (the least recently used first)
+    uint64_t latency;      // EWMA of the time to the first byte of the responses (in microsecs)
+    uint64_t inflight;     // requests sent and not answered yet
+    uint64_t errors;       // requests which failed
+    time_t updated;        // when the latency has been last updated
+    char *counters[CONNECTIONS_PEER_NUM_COUNTERS]; // names of the exported counters
+} connections_peer_t;
 
 struct __connections_pool_s {
-    hashtable_t *table;
+    hashtable_t *table;     // address -> connections_peer_t
+    shardcache_counters_t *counters;
     int tcp_timeout;
     int max_spare;
     int check;
     int expire_time;
-    int fds_limit;
+    pthread_t checker_th;   // validates the idle connections when 'check' is enabled
+    int checker_running;
+    int quit;
+    char *auth;             // secret used to authenticate new connections
+    uint32_t wanted;        // capabilities to negotiate on new connections
+    char *label;            // label identifying us on new connections (if any)
+    hashtable_t *v1_peers;  // peers which don't support any capability
+                            // (mapped to the time they have been detected)
 };
 
 struct __connection_pool_entry_s {
     int fd;
-    struct timeval last_access;
+    uint32_t caps; // capabilities negotiated on the connection (see open_peer_session())
+    struct timeval last_access; // when it has been given back or last validated
 };
 
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+free_connection(void *conn)
+{
+    connection_pool_entry_t *entry = (connection_pool_entry_t *)conn;
+    close(entry->fd);
+    free(entry);
+}
+
+static void
+connections_peer_destroy(connections_peer_t *peer)
+{
+    int i;
+    connection_pool_entry_t *entry = list_shift_value(peer->spare);
+    while (entry) {
+        free_connection(entry);
+        entry = list_shift_value(peer->spare);
+    }
+    list_destroy(peer->spare);
+    for (i = 0; i < CONNECTIONS_PEER_NUM_COUNTERS; i++)
+        free(peer->counters[i]);
+    free(peer);
+}
+
 static inline int
 is_connection_time_valid(connections_pool_t *cc, struct timeval *conn_time)
 {
@@ -53,178 +117,289 @@ connections_pool_t *
 connections_pool_create(int tcp_timeout, int expire_time, int max_spare)
 {
     connections_pool_t *cc = calloc(1, sizeof(connections_pool_t));
-    cc->table = ht_create(128, 65535, (ht_free_item_callback_t)queue_destroy);
+    cc->table = ht_create(128, 65535, (ht_free_item_callback_t)connections_peer_destroy);
+    cc->v1_peers = ht_create(128, 65535, free);
     cc->tcp_timeout = tcp_timeout;
     cc->max_spare = max_spare;
     cc->expire_time = expire_time;
-
-    // XXX - hack to overcome the 1024 FD_SETSIZE limit on some
-    //       system's select() implementation (notably linux)
-    struct rlimit rlim;
-    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
-        int limit = sizeof(fd_set) * rlim.rlim_max;
-        if (!limit)
-            limit = sizeof(fd_set) * rlim.rlim_cur;
-        // defaults to at least 8192 fds
-        cc->fds_limit = (limit > 0) ? limit/FD_SETSIZE : 8192;
-    }
-
     return cc;
 }
 
 void
 connections_pool_destroy(connections_pool_t *cc)
 {
+    ATOMIC_INCREMENT(cc->quit);
+    if (ATOMIC_READ(cc->checker_running))
+        pthread_join(cc->checker_th, NULL);
+    // the exported counters point to the peers being released
+    connections_pool_counters(cc, NULL);
     ht_destroy(cc->table);
+    ht_destroy(cc->v1_peers);
     free(cc);
 }
 
 static void
-free_connection(void *conn)
+connections_peer_export(connections_peer_t *peer, shardcache_counters_t *counters)
 {
-    connection_pool_entry_t *entry = (connection_pool_entry_t *)conn;
-    close(entry->fd);
-    free(entry);
+    shardcache_counter_add(counters, peer->counters[0], &peer->latency);
+    shardcache_counter_add(counters, peer->counters[1], &peer->inflight);
+    shardcache_counter_add(counters, peer->counters[2], &peer->errors);
 }
 
-static queue_t *
-get_connection_queue(connections_pool_t *cc, char *addr)
+static connections_peer_t *
+get_connection_peer(connections_pool_t *cc, char *addr)
 {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
-    pthread_mutex_lock(&lock);
-    queue_t *connection_queue = ht_get(cc->table, addr, strlen(addr), NULL);
-    if (!connection_queue) {
-        // there is no queue, so we are the first one opening a connection to 'addr'
-        connection_queue = queue_create();
-        queue_set_bpool_size(connection_queue, cc->max_spare);
-        queue_set_free_value_callback(connection_queue, free_connection);
-        if (ht_set(cc->table, addr, strlen(addr), connection_queue, 0) != 0) {
+    pthread_mutex_lock(&peers_lock);
+    connections_peer_t *peer = ht_get(cc->table, addr, strlen(addr), NULL);
+    if (!peer) {
+        // there is no list, so we are the first one opening a connection to 'addr'
+        peer = calloc(1, sizeof(connections_peer_t));
+        peer->spare = list_create();
+        if (ht_set(cc->table, addr, strlen(addr), peer, 0) != 0) {
             // ERRORS
-            queue_destroy(connection_queue);
-            pthread_mutex_unlock(&lock);
+            list_destroy(peer->spare);
+            free(peer);
+            pthread_mutex_unlock(&peers_lock);
             return NULL;
         }
+        const char *labels[CONNECTIONS_PEER_NUM_COUNTERS] = { "latency", "inflight", "errors" };
+        int i;
+        for (i = 0; i < CONNECTIONS_PEER_NUM_COUNTERS; i++) {
+            char name[256];
+            snprintf(name, sizeof(name), "peer_%s[%s]", labels[i], addr);
+            peer->counters[i] = strdup(name);
+        }
+        if (cc->counters)
+            connections_peer_export(peer, cc->counters);
+    }
+    pthread_mutex_unlock(&peers_lock);
+    return peer;
+}
+
+static linked_list_t *
+get_connection_list(connections_pool_t *cc, char *addr)
+{
+    connections_peer_t *peer = get_connection_peer(cc, addr);
+    return peer ? peer->spare : NULL;
+}
+
+// the latency is halved every CONNECTIONS_POOL_LATENCY_HALF_LIFE seconds
+// passed without any new sample
+static uint64_t
+connections_peer_latency(connections_peer_t *peer, time_t now)
+{
+    uint64_t latency = ATOMIC_READ(peer->latency);
+    time_t halvings = (now - ATOMIC_READ(peer->updated)) / CONNECTIONS_POOL_LATENCY_HALF_LIFE;
+    if (halvings > 0)
+        latency = (halvings < 64) ? latency >> halvings : 0;
+    return latency;
+}
+
+// account a request answered after 'elapsed' microseconds (or which failed),
+// errors are accounted as if they lasted the whole tcp timeout
+static void
+connections_peer_sample(connections_pool_t *cc, connections_peer_t *peer, uint64_t elapsed, int error)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    if (error) {
+        ATOMIC_INCREMENT(peer->errors);
+        elapsed = (uint64_t)ATOMIC_READ(cc->tcp_timeout) * 1000;
     }
-    pthread_mutex_unlock(&lock);
-    return connection_queue;
+
+    uint64_t latency = connections_peer_latency(peer, now.tv_sec);
+    latency = latency ? latency - (latency >> 3) + (elapsed >> 3) : elapsed;
+    ATOMIC_SET(peer->latency, latency);
+    ATOMIC_SET(peer->updated, now.tv_sec);
 }
 
 int
-connections_queue_empty(hashtable_t *table, void *value, size_t vlen, void *user)
+connections_list_empty(hashtable_t *table, void *value, size_t vlen, void *user)
 {
-    queue_t *connection_queue = (queue_t *)value;
-    connection_pool_entry_t *entry = queue_pop_left(connection_queue);
+    linked_list_t *connection_list = ((connections_peer_t *)value)->spare;
+    connection_pool_entry_t *entry = list_shift_value(connection_list);
     while (entry) {
         close(entry->fd);
         free(entry);
-        entry = queue_pop_left(connection_queue);
+        entry = list_shift_value(connection_list);
     }
     return 1;
 }
 
+// probe an idle connection without ever blocking,
+// returns 0 if it still looks usable, -1 otherwise
 static int
-write_noop(connections_pool_t *cc, int fd, int flags)
+check_connection(int fd)
 {
-    int rc = -1;
-    flags |= O_NONBLOCK;
-    fcntl(fd, F_SETFL, flags);
-    char noop = SHC_HDR_NOOP;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+        return -1;
 
-    int fdset_size = sizeof(fd_set) * cc->fds_limit;
-    // we want to fit at most cc->fds_limit filedescriptors
-    char fdset[fdset_size];
-
-    struct timeval before;
-    gettimeofday(&before, NULL);
-    for (;;) {
-        FD_SET(fd, (fd_set *)fdset);
-        struct timeval timeout = { 1, 0 };
-        int rc = select(fd + 1, NULL, (fd_set *)fdset, NULL, &timeout);
-        switch (rc) {
-            case -1:
-                if (errno == EINTR || errno == EAGAIN)
-                    continue;
-                break;
-            case 1:
-                rc = write(fd, &noop, 1);
-                if (rc <= 0 && errno != EINTR && errno != EAGAIN)
-                    continue;
-                break;
-            default:
-            {
-                suseconds_t msecs = ATOMIC_READ(cc->tcp_timeout);
-                struct timeval limit = { msecs/1000, ((msecs*1000) % 1000000) };
-                struct timeval now;
-                struct timeval diff = { 0, 0 };
-                gettimeofday(&now, NULL);
-                timersub(&now, &before, &diff);
-                if (timercmp(&diff, &limit, >))
-                    break;
-            }
-        }
+#ifdef TCP_INFO
+    struct tcp_info info;
+    len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+        info.tcpi_state != TCP_ESTABLISHED)
+    {
+        return -1;
     }
+#endif
 
-    flags &= ~O_NONBLOCK;
-    fcntl(fd, F_SETFL, flags);
-    return rc;
+    // nothing is expected on an idle connection, if it's readable
+    // the peer either closed it or sent something we can't handle
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int rc = poll(&pfd, 1, 0);
+    if (rc != 0)
+        return -1;
+
+    // the peer ignores noops, a failing write means the connection is gone
+    char noop = SHC_HDR_NOOP;
+    if (send(fd, &noop, 1, MSG_DONTWAIT|MSG_NOSIGNAL) != 1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+
+    return 0;
 }
 
-int
-connections_pool_get(connections_pool_t *cc, char *addr)
+static int
+connections_entry_check(void *item, size_t idx, void *user)
 {
-    queue_t *connection_queue = get_connection_queue(cc, addr);
-    if (!connection_queue)
+    connections_pool_t *cc = (connections_pool_t *)user;
+    connection_pool_entry_t *entry = (connection_pool_entry_t *)item;
+
+    if (is_connection_time_valid(cc, &entry->last_access))
+        return 1;
+
+    if (check_connection(entry->fd) != 0) {
+        free_connection(entry);
         return -1;
+    }
 
-    connection_pool_entry_t *entry = queue_pop_left(connection_queue);
-    while (entry) {
-        int fd = entry->fd;
-        struct timeval last_access = entry->last_access;
-        free(entry);
-        int flags = fcntl(fd, F_GETFL, 0);
-        if (flags == -1) {
-            close(fd);
-            entry = queue_pop_left(connection_queue);
-            continue;
-        }
+    gettimeofday(&entry->last_access, NULL);
+    return 1;
+}
 
+static int
+connections_list_check(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    // the connections are checked in place (the probes never block),
+    // so they are neither taken away from concurrent gets nor reordered
+    list_foreach_value(((connections_peer_t *)value)->spare, connections_entry_check, user);
+    return 1;
+}
+
+static void *
+connections_pool_checker(void *priv)
+{
+    connections_pool_t *cc = (connections_pool_t *)priv;
+    struct timeval last_check;
+    gettimeofday(&last_check, NULL);
+    while (!ATOMIC_READ(cc->quit)) {
+        usleep(100000);
         if (!ATOMIC_READ(cc->check))
-            return fd;
+            continue;
 
-        // XXX - this is a blocking write
-        if (is_connection_time_valid(cc, &last_access) || write_noop(cc, fd, flags) == 1)
-            return fd;
-        else
-            close(fd);
+        // sweep the spare connections twice per expiration period
+        int expire_time = ATOMIC_READ(cc->expire_time);
+        struct timeval interval = { expire_time / 2000, (expire_time % 2000) * 500 };
+        struct timeval now, diff;
+        gettimeofday(&now, NULL);
+        timersub(&now, &last_check, &diff);
+        if (timercmp(&diff, &interval, <))
+            continue;
 
-        entry = queue_pop_left(connection_queue);
+        ht_foreach_value(cc->table, connections_list_check, cc);
+        gettimeofday(&last_check, NULL);
+    }
+    return NULL;
+}
+
+static void *
+connections_v1_since_cb(void *data, size_t dlen, void *user)
+{
+    *((time_t *)user) = *((time_t *)data);
+    return NULL;
+}
+
+static int
+connections_pool_is_v1_peer(connections_pool_t *cc, char *addr)
+{
+    time_t since = 0;
+    ht_get_deep_copy(cc->v1_peers, addr, strlen(addr), NULL, connections_v1_since_cb, &since);
+    return (since && time(NULL) - since < CONNECTIONS_POOL_V1_RETRY);
+}
+
+int
+connections_pool_get_caps(connections_pool_t *cc, char *addr, uint32_t *caps)
+{
+    if (caps)
+        *caps = 0;
+
+    connections_peer_t *peer = get_connection_peer(cc, addr);
+    if (!peer)
+        return -1;
+
+    // the spare connections are validated in the background
+    // (if 'check' is enabled), so the first one is just taken
+    connection_pool_entry_t *entry = list_shift_value(peer->spare);
+    if (entry) {
+        int fd = entry->fd;
+        if (caps)
+            *caps = entry->caps;
+        free(entry);
+        return fd;
     }
 
     int new_fd = connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
     if (new_fd == -1 && (errno == EMFILE || errno == ENFILE)) {
-        ht_foreach_value(cc->table, connections_queue_empty, NULL);
+        ht_foreach_value(cc->table, connections_list_empty, NULL);
         // give us one more chance
         new_fd = connect_to_peer(addr, ATOMIC_READ(cc->tcp_timeout));
     }
+
+    uint32_t wanted = ATOMIC_READ(cc->wanted);
+    if (new_fd >= 0 && caps && wanted && !connections_pool_is_v1_peer(cc, addr)) {
+        if (open_peer_session(addr, ATOMIC_READ(cc->auth), ATOMIC_READ(cc->label), new_fd, wanted, caps) != 0) {
+            close(new_fd);
+            new_fd = -1;
+        } else if (!*caps) {
+            // don't try again with this peer for a while
+            time_t *since = malloc(sizeof(time_t));
+            if (since) {
+                *since = time(NULL);
+                ht_set(cc->v1_peers, addr, strlen(addr), since, sizeof(time_t));
+            }
+        } else {
+            ht_delete(cc->v1_peers, addr, strlen(addr), NULL, NULL);
+        }
+    }
+
     return new_fd;
 }
 
+int
+connections_pool_get(connections_pool_t *cc, char *addr)
+{
+    return connections_pool_get_caps(cc, addr, NULL);
+}
+
 
 void
-connections_pool_add(connections_pool_t *cc, char *addr, int fd)
+connections_pool_add_caps(connections_pool_t *cc, char *addr, int fd, uint32_t caps)
 {
-    queue_t *connection_queue = get_connection_queue(cc, addr);
-    if (!connection_queue) {
+    linked_list_t *connection_list = get_connection_list(cc, addr);
+    if (!connection_list) {
         close(fd);
         return;
     }
 
-    if (queue_count(connection_queue) < ATOMIC_READ(cc->max_spare)) {
+    if (list_count(connection_list) < ATOMIC_READ(cc->max_spare)) {
         connection_pool_entry_t *entry = malloc(sizeof(connection_pool_entry_t));
         entry->fd = fd;
+        entry->caps = caps;
         gettimeofday(&entry->last_access, NULL);
-        if (queue_push_right(connection_queue, entry) != 0) {
+        if (list_push_value(connection_list, entry) != 0) {
             free(entry);
             close(fd);
         }
@@ -233,6 +408,25 @@ connections_pool_add(connections_pool_t *cc, char *addr, int fd)
     }
 }
 
+void
+connections_pool_add(connections_pool_t *cc, char *addr, int fd)
+{
+    connections_pool_add_caps(cc, addr, fd, 0);
+}
+
+void
+connections_pool_negotiate(connections_pool_t *cc, char *auth, uint32_t wanted)
+{
+    ATOMIC_SET(cc->auth, auth);
+    ATOMIC_SET(cc->wanted, wanted);
+}
+
+void
+connections_pool_identify(connections_pool_t *cc, char *label)
+{
+    ATOMIC_SET(cc->label, label);
+}
+
 int
 connections_pool_tcp_timeout(connections_pool_t *cc, int new_value)
 {
@@ -266,12 +460,101 @@ connections_pool_max_spare(connections_pool_t *cc, int new_value)
     return old_value;
 }
 
+void
+connections_pool_request(connections_pool_t *cc, char *addr)
+{
+    connections_peer_t *peer = get_connection_peer(cc, addr);
+    if (peer)
+        ATOMIC_INCREMENT(peer->inflight);
+}
+
+void
+connections_pool_sample(connections_pool_t *cc, char *addr, uint64_t elapsed, int error)
+{
+    connections_peer_t *peer = get_connection_peer(cc, addr);
+    if (peer) {
+        connections_peer_sample(cc, peer, elapsed, error);
+        ATOMIC_DECREMENT(peer->inflight);
+    }
+}
+
+int
+connections_pool_select(connections_pool_t *cc, shardcache_node_t *node)
+{
+    int num_addresses = shardcache_node_num_addresses(node);
+    if (num_addresses < 2)
+        return 0;
+
+    // power of two choices: pick two distinct addresses at random
+    // and use the one expected to answer first
+    int candidates[2];
+    candidates[0] = random() % num_addresses;
+    candidates[1] = (candidates[0] + 1 + random() % (num_addresses - 1)) % num_addresses;
+
+    uint64_t scores[2] = { 0, 0 };
+    time_t now = time(NULL);
+    int i;
+    for (i = 0; i < 2; i++) {
+        char *addr = shardcache_node_get_address_at_index(node, candidates[i]);
+        pthread_mutex_lock(&peers_lock);
+        connections_peer_t *peer = ht_get(cc->table, addr, strlen(addr), NULL);
+        pthread_mutex_unlock(&peers_lock);
+        // addresses never used before score 0 so that they are tried soon
+        if (peer)
+            scores[i] = connections_peer_latency(peer, now) * (ATOMIC_READ(peer->inflight) + 1);
+    }
+
+    return (scores[1] < scores[0]) ? candidates[1] : candidates[0];
+}
+
+char *
+connections_pool_select_address(connections_pool_t *cc, shardcache_node_t *node)
+{
+    return shardcache_node_get_address_at_index(node, connections_pool_select(cc, node));
+}
+
+static int
+connections_peer_export_helper(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    connections_peer_export((connections_peer_t *)value, (shardcache_counters_t *)user);
+    return 1;
+}
+
+static int
+connections_peer_unexport_helper(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    connections_peer_t *peer = (connections_peer_t *)value;
+    int i;
+    for (i = 0; i < CONNECTIONS_PEER_NUM_COUNTERS; i++)
+        shardcache_counter_remove((shardcache_counters_t *)user, peer->counters[i]);
+    return 1;
+}
+
+void
+connections_pool_counters(connections_pool_t *cc, shardcache_counters_t *counters)
+{
+    pthread_mutex_lock(&peers_lock);
+    if (cc->counters)
+        ht_foreach_value(cc->table, connections_peer_unexport_helper, cc->counters);
+    cc->counters = counters;
+    if (counters)
+        ht_foreach_value(cc->table, connections_peer_export_helper, counters);
+    pthread_mutex_unlock(&peers_lock);
+}
+
 int
 connections_pool_check(connections_pool_t *cc, int new_value)
 {
     int old_value = ATOMIC_READ(cc->check);
 
-    ATOMIC_SET(cc->check, new_value);
+    if (new_value >= 0)
+        ATOMIC_SET(cc->check, new_value);
+
+    // the checker thread is started the first time checks are enabled
+    if (new_value > 0 && ATOMIC_CAS(cc->checker_running, 0, 1)) {
+        if (pthread_create(&cc->checker_th, NULL, connections_pool_checker, cc) != 0)
+            ATOMIC_SET(cc->checker_running, 0);
+    }
 
     return old_value;
 }
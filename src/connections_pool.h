@@ -1,6 +1,10 @@
 #ifndef __CONNECTIONS_POOL_H__
 #define __CONNECTIONS_POOL_H__
 
+#include <stdint.h>
+#include "shardcache_node.h"
+#include "counters.h"
+
 typedef struct __connections_pool_s connections_pool_t;
 
 typedef struct __connection_pool_entry_s connection_pool_entry_t;
@@ -9,10 +13,42 @@ connections_pool_t * connections_pool_create(int tcp_timeout, int expire_time, i
 void connections_pool_destroy(connections_pool_t *cc);
 int connections_pool_get(connections_pool_t *cc, char *addr);
 void connections_pool_add(connections_pool_t *cc, char *addr, int fd);
+
+// same as connections_pool_get()/connections_pool_add() but keeping track
+// of the capabilities negotiated on each connection with open_peer_session().
+// They are negotiated on new connections only if enabled with
+// connections_pool_negotiate(). Peers which don't support any capability
+// aren't asked again for a minute (in case they get upgraded)
+int connections_pool_get_caps(connections_pool_t *cc, char *addr, uint32_t *caps);
+void connections_pool_add_caps(connections_pool_t *cc, char *addr, int fd, uint32_t caps);
+// negotiate the 'wanted' capabilities on new connections, using the
+// provided secret to authenticate them if SHC_CAP_CRC32C is wanted
+// (0 disables the negotiation)
+void connections_pool_negotiate(connections_pool_t *cc, char *auth, uint32_t wanted);
+// identify ourselves with 'label' when negotiating new connections
+// (the string is not copied and must outlive the pool)
+void connections_pool_identify(connections_pool_t *cc, char *label);
 int connections_pool_tcp_timeout(connections_pool_t *cc, int new_value);
+// when enabled a background thread probes (without blocking) the spare
+// connections idle for longer than the expire time and drops the dead ones
 int connections_pool_check(connections_pool_t *cc, int new_value);
 int connections_pool_expire_time(connections_pool_t *cc, int new_value);
 
+// The time to the first byte of the responses (EWMA, in microsecs) and the
+// number of requests still waiting for it are tracked for each address.
+// connections_pool_select() returns the index of the address of 'node'
+// to use, picking the best of two random ones (power of two choices)
+int connections_pool_select(connections_pool_t *cc, shardcache_node_t *node);
+char *connections_pool_select_address(connections_pool_t *cc, shardcache_node_t *node);
+// account a request sent to 'addr' (whatever connection it uses),
+// each request must then be completed with connections_pool_sample()
+void connections_pool_request(connections_pool_t *cc, char *addr);
+// account the first byte of the response to a request sent to 'addr'
+// received after 'elapsed' microsecs (or the failure of the request)
+void connections_pool_sample(connections_pool_t *cc, char *addr, uint64_t elapsed, int error);
+// export the per-address statistics as counters (NULL stops exporting them)
+void connections_pool_counters(connections_pool_t *cc, shardcache_counters_t *counters);
+
 #endif
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include <chash.h>
+
+#include "continuum.h"
+#include "crc32c.h"
+
+#define CONTINUUM_REPLICAS 200
+// points of the ring sampled (for each node) to measure the
+// share of the keys owned by each node in bounded-load mode
+#define CONTINUUM_SAMPLES_PER_NODE 1024
+#define CONTINUUM_SAMPLES_MAX      65536
+// rounds used to compute the spill rates (each round
+// spreads the excess to the following nodes)
+#define CONTINUUM_SPILL_ROUNDS 8
+// nodes considered (in ring order) when spilling a key
+#define CONTINUUM_CANDIDATES_MAX 8
+
+struct __continuum_s {
+    chash_t *chash;
+    // a node with weight N appears N times in the chash (as label,
+    // label#2 ... label#N) and each point is mapped back to the node
+    char **points;
+    size_t *lens;
+    int *nodes;         // point -> node index
+    int *first;         // node index -> its first point (the plain label)
+    int num_points;
+    int num_nodes;
+    int me;
+    // open addressing table mapping the labels returned
+    // by the chash to their point (-1 marks the free slots)
+    int *slots;
+    int num_slots;  // power of two, at least twice the number of points
+    // bounded-load mode: the fraction (out of 2^32) of the keys reaching
+    // each node which is spilled to the next node on the ring
+    // (NULL if all the nodes keep their share)
+    uint32_t *spill;
+};
+
+static inline int
+continuum_slot(continuum_t *continuum, const char *label, size_t len)
+{
+    return crc32c(0, label, len) & (continuum->num_slots - 1);
+}
+
+static int
+continuum_point(continuum_t *continuum, const char *label, size_t len)
+{
+    int slot = continuum_slot(continuum, label, len);
+    while (continuum->slots[slot] != -1) {
+        int point = continuum->slots[slot];
+        if (continuum->lens[point] == len && memcmp(continuum->points[point], label, len) == 0)
+            return point;
+        slot = (slot + 1) & (continuum->num_slots - 1);
+    }
+    return -1;
+}
+
+// the distinct nodes following the key on the ring (the owner first)
+static int
+continuum_candidates(continuum_t *continuum, void *key, size_t klen, int *candidates)
+{
+    const char *names[CONTINUUM_CANDIDATES_MAX];
+    size_t lens[CONTINUUM_CANDIDATES_MAX];
+    int num = continuum->num_points < CONTINUUM_CANDIDATES_MAX
+            ? continuum->num_points
+            : CONTINUUM_CANDIDATES_MAX;
+    num = chash_lookup_multi(continuum->chash, key, klen, num, names, lens);
+
+    int i, n, count = 0;
+    for (i = 0; i < num; i++) {
+        int point = continuum_point(continuum, names[i], lens[i]);
+        if (point < 0)
+            continue;
+        int node = continuum->nodes[point];
+        for (n = 0; n < count && candidates[n] != node; n++)
+            ;
+        if (n == count)
+            candidates[count++] = node;
+    }
+    return count;
+}
+
+// each hop along the ring mixes the checksum of the key with its own seed
+// so that the keys spilled by a node are spread over the next ones.
+// NOTE: the crc is affine in its seed (seeding it per hop would just xor
+//       all the hashes of a key with the same constant), the murmur3
+//       finalizer is a nonlinear bijection which decorrelates the hops
+static inline uint32_t
+continuum_spill_hash(uint32_t crc, int hop)
+{
+    uint32_t h = crc ^ (0x9e3779b9 * (hop + 1));
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int
+continuum_spill_lookup(continuum_t *continuum, void *key, size_t klen, int *candidates, int num, int *visited)
+{
+    uint32_t crc = crc32c(0, key, klen);
+    int i;
+    for (i = 0; i < num; i++) {
+        if (visited)
+            visited[candidates[i]]++;
+        uint32_t spill = continuum->spill[candidates[i]];
+        if (!spill || continuum_spill_hash(crc, i) >= spill)
+            return candidates[i];
+    }
+    // all the candidates are overloaded, the owner keeps the key
+    return candidates[0];
+}
+
+// compute the spill rates so that no node owns more than its weighted share
+// (plus 'bounded_load' percent) of a deterministic sample of the keys.
+// All the nodes compute the same rates out of the same list of nodes
+static void
+continuum_bound_load(continuum_t *continuum, int *weights, int bounded_load)
+{
+    int num_nodes = continuum->num_nodes;
+    int num_samples = num_nodes * CONTINUUM_SAMPLES_PER_NODE;
+    if (num_samples > CONTINUUM_SAMPLES_MAX)
+        num_samples = CONTINUUM_SAMPLES_MAX;
+
+    int total_weight = 0;
+    int i, n, round;
+    for (i = 0; i < num_nodes; i++)
+        total_weight += weights ? weights[i] : 1;
+
+    double capacity[num_nodes];
+    for (i = 0; i < num_nodes; i++) {
+        int weight = weights ? weights[i] : 1;
+        capacity[i] = (double)num_samples * weight / total_weight * (100 + bounded_load) / 100;
+    }
+
+    continuum->spill = calloc(num_nodes, sizeof(uint32_t));
+
+    int visited[num_nodes];
+    int candidates[CONTINUUM_CANDIDATES_MAX];
+    for (round = 0; round < CONTINUUM_SPILL_ROUNDS; round++) {
+        memset(visited, 0, sizeof(visited));
+        for (n = 0; n < num_samples; n++) {
+            uint32_t sample = htonl(n);
+            int num = continuum_candidates(continuum, &sample, sizeof(sample), candidates);
+            if (num > 0)
+                continuum_spill_lookup(continuum, &sample, sizeof(sample), candidates, num, visited);
+        }
+
+        int changed = 0;
+        for (i = 0; i < num_nodes; i++) {
+            // the keys reaching the node (owned or spilled to it) above
+            // its capacity are spilled in turn to the following nodes
+            uint32_t spill = 0;
+            if (visited[i] > capacity[i])
+                spill = (uint32_t)((1.0 - capacity[i] / visited[i]) * UINT32_MAX);
+            if (spill != continuum->spill[i]) {
+                continuum->spill[i] = spill;
+                changed = 1;
+            }
+        }
+        if (!changed)
+            break;
+    }
+
+    for (i = 0; i < num_nodes && !continuum->spill[i]; i++)
+        ;
+    if (i == num_nodes) {
+        free(continuum->spill);
+        continuum->spill = NULL;
+    }
+}
+
+continuum_t *
+continuum_create(char **labels, int *weights, int num_nodes, char *me, int bounded_load)
+{
+    continuum_t *continuum = calloc(1, sizeof(continuum_t));
+    continuum->num_nodes = num_nodes;
+    continuum->me = -1;
+
+    int i, n;
+    for (i = 0; i < num_nodes; i++)
+        continuum->num_points += weights ? weights[i] : 1;
+
+    continuum->points = calloc(continuum->num_points, sizeof(char *));
+    continuum->lens = calloc(continuum->num_points, sizeof(size_t));
+    continuum->nodes = calloc(continuum->num_points, sizeof(int));
+    continuum->first = calloc(num_nodes, sizeof(int));
+
+    continuum->num_slots = 2;
+    while (continuum->num_slots < continuum->num_points * 2)
+        continuum->num_slots <<= 1;
+    continuum->slots = malloc(continuum->num_slots * sizeof(int));
+    memset(continuum->slots, 0xff, continuum->num_slots * sizeof(int));
+
+    int point = 0;
+    for (i = 0; i < num_nodes; i++) {
+        if (me && strcmp(labels[i], me) == 0)
+            continuum->me = i;
+
+        int weight = weights ? weights[i] : 1;
+        continuum->first[i] = point;
+        for (n = 0; n < weight; n++) {
+            // the first point is the plain label, so that nodes
+            // with weight 1 keep the same keys as before
+            if (n == 0) {
+                continuum->points[point] = strdup(labels[i]);
+            } else {
+                size_t size = strlen(labels[i]) + 16;
+                continuum->points[point] = malloc(size);
+                snprintf(continuum->points[point], size, "%s#%d", labels[i], n + 1);
+            }
+            continuum->lens[point] = strlen(continuum->points[point]);
+            continuum->nodes[point] = i;
+
+            int slot = continuum_slot(continuum, continuum->points[point], continuum->lens[point]);
+            while (continuum->slots[slot] != -1)
+                slot = (slot + 1) & (continuum->num_slots - 1);
+            continuum->slots[slot] = point;
+            point++;
+        }
+    }
+
+    continuum->chash = chash_create((const char **)continuum->points,
+                                    continuum->lens,
+                                    continuum->num_points,
+                                    CONTINUUM_REPLICAS);
+
+    if (bounded_load > 0 && num_nodes > 1)
+        continuum_bound_load(continuum, weights, bounded_load);
+
+    return continuum;
+}
+
+void
+continuum_destroy(continuum_t *continuum)
+{
+    chash_free(continuum->chash);
+    int i;
+    for (i = 0; i < continuum->num_points; i++)
+        free(continuum->points[i]);
+    free(continuum->points);
+    free(continuum->lens);
+    free(continuum->nodes);
+    free(continuum->first);
+    free(continuum->slots);
+    free(continuum->spill);
+    free(continuum);
+}
+
+int
+continuum_index(continuum_t *continuum, const char *label, size_t len)
+{
+    int point = continuum_point(continuum, label, len);
+    if (point < 0)
+        return -1;
+    // only the plain label identifies the node
+    int index = continuum->nodes[point];
+    return (continuum->first[index] == point) ? index : -1;
+}
+
+int
+continuum_lookup(continuum_t *continuum, void *key, size_t klen)
+{
+    if (continuum->num_nodes == 1)
+        return 0;
+
+    const char *label = NULL;
+    size_t len = 0;
+    chash_lookup(continuum->chash, key, klen, &label, &len);
+    int point = continuum_point(continuum, label, len);
+    if (point < 0)
+        return -1;
+
+    int index = continuum->nodes[point];
+    if (!continuum->spill || !continuum->spill[index])
+        return index;
+
+    // the owner is overloaded, part of its keys go to the following nodes
+    int candidates[CONTINUUM_CANDIDATES_MAX];
+    int num = continuum_candidates(continuum, key, klen, candidates);
+    if (num <= 0)
+        return index;
+    return continuum_spill_lookup(continuum, key, klen, candidates, num, NULL);
+}
+
+int
+continuum_me(continuum_t *continuum)
+{
+    return continuum->me;
+}
+
+int
+continuum_num_nodes(continuum_t *continuum)
+{
+    return continuum->num_nodes;
+}
+
+char *
+continuum_label(continuum_t *continuum, int index, size_t *len)
+{
+    if (index < 0 || index >= continuum->num_nodes)
+        return NULL;
+
+    int point = continuum->first[index];
+    if (len)
+        *len = continuum->lens[point];
+    return continuum->points[point];
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,49 @@
+#ifndef __CONTINUUM_H__
+#define __CONTINUUM_H__
+
+#include <sys/types.h>
+
+// A consistent hashing continuum resolving the keys directly to the index
+// of their owner in the list of nodes it has been built from (so that the
+// owner can be checked with an integer compare).
+// A continuum is immutable once created, so any number of readers can use
+// it without locking as long as it's not destroyed under their feet.
+//
+// Each node owns a share of the keys proportional to its weight. In
+// bounded-load mode no node owns more than its share plus 'bounded_load'
+// percent: part of the keys of an overloaded node are spilled to the nodes
+// following it on the ring. The load is measured on a deterministic sample
+// of the keys, so all the nodes (and clients) agree on the owners as long
+// as they build the continuum out of the same nodes, weights and bound
+typedef struct __continuum_s continuum_t;
+
+// 'me' is the label of the local node (NULL if not part of the continuum),
+// 'weights' can be NULL if all the nodes have weight 1 and 'bounded_load'
+// is 0 if the load of the nodes is not bounded
+continuum_t *continuum_create(char **labels,
+                              int *weights,
+                              int num_nodes,
+                              char *me,
+                              int bounded_load);
+void continuum_destroy(continuum_t *continuum);
+
+// returns the index of the node owning the key
+int continuum_lookup(continuum_t *continuum, void *key, size_t klen);
+
+// returns the index of the node with the given label
+// (-1 if it's not part of the continuum)
+int continuum_index(continuum_t *continuum, const char *label, size_t len);
+
+// returns the index of the local node (-1 if it's not part of the continuum)
+int continuum_me(continuum_t *continuum);
+
+int continuum_num_nodes(continuum_t *continuum);
+
+// returns the label of the node at 'index' (NULL if out of range),
+// valid as long as the continuum exists
+char *continuum_label(continuum_t *continuum, int index, size_t *len);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
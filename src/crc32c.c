@@ -0,0 +1,94 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_HAVE_SSE42
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_HAVE_ARMV8
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // reversed castagnoli polynomial
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t) = NULL;
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len >= sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#elif defined(CRC32C_HAVE_ARMV8)
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len >= sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+        p += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static void
+crc32c_init(void)
+{
+    uint32_t i, j;
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(CRC32C_HAVE_SSE42)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#elif defined(CRC32C_HAVE_ARMV8)
+    crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len)
+{
+    if (__builtin_expect(crc32c_impl == NULL, 0))
+        pthread_once(&crc32c_once, crc32c_init);
+
+    return ~crc32c_impl(~crc, (const unsigned char *)data, len);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
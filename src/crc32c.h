@@ -0,0 +1,15 @@
+#ifndef __SHARDCACHE_CRC32C_H__
+#define __SHARDCACHE_CRC32C_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// update a running crc32c (castagnoli) checksum with the provided data
+// (start with crc == 0). The SSE4.2 or ARMv8 crc32 instructions are used
+// if available, otherwise it falls back to a table-driven implementation
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
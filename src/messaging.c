@@ -2,12 +2,15 @@
 #include <fcntl.h>
 #include <fbuf.h>
 #include <rbuf.h>
+#include <hashtable.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifndef HAVE_UINT64_T
 #define HAVE_UINT64_T
@@ -17,6 +20,7 @@
 #include "messaging.h"
 #include "connections.h"
 #include "shardcache.h"
+#include "crc32c.h"
 
 #include <atomic_defs.h>
 #include <iomux.h>
@@ -30,25 +34,99 @@ struct __async_read_ctx_s {
     shardcache_hdr_t sig_hdr;
     void *cb_priv;
     char *auth;
-    rbuf_t *buf;
-    char chunk[65536];
-    uint16_t clen;
-    uint16_t coff;
+    rbuf_t *buf; // input buffer (borrowed only while a message is being read)
+    char *chunk; // the current chunk of a chunk-signed message (buffered until
+                 // its signature has been verified, released with the message)
+    uint32_t csize; // size of the 'chunk' buffer
+    uint32_t clen;
+    uint32_t coff;
+    uint32_t cused; // bytes of the current chunk buffered in 'chunk'
     uint32_t rlen;
     int rnum;
     char state;
     int csig;
     char magic[4];
     char version;
+    char wide; // records are framed with 32bit chunk sizes
+    char compressed; // records are compressed
+    shc_decompressor_t *decompressor; // created on the first compressed message
     int moff;
     sip_hash *shash;
     int blocking;
     struct timeval last_update;
+    uint32_t tag;
+    char tagged;
+    char session; // the connection has been authenticated
+    char crc;     // the message being read is checksummed with crc32c
+    uint32_t crcval;
 };
 #pragma pack(pop)
 
 static int _tcp_timeout = SHARDCACHE_TCP_TIMEOUT_DEFAULT;
 
+#define ASYNC_READ_BUFFER_SIZE (1<<16)
+#define ASYNC_READ_CHUNK_MAX   (1<<16)
+// pipelined messages found in the input buffer are framed without
+// the state machine only if not bigger than ASYNC_READ_PEEK_MAX
+#define ASYNC_READ_PEEK_HDR    16
+#define ASYNC_READ_PEEK_MAX    4096
+
+// the input buffers are borrowed from a per-thread pool (holding one
+// spare buffer) so that idle connections don't hold any of them
+static pthread_key_t async_read_buffer_key;
+static pthread_once_t async_read_buffer_key_once = PTHREAD_ONCE_INIT;
+
+static void
+async_read_buffer_release(void *buf)
+{
+    rbuf_destroy((rbuf_t *)buf);
+}
+
+static void
+async_read_buffer_key_create(void)
+{
+    pthread_key_create(&async_read_buffer_key, async_read_buffer_release);
+}
+
+static rbuf_t *
+async_read_buffer_get(void)
+{
+    pthread_once(&async_read_buffer_key_once, async_read_buffer_key_create);
+    rbuf_t *buf = pthread_getspecific(async_read_buffer_key);
+    if (buf) {
+        pthread_setspecific(async_read_buffer_key, NULL);
+        return buf;
+    }
+    return rbuf_create(ASYNC_READ_BUFFER_SIZE);
+}
+
+static void
+async_read_buffer_put(rbuf_t *buf)
+{
+    pthread_once(&async_read_buffer_key_once, async_read_buffer_key_create);
+    if (pthread_getspecific(async_read_buffer_key)) {
+        rbuf_destroy(buf);
+        return;
+    }
+    rbuf_clear(buf);
+    pthread_setspecific(async_read_buffer_key, buf);
+}
+
+// a coarse clock is good enough to detect stalled connections
+static inline void
+coarse_time(struct timeval *tv)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+        tv->tv_sec = ts.tv_sec;
+        tv->tv_usec = ts.tv_nsec / 1000;
+        return;
+    }
+#endif
+    gettimeofday(tv, NULL);
+}
+
 int
 global_tcp_timeout(int timeout)
 {
@@ -78,27 +156,291 @@ async_read_context_sig_hdr(async_read_ctx_t *ctx)
     return ctx->sig_hdr;
 }
 
+int
+async_read_context_tag(async_read_ctx_t *ctx, uint32_t *tag)
+{
+    if (ctx->tagged && tag)
+        *tag = ctx->tag;
+    return ctx->tagged;
+}
+
+int
+async_read_context_pending(async_read_ctx_t *ctx)
+{
+    return ctx->buf ? rbuf_used(ctx->buf) : 0;
+}
+
+int
+async_read_context_wide(async_read_ctx_t *ctx)
+{
+    return ctx->wide;
+}
+
+int
+async_read_context_compressed(async_read_ctx_t *ctx)
+{
+    return ctx->compressed;
+}
+
+static int
+async_read_decompressed_data(void *data, size_t len, void *priv)
+{
+    async_read_ctx_t *ctx = (async_read_ctx_t *)priv;
+    return ctx->cb(data, len, ctx->rnum, ctx->cb_priv);
+}
+
+// pass the data of the record being read to the callback
+// (the status record of a busy response is not propagated)
+static inline int
+async_read_record_data(async_read_ctx_t *ctx, void *data, size_t len)
+{
+    if (!ctx->cb || ctx->hdr == SHC_HDR_BUSY)
+        return 0;
+
+    if (ctx->compressed)
+        return shc_decompressor_feed(ctx->decompressor, data, len,
+                                     async_read_decompressed_data, ctx);
+
+    return ctx->cb(data, len, ctx->rnum, ctx->cb_priv);
+}
+
+int
+async_read_context_session(async_read_ctx_t *ctx, int new_value)
+{
+    int old_value = ATOMIC_READ(ctx->session);
+    if (new_value >= 0)
+        ATOMIC_SET(ctx->session, new_value);
+    return old_value;
+}
+
+// get ready to read the next message
+static void
+async_read_context_reset(async_read_ctx_t *ctx)
+{
+    ctx->state = SHC_STATE_READING_NONE;
+    ctx->rnum = 0;
+    ctx->rlen = 0;
+    ctx->moff = 0;
+    ctx->version = 0;
+    ctx->csig = 0;
+    ctx->clen = 0;
+    ctx->coff = 0;
+    ctx->cused = 0;
+    ctx->wide = 0;
+    ctx->compressed = 0;
+    ctx->tag = 0;
+    ctx->tagged = 0;
+    ctx->crc = 0;
+    ctx->crcval = 0;
+    memset(ctx->magic, 0, sizeof(ctx->magic));
+    if (ctx->chunk) {
+        free(ctx->chunk);
+        ctx->chunk = NULL;
+        ctx->csize = 0;
+    }
+}
+
+// give back the input buffer (and the decompressor)
+// if we are not in the middle of a message
+static inline void
+async_read_context_idle(async_read_ctx_t *ctx)
+{
+    if ((ctx->state != SHC_STATE_READING_NONE && ctx->state != SHC_STATE_READING_DONE) ||
+        (ctx->buf && rbuf_used(ctx->buf)))
+    {
+        return;
+    }
+
+    if (ctx->buf) {
+        async_read_buffer_put(ctx->buf);
+        ctx->buf = NULL;
+    }
+    if (ctx->decompressor) {
+        shc_decompressor_destroy(ctx->decompressor);
+        ctx->decompressor = NULL;
+    }
+}
+
+// the unsigned messages which are complete and contiguous in 'data' are
+// framed in a single walk over the chunk lengths and their records are
+// passed up straight from 'data' (skipping the byte-wise state machine).
+// Returns the number of bytes consumed by the message, 0 if the slow path
+// needs to take over (incomplete, signed or malformed input)
+// or -1 if the callback refused the data.
+// If 'need' is provided and the input is just incomplete, it's set to the
+// number of bytes needed to go on framing the message (0 otherwise)
+#define ASYNC_READ_SCAN_NEED(__n) { if (need) *need = (p - data) + (__n); return 0; }
+static int
+async_read_message_scan(async_read_ctx_t *ctx, u_char *data, int len, int *need)
+{
+    u_char *p = data;
+    u_char *end = data + len;
+
+    if (need)
+        *need = 0;
+
+    while (p < end && *p == SHC_HDR_NOOP)
+        p++;
+
+    int tagged = 0;
+    uint32_t tag = 0;
+    if (p < end && *p == SHC_HDR_TAG) {
+        if (end - p < 1 + (int)sizeof(uint32_t))
+            ASYNC_READ_SCAN_NEED(1 + sizeof(uint32_t));
+        memcpy(&tag, p + 1, sizeof(uint32_t));
+        tagged = 1;
+        p += 1 + sizeof(uint32_t);
+    }
+
+    if (end - p < (int)sizeof(uint32_t) + 1)
+        ASYNC_READ_SCAN_NEED(sizeof(uint32_t) + 1);
+
+    uint32_t rmagic;
+    memcpy(&rmagic, p, sizeof(uint32_t));
+    if ((ntohl(rmagic)&0xFFFFFF00) != (SHC_MAGIC&0xFFFFFF00))
+        return 0;
+
+    u_char flags = p[3];
+    int version = flags & ~(SHC_MAGIC_WIDE_RECORDS|SHC_MAGIC_COMPRESSED);
+    if (version > SHC_PROTOCOL_VERSION)
+        return 0;
+
+    u_char hdr = p[4];
+    if (hdr == SHC_HDR_SIGNATURE_SIP || hdr == SHC_HDR_CSIGNATURE_SIP || hdr == SHC_HDR_CSIGNATURE_CRC)
+        return 0;
+
+    u_char *records = p + sizeof(uint32_t) + 1;
+    int wide = (flags & SHC_MAGIC_WIDE_RECORDS) ? 1 : 0;
+    int slen = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+
+    // first make sure the whole message is there and properly framed
+    p = records;
+    for (;;) {
+        if (end - p < slen)
+            ASYNC_READ_SCAN_NEED(slen);
+        uint32_t clen;
+        if (wide) {
+            memcpy(&clen, p, sizeof(uint32_t));
+            clen = ntohl(clen);
+        } else {
+            uint16_t nlen;
+            memcpy(&nlen, p, sizeof(uint16_t));
+            clen = ntohs(nlen);
+        }
+        p += slen;
+        if (clen) {
+            if (end - p < clen)
+                ASYNC_READ_SCAN_NEED(clen);
+            p += clen;
+            continue;
+        }
+        if (p == end)
+            ASYNC_READ_SCAN_NEED(1);
+        u_char bsep = *p++;
+        if (bsep == 0)
+            break;
+        if (bsep != SHARDCACHE_RSEP)
+            return 0;
+    }
+    int consumed = p - data;
+
+    ctx->tagged = tagged;
+    ctx->tag = ntohl(tag);
+    memcpy(ctx->magic, &rmagic, sizeof(uint32_t));
+    ctx->version = version;
+    ctx->wide = wide;
+    ctx->compressed = (flags & SHC_MAGIC_COMPRESSED) ? 1 : 0;
+    ctx->sig_hdr = 0;
+    ctx->hdr = hdr;
+    if (ctx->compressed) {
+        if (!ctx->decompressor)
+            ctx->decompressor = shc_decompressor_create();
+        else
+            shc_decompressor_reset(ctx->decompressor);
+    }
+
+    // now pass up the records
+    p = records;
+    for (;;) {
+        uint32_t clen;
+        if (wide) {
+            memcpy(&clen, p, sizeof(uint32_t));
+            clen = ntohl(clen);
+        } else {
+            uint16_t nlen;
+            memcpy(&nlen, p, sizeof(uint16_t));
+            clen = ntohs(nlen);
+        }
+        p += slen;
+        if (clen) {
+            ctx->rlen += clen;
+            if (async_read_record_data(ctx, p, clen) != 0)
+                goto error;
+            p += clen;
+            continue;
+        }
+
+        if (ctx->compressed && !shc_decompressor_idle(ctx->decompressor)) {
+            SHC_WARNING("Truncated compressed record in received message");
+            goto error;
+        }
+
+        if (*p++ == SHARDCACHE_RSEP) {
+            if (ctx->cb && ctx->hdr != SHC_HDR_BUSY &&
+                ctx->cb(NULL, 0, ctx->rnum, ctx->cb_priv) != 0)
+            {
+                goto error;
+            }
+            ctx->rnum++;
+            ctx->rlen = 0;
+        } else {
+            ctx->state = SHC_STATE_READING_DONE;
+            int idx = (ctx->hdr == SHC_HDR_BUSY) ? -4 : -1;
+            if (ctx->cb && ctx->cb(NULL, 0, idx, ctx->cb_priv) != 0)
+                goto error;
+            break;
+        }
+    }
+
+    return consumed;
+
+error:
+    ctx->state = SHC_STATE_READING_ERR;
+    if (ctx->cb)
+        ctx->cb(NULL, 0, -2, ctx->cb_priv);
+    return -1;
+}
+
 async_read_context_state_t
 async_read_context_update(async_read_ctx_t *ctx)
 {
-    gettimeofday(&ctx->last_update, NULL);
+    coarse_time(&ctx->last_update);
 
     if (__builtin_expect(ctx->state == SHC_STATE_READING_DONE, 0))
-    {
-        ctx->state = SHC_STATE_READING_NONE;
-        ctx->rnum = 0;
-        ctx->rlen = 0;
-        ctx->moff = 0;
-        ctx->version = 0;
-        ctx->csig = 0;
-        ctx->clen = 0;
-        ctx->coff = 0;
-        memset(ctx->magic, 0, sizeof(ctx->magic));
-    }
+        async_read_context_reset(ctx);
 
-    if (!rbuf_used(ctx->buf))
+    if (!ctx->buf || !rbuf_used(ctx->buf))
         return ctx->state;
 
+    if (ctx->state == SHC_STATE_READING_NONE && !ctx->auth) {
+        // small pipelined messages are usually whole in the buffer, peek at
+        // the header first and, if it shows an unsigned message, copy out
+        // (once) as much of the buffer as the peek area can hold to frame it
+        u_char peek[ASYNC_READ_PEEK_MAX];
+        int len = rbuf_copy(ctx->buf, peek, ASYNC_READ_PEEK_HDR);
+        int need = 0;
+        int consumed = async_read_message_scan(ctx, peek, len, &need);
+        if (!consumed && need > len && need <= (int)sizeof(peek) && need <= rbuf_used(ctx->buf)) {
+            int avail = rbuf_used(ctx->buf);
+            len = rbuf_copy(ctx->buf, peek, avail < (int)sizeof(peek) ? avail : (int)sizeof(peek));
+            consumed = async_read_message_scan(ctx, peek, len, NULL);
+        }
+        if (consumed > 0)
+            rbuf_skip(ctx->buf, consumed);
+        if (consumed)
+            return ctx->state;
+    }
+
     if (ctx->state == SHC_STATE_READING_NONE)
     {
         ctx->hdr = 0;
@@ -110,9 +452,27 @@ async_read_context_update(async_read_ctx_t *ctx)
         if (byte == SHC_HDR_NOOP && !rbuf_used(ctx->buf))
             return ctx->state;
 
-        ctx->magic[0] = byte;
+        if (byte == SHC_HDR_TAG) {
+            // the message is wrapped in a tag envelope,
+            // the actual magic will follow the tag
+            ctx->tagged = 1;
+            ctx->state = SHC_STATE_READING_TAG;
+        } else {
+            ctx->magic[0] = byte;
+            ctx->state = SHC_STATE_READING_MAGIC;
+            ctx->moff = 1;
+        }
+    }
+
+    if (ctx->state == SHC_STATE_READING_TAG) {
+        if (rbuf_used(ctx->buf) < sizeof(uint32_t))
+            return ctx->state;
+
+        uint32_t tag;
+        rbuf_read(ctx->buf, (u_char *)&tag, sizeof(uint32_t));
+        ctx->tag = ntohl(tag);
+        ctx->moff = 0;
         ctx->state = SHC_STATE_READING_MAGIC;
-        ctx->moff = 1;
     }
 
     if (ctx->state == SHC_STATE_READING_MAGIC) {
@@ -123,13 +483,21 @@ async_read_context_update(async_read_ctx_t *ctx)
         rbuf_read(ctx->buf, (u_char *)&ctx->magic[ctx->moff], sizeof(uint32_t) - ctx->moff);
         uint32_t rmagic;
         memcpy((char *)&rmagic, ctx->magic, sizeof(uint32_t));
-        if ((rmagic&0xFFFFFF00) != (htonl(SHC_MAGIC)&0xFFFFFF00)) {
+        if ((ntohl(rmagic)&0xFFFFFF00) != (SHC_MAGIC&0xFFFFFF00)) {
             ctx->state = SHC_STATE_READING_ERR;
             if (ctx->cb)
                 ctx->cb(NULL, 0, -2, ctx->cb_priv);
             return ctx->state;
         }
-        ctx->version = ctx->magic[3];
+        ctx->version = ctx->magic[3] & ~(SHC_MAGIC_WIDE_RECORDS|SHC_MAGIC_COMPRESSED);
+        ctx->wide = (ctx->magic[3] & SHC_MAGIC_WIDE_RECORDS) ? 1 : 0;
+        ctx->compressed = (ctx->magic[3] & SHC_MAGIC_COMPRESSED) ? 1 : 0;
+        if (ctx->compressed) {
+            if (!ctx->decompressor)
+                ctx->decompressor = shc_decompressor_create();
+            else
+                shc_decompressor_reset(ctx->decompressor);
+        }
         if (ctx->version > SHC_PROTOCOL_VERSION) {
             SHC_WARNING("Unsupported protocol version %02x", ctx->version);
             ctx->state = SHC_STATE_READING_ERR;
@@ -147,7 +515,19 @@ async_read_context_update(async_read_ctx_t *ctx)
             if (rbuf_used(ctx->buf) < 1)
                 return ctx->state;
             rbuf_read(ctx->buf, (unsigned char *)&ctx->sig_hdr, 1);
-            if (ctx->sig_hdr == SHC_HDR_SIGNATURE_SIP || ctx->sig_hdr == SHC_HDR_CSIGNATURE_SIP)
+            if (ctx->sig_hdr == SHC_HDR_CSIGNATURE_CRC) {
+                // checksummed messages are accepted without a signature
+                // only if the connection has been authenticated already
+                if (ctx->auth && !ATOMIC_READ(ctx->session)) {
+                    ctx->state = SHC_STATE_AUTH_ERR;
+                    if (ctx->cb)
+                        ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                    return ctx->state;
+                }
+                ctx->state = SHC_STATE_READING_HDR;
+                ctx->csig = 1;
+                ctx->crc = 1;
+            } else if (ctx->sig_hdr == SHC_HDR_SIGNATURE_SIP || ctx->sig_hdr == SHC_HDR_CSIGNATURE_SIP)
             {
                 if (!ctx->auth) {
                     ctx->state = SHC_STATE_AUTH_ERR;
@@ -180,7 +560,9 @@ async_read_context_update(async_read_ctx_t *ctx)
         }
 
         ctx->state = SHC_STATE_READING_RECORD;
-        if (ctx->auth) {
+        if (ctx->crc) {
+            ctx->crcval = crc32c(0, (unsigned char *)&ctx->hdr, 1);
+        } else if (ctx->auth) {
             ctx->shash = sip_hash_new((uint8_t *)ctx->auth, 2, 4);
             sip_hash_update(ctx->shash, (unsigned char *)&ctx->hdr, 1);
         }
@@ -191,11 +573,25 @@ async_read_context_update(async_read_ctx_t *ctx)
             break;
 
         if (ctx->coff == ctx->clen && ctx->state == SHC_STATE_READING_RECORD) {
-            if (rbuf_used(ctx->buf) < 2)
+            int slen = ctx->wide ? sizeof(uint32_t) : sizeof(uint16_t);
+            if (rbuf_used(ctx->buf) < slen)
                 break;
 
-            if (ctx->csig) {
-                if (rbuf_used(ctx->buf) < SHARDCACHE_MSG_SIG_LEN + 2) // truncated
+            if (ctx->csig && ctx->crc) {
+                if (rbuf_used(ctx->buf) < SHARDCACHE_MSG_CRC_LEN + slen) // truncated
+                    break;
+
+                uint32_t received_crc;
+                rbuf_read(ctx->buf, (u_char *)&received_crc, sizeof(received_crc));
+                if (ntohl(received_crc) != ctx->crcval) {
+                    SHC_WARNING("Bad checksum in received message");
+                    ctx->state = SHC_STATE_READING_ERR;
+                    if (ctx->cb)
+                        ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                    return ctx->state;
+                }
+            } else if (ctx->csig) {
+                if (rbuf_used(ctx->buf) < SHARDCACHE_MSG_SIG_LEN + slen) // truncated
                     break;
 
                 if (!ctx->shash) {
@@ -230,26 +626,91 @@ async_read_context_update(async_read_ctx_t *ctx)
             }
 
             // let's call the read_async callback
-            if (ctx->clen > 0 && ctx->cb && ctx->cb(ctx->chunk, ctx->clen, ctx->rnum, ctx->cb_priv) != 0) {
+            if (ctx->cused > 0 && async_read_record_data(ctx, ctx->chunk, ctx->cused) != 0)
+            {
                 ctx->state = SHC_STATE_READING_ERR;
                 if (ctx->cb)
                     ctx->cb(NULL, 0, -2, ctx->cb_priv);
                 return ctx->state;
             } 
-
-            uint16_t nlen = 0;
-            rbuf_read(ctx->buf, (u_char *)&nlen, 2);
-            ctx->clen = ntohs(nlen);
+            ctx->cused = 0;
+
+            u_char nlen[sizeof(uint32_t)];
+            rbuf_read(ctx->buf, nlen, slen);
+            if (ctx->wide) {
+                uint32_t wlen;
+                memcpy(&wlen, nlen, sizeof(uint32_t));
+                ctx->clen = ntohl(wlen);
+            } else {
+                uint16_t len;
+                memcpy(&len, nlen, sizeof(uint16_t));
+                ctx->clen = ntohs(len);
+            }
             ctx->rlen += ctx->clen;
             ctx->coff = 0;
-            if (ctx->shash)
-                sip_hash_update(ctx->shash, (uint8_t *)&nlen, 2);
+            if (ctx->csig && ctx->clen > ctx->csize) {
+                // wide chunks are passed up in parts anyway
+                uint32_t csize = (ctx->clen < ASYNC_READ_CHUNK_MAX) ? ctx->clen : ASYNC_READ_CHUNK_MAX;
+                if (csize > ctx->csize) {
+                    char *chunk = realloc(ctx->chunk, csize);
+                    if (!chunk) {
+                        ctx->state = SHC_STATE_READING_ERR;
+                        if (ctx->cb)
+                            ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                        return ctx->state;
+                    }
+                    ctx->chunk = chunk;
+                    ctx->csize = csize;
+                }
+            }
+            if (ctx->crc)
+                ctx->crcval = crc32c(ctx->crcval, nlen, slen);
+            else if (ctx->shash)
+                sip_hash_update(ctx->shash, (uint8_t *)nlen, slen);
         }
-        if (ctx->clen > ctx->coff) {
-            int rb = rbuf_read(ctx->buf, (u_char *)ctx->chunk + ctx->coff, ctx->clen - ctx->coff);
-            if (ctx->shash)
-                sip_hash_update(ctx->shash, (u_char *)ctx->chunk + ctx->coff, rb);
+        if (ctx->clen > ctx->coff && !ctx->csig) {
+            // not chunk-signed, the data can be passed up straight away
+            u_char data[4096];
+            uint32_t toread = ctx->clen - ctx->coff;
+            if (toread > sizeof(data))
+                toread = sizeof(data);
+            int rb = rbuf_read(ctx->buf, data, toread);
+            if (ctx->crc)
+                ctx->crcval = crc32c(ctx->crcval, (char *)data, rb);
+            else if (ctx->shash)
+                sip_hash_update(ctx->shash, data, rb);
+            ctx->coff += rb;
+            if (async_read_record_data(ctx, data, rb) != 0) {
+                ctx->state = SHC_STATE_READING_ERR;
+                if (ctx->cb)
+                    ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                return ctx->state;
+            }
+            if (!rbuf_used(ctx->buf))
+                break; // TRUNCATED - we need more data
+        } else if (ctx->clen > ctx->coff) {
+            uint32_t toread = ctx->clen - ctx->coff;
+            if (toread > ctx->csize - ctx->cused)
+                toread = ctx->csize - ctx->cused;
+            int rb = rbuf_read(ctx->buf, (u_char *)ctx->chunk + ctx->cused, toread);
+            if (ctx->crc)
+                ctx->crcval = crc32c(ctx->crcval, ctx->chunk + ctx->cused, rb);
+            else if (ctx->shash)
+                sip_hash_update(ctx->shash, (u_char *)ctx->chunk + ctx->cused, rb);
             ctx->coff += rb;
+            ctx->cused += rb;
+            if (ctx->cused == ctx->csize && ctx->coff < ctx->clen) {
+                // a wide chunk doesn't fit in the buffer,
+                // pass up the data read so far
+                if (async_read_record_data(ctx, ctx->chunk, ctx->cused) != 0)
+                {
+                    ctx->state = SHC_STATE_READING_ERR;
+                    if (ctx->cb)
+                        ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                    return ctx->state;
+                }
+                ctx->cused = 0;
+            }
             if (!rbuf_used(ctx->buf))
                 break; // TRUNCATED - we need more data
         } else {
@@ -261,12 +722,24 @@ async_read_context_update(async_read_ctx_t *ctx)
 
             u_char bsep = 0;
             rbuf_read(ctx->buf, &bsep, 1);
-            if (ctx->shash)
+            if (ctx->crc)
+                ctx->crcval = crc32c(ctx->crcval, &bsep, 1);
+            else if (ctx->shash)
                 sip_hash_update(ctx->shash, (uint8_t *)&bsep, 1);
 
+            if (ctx->compressed && !shc_decompressor_idle(ctx->decompressor)) {
+                // the record ended in the middle of a compressed block
+                SHC_WARNING("Truncated compressed record in received message");
+                ctx->state = SHC_STATE_READING_ERR;
+                if (ctx->cb)
+                    ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                return ctx->state;
+            }
+
             if (bsep == SHARDCACHE_RSEP) {
                 ctx->state = SHC_STATE_READING_RECORD;
-                if (ctx->cb && ctx->cb(NULL, 0, ctx->rnum, ctx->cb_priv) != 0)
+                if (ctx->cb && ctx->hdr != SHC_HDR_BUSY &&
+                    ctx->cb(NULL, 0, ctx->rnum, ctx->cb_priv) != 0)
                 {
                     ctx->state = SHC_STATE_READING_ERR;
                     if (ctx->cb)
@@ -276,11 +749,12 @@ async_read_context_update(async_read_ctx_t *ctx)
                 ctx->rnum++;
                 ctx->rlen = 0;
             } else if (bsep == 0) {
-                if (ctx->auth)
+                if (ctx->auth || ctx->crc)
                     ctx->state = SHC_STATE_READING_AUTH;
                 else
                     ctx->state = SHC_STATE_READING_DONE;
-                if (ctx->cb && ctx->cb(NULL, 0, -1, ctx->cb_priv) != 0)
+                int idx = (ctx->hdr == SHC_HDR_BUSY) ? -4 : -1;
+                if (ctx->cb && ctx->cb(NULL, 0, idx, ctx->cb_priv) != 0)
                 {
                     ctx->state = SHC_STATE_READING_ERR;
                     if (ctx->cb)
@@ -297,6 +771,22 @@ async_read_context_update(async_read_ctx_t *ctx)
         }
     }
 
+    if (ctx->state == SHC_STATE_READING_AUTH && ctx->crc) {
+        if (rbuf_used(ctx->buf) < SHARDCACHE_MSG_CRC_LEN)
+            return ctx->state;
+
+        uint32_t received_crc;
+        rbuf_read(ctx->buf, (u_char *)&received_crc, sizeof(received_crc));
+        if (ntohl(received_crc) != ctx->crcval) {
+            SHC_WARNING("Bad checksum in received message");
+            ctx->state = SHC_STATE_READING_ERR;
+            if (ctx->cb)
+                ctx->cb(NULL, 0, -2, ctx->cb_priv);
+            return ctx->state;
+        }
+        ctx->state = SHC_STATE_READING_DONE;
+    }
+
     if (ctx->state == SHC_STATE_READING_AUTH) {
         if (rbuf_used(ctx->buf) < SHARDCACHE_MSG_SIG_LEN)
             return ctx->state;
@@ -344,18 +834,76 @@ async_read_context_update(async_read_ctx_t *ctx)
 async_read_context_state_t
 async_read_context_consume_data(async_read_ctx_t *ctx, rbuf_t *in)
 {
+    if (!ctx->buf)
+        ctx->buf = async_read_buffer_get();
     int used_bytes = rbuf_move(in, ctx->buf, rbuf_used(in));
     if (used_bytes)
-        return async_read_context_update(ctx);
+        async_read_context_update(ctx);
+    async_read_context_idle(ctx);
     return ctx->state;
 }
 
 async_read_context_state_t
 async_read_context_input_data(async_read_ctx_t *ctx, void *data, int len, int *processed)
 {
-    int used_bytes = rbuf_write(ctx->buf, data, len);
-    if (used_bytes)
-        async_read_context_update(ctx);
+    int used_bytes = 0;
+
+    if ((ctx->state == SHC_STATE_READING_NONE || ctx->state == SHC_STATE_READING_DONE) &&
+        !ctx->auth && (!ctx->buf || !rbuf_used(ctx->buf)))
+    {
+        // a whole message in the input can be parsed in place
+        if (ctx->state == SHC_STATE_READING_DONE)
+            async_read_context_reset(ctx);
+        int consumed = async_read_message_scan(ctx, data, len, NULL);
+        if (consumed) {
+            coarse_time(&ctx->last_update);
+            used_bytes = (consumed > 0) ? consumed : len;
+            // anything following the message is left for the next update
+            if (used_bytes < len) {
+                if (!ctx->buf)
+                    ctx->buf = async_read_buffer_get();
+                used_bytes += rbuf_write(ctx->buf, (u_char *)data + used_bytes, len - used_bytes);
+            }
+            async_read_context_idle(ctx);
+            if (processed)
+                *processed = used_bytes;
+            return ctx->state;
+        }
+    }
+
+    // the data of a chunk which is not chunk-signed is decoded
+    // in place, straight from the input buffer
+    if (ctx->state == SHC_STATE_READING_RECORD && !ctx->csig &&
+        ctx->clen > ctx->coff && (!ctx->buf || !rbuf_used(ctx->buf)))
+    {
+        uint32_t toread = ctx->clen - ctx->coff;
+        if (toread > (uint32_t)len)
+            toread = len;
+        coarse_time(&ctx->last_update);
+        if (ctx->crc)
+            ctx->crcval = crc32c(ctx->crcval, data, toread);
+        else if (ctx->shash)
+            sip_hash_update(ctx->shash, data, toread);
+        ctx->coff += toread;
+        used_bytes = toread;
+        if (async_read_record_data(ctx, data, toread) != 0) {
+            ctx->state = SHC_STATE_READING_ERR;
+            if (ctx->cb)
+                ctx->cb(NULL, 0, -2, ctx->cb_priv);
+        }
+    }
+
+    if (used_bytes < len && ctx->state != SHC_STATE_READING_ERR) {
+        if (!ctx->buf)
+            ctx->buf = async_read_buffer_get();
+        int wb = rbuf_write(ctx->buf, (u_char *)data + used_bytes, len - used_bytes);
+        used_bytes += wb;
+        if (wb)
+            async_read_context_update(ctx);
+    }
+
+    async_read_context_idle(ctx);
+
     if (processed)
         *processed = used_bytes;
     return ctx->state;
@@ -399,18 +947,23 @@ async_read_context_create(char *auth,
                           void *priv)
 {
     async_read_ctx_t *ctx = calloc(1, sizeof(async_read_ctx_t));
-    ctx->buf = rbuf_create(1<<16);
     ctx->cb = cb;
     ctx->cb_priv = priv;
     ctx->auth = auth;
-    gettimeofday(&ctx->last_update, NULL);
+    coarse_time(&ctx->last_update);
     return ctx;
 }
 
 void
 async_read_context_destroy(async_read_ctx_t *ctx)
 {
-    rbuf_destroy(ctx->buf);
+    if (ctx->buf)
+        async_read_buffer_put(ctx->buf);
+    if (ctx->decompressor)
+        shc_decompressor_destroy(ctx->decompressor);
+    if (ctx->shash)
+        sip_hash_free(ctx->shash);
+    free(ctx->chunk);
     free(ctx);
 }
 
@@ -451,12 +1004,15 @@ read_async_timeout(iomux_t *iomux, int fd, void *priv)
     }
 }
 
-int
-read_message_async(int fd,
-                   char *auth,
-                   async_read_callback_t cb,
-                   void *priv,
-                   async_read_wrk_t **worker)
+// 'session' must be true if the request has been sent on an authenticated
+// connection (so that the crc32c checksummed response is accepted)
+static int
+_read_message_async(int fd,
+                    char *auth,
+                    int session,
+                    async_read_callback_t cb,
+                    void *priv,
+                    async_read_wrk_t **worker)
 {
     struct timeval iomux_timeout = { 0, 20000 }; // 20ms
 
@@ -465,6 +1021,7 @@ read_message_async(int fd,
 
     async_read_wrk_t *wrk = calloc(1, sizeof(async_read_wrk_t));
     wrk->ctx = async_read_context_create(auth, cb, priv);
+    wrk->ctx->session = session;
     wrk->cbs.mux_input = read_async_input_data;
     wrk->cbs.mux_timeout = read_async_timeout;
     wrk->cbs.mux_eof = read_async_input_eof;
@@ -516,6 +1073,16 @@ read_message_async(int fd,
     return 0;
 }
 
+int
+read_message_async(int fd,
+                   char *auth,
+                   async_read_callback_t cb,
+                   void *priv,
+                   async_read_wrk_t **worker)
+{
+    return _read_message_async(fd, auth, 0, cb, priv, worker);
+}
+
 typedef struct {
     char *peer;
     void *key;
@@ -537,6 +1104,7 @@ fetch_from_peer_helper(void *data,
     // idx == -1 means that reading finished 
     // idx == -2 means error
     // idx == -3 means the async connection can been closed
+    // idx == -4 means that the peer is busy (reported as an error)
     // any idx >= 0 refers to the record index
     
     int ret = 0;
@@ -565,18 +1133,19 @@ fetch_from_peer_helper(void *data,
     return ret;
 }
 
-int
-fetch_from_peer_async(char *peer,
-                      char *auth,
-                      unsigned char sig_hdr,
-                      void *key,
-                      size_t klen,
-                      size_t offset,
-                      size_t len,
-                      fetch_from_peer_async_cb cb,
-                      void *priv,
-                      int fd,
-                      async_read_wrk_t **wrk)
+static int
+_fetch_from_peer_async(char *peer,
+                       char *auth,
+                       int sig_hdr,
+                       void *key,
+                       size_t klen,
+                       size_t offset,
+                       size_t len,
+                       unsigned char flags,
+                       fetch_from_peer_async_cb cb,
+                       void *priv,
+                       int fd,
+                       async_read_wrk_t **wrk)
 {
     int rc = -1;
     int should_close = 0;
@@ -603,10 +1172,14 @@ fetch_from_peer_async(char *peer,
             }
         };
 
-        if (!offset && !len)
-            rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_ASYNC, &record[0], 1);
-        else
+        if (offset || len) {
             rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_OFFSET, record, 3);
+        } else {
+            // the flags (if any) follow the key
+            record[1].v = &flags;
+            record[1].l = 1;
+            rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_ASYNC, record, flags ? 2 : 1);
+        }
 
         if (rc == 0) {
             fetch_from_peer_helper_arg_t *arg = calloc(1, sizeof(fetch_from_peer_helper_arg_t));
@@ -620,7 +1193,8 @@ fetch_from_peer_async(char *peer,
             arg->fd = should_close ? fd : -1;
             arg->cb = cb;
             arg->priv = priv;
-            rc = read_message_async(fd, auth, fetch_from_peer_helper, arg, wrk);
+            rc = _read_message_async(fd, auth, (SHC_SIG_HDR(sig_hdr) == SHC_HDR_CSIGNATURE_CRC),
+                                     fetch_from_peer_helper, arg, wrk);
             if (rc != 0) {
                 if (fd >= 0 && should_close)
                     close(fd);
@@ -636,277 +1210,523 @@ fetch_from_peer_async(char *peer,
     return rc;
 }
 
-static int
-read_and_check_siphash_signature(int fd, sip_hash *shash)
+int
+fetch_from_peer_async(char *peer,
+                      char *auth,
+                      int sig_hdr,
+                      void *key,
+                      size_t klen,
+                      size_t offset,
+                      size_t len,
+                      fetch_from_peer_async_cb cb,
+                      void *priv,
+                      int fd,
+                      async_read_wrk_t **wrk)
 {
-    uint64_t digest, received_digest;
-
-    int rb = read_socket(fd, (char *)&received_digest, sizeof(received_digest), 0);
-    if (rb != sizeof(received_digest)) {
-        SHC_WARNING("Truncated message (expected signature)");
-        return -1;
-    }
-    if (!sip_hash_final_integer(shash, &digest)) {
-        SHC_ERROR("Errors computing the siphash digest");
-        return -1;
-    }
+    return _fetch_from_peer_async(peer, auth, sig_hdr, key, klen, offset, len, 0, cb, priv, fd, wrk);
+}
 
-    int match = (memcmp(&digest, &received_digest, sizeof(digest)) == 0);
+int
+fetch_from_peer_async_flags(char *peer,
+                            char *auth,
+                            int sig_hdr,
+                            void *key,
+                            size_t klen,
+                            unsigned char flags,
+                            fetch_from_peer_async_cb cb,
+                            void *priv,
+                            int fd,
+                            async_read_wrk_t **wrk)
+{
+    return _fetch_from_peer_async(peer, auth, sig_hdr, key, klen, 0, 0, flags, cb, priv, fd, wrk);
+}
 
-    SHC_DEBUG2("computed digest for received data: %s",
-            shardcache_hex_escape((char *)&digest, sizeof(digest), 0, 0));
+typedef struct {
+    char *peer;
+    int num_keys;
+    int multi;
+    int received; // number of responses completely read
+    char index[sizeof(uint32_t)]; // index record of the response being read
+    int index_len;
+    fbuf_t value;
+    int fd;
+    fetch_multi_from_peer_async_cb cb;
+    void *priv;
+} fetch_multi_from_peer_arg_t;
+
+static int
+fetch_multi_from_peer_record(void *data, size_t len, int idx, void *priv)
+{
+    fetch_multi_from_peer_arg_t *arg = (fetch_multi_from_peer_arg_t *)priv;
+
+    // the value is the second record of a GET_MULTI response
+    // (the first one is the index of the key) and the only
+    // record of a GET_ASYNC response
+    if (idx == (arg->multi ? 1 : 0)) {
+        if (len)
+            fbuf_add_binary(&arg->value, data, len);
+    } else if (idx == 0 && len) {
+        if (arg->index_len + len > sizeof(arg->index))
+            return -1;
+        memcpy(arg->index + arg->index_len, data, len);
+        arg->index_len += len;
+    }
+
+    return (idx >= -1) ? 0 : -1;
+}
+
+static int
+fetch_multi_from_peer_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    async_read_ctx_t *ctx = (async_read_ctx_t *)priv;
+    fetch_multi_from_peer_arg_t *arg = (fetch_multi_from_peer_arg_t *)ctx->cb_priv;
+    int processed = 0;
+
+    async_read_context_state_t state = async_read_context_input_data(ctx, data, len, &processed);
+    while (state == SHC_STATE_READING_DONE) {
+        if (ctx->hdr == SHC_HDR_BUSY) {
+            SHC_DEBUG("Peer %s is busy, can't fetch multiple keys", arg->peer);
+            state = SHC_STATE_READING_ERR;
+            break;
+        }
+
+        // responses to a GET_MULTI are sent as soon as the values are
+        // available, pipelined GET_ASYNC responses are sent in order
+        int index = arg->received;
+        if (arg->multi) {
+            uint32_t index_nbo;
+            if (arg->index_len != sizeof(index_nbo)) {
+                state = SHC_STATE_READING_ERR;
+                break;
+            }
+            memcpy(&index_nbo, arg->index, sizeof(index_nbo));
+            index = ntohl(index_nbo);
+        }
+        if (index < 0 || index >= arg->num_keys) {
+            SHC_WARNING("Unexpected response from %s (index: %d, keys: %d)",
+                        arg->peer, index, arg->num_keys);
+            state = SHC_STATE_READING_ERR;
+            break;
+        }
+
+        arg->received++;
+        arg->index_len = 0;
+
+        if (arg->cb && arg->cb(arg->peer, index,
+                               fbuf_used(&arg->value) ? fbuf_data(&arg->value) : NULL,
+                               fbuf_used(&arg->value), 0, arg->priv) != 0)
+        {
+            arg->cb = NULL;
+            arg->priv = NULL;
+        }
+        fbuf_set_used(&arg->value, 0);
 
-    SHC_DEBUG2("digest from received data: %s (%s)",
-              shardcache_hex_escape((char *)&received_digest, sizeof(digest), 0, 0),
-              match ? "MATCH" : "MISMATCH");
+        if (arg->received == arg->num_keys)
+            break;
+
+        state = async_read_context_update(ctx);
+    }
 
+    if (state == SHC_STATE_READING_ERR ||
+        state == SHC_STATE_AUTH_ERR ||
+        arg->received == arg->num_keys)
+    {
+        iomux_close(iomux, fd);
+    }
 
-    return match;
+    return processed;
+}
+
+static void
+fetch_multi_from_peer_eof(iomux_t *iomux, int fd, void *priv)
+{
+    async_read_ctx_t *ctx = (async_read_ctx_t *)priv;
+    fetch_multi_from_peer_arg_t *arg = (fetch_multi_from_peer_arg_t *)ctx->cb_priv;
+
+    if (arg->cb)
+        arg->cb(arg->peer, -1, NULL, 0,
+                (arg->received == arg->num_keys) ? 1 : -1, arg->priv);
+
+    if (arg->fd >= 0)
+        close(arg->fd);
+    fbuf_destroy(&arg->value);
+    free(arg);
+
+    async_read_context_destroy(ctx);
 }
 
-// synchronous (blocking)  message reading
 int
-read_message(int fd,
-             char *auth,
-             fbuf_t **records,
-             int expected_records,
-             shardcache_hdr_t *ohdr,
-             int ignore_timeout)
+fetch_multi_from_peer_async(char *peer,
+                            char *auth,
+                            int sig_hdr,
+                            void **keys,
+                            size_t *klens,
+                            int num_keys,
+                            int multi,
+                            fetch_multi_from_peer_async_cb cb,
+                            void *priv,
+                            int fd,
+                            async_read_wrk_t **wrk)
 {
-    uint16_t clen;
-    int reading_message = 0;
-    unsigned char hdr;
-    int csig = 0;
-    sip_hash *shash = NULL;
-    char version = 0;
+    if (!wrk || num_keys <= 0)
+        return -1;
 
-    // there is no point in reading the message
-    // if we are not interested in any record
-    if (expected_records < 1)
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        if (fd < 0)
+            return -1;
+        should_close = 1;
+    }
+
+    int rc = 0;
+    if (multi) {
+        fbuf_t keys_buf = FBUF_STATIC_INITIALIZER;
+        pack_multi_keys(keys, klens, num_keys, &keys_buf);
+        shardcache_record_t record = {
+            .v = fbuf_data(&keys_buf),
+            .l = fbuf_used(&keys_buf)
+        };
+        rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_MULTI, &record, 1);
+        fbuf_destroy(&keys_buf);
+    } else {
+        // pipeline all the requests so that they go out with a single write
+        fbuf_t msg = FBUF_STATIC_INITIALIZER;
+        int i;
+        for (i = 0; i < num_keys && rc == 0; i++) {
+            shardcache_record_t record = {
+                .v = keys[i],
+                .l = klens[i]
+            };
+            rc = build_message(auth, sig_hdr, SHC_HDR_GET_ASYNC, &record, 1, &msg);
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        while(rc == 0 && fbuf_used(&msg) > 0) {
+            int wb = fbuf_write(&msg, fd, 0);
+            if (wb == 0 || (wb == -1 && errno != EINTR && errno != EAGAIN))
+                rc = -1;
+        }
+        fbuf_destroy(&msg);
+    }
+
+    if (rc != 0) {
+        if (should_close)
+            close(fd);
         return -1;
+    }
 
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    fetch_multi_from_peer_arg_t *arg = calloc(1, sizeof(fetch_multi_from_peer_arg_t));
+    arg->peer = peer;
+    arg->num_keys = num_keys;
+    arg->multi = multi;
+    arg->fd = should_close ? fd : -1;
+    arg->cb = cb;
+    arg->priv = priv;
+    FBUF_STATIC_INITIALIZER_POINTER(&arg->value, FBUF_MAXLEN_NONE, 64, 1024, 512);
+
+    *wrk = calloc(1, sizeof(async_read_wrk_t));
+    (*wrk)->ctx = async_read_context_create(auth, fetch_multi_from_peer_record, arg);
+    (*wrk)->ctx->session = (SHC_SIG_HDR(sig_hdr) == SHC_HDR_CSIGNATURE_CRC);
+    (*wrk)->cbs.mux_input = fetch_multi_from_peer_input;
+    (*wrk)->cbs.mux_timeout = read_async_timeout;
+    (*wrk)->cbs.mux_eof = fetch_multi_from_peer_eof;
+    (*wrk)->cbs.priv = (*wrk)->ctx;
+    (*wrk)->fd = fd;
 
-    if (auth)
-        shash = sip_hash_new((uint8_t *)auth, 2, 4);
+    return 0;
+}
 
-    int record_index = 0;
-    fbuf_t *out = records[record_index];
-    int initial_len = fbuf_used(out);
-
-    for(;;) {
-        int rb;
-
-        if (reading_message == 0) {
-            uint32_t magic = 0;
-            do {
-                rb = read_socket(fd, (char *)&hdr, 1, ignore_timeout);
-            } while (rb == 1 && hdr == SHC_HDR_NOOP);
-
-            ((char *)&magic)[0] = hdr;
-            rb = read_socket(fd, ((char *)&magic)+1, sizeof(magic)-1, ignore_timeout);
-            if (rb != sizeof(magic) -1) {
-                if (shash)
-                    sip_hash_free(shash);
-                return -1;
-            }
+// the synchronous reader parses the messages with the same state machine
+// used by the asynchronous one, each thread reuses its own context
+static pthread_key_t sync_reader_key;
+static pthread_once_t sync_reader_key_once = PTHREAD_ONCE_INIT;
 
-            if (((ntohl(magic))&0xFFFFFF00) != (SHC_MAGIC&0xFFFFFF00)) {
-                SHC_DEBUG("Wrong magic");
-                if (shash)
-                    sip_hash_free(shash);
-                return -1;
-            }
-            version = ((char *)&magic)[3];
-            if (version > SHC_PROTOCOL_VERSION) {
-                SHC_WARNING("Unsupported protocol version 0x%02x\n", version);
-                if (shash)
-                    sip_hash_free(shash);
-                return -1;
-            }
+static void
+sync_reader_destroy(void *ctx)
+{
+    async_read_context_destroy((async_read_ctx_t *)ctx);
+}
 
-            rb = read_socket(fd, (char *)&hdr, 1, ignore_timeout);
-            if (rb != 1) {
-                if (shash)
-                    sip_hash_free(shash);
-                return -1;
-            }
+static void
+sync_reader_key_create(void)
+{
+    pthread_key_create(&sync_reader_key, sync_reader_destroy);
+}
 
-            if (rb == 1) {
-                if ((hdr&0xFE) == SHC_HDR_SIGNATURE_SIP) {
-                    if (!shash) // no secred is configured but the message is signed
-                        return -1;
-                    csig = (hdr&0x01);
-                    rb = read_socket(fd, (char *)&hdr, 1, ignore_timeout);
-                } else if (shash) {
-                    // we are expecting a signature header
-                    sip_hash_free(shash);
-                    return -1;
-                }
-            }
+typedef struct {
+    fbuf_t **records;
+    int expected_records;
+    int error;
+} sync_reader_arg_t;
 
-            if (rb == 0 || (rb == -1 && errno != EINTR && errno != EAGAIN)) {
-                if (shash)
-                    sip_hash_free(shash);
-                return -1;
-            } else if (rb == -1) {
-                continue;
-            }
+static int
+sync_reader_callback(void *data, size_t len, int idx, void *priv)
+{
+    sync_reader_arg_t *arg = (sync_reader_arg_t *)priv;
 
-            if (hdr != SHC_HDR_GET &&
-                hdr != SHC_HDR_GET &&
-                hdr != SHC_HDR_DELETE &&
-                hdr != SHC_HDR_EVICT &&
-                hdr != SHC_HDR_GET_ASYNC &&
-                hdr != SHC_HDR_GET_OFFSET &&
-                hdr != SHC_HDR_ADD &&
-                hdr != SHC_HDR_EXISTS &&
-                hdr != SHC_HDR_TOUCH &&
-                hdr != SHC_HDR_MIGRATION_BEGIN &&
-                hdr != SHC_HDR_MIGRATION_ABORT &&
-                hdr != SHC_HDR_MIGRATION_END &&
-                hdr != SHC_HDR_CHECK &&
-                hdr != SHC_HDR_STATS &&
-                hdr != SHC_HDR_GET_INDEX &&
-                hdr != SHC_HDR_INDEX_RESPONSE &&
-                hdr != SHC_HDR_REPLICA_COMMAND &&
-                hdr != SHC_HDR_REPLICA_RESPONSE &&
-                hdr != SHC_HDR_REPLICA_PING &&
-                hdr != SHC_HDR_REPLICA_ACK &&
-                hdr != SHC_HDR_RESPONSE)
-            {
-                if (shash)
-                    sip_hash_free(shash);
-                fprintf(stderr, "Unknown message type %02x in read_message()\n", hdr);
-                return -1;
-            }
-            if (shash) {
-                sip_hash_update(shash, &hdr, 1);
-                if (csig) {
-                    if (!read_and_check_siphash_signature(fd, shash)) {
-                        sip_hash_free(shash);
-                        SHC_WARNING("Can't validate signature (message type %02x) in read_message()", hdr);
-                        return -1;
-                    }
-                }
+    if (idx == -2) {
+        arg->error = 1;
+        return 0;
+    }
 
-            }
-            if (ohdr)
-                *ohdr = hdr;
-            reading_message = 1;
-        }
-
-        rb = read_socket(fd, (char *)&clen, 2, ignore_timeout);
-        // XXX - bug if read only one byte at this point
-        if (rb == 2) {
-            if (shash)
-                sip_hash_update(shash, (uint8_t *)&clen, 2);
-            uint16_t chunk_len = ntohs(clen);
-
-            if (chunk_len == 0) {
-                unsigned char rsep = 0;
-                rb = read_socket(fd, (char *)&rsep, 1, ignore_timeout);
-                if (rb != 1) {
-                    fbuf_set_used(out, initial_len);
-                    if (shash)
-                        sip_hash_free(shash);
-                    return -1;
-                }
+    // records we are not interested in are discarded
+    if (idx < 0 || idx >= arg->expected_records || !len)
+        return 0;
 
-                if (shash)
-                    sip_hash_update(shash, &rsep, 1);
-
-                if (rsep == SHARDCACHE_RSEP) {
-                    // go ahead fetching the next record
-                    if (shash && csig) {
-                        if (!read_and_check_siphash_signature(fd, shash)) {
-                            sip_hash_free(shash);
-                            fbuf_set_used(out, initial_len);
-                            SHC_WARNING("Unauthorized message type %02x in read_message()", hdr);
-                            return -1;
-                        }
-                    }
-                    record_index++;
-                    if (record_index == expected_records) {
-                        if (shash)
-                            sip_hash_free(shash);
-                        return record_index + 1;
-                    }
-                    out = records[record_index];
-                } else if (rsep == 0) {
-                    if (shash) {
-                        if (!read_and_check_siphash_signature(fd, shash)) {
-                            sip_hash_free(shash);
-                            fbuf_set_used(out, initial_len);
-                            SHC_WARNING("Unauthorized message type %02x in read_message()", hdr);
-                            return -1;
-                        }
-                        sip_hash_free(shash);
-                    }
-                    return record_index + 1;
-                } else {
-                    // BOGUS RESPONSE
-                    fbuf_set_used(out, initial_len);
-                    if (shash)
-                        sip_hash_free(shash);
-                    return -1;
-                }
-            }
+    fbuf_t *out = arg->records[idx];
+    if (fbuf_used(out) + len > SHARDCACHE_MSG_MAX_RECORD_LEN) {
+        // we would exceed the maximum size for a record
+        // let's abort this request
+        SHC_WARNING("Maximum record size exceeded (%dMB)",
+                    SHARDCACHE_MSG_MAX_RECORD_LEN >> 20);
+        return -1;
+    }
 
-            while (chunk_len != 0) {
-                char buf[chunk_len];
-                rb = read_socket(fd, buf, chunk_len, ignore_timeout);
-                if (rb == -1) {
-                    if (errno != EINTR && errno != EAGAIN) {
-                        // ERROR
-                        fbuf_set_used(out, initial_len);
-                        if (shash)
-                            sip_hash_free(shash);
-
-                        return -1;
-                    }
-                    continue;
-                } else if (rb == 0) {
-                    fbuf_set_used(out, initial_len);
-                    if (shash)
-                        sip_hash_free(shash);
+    fbuf_add_binary(out, data, len);
+    return 0;
+}
 
-                    return -1;
-                }
-                chunk_len -= rb;
-                fbuf_add_binary(out, buf, rb);
-                if (shash)
-                    sip_hash_update(shash, (uint8_t *)buf, rb);
-                if (fbuf_used(out) > SHARDCACHE_MSG_MAX_RECORD_LEN) {
-                    // we have exceeded the maximum size for a record
-                    // let's abort this request
-                    fprintf(stderr, "Maximum record size exceeded (%dMB)",
-                            SHARDCACHE_MSG_MAX_RECORD_LEN >> 20);
-                    fbuf_set_used(out, initial_len);
-                    if (shash)
-                        sip_hash_free(shash);
+static async_read_ctx_t *
+sync_reader_get(char *auth, int session, sync_reader_arg_t *arg)
+{
+    pthread_once(&sync_reader_key_once, sync_reader_key_create);
 
-                    return -1;
-                }
-            }
+    async_read_ctx_t *ctx = pthread_getspecific(sync_reader_key);
+    if (!ctx) {
+        ctx = async_read_context_create(auth, sync_reader_callback, arg);
+        pthread_setspecific(sync_reader_key, ctx);
+    } else {
+        // discard whatever has been left by a failed read
+        if (ctx->buf)
+            rbuf_clear(ctx->buf);
+        if (ctx->shash) {
+            sip_hash_free(ctx->shash);
+            ctx->shash = NULL;
+        }
+        async_read_context_reset(ctx);
+        ctx->hdr = 0;
+        ctx->auth = auth;
+        ctx->cb = sync_reader_callback;
+        ctx->cb_priv = arg;
+    }
+    ctx->session = session;
+    return ctx;
+}
 
-            if (shash && csig) {
-                if (!read_and_check_siphash_signature(fd, shash)) {
-                    sip_hash_free(shash);
-                    fbuf_set_used(out, initial_len);
-                    SHC_WARNING("Unauthorized message type %02x in read_message()", hdr);
-                    return -1;
+static inline int
+_known_message_type(shardcache_hdr_t hdr)
+{
+    switch(hdr) {
+        case SHC_HDR_GET:
+        case SHC_HDR_DELETE:
+        case SHC_HDR_EVICT:
+        case SHC_HDR_GET_ASYNC:
+        case SHC_HDR_GET_OFFSET:
+        case SHC_HDR_ADD:
+        case SHC_HDR_EXISTS:
+        case SHC_HDR_TOUCH:
+        case SHC_HDR_GET_MULTI:
+        case SHC_HDR_SET_MULTI:
+        case SHC_HDR_DELETE_MULTI:
+        case SHC_HDR_TOUCH_MULTI:
+        case SHC_HDR_EVICT_MULTI:
+        case SHC_HDR_GET_IF_MODIFIED:
+        case SHC_HDR_CAS:
+        case SHC_HDR_GETS:
+        case SHC_HDR_INCR:
+        case SHC_HDR_DECR:
+        case SHC_HDR_MIGRATION_BEGIN:
+        case SHC_HDR_MIGRATION_ABORT:
+        case SHC_HDR_MIGRATION_END:
+        case SHC_HDR_CHECK:
+        case SHC_HDR_STATS:
+        case SHC_HDR_AUTH:
+        case SHC_HDR_GET_INDEX:
+        case SHC_HDR_INDEX_RESPONSE:
+        case SHC_HDR_REPLICA_COMMAND:
+        case SHC_HDR_REPLICA_RESPONSE:
+        case SHC_HDR_REPLICA_PING:
+        case SHC_HDR_REPLICA_ACK:
+        case SHC_HDR_BUSY:
+        case SHC_HDR_NOT_MODIFIED:
+        case SHC_HDR_RESPONSE:
+            return 1;
+        default:
+            break;
+    }
+    return 0;
+}
+
+// read as much as available (a single read() for most of the messages),
+// returns 0 if no more data will come
+static int
+sync_reader_read(int fd, char *buf, int len, int ignore_timeout)
+{
+    for (;;) {
+        int rb = read(fd, buf, len);
+        if (rb >= 0)
+            return rb;
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+
+        // the socket has been left in non-blocking mode (by the async reader),
+        // go back to blocking reads (honoring the receive timeout of the socket)
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags == -1)
+            return -1;
+        if (flags & O_NONBLOCK) {
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+            continue;
+        }
+
+        if (!ignore_timeout)
+            return -1;
+    }
+    return -1;
+}
+
+// synchronous (blocking)  message reading
+// NOTE: messages checksummed with crc32c are accepted only if accept_crc
+//       is true (which means that the request was sent using a session)
+static int
+_read_message_internal(int fd,
+                       char *auth,
+                       fbuf_t **records,
+                       int expected_records,
+                       shardcache_hdr_t *ohdr,
+                       int ignore_timeout,
+                       int accept_crc)
+{
+    // there is no point in reading the message
+    // if we are not interested in any record
+    if (expected_records < 1)
+        return -1;
+
+    int initial_lens[expected_records];
+    int i;
+    for (i = 0; i < expected_records; i++)
+        initial_lens[i] = fbuf_used(records[i]);
+
+    sync_reader_arg_t arg = {
+        .records = records,
+        .expected_records = expected_records,
+        .error = 0
+    };
+
+    async_read_ctx_t *ctx = sync_reader_get(auth, accept_crc, &arg);
+
+    char buf[16384];
+    int leftover = 0;
+    async_read_context_state_t state = SHC_STATE_READING_NONE;
+    while (state != SHC_STATE_READING_DONE &&
+           state != SHC_STATE_READING_ERR &&
+           state != SHC_STATE_AUTH_ERR)
+    {
+        int rb = sync_reader_read(fd, buf, sizeof(buf), ignore_timeout);
+        if (rb <= 0)
+            break;
+
+        int offset = 0;
+        while (offset < rb) {
+            int processed = 0;
+            state = async_read_context_input_data(ctx, buf + offset, rb - offset, &processed);
+            offset += processed;
+            if (state == SHC_STATE_READING_DONE ||
+                state == SHC_STATE_READING_ERR ||
+                state == SHC_STATE_AUTH_ERR)
+            {
+                // noops might follow the message, anything else would be lost
+                for (i = offset; i < rb; i++) {
+                    if ((unsigned char)buf[i] != SHC_HDR_NOOP)
+                        leftover++;
+                }
+                unsigned char byte;
+                while (ctx->buf && rbuf_used(ctx->buf)) {
+                    rbuf_read(ctx->buf, &byte, 1);
+                    if (byte != SHC_HDR_NOOP)
+                        leftover++;
                 }
+                break;
+            }
+            if (!processed) {
+                // can't happen unless the state machine got stuck
+                state = SHC_STATE_READING_ERR;
+                break;
             }
-        } else if (rb == 0 || (rb == -1 && errno != EINTR && errno != EAGAIN)) {
-            // ERROR
-            break;
         }
     }
-    if (shash)
-        sip_hash_free(shash);
 
-    return -1;
+    shardcache_hdr_t hdr = ctx->hdr;
+    int rc = -1;
+
+    if (state == SHC_STATE_READING_DONE && !arg.error) {
+        if (!_known_message_type(hdr)) {
+            SHC_WARNING("Unknown message type %02x in read_message()", hdr);
+        } else if (ctx->crc && !accept_crc) {
+            SHC_WARNING("Unauthorized message type %02x in read_message()", hdr);
+        } else if (leftover) {
+            // the connection can't be reused if we read
+            // data belonging to the next message
+            SHC_WARNING("Unexpected data (%d bytes) after message type %02x in read_message()",
+                        leftover, hdr);
+        } else {
+            rc = ctx->rnum + 1;
+        }
+    } else if (state == SHC_STATE_AUTH_ERR) {
+        SHC_WARNING("Can't validate signature (message type %02x) in read_message()", hdr);
+    }
+
+    if (rc == -1) {
+        for (i = 0; i < expected_records; i++)
+            fbuf_set_used(records[i], initial_lens[i]);
+    }
+
+    if (ohdr)
+        *ohdr = hdr;
+
+    // don't keep references to the caller's stack
+    ctx->cb = NULL;
+    ctx->cb_priv = NULL;
+
+    return rc;
+}
+
+static int
+_read_response(int fd,
+               char *auth,
+               int sig_hdr,
+               fbuf_t **records,
+               int expected_records,
+               shardcache_hdr_t *ohdr,
+               int ignore_timeout)
+{
+    shardcache_hdr_t hdr = 0;
+    int initial_len = (expected_records > 0) ? fbuf_used(records[0]) : 0;
+    int rc = _read_message_internal(fd, auth, records, expected_records, &hdr, ignore_timeout,
+                                    (SHC_SIG_HDR(sig_hdr) == SHC_HDR_CSIGNATURE_CRC));
+    if (rc > 0 && hdr == SHC_HDR_BUSY) {
+        // the status record of a busy response is not
+        // data the caller is interested in
+        fbuf_set_used(records[0], initial_len);
+    }
+    if (ohdr)
+        *ohdr = hdr;
+    return rc;
+}
+
+int
+read_message(int fd,
+             char *auth,
+             fbuf_t **records,
+             int expected_records,
+             shardcache_hdr_t *ohdr,
+             int ignore_timeout)
+{
+    return _read_response(fd, auth, 0, records, expected_records, ohdr, ignore_timeout);
 }
 
 uint64_t
@@ -921,6 +1741,20 @@ _sign_chunk(sip_hash *shash, void *buf, size_t len)
     return digest;
 }
 
+// add the size of a chunk (or the EOR if 0) using the framing
+// requested for the message (32bit sizes if wide)
+static inline void
+_add_chunk_size(fbuf_t *out, uint32_t size, int wide)
+{
+    if (wide) {
+        uint32_t size_nbo = htonl(size);
+        fbuf_add_binary(out, (char *)&size_nbo, sizeof(size_nbo));
+    } else {
+        uint16_t size_nbo = htons(size);
+        fbuf_add_binary(out, (char *)&size_nbo, sizeof(size_nbo));
+    }
+}
+
 int
 _chunkize_buffer(sip_hash *shash,
                  unsigned char sig_hdr,
@@ -929,13 +1763,17 @@ _chunkize_buffer(sip_hash *shash,
                  fbuf_t *out)
 {
     int ofx = 0;
+    int wide = (sig_hdr & SHC_SIG_WIDE_RECORDS);
+    sig_hdr &= ~SHC_SIG_WIDE_RECORDS;
 
     do {
         size_t out_initial_offset = fbuf_used(out);
-        int writelen = (blen > (size_t)UINT16_MAX) ? UINT16_MAX : blen;
+        size_t writelen = blen;
+        // wide records are sent as a single chunk
+        if (!wide && writelen > (size_t)UINT16_MAX)
+            writelen = UINT16_MAX;
         blen -= writelen;
-        uint16_t size = htons(writelen);
-        fbuf_add_binary(out, (char *)&size, 2);
+        _add_chunk_size(out, writelen, wide);
         fbuf_add_binary(out, buf + ofx, writelen);
         if (shash && sig_hdr == SHC_HDR_CSIGNATURE_SIP) {
             uint64_t digest = _sign_chunk(shash,
@@ -944,8 +1782,7 @@ _chunkize_buffer(sip_hash *shash,
             fbuf_add_binary(out, (char *)&digest, sizeof(digest));
         }
         if (blen == 0) {
-            uint16_t eor = 0;
-            fbuf_add_binary(out, (char *)&eor, 2);
+            _add_chunk_size(out, 0, wide);
             return 0;
         }
         ofx += writelen;
@@ -954,18 +1791,95 @@ _chunkize_buffer(sip_hash *shash,
     return -1;
 }
 
-int build_message(char *auth,
-                  unsigned char sig_hdr,
-                  unsigned char hdr,
-                  shardcache_record_t *records,
-                  int num_records,
-                  fbuf_t *out)
+static inline void
+_add_crc(uint32_t *crc, void *buf, size_t len, fbuf_t *out)
+{
+    *crc = crc32c(*crc, buf, len);
+    uint32_t crc_nbo = htonl(*crc);
+    fbuf_add_binary(out, (char *)&crc_nbo, sizeof(crc_nbo));
+}
+
+// same layout of the messages using SHC_HDR_CSIGNATURE_SIP but with
+// a running crc32c checksum instead of the siphash digests
+static int
+_build_message_crc(unsigned char hdr,
+                   shardcache_record_t *records,
+                   int num_records,
+                   int wide,
+                   unsigned char magic_flags,
+                   fbuf_t *out)
 {
     static char eom = 0;
     static char sep = SHARDCACHE_RSEP;
-    uint16_t    eor = 0;
+    uint32_t    crc = 0;
+    // EOR + RSEP (or EOM)
+    int         eor_len = (wide ? sizeof(uint32_t) : sizeof(uint16_t)) + 1;
 
-    uint32_t magic = htonl(SHC_MAGIC);
+    uint32_t magic = htonl(SHC_MAGIC_V2|magic_flags);
+    fbuf_add_binary(out, (char *)&magic, sizeof(magic));
+
+    unsigned char hdr_sig = SHC_HDR_CSIGNATURE_CRC;
+    fbuf_add_binary(out, (char *)&hdr_sig, 1);
+
+    fbuf_add_binary(out, (char *)&hdr, 1);
+    _add_crc(&crc, &hdr, 1, out);
+
+    int i;
+    for (i = 0; i < num_records || i == 0; i++) {
+        if (i > 0) {
+            fbuf_add_binary(out, &sep, 1);
+            _add_crc(&crc, fbuf_data(out) + fbuf_used(out) - eor_len, eor_len, out);
+        }
+        if (i < num_records && records[i].v && records[i].l) {
+            char *buf = records[i].v;
+            size_t blen = records[i].l;
+            while (blen) {
+                size_t writelen = blen;
+                if (!wide && writelen > (size_t)UINT16_MAX)
+                    writelen = UINT16_MAX;
+                int offset = fbuf_used(out);
+                _add_chunk_size(out, writelen, wide);
+                fbuf_add_binary(out, buf, writelen);
+                _add_crc(&crc, fbuf_data(out) + offset, fbuf_used(out) - offset, out);
+                buf += writelen;
+                blen -= writelen;
+            }
+        }
+        _add_chunk_size(out, 0, wide);
+    }
+
+    fbuf_add_binary(out, &eom, 1);
+    _add_crc(&crc, fbuf_data(out) + fbuf_used(out) - eor_len, eor_len, out);
+
+    return 0;
+}
+
+static int
+_build_message(char *auth,
+               int sig,
+               unsigned char hdr,
+               shardcache_record_t *records,
+               int num_records,
+               unsigned char magic_flags,
+               fbuf_t *out)
+{
+    static char eom = 0;
+    static char sep = SHARDCACHE_RSEP;
+
+    int wide = (sig & SHC_SIG_WIDE_RECORDS);
+    // EOR + RSEP (or EOM)
+    int eor_len = (wide ? sizeof(uint32_t) : sizeof(uint16_t)) + 1;
+    unsigned char framing = wide ? SHC_SIG_WIDE_RECORDS : 0;
+    unsigned char sig_hdr = SHC_SIG_HDR(sig);
+
+    if (wide)
+        magic_flags |= SHC_MAGIC_WIDE_RECORDS;
+
+    if (sig_hdr == SHC_HDR_CSIGNATURE_CRC)
+        return _build_message_crc(hdr, records, num_records, wide, magic_flags, out);
+
+    // V1 messages have no flags in the version byte
+    uint32_t magic = htonl(magic_flags ? SHC_MAGIC_V2|magic_flags : SHC_MAGIC);
     fbuf_add_binary(out, (char *)&magic, sizeof(magic));
 
     sip_hash *shash = NULL;
@@ -989,29 +1903,29 @@ int build_message(char *auth,
             if (i > 0) {
                 fbuf_add_binary(out, &sep, 1);
                 if (auth && sig_hdr == SHC_HDR_CSIGNATURE_SIP) {
-                    uint64_t digest = _sign_chunk(shash, fbuf_data(out) + fbuf_used(out) - 3, 3);
+                    uint64_t digest = _sign_chunk(shash, fbuf_data(out) + fbuf_used(out) - eor_len, eor_len);
                     fbuf_add_binary(out, (char *)&digest, sizeof(digest));
                 }
             }
             if (records[i].v && records[i].l) {
-                if (_chunkize_buffer(shash, sig_hdr, records[i].v, records[i].l, out) != 0) {
+                if (_chunkize_buffer(shash, sig_hdr|framing, records[i].v, records[i].l, out) != 0) {
                     if (shash)
                         sip_hash_free(shash);
                     return -1;
                 }
             } else {
-                fbuf_add_binary(out, (char *)&eor, sizeof(eor));
+                _add_chunk_size(out, 0, wide);
             }
         }
     } else {
-        fbuf_add_binary(out, (char *)&eor, sizeof(eor));
+        _add_chunk_size(out, 0, wide);
     }
 
     fbuf_add_binary(out, &eom, 1);
 
     if (auth) {
         if (sig_hdr == SHC_HDR_CSIGNATURE_SIP) {
-            uint64_t digest = _sign_chunk(shash, fbuf_data(out) + fbuf_used(out) - 3, 3);
+            uint64_t digest = _sign_chunk(shash, fbuf_data(out) + fbuf_used(out) - eor_len, eor_len);
             fbuf_add_binary(out, (char *)&digest, sizeof(digest));
         } else {
             uint64_t digest = _sign_chunk(shash,
@@ -1027,10 +1941,73 @@ int build_message(char *auth,
     return 0;
 }
 
+int build_message(char *auth,
+                  int sig_hdr,
+                  unsigned char hdr,
+                  shardcache_record_t *records,
+                  int num_records,
+                  fbuf_t *out)
+{
+    int algo = SHC_SIG_COMPRESSION_ALGO(sig_hdr);
+    if (!algo || num_records < 1)
+        return _build_message(auth, sig_hdr, hdr, records, num_records, 0, out);
+
+    // the whole message is compressed only if any of the records is big
+    // enough, the small ones are then sent as uncompressed blocks
+    size_t threshold = shc_compression_threshold(-1);
+    int i;
+    for (i = 0; i < num_records; i++) {
+        if (records[i].v && records[i].l >= threshold)
+            break;
+    }
+    if (i == num_records)
+        return _build_message(auth, sig_hdr, hdr, records, num_records, 0, out);
+
+    fbuf_t blocks = FBUF_STATIC_INITIALIZER;
+    size_t offsets[num_records + 1];
+    for (i = 0; i < num_records; i++) {
+        offsets[i] = fbuf_used(&blocks);
+        if (records[i].v && records[i].l &&
+            shc_compress(algo, records[i].v, records[i].l, &blocks) != 0)
+        {
+            // send it uncompressed
+            SHC_WARNING("Can't compress record %d of message %02x", i, hdr);
+            fbuf_destroy(&blocks);
+            return _build_message(auth, sig_hdr, hdr, records, num_records, 0, out);
+        }
+    }
+    offsets[num_records] = fbuf_used(&blocks);
+
+    shardcache_record_t compressed[num_records];
+    for (i = 0; i < num_records; i++) {
+        compressed[i].v = fbuf_data(&blocks) + offsets[i];
+        compressed[i].l = offsets[i+1] - offsets[i];
+    }
+
+    int rc = _build_message(auth, sig_hdr, hdr, compressed, num_records,
+                            SHC_MAGIC_COMPRESSED, out);
+    fbuf_destroy(&blocks);
+    return rc;
+}
+
+// write (and consume) a message already built in 'msg'
+static int
+write_buffer(int fd, fbuf_t *msg)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    while(fbuf_used(msg) > 0) {
+        int wb = fbuf_write(msg, fd, 0);
+        if (wb == 0 || (wb == -1 && errno != EINTR && errno != EAGAIN))
+            return -1;
+    }
+    return 0;
+}
+
 int
 write_message(int fd,
               char *auth,
-              unsigned char sig_hdr,
+              int sig_hdr,
               unsigned char hdr,
               shardcache_record_t *records,
               int num_records)
@@ -1055,24 +2032,16 @@ write_message(int fd,
                   shardcache_hex_escape(fbuf_end(&msg)-dlen, dlen, 0, 0));
     }
 
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
-
-    while(fbuf_used(&msg) > 0) {
-        int wb = fbuf_write(&msg, fd, 0);
-        if (wb == 0 || (wb == -1 && errno != EINTR && errno != EAGAIN)) {
-            fbuf_destroy(&msg);
-            return -1;
-        }
-    }
+    int rc = write_buffer(fd, &msg);
     fbuf_destroy(&msg);
-    return 0;
+    return rc;
 }
 
 
 static int
 _delete_from_peer_internal(char *peer,
                            char *auth,
-                           unsigned char sig_hdr,
+                           int sig_hdr,
                            void *key,
                            size_t klen,
                            int owner,
@@ -1109,7 +2078,7 @@ _delete_from_peer_internal(char *peer,
             shardcache_hdr_t hdr = 0;
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 SHC_DEBUG2("Got (del) response from peer %s: %02x\n",
                           peer, *((char *)fbuf_data(&resp)));
@@ -1122,6 +2091,11 @@ _delete_from_peer_internal(char *peer,
 
                 fbuf_destroy(&resp);
                 return rc;
+            } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+                fbuf_destroy(&resp);
+                if (should_close)
+                    close(fd);
+                return SHARDCACHE_PEER_BUSY;
             } else {
                 // TODO - Error messages
             }
@@ -1137,7 +2111,7 @@ _delete_from_peer_internal(char *peer,
 int
 delete_from_peer(char *peer,
                  char *auth,
-                 unsigned char sig,
+                 int sig,
                  void *key,
                  size_t klen,
                  int fd,
@@ -1149,7 +2123,7 @@ delete_from_peer(char *peer,
 int
 evict_from_peer(char *peer,
                 char *auth,
-                unsigned char sig,
+                int sig,
                 void *key,
                 size_t klen,
                 int fd,
@@ -1163,7 +2137,7 @@ evict_from_peer(char *peer,
 int
 _send_to_peer_internal(char *peer,
                        char *auth,
-                       unsigned char sig_hdr,
+                       int sig_hdr,
                        void *key,
                        size_t klen,
                        void *value,
@@ -1212,7 +2186,7 @@ _send_to_peer_internal(char *peer,
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
             errno = 0;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 SHC_DEBUG2("Got (set) response from peer %s : %s\n",
                           peer, fbuf_data(&resp));
@@ -1237,6 +2211,11 @@ _send_to_peer_internal(char *peer,
                 }
                 fbuf_destroy(&resp);
                 return rc;
+            } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+                fbuf_destroy(&resp);
+                if (should_close)
+                    close(fd);
+                return SHARDCACHE_PEER_BUSY;
             } else {
                 fprintf(stderr, "Bad response (%02x) from %s : %s\n",
                         hdr, peer, strerror(errno));
@@ -1255,7 +2234,7 @@ _send_to_peer_internal(char *peer,
 int
 send_to_peer(char *peer,
              char *auth,
-             unsigned char sig,
+             int sig,
              void *key,
              size_t klen,
              void *value,
@@ -1271,7 +2250,7 @@ send_to_peer(char *peer,
 int
 add_to_peer(char *peer,
             char *auth,
-            unsigned char sig,
+            int sig,
             void *key,
             size_t klen,
             void *value,
@@ -1284,14 +2263,17 @@ add_to_peer(char *peer,
                                   value, vlen, expire, 1, fd, expect_response);
 }
 
-int
-fetch_from_peer(char *peer,
-                char *auth,
-                unsigned char sig_hdr,
-                void *key,
-                size_t len,
-                fbuf_t *out,
-                int fd)
+// if 'version' is provided the value is requested only if its version
+// stamp differs from *version (returns 1 if it didn't change)
+static int
+_fetch_from_peer_internal(char *peer,
+                          char *auth,
+                          int sig_hdr,
+                          void *key,
+                          size_t len,
+                          uint64_t *version,
+                          fbuf_t *out,
+                          int fd)
 {
     int should_close = 0;
     if (fd < 0) {
@@ -1300,16 +2282,32 @@ fetch_from_peer(char *peer,
     }
 
     if (fd >= 0) {
-        shardcache_record_t record = {
-            .v = key,
-            .l = len
+        uint64_t version_nbo = version ? shc_hton64(*version) : 0;
+        shardcache_record_t record[2] = {
+            {
+                .v = key,
+                .l = len
+            },
+            {
+                .v = &version_nbo,
+                .l = sizeof(uint64_t)
+            }
         };
         int rc = write_message(fd, auth, sig_hdr,
-                SHC_HDR_GET, &record, 1);
+                version ? SHC_HDR_GET_IF_MODIFIED : SHC_HDR_GET, record, version ? 2 : 1);
         if (rc == 0) {
             shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, auth, &out, 1, &hdr, 0);
-            if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
+            fbuf_t version_buf = FBUF_STATIC_INITIALIZER;
+            fbuf_t *resp[2] = { out, &version_buf };
+            int num_records = _read_response(fd, auth, sig_hdr, resp, version ? 2 : 1, &hdr, 0);
+            if (hdr == SHC_HDR_RESPONSE && num_records == (version ? 2 : 1) &&
+                (!version || fbuf_used(&version_buf) == sizeof(uint64_t)))
+            {
+                if (version) {
+                    memcpy(&version_nbo, fbuf_data(&version_buf), sizeof(uint64_t));
+                    *version = shc_ntoh64(version_nbo);
+                }
+                fbuf_destroy(&version_buf);
                 if (fbuf_used(out)) {
                     char keystr[1024];
                     memcpy(keystr, key, len < 1024 ? len : 1024);
@@ -1320,9 +2318,20 @@ fetch_from_peer(char *peer,
                 if (should_close)
                     close(fd);
                 return 0;
+            } else if (hdr == SHC_HDR_NOT_MODIFIED && version) {
+                fbuf_destroy(&version_buf);
+                if (should_close)
+                    close(fd);
+                return 1;
+            } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+                fbuf_destroy(&version_buf);
+                if (should_close)
+                    close(fd);
+                return SHARDCACHE_PEER_BUSY;
             } else {
                 // TODO - Error messages
             }
+            fbuf_destroy(&version_buf);
         }
         if (should_close)
             close(fd);
@@ -1330,10 +2339,35 @@ fetch_from_peer(char *peer,
     return -1;
 }
 
+int
+fetch_from_peer(char *peer,
+                char *auth,
+                int sig_hdr,
+                void *key,
+                size_t len,
+                fbuf_t *out,
+                int fd)
+{
+    return _fetch_from_peer_internal(peer, auth, sig_hdr, key, len, NULL, out, fd);
+}
+
+int
+fetch_from_peer_if_modified(char *peer,
+                            char *auth,
+                            int sig_hdr,
+                            void *key,
+                            size_t len,
+                            uint64_t *version,
+                            fbuf_t *out,
+                            int fd)
+{
+    return _fetch_from_peer_internal(peer, auth, sig_hdr, key, len, version, out, fd);
+}
+
 int
 offset_from_peer(char *peer,
                  char *auth,
-                 unsigned char sig_hdr,
+                 int sig_hdr,
                  void *key,
                  size_t len,
                  uint32_t offset,
@@ -1369,7 +2403,7 @@ offset_from_peer(char *peer,
 
         if (rc == 0) {
             shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, auth, &out, 1, &hdr, 0);
+            int num_records = _read_response(fd, auth, sig_hdr, &out, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 if (fbuf_used(out)) {
                     char keystr[1024];
@@ -1381,6 +2415,10 @@ offset_from_peer(char *peer,
                 if (should_close)
                     close(fd);
                 return 0;
+            } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+                if (should_close)
+                    close(fd);
+                return SHARDCACHE_PEER_BUSY;
             } else {
                 // TODO - Error messages
             }
@@ -1396,7 +2434,7 @@ offset_from_peer(char *peer,
 int
 exists_on_peer(char *peer,
                char *auth,
-               unsigned char sig_hdr,
+               int sig_hdr,
                void *key,
                size_t klen,
                int fd,
@@ -1425,7 +2463,7 @@ exists_on_peer(char *peer,
             shardcache_hdr_t hdr = 0;
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 SHC_DEBUG2("Got (exists) response from peer %s : %s\n",
                           peer, fbuf_data(&resp));
@@ -1448,25 +2486,316 @@ exists_on_peer(char *peer,
                 }
                 fbuf_destroy(&resp);
                 return rc;
+            } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+                fbuf_destroy(&resp);
+                if (should_close)
+                    close(fd);
+                return SHARDCACHE_PEER_BUSY;
             } else {
                 // TODO - Error messages
             }
-            fbuf_destroy(&resp);
+            fbuf_destroy(&resp);
+        }
+        if (should_close)
+            close(fd);
+        return 0;
+    }
+    return rc;
+}
+
+int
+touch_on_peer(char *peer,
+              char *auth,
+              int sig_hdr,
+              void *key,
+              size_t klen,
+              int fd)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    SHC_DEBUG2("Sending touch command to peer %s", peer);
+    if (fd >= 0) {
+        unsigned char hdr = SHC_HDR_TOUCH;
+        shardcache_record_t record = {
+            .v = key,
+            .l = klen
+        };
+        int rc = write_message(fd, auth, sig_hdr, hdr, &record, 1);
+
+        // if we are not forwarding a delete command to the owner
+        // of the key, but only an eviction request to a peer,
+        // we don't need to wait for the response
+        if (rc == 0) {
+            shardcache_hdr_t hdr = 0;
+            fbuf_t resp = FBUF_STATIC_INITIALIZER;
+            fbuf_t *respp = &resp;
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
+            if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
+                SHC_DEBUG2("Got (touch) response from peer %s : %s\n",
+                          peer, fbuf_data(&resp));
+                if (should_close)
+                    close(fd);
+
+                rc = -1;
+                char *res = fbuf_data(&resp);
+                if (res && *res == SHC_RES_OK)
+                    rc = 0;
+
+                fbuf_destroy(&resp);
+                return rc;
+            } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+                fbuf_destroy(&resp);
+                if (should_close)
+                    close(fd);
+                return SHARDCACHE_PEER_BUSY;
+            } else {
+                // TODO - Error messages
+            }
+            fbuf_destroy(&resp);
+        }
+        if (should_close)
+            close(fd);
+        return 0;
+    }
+    return -1;
+}
+
+static int
+_multi_command_on_peer_internal(char *peer,
+                                char *auth,
+                                int sig_hdr,
+                                unsigned char hdr,
+                                void **keys,
+                                size_t *klens,
+                                void **values,
+                                size_t *vlens,
+                                uint32_t *expires,
+                                int num_keys,
+                                unsigned char *statuses,
+                                int fd,
+                                int expect_response)
+{
+    if (num_keys <= 0)
+        return -1;
+
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    if (fd < 0)
+        return -1;
+
+    SHC_DEBUG2("Sending multi command %02x (%d keys) to peer %s", hdr, num_keys, peer);
+
+    fbuf_t keys_buf = FBUF_STATIC_INITIALIZER;
+    fbuf_t values_buf = FBUF_STATIC_INITIALIZER;
+    fbuf_t expires_buf = FBUF_STATIC_INITIALIZER;
+
+    pack_multi_keys(keys, klens, num_keys, &keys_buf);
+
+    shardcache_record_t records[3] = {
+        {
+            .v = fbuf_data(&keys_buf),
+            .l = fbuf_used(&keys_buf)
+        },
+        {
+            .v = NULL,
+            .l = 0
+        },
+        {
+            .v = NULL,
+            .l = 0
+        }
+    };
+    int num_records = 1;
+
+    if (values) {
+        pack_multi_keys(values, vlens, num_keys, &values_buf);
+        records[1].v = fbuf_data(&values_buf);
+        records[1].l = fbuf_used(&values_buf);
+        num_records = 2;
+        if (expires) {
+            int i;
+            for (i = 0; i < num_keys; i++) {
+                uint32_t expire_nbo = htonl(expires[i]);
+                fbuf_add_binary(&expires_buf, (char *)&expire_nbo, sizeof(expire_nbo));
+            }
+            records[2].v = fbuf_data(&expires_buf);
+            records[2].l = fbuf_used(&expires_buf);
+            num_records = 3;
+        }
+    }
+
+    int rc = write_message(fd, auth, sig_hdr, hdr, records, num_records);
+
+    fbuf_destroy(&keys_buf);
+    fbuf_destroy(&values_buf);
+    fbuf_destroy(&expires_buf);
+
+    if (rc == 0 && expect_response) {
+        shardcache_hdr_t rhdr = 0;
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp = &resp;
+        int num_responses = _read_response(fd, auth, sig_hdr, &respp, 1, &rhdr, 0);
+        if (rhdr == SHC_HDR_RESPONSE && num_responses == 1) {
+            // one status byte for each of the keys
+            if (fbuf_used(&resp) == num_keys) {
+                if (statuses)
+                    memcpy(statuses, fbuf_data(&resp), num_keys);
+            } else {
+                SHC_WARNING("Bad response (%d statuses, expected %d) from peer %s",
+                            fbuf_used(&resp), num_keys, peer);
+                rc = -1;
+            }
+        } else if (rhdr == SHC_HDR_BUSY && num_responses == 1) {
+            rc = SHARDCACHE_PEER_BUSY;
+        } else {
+            rc = -1;
+        }
+        fbuf_destroy(&resp);
+    }
+
+    if (should_close)
+        close(fd);
+
+    return rc;
+}
+
+int
+set_multi_on_peer(char *peer,
+                  char *auth,
+                  int sig_hdr,
+                  void **keys,
+                  size_t *klens,
+                  void **values,
+                  size_t *vlens,
+                  uint32_t *expires,
+                  int num_keys,
+                  unsigned char *statuses,
+                  int fd)
+{
+    return _multi_command_on_peer_internal(peer, auth, sig_hdr, SHC_HDR_SET_MULTI,
+                                           keys, klens, values, vlens, expires,
+                                           num_keys, statuses, fd, 1);
+}
+
+int
+delete_multi_from_peer(char *peer,
+                       char *auth,
+                       int sig_hdr,
+                       void **keys,
+                       size_t *klens,
+                       int num_keys,
+                       unsigned char *statuses,
+                       int fd)
+{
+    return _multi_command_on_peer_internal(peer, auth, sig_hdr, SHC_HDR_DELETE_MULTI,
+                                           keys, klens, NULL, NULL, NULL,
+                                           num_keys, statuses, fd, 1);
+}
+
+int
+touch_multi_on_peer(char *peer,
+                    char *auth,
+                    int sig_hdr,
+                    void **keys,
+                    size_t *klens,
+                    int num_keys,
+                    unsigned char *statuses,
+                    int fd)
+{
+    return _multi_command_on_peer_internal(peer, auth, sig_hdr, SHC_HDR_TOUCH_MULTI,
+                                           keys, klens, NULL, NULL, NULL,
+                                           num_keys, statuses, fd, 1);
+}
+
+int
+evict_multi_from_peer(char *peer,
+                      char *auth,
+                      int sig_hdr,
+                      void **keys,
+                      size_t *klens,
+                      int num_keys,
+                      int fd,
+                      int expect_response)
+{
+    return _multi_command_on_peer_internal(peer, auth, sig_hdr, SHC_HDR_EVICT_MULTI,
+                                           keys, klens, NULL, NULL, NULL,
+                                           num_keys, NULL, fd, expect_response);
+}
+
+
+int
+gets_from_peer(char *peer,
+               char *auth,
+               int sig_hdr,
+               void *key,
+               size_t klen,
+               fbuf_t *out,
+               uint64_t *version,
+               int fd)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    if (fd < 0)
+        return -1;
+
+    SHC_DEBUG2("Sending gets command to peer %s", peer);
+
+    shardcache_record_t record = {
+        .v = key,
+        .l = klen
+    };
+    int rc = write_message(fd, auth, sig_hdr, SHC_HDR_GETS, &record, 1);
+    if (rc == 0) {
+        shardcache_hdr_t hdr = 0;
+        fbuf_t version_buf = FBUF_STATIC_INITIALIZER;
+        fbuf_t *resp[2] = { out, &version_buf };
+        int num_records = _read_response(fd, auth, sig_hdr, resp, 2, &hdr, 0);
+        if (hdr == SHC_HDR_RESPONSE && num_records == 2 &&
+            fbuf_used(&version_buf) == sizeof(uint64_t))
+        {
+            if (version) {
+                uint64_t version_nbo;
+                memcpy(&version_nbo, fbuf_data(&version_buf), sizeof(uint64_t));
+                *version = shc_ntoh64(version_nbo);
+            }
+        } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+            rc = SHARDCACHE_PEER_BUSY;
+        } else {
+            rc = -1;
         }
-        if (should_close)
-            close(fd);
-        return 0;
+        fbuf_destroy(&version_buf);
     }
+
+    if (should_close)
+        close(fd);
+
     return rc;
 }
 
 int
-touch_on_peer(char *peer,
-              char *auth,
-              unsigned char sig_hdr,
-              void *key,
-              size_t klen,
-              int fd)
+cas_on_peer(char *peer,
+            char *auth,
+            int sig_hdr,
+            void *key,
+            size_t klen,
+            uint64_t version,
+            void *value,
+            size_t vlen,
+            uint32_t expire,
+            uint64_t *new_version,
+            int fd)
 {
     int should_close = 0;
     if (fd < 0) {
@@ -1474,53 +2803,138 @@ touch_on_peer(char *peer,
         should_close = 1;
     }
 
-    SHC_DEBUG2("Sending touch command to peer %s", peer);
-    if (fd >= 0) {
-        unsigned char hdr = SHC_HDR_TOUCH;
-        shardcache_record_t record = {
+    if (fd < 0)
+        return -1;
+
+    SHC_DEBUG2("Sending cas command to peer %s", peer);
+
+    uint64_t version_nbo = shc_hton64(version);
+    uint32_t expire_nbo = htonl(expire);
+    shardcache_record_t record[4] = {
+        {
             .v = key,
             .l = klen
-        };
-        int rc = write_message(fd, auth, sig_hdr, hdr, &record, 1);
+        },
+        {
+            .v = &version_nbo,
+            .l = sizeof(uint64_t)
+        },
+        {
+            .v = value,
+            .l = vlen
+        },
+        {
+            .v = &expire_nbo,
+            .l = sizeof(uint32_t)
+        }
+    };
+    int rc = write_message(fd, auth, sig_hdr, SHC_HDR_CAS, record, expire ? 4 : 3);
+    if (rc == 0) {
+        shardcache_hdr_t hdr = 0;
+        fbuf_t status = FBUF_STATIC_INITIALIZER;
+        fbuf_t version_buf = FBUF_STATIC_INITIALIZER;
+        fbuf_t *resp[2] = { &status, &version_buf };
+        int num_records = _read_response(fd, auth, sig_hdr, resp, 2, &hdr, 0);
+        if (hdr == SHC_HDR_RESPONSE && num_records == 2 && fbuf_used(&status) == 1 &&
+            fbuf_used(&version_buf) == sizeof(uint64_t))
+        {
+            switch(*((unsigned char *)fbuf_data(&status))) {
+                case SHC_RES_OK:
+                    rc = 0;
+                    break;
+                case SHC_RES_EXISTS:
+                    rc = 1;
+                    break;
+                default:
+                    rc = -1;
+                    break;
+            }
+            if (new_version) {
+                memcpy(&version_nbo, fbuf_data(&version_buf), sizeof(uint64_t));
+                *new_version = shc_ntoh64(version_nbo);
+            }
+        } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+            rc = SHARDCACHE_PEER_BUSY;
+        } else {
+            rc = -1;
+        }
+        fbuf_destroy(&status);
+        fbuf_destroy(&version_buf);
+    }
 
-        // if we are not forwarding a delete command to the owner
-        // of the key, but only an eviction request to a peer,
-        // we don't need to wait for the response
-        if (rc == 0) {
-            shardcache_hdr_t hdr = 0;
-            fbuf_t resp = FBUF_STATIC_INITIALIZER;
-            fbuf_t *respp = &resp;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
-            if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
-                SHC_DEBUG2("Got (touch) response from peer %s : %s\n",
-                          peer, fbuf_data(&resp));
-                if (should_close)
-                    close(fd);
+    if (should_close)
+        close(fd);
 
-                rc = -1;
-                char *res = fbuf_data(&resp);
-                if (res && *res == SHC_RES_OK)
-                    rc = 0;
+    return rc;
+}
 
-                fbuf_destroy(&resp);
-                return rc;
-            } else {
-                // TODO - Error messages
+int
+increment_on_peer(char *peer,
+                  char *auth,
+                  int sig_hdr,
+                  void *key,
+                  size_t klen,
+                  int64_t amount,
+                  int64_t *value,
+                  int fd)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    if (fd < 0)
+        return -1;
+
+    SHC_DEBUG2("Sending increment command to peer %s", peer);
+
+    // the amount is sent as an unsigned integer, its sign
+    // determines if the command is INCR or DECR
+    uint64_t amount_nbo = shc_hton64((amount < 0) ? -(uint64_t)amount : (uint64_t)amount);
+    shardcache_record_t record[2] = {
+        {
+            .v = key,
+            .l = klen
+        },
+        {
+            .v = &amount_nbo,
+            .l = sizeof(uint64_t)
+        }
+    };
+    int rc = write_message(fd, auth, sig_hdr,
+                           (amount < 0) ? SHC_HDR_DECR : SHC_HDR_INCR, record, 2);
+    if (rc == 0) {
+        shardcache_hdr_t hdr = 0;
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp = &resp;
+        int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
+        if (hdr == SHC_HDR_RESPONSE && num_records == 1 && fbuf_used(&resp) == sizeof(uint64_t)) {
+            if (value) {
+                uint64_t value_nbo;
+                memcpy(&value_nbo, fbuf_data(&resp), sizeof(uint64_t));
+                *value = (int64_t)shc_ntoh64(value_nbo);
             }
-            fbuf_destroy(&resp);
+        } else if (hdr == SHC_HDR_BUSY && num_records == 1) {
+            rc = SHARDCACHE_PEER_BUSY;
+        } else {
+            // a single <ERR> byte if the value is not a 64bit integer
+            rc = -1;
         }
-        if (should_close)
-            close(fd);
-        return 0;
+        fbuf_destroy(&resp);
     }
-    return -1;
+
+    if (should_close)
+        close(fd);
+
+    return rc;
 }
 
 
 int
 stats_from_peer(char *peer,
                 char *auth,
-                unsigned char sig_hdr,
+                int sig_hdr,
                 char **out,
                 size_t *len,
                 int fd)
@@ -1538,7 +2952,7 @@ stats_from_peer(char *peer,
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
             shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 size_t l = fbuf_used(&resp)+1;
                 if (len)
@@ -1563,7 +2977,7 @@ stats_from_peer(char *peer,
 int
 check_peer(char *peer,
            char *auth,
-           unsigned char sig_hdr,
+           int sig_hdr,
            int fd)
 {
     int should_close = 0;
@@ -1578,7 +2992,7 @@ check_peer(char *peer,
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
             shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 rc = -1;
                 char *res = fbuf_data(&resp);
@@ -1600,7 +3014,7 @@ check_peer(char *peer,
 shardcache_storage_index_t *
 index_from_peer(char *peer,
                 char *auth,
-                unsigned char sig_hdr,
+                int sig_hdr,
                 int fd)
 {
     int should_close = 0;
@@ -1616,7 +3030,7 @@ index_from_peer(char *peer,
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
             shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 1);
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 1);
             if (hdr == SHC_HDR_INDEX_RESPONSE && num_records == 1) {
                 char *data = fbuf_data(&resp);
                 int len = fbuf_used(&resp);
@@ -1656,7 +3070,7 @@ index_from_peer(char *peer,
 int
 migrate_peer(char *peer,
              char *auth,
-             unsigned char sig_hdr,
+             int sig_hdr,
              void *msgdata,
              size_t len,
              int fd)
@@ -1684,7 +3098,7 @@ migrate_peer(char *peer,
         shardcache_hdr_t hdr = 0;
         fbuf_t resp = FBUF_STATIC_INITIALIZER;
         fbuf_t *respp = &resp;
-        int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+        int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
         if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
             SHC_DEBUG2("Got (del) response from peer %s : %s",
                     peer, fbuf_data(&resp));
@@ -1705,7 +3119,7 @@ migrate_peer(char *peer,
 int
 abort_migrate_peer(char *peer,
                    char *auth,
-                   unsigned char sig_hdr,
+                   int sig_hdr,
                    int fd)
 {
     int should_close = 0;
@@ -1720,7 +3134,7 @@ abort_migrate_peer(char *peer,
             fbuf_t resp = FBUF_STATIC_INITIALIZER;
             fbuf_t *respp = &resp;
             shardcache_hdr_t hdr = 0;
-            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
             if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
                 rc = -1;
                 char *res = fbuf_data(&resp);
@@ -1740,11 +3154,328 @@ abort_migrate_peer(char *peer,
 }
 
 int
-connect_to_peer(char *address_string, unsigned int timeout)
+negotiate_peer_capabilities(char *peer,
+                            char *auth,
+                            int sig_hdr,
+                            uint32_t wanted,
+                            uint32_t *accepted,
+                            int fd)
+{
+    int should_close = 0;
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    if (fd >= 0) {
+        uint32_t wanted_nbo = htonl(wanted);
+        shardcache_record_t record = {
+            .v = &wanted_nbo,
+            .l = sizeof(uint32_t)
+        };
+        int rc = write_message(fd, auth, sig_hdr, SHC_HDR_CHECK, &record, 1);
+        if (rc == 0) {
+            fbuf_t resp = FBUF_STATIC_INITIALIZER;
+            fbuf_t *respp = &resp;
+            shardcache_hdr_t hdr = 0;
+            int num_records = _read_response(fd, auth, sig_hdr, &respp, 1, &hdr, 0);
+            if (hdr == SHC_HDR_RESPONSE && num_records == 1) {
+                uint32_t caps = 0;
+                // peers not knowing about capabilities will just
+                // answer with the status byte of a plain CHECK command
+                if (fbuf_used(&resp) == sizeof(uint32_t)) {
+                    memcpy(&caps, fbuf_data(&resp), sizeof(uint32_t));
+                    caps = ntohl(caps) & wanted;
+                }
+                if (accepted)
+                    *accepted = caps;
+                fbuf_destroy(&resp);
+                if (should_close)
+                    close(fd);
+                return 0;
+            }
+            fbuf_destroy(&resp);
+        }
+        if (should_close)
+            close(fd);
+    }
+    return -1;
+}
+
+uint64_t
+session_proof(char *auth, char role, uint64_t nonce1, uint64_t nonce2)
+{
+    uint64_t digest = 0;
+    sip_hash *shash = sip_hash_new((uint8_t *)auth, 2, 4);
+    sip_hash_update(shash, (uint8_t *)&role, 1);
+    sip_hash_update(shash, (uint8_t *)&nonce1, sizeof(nonce1));
+    sip_hash_update(shash, (uint8_t *)&nonce2, sizeof(nonce2));
+    if (!sip_hash_final_integer(shash, &digest))
+        SHC_ERROR("Errors computing the siphash digest");
+    sip_hash_free(shash);
+    return digest;
+}
+
+void
+session_nonce(void *buf, size_t len)
+{
+    size_t rb = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        while (rb < len) {
+            int n = read(fd, (char *)buf + rb, len - rb);
+            if (n <= 0 && errno != EINTR)
+                break;
+            if (n > 0)
+                rb += n;
+        }
+        close(fd);
+    }
+    // fallback if /dev/urandom is not available
+    while (rb < len)
+        ((unsigned char *)buf)[rb++] = random() & 0xFF;
+}
+
+int
+build_peer_session_request(char *auth, char *label, uint32_t *wanted, uint64_t *client_nonce, fbuf_t *out)
+{
+    // without a secret messages aren't signed and there
+    // is nothing to gain from authenticating the connection
+    if (!auth)
+        *wanted &= ~SHC_CAP_CRC32C;
+
+    *client_nonce = 0;
+    if (!*wanted)
+        return 0;
+
+    uint32_t wanted_nbo = htonl(*wanted);
+    if (*wanted & SHC_CAP_CRC32C)
+        session_nonce(client_nonce, sizeof(*client_nonce));
+
+    shardcache_record_t records[3] = {
+        {
+            .v = &wanted_nbo,
+            .l = sizeof(uint32_t)
+        },
+        {
+            .v = client_nonce,
+            .l = (*wanted & SHC_CAP_CRC32C) ? sizeof(*client_nonce) : 0
+        },
+        {
+            .v = label,
+            .l = label ? strlen(label) : 0
+        }
+    };
+
+    // nodes identify themselves so that the owners of the keys
+    // they cache know whom to notify when they change
+    int num_records = label ? 3 : (*wanted & SHC_CAP_CRC32C) ? 2 : 1;
+    return build_message(auth, SHC_HDR_SIGNATURE_SIP, SHC_HDR_CHECK, records, num_records, out);
+}
+
+int
+check_peer_session_response(char *peer,
+                            char *auth,
+                            uint32_t wanted,
+                            uint64_t client_nonce,
+                            shardcache_hdr_t hdr,
+                            fbuf_t **records,
+                            int num_records,
+                            uint32_t *accepted,
+                            fbuf_t *out)
+{
+    if (hdr != SHC_HDR_RESPONSE || num_records < 1)
+        return -1;
+
+    uint32_t caps = 0;
+    // peers not knowing about capabilities will just
+    // answer with the status byte of a plain CHECK command
+    if (fbuf_used(records[0]) == sizeof(uint32_t)) {
+        memcpy(&caps, fbuf_data(records[0]), sizeof(uint32_t));
+        caps = ntohl(caps) & wanted;
+    }
+
+    if (accepted)
+        *accepted = caps;
+
+    if (!(caps & SHC_CAP_CRC32C))
+        return 0;
+
+    if (num_records != 3 ||
+        fbuf_used(records[1]) != SHARDCACHE_MSG_NONCE_LEN ||
+        fbuf_used(records[2]) != SHARDCACHE_MSG_NONCE_LEN)
+    {
+        return -1;
+    }
+
+    uint64_t server_nonce, server_proof;
+    memcpy(&server_nonce, fbuf_data(records[1]), sizeof(server_nonce));
+    memcpy(&server_proof, fbuf_data(records[2]), sizeof(server_proof));
+    if (server_proof != session_proof(auth, 'S', client_nonce, server_nonce)) {
+        SHC_WARNING("Peer %s can't prove to know the secret", peer);
+        return -1;
+    }
+
+    uint64_t proof = session_proof(auth, 'C', server_nonce, client_nonce);
+    shardcache_record_t record = {
+        .v = &proof,
+        .l = sizeof(proof)
+    };
+    if (build_message(auth, SHC_HDR_SIGNATURE_SIP, SHC_HDR_AUTH, &record, 1, out) != 0)
+        return -1;
+
+    return 1;
+}
+
+int
+open_peer_session(char *peer, char *auth, char *label, int fd, uint32_t wanted, uint32_t *accepted)
+{
+    if (fd < 0)
+        return -1;
+
+    if (accepted)
+        *accepted = 0;
+
+    uint64_t client_nonce = 0;
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    if (build_peer_session_request(auth, label, &wanted, &client_nonce, &msg) != 0) {
+        fbuf_destroy(&msg);
+        return -1;
+    }
+
+    if (!wanted)
+        return 0;
+
+    if (write_buffer(fd, &msg) != 0) {
+        fbuf_destroy(&msg);
+        return -1;
+    }
+
+    fbuf_t caps_buf = FBUF_STATIC_INITIALIZER;
+    fbuf_t nonce_buf = FBUF_STATIC_INITIALIZER;
+    fbuf_t proof_buf = FBUF_STATIC_INITIALIZER;
+    fbuf_t *resp[3] = { &caps_buf, &nonce_buf, &proof_buf };
+    shardcache_hdr_t hdr = 0;
+    uint32_t caps = 0;
+
+    int num_records = read_message(fd, auth, resp, 3, &hdr, 0);
+    int rc = check_peer_session_response(peer, auth, wanted, client_nonce,
+                                         hdr, resp, num_records, &caps, &msg);
+    if (rc == 1) {
+        // the connection needs to be authenticated
+        rc = -1;
+        if (write_buffer(fd, &msg) == 0) {
+            fbuf_t status = FBUF_STATIC_INITIALIZER;
+            fbuf_t *statusp = &status;
+            num_records = read_message(fd, auth, &statusp, 1, &hdr, 0);
+            if (hdr == SHC_HDR_RESPONSE && num_records == 1 && fbuf_used(&status) == 1 &&
+                *((char *)fbuf_data(&status)) == SHC_RES_OK)
+            {
+                rc = 0;
+            } else {
+                SHC_WARNING("Peer %s refused the authentication", peer);
+            }
+            fbuf_destroy(&status);
+        }
+    }
+
+    if (rc == 0 && accepted)
+        *accepted = caps;
+
+    fbuf_destroy(&msg);
+    fbuf_destroy(&caps_buf);
+    fbuf_destroy(&nonce_buf);
+    fbuf_destroy(&proof_buf);
+    return rc;
+}
+
+void
+add_message_tag(uint32_t tag, fbuf_t *out)
+{
+    unsigned char hdr = SHC_HDR_TAG;
+    uint32_t tag_nbo = htonl(tag);
+    fbuf_add_binary(out, (char *)&hdr, 1);
+    fbuf_add_binary(out, (char *)&tag_nbo, sizeof(tag_nbo));
+}
+
+void
+pack_multi_keys(void **keys, size_t *klens, int num_keys, fbuf_t *out)
+{
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        uint32_t klen_nbo = htonl(klens[i]);
+        fbuf_add_binary(out, (char *)&klen_nbo, sizeof(klen_nbo));
+        fbuf_add_binary(out, keys[i], klens[i]);
+    }
+}
+
+int
+unpack_multi_keys(void *data, size_t len, void ***keys, size_t **klens)
+{
+    int num_keys = 0;
+    void **k = NULL;
+    size_t *kl = NULL;
+    size_t offset = 0;
+    while (offset < len) {
+        uint32_t klen_nbo;
+        if (len - offset < sizeof(klen_nbo))
+            break;
+        memcpy(&klen_nbo, data + offset, sizeof(klen_nbo));
+        offset += sizeof(klen_nbo);
+        size_t klen = ntohl(klen_nbo);
+        if (!klen || klen > len - offset)
+            break;
+        k = realloc(k, sizeof(void *) * (num_keys + 1));
+        kl = realloc(kl, sizeof(size_t) * (num_keys + 1));
+        k[num_keys] = data + offset;
+        kl[num_keys] = klen;
+        num_keys++;
+        offset += klen;
+    }
+
+    if (offset != len || !num_keys) {
+        free(k);
+        free(kl);
+        return -1;
+    }
+
+    *keys = k;
+    *klens = kl;
+    return num_keys;
+}
+
+// resolved peer addresses are cached for a while,
+// so that connecting doesn't need a lookup each time
+#define PEER_ADDRESS_TTL 60 // (in seconds)
+
+typedef struct {
+    struct sockaddr_in sockaddr;
+    time_t resolved;
+} peer_address_t;
+
+static hashtable_t *peer_addresses = NULL;
+static pthread_mutex_t peer_addresses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+resolve_peer_address(char *address_string, struct sockaddr_in *sockaddr)
 {
-    static __thread char host[2048];
-    static __thread int port = 0;
-    static __thread int len = 0;
+    size_t alen = strlen(address_string);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&peer_addresses_lock);
+    if (!peer_addresses)
+        peer_addresses = ht_create(128, 65535, free);
+    peer_address_t *cached = ht_get(peer_addresses, address_string, alen, NULL);
+    if (cached && now - cached->resolved < PEER_ADDRESS_TTL) {
+        memcpy(sockaddr, &cached->sockaddr, sizeof(struct sockaddr_in));
+        pthread_mutex_unlock(&peer_addresses_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&peer_addresses_lock);
+
+    char host[2048];
+    int port = 0;
+    int len = 0;
 
     char *sep = strchr(address_string, ':');
 
@@ -1752,7 +3483,7 @@ connect_to_peer(char *address_string, unsigned int timeout)
         len = sep - address_string;
         port = strtol(sep+1, NULL , 10);
     } else {
-        len = strlen(address_string);
+        len = alen;
         port = SHARDCACHE_PORT_DEFAULT;
     }
 
@@ -1762,9 +3493,60 @@ connect_to_peer(char *address_string, unsigned int timeout)
         SHC_ERROR("address_string too long : %s", address_string);
         return -1;
     }
-    int fd = open_connection(host, port, timeout);
-    if (__builtin_expect(fd < 0 && errno != EMFILE, 0))
+
+    if (!*host || !port || string2sockaddr(host, port, sockaddr) != 0)
+        return -1;
+
+    peer_address_t *address = malloc(sizeof(peer_address_t));
+    memcpy(&address->sockaddr, sockaddr, sizeof(struct sockaddr_in));
+    address->resolved = now;
+    pthread_mutex_lock(&peer_addresses_lock);
+    ht_set(peer_addresses, address_string, alen, address, sizeof(peer_address_t));
+    pthread_mutex_unlock(&peer_addresses_lock);
+    return 0;
+}
+
+// the peer might have moved, resolve its address again next time
+static void
+forget_peer_address(char *address_string)
+{
+    pthread_mutex_lock(&peer_addresses_lock);
+    if (peer_addresses)
+        ht_delete(peer_addresses, address_string, strlen(address_string), NULL, NULL);
+    pthread_mutex_unlock(&peer_addresses_lock);
+}
+
+int
+connect_to_peer(char *address_string, unsigned int timeout)
+{
+    struct sockaddr_in sockaddr;
+    if (resolve_peer_address(address_string, &sockaddr) != 0) {
+        SHC_DEBUG("Can't resolve %s", address_string);
+        return -1;
+    }
+
+    int fd = open_connection_sockaddr(&sockaddr, timeout);
+    if (__builtin_expect(fd < 0 && errno != EMFILE, 0)) {
+        SHC_DEBUG("Can't connect to %s", address_string);
+        forget_peer_address(address_string);
+    }
+    return fd;
+}
+
+int
+connect_to_peer_async(char *address_string, int *in_progress)
+{
+    struct sockaddr_in sockaddr;
+    if (resolve_peer_address(address_string, &sockaddr) != 0) {
+        SHC_DEBUG("Can't resolve %s", address_string);
+        return -1;
+    }
+
+    int fd = open_connection_nonblocking(&sockaddr, in_progress);
+    if (__builtin_expect(fd < 0 && errno != EMFILE, 0)) {
         SHC_DEBUG("Can't connect to %s", address_string);
+        forget_peer_address(address_string);
+    }
     return fd;
 }
 
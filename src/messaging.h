@@ -2,10 +2,12 @@
 #define __MESSAGING_H__
 
 #include <sys/types.h>
+#include <arpa/inet.h>
 #include <iomux.h>
 #include <fbuf.h>
 #include <rbuf.h>
 #include "shardcache.h"
+#include "compression.h"
 
 /* For the protocol specification check the 'docs/protocol.txt' file
  * in the libshardcache source distribution
@@ -13,11 +15,23 @@
 
 // in bytes
 #define SHARDCACHE_MSG_SIG_LEN 8
+#define SHARDCACHE_MSG_CRC_LEN 4
 #define SHARDCACHE_MSG_MAX_RECORD_LEN (1<<28) // 256MB
 
 // last byte holds the protocol version
-#define SHC_PROTOCOL_VERSION 1
+#define SHC_PROTOCOL_VERSION 2
 #define SHC_MAGIC 0x73686301
+// magic used by messages checksummed with crc32c (only
+// sent on connections where SHC_CAP_CRC32C has been negotiated)
+#define SHC_MAGIC_V2 0x73686302
+// flag set in the version byte of the magic if the records of the message
+// are framed with 32bit chunk sizes (only sent on connections where
+// SHC_CAP_WIDE_RECORDS has been negotiated)
+#define SHC_MAGIC_WIDE_RECORDS 0x80
+// flag set in the version byte of the magic if the records of the message
+// are compressed (only sent on connections where SHC_CAP_LZ4 or
+// SHC_CAP_ZSTD has been negotiated)
+#define SHC_MAGIC_COMPRESSED 0x40
 
 typedef enum {
     // data commands
@@ -30,6 +44,18 @@ typedef enum {
     SHC_HDR_ADD              = 0x07,
     SHC_HDR_EXISTS           = 0x08,
     SHC_HDR_TOUCH            = 0x09,
+    SHC_HDR_GET_MULTI        = 0x0A,
+    SHC_HDR_SET_MULTI        = 0x0B,
+    SHC_HDR_DELETE_MULTI     = 0x0C,
+    SHC_HDR_TOUCH_MULTI      = 0x0D,
+    SHC_HDR_EVICT_MULTI      = 0x0E,
+    SHC_HDR_GET_IF_MODIFIED  = 0x0F,
+
+    // atomic commands (executed by the owner of the key)
+    SHC_HDR_CAS              = 0x10,
+    SHC_HDR_GETS             = 0x11,
+    SHC_HDR_INCR             = 0x12,
+    SHC_HDR_DECR             = 0x13,
 
     // migration commands
     SHC_HDR_MIGRATION_ABORT  = 0x21,
@@ -39,6 +65,7 @@ typedef enum {
     // administrative commands
     SHC_HDR_CHECK            = 0x31,
     SHC_HDR_STATS            = 0x32,
+    SHC_HDR_AUTH             = 0x33,
 
     // index-related commands
     SHC_HDR_GET_INDEX        = 0x41,
@@ -47,6 +74,14 @@ typedef enum {
     // no-op (for ping/health-check)
     SHC_HDR_NOOP             = 0x90,
 
+    // the value hasn't changed since the version provided
+    // with a GET_IF_MODIFIED command
+    SHC_HDR_NOT_MODIFIED     = 0x97,
+
+    // the command has been refused because the node is overloaded
+    // (the command can be retried later)
+    SHC_HDR_BUSY             = 0x98,
+
     // generic response header
     SHC_HDR_RESPONSE         = 0x99,
 
@@ -55,9 +90,14 @@ typedef enum {
     SHC_HDR_REPLICA_PING     = 0xA2,
     SHC_HDR_REPLICA_ACK      = 0xA3,
 
+    // tagged message envelope (out-of-order responses)
+    SHC_HDR_TAG              = 0xE0,
+
     // signature headers
     SHC_HDR_SIGNATURE_SIP    = 0xF0,
-    SHC_HDR_CSIGNATURE_SIP   = 0xF1
+    SHC_HDR_CSIGNATURE_SIP   = 0xF1,
+    // per-chunk crc32c checksums (V2)
+    SHC_HDR_CSIGNATURE_CRC   = 0xF2
 
 } shardcache_hdr_t;
 
@@ -65,10 +105,17 @@ typedef enum {
     SHC_RES_OK     = 0x00,
     SHC_RES_YES    = 0x01,
     SHC_RES_EXISTS = 0x02,
+    SHC_RES_BUSY   = 0xFD,
     SHC_RES_NO     = 0xFE,
     SHC_RES_ERR    = 0xFF
 } shardcache_res_t;
 
+// flags which can follow the key of a GET_ASYNC message
+// (ignored by the nodes which don't know them)
+#define SHC_GET_FLAG_LOCAL 0x01 // load the key locally, never forwarding it to
+                                // its owner (sent when failing over to the node
+                                // next to an unreachable owner)
+
 typedef struct __shardcache_record_s {
     void *v;
     size_t l;
@@ -76,6 +123,69 @@ typedef struct __shardcache_record_s {
 
 #define SHARDCACHE_RSEP 0x80
 
+// capabilities which can be negotiated on a connection
+// by sending a CHECK command with a capabilities record
+#define SHC_CAP_TAGGED    0x00000001 // tagged requests, responses can be out-of-order
+#define SHC_CAP_CRC32C    0x00000002 // crc32c checksums instead of siphash signatures
+                                     // (the connection must be authenticated first
+                                     //  if a secret is configured)
+#define SHC_CAP_WIDE_RECORDS 0x00000004 // 32bit chunk sizes, records can be sent
+                                        // as a single chunk of any size
+
+#define SHC_CAP_LZ4       0x00000008 // records can be compressed with lz4
+#define SHC_CAP_ZSTD      0x00000010 // records can be compressed with zstd
+#define SHC_CAP_MULTI     0x00000020 // the GET_MULTI command is understood
+#define SHC_CAP_MULTI_WRITE 0x00000040 // the SET_MULTI, DELETE_MULTI, TOUCH_MULTI
+                                       // and EVICT_MULTI commands are understood
+
+#define SHC_CAP_ATOMIC    0x00000080 // the CAS, GETS, INCR and DECR commands are understood
+#define SHC_CAP_CONDITIONAL 0x00000100 // the GET_IF_MODIFIED command is understood
+
+#define SHC_CAPS_SUPPORTED (SHC_CAP_TAGGED|SHC_CAP_CRC32C|SHC_CAP_WIDE_RECORDS| \
+                            SHC_CAP_MULTI|SHC_CAP_MULTI_WRITE|SHC_CAP_ATOMIC| \
+                            SHC_CAP_CONDITIONAL| \
+                            shc_compression_caps())
+
+// can be OR-ed to the sig_hdr argument of build_message(), write_message()
+// and of the *_peer() functions to send the message using 32bit chunk sizes.
+// It's never sent on the wire as part of the signature header
+#define SHC_SIG_WIDE_RECORDS 0x08
+
+// can be OR-ed to the sig_hdr argument as well to compress the records
+// with the given algorithm (if at least one of them is bigger than
+// the compression threshold, see shc_compression_threshold())
+#define SHC_SIG_COMPRESSION(__algo) ((__algo) << 8)
+#define SHC_SIG_COMPRESSION_ALGO(__sig_hdr) (((__sig_hdr) >> 8) & 0xFF)
+
+// the actual signature header out of a sig_hdr argument
+#define SHC_SIG_HDR(__sig_hdr) ((unsigned char)((__sig_hdr) & ~SHC_SIG_WIDE_RECORDS))
+
+// signature header (and framing) to use for messages sent on a connection
+// where the capabilities 'caps' have been negotiated
+#define SHC_CONNECTION_SIG_HDR(__caps, __sig_hdr) \
+    ((((__caps) & SHC_CAP_CRC32C) ? SHC_HDR_CSIGNATURE_CRC : (__sig_hdr)) | \
+     (((__caps) & SHC_CAP_WIDE_RECORDS) ? SHC_SIG_WIDE_RECORDS : 0) | \
+     SHC_SIG_COMPRESSION(shc_compression_select(__caps)))
+
+// length of the nonces and of the proofs exchanged
+// when authenticating a connection
+#define SHARDCACHE_MSG_NONCE_LEN 8
+
+// length of the tag envelope (SHC_HDR_TAG + 32bit tag)
+#define SHARDCACHE_MSG_TAG_LEN 5
+
+// 64bit integers (version stamps and counters) are sent in network byte order
+static inline uint64_t
+shc_hton64(uint64_t v)
+{
+    return ((uint64_t)htonl(v & 0xFFFFFFFF) << 32) | htonl(v >> 32);
+}
+#define shc_ntoh64(__v) shc_hton64(__v)
+
+// returned by the *_peer() functions if the peer refused the
+// command because overloaded (the command can be retried later)
+#define SHARDCACHE_PEER_BUSY -2
+
 // TODO - Document all exposed functions
 
 int global_tcp_timeout(int tcp_timeout);
@@ -91,14 +201,14 @@ int read_message(int fd,
 // synchronously write a message (blocking)
 int write_message(int fd,
                   char *auth,
-                  unsigned char sig_hdr,
+                  int sig_hdr,
                   unsigned char hdr,
                   shardcache_record_t *records,
                   int num_records);
 
 // build a valid shardcache message containing the provided records
 int build_message(char *auth,
-                  unsigned char sig_hdr,
+                  int sig_hdr,
                   unsigned char hdr,
                   shardcache_record_t *records,
                   int num_records,
@@ -107,7 +217,7 @@ int build_message(char *auth,
 // delete a key from a peer
 int delete_from_peer(char *peer,
                      char *auth,
-                     unsigned char sig_hdr,
+                     int sig_hdr,
                      void *key,
                      size_t klen,
                      int fd,
@@ -117,7 +227,7 @@ int delete_from_peer(char *peer,
 int
 evict_from_peer(char *peer,
                 char *auth,
-                unsigned char sig,
+                int sig,
                 void *key,
                 size_t klen,
                 int fd,
@@ -127,7 +237,7 @@ evict_from_peer(char *peer,
 // send a new value for a given key to a peer
 int send_to_peer(char *peer,
                  char *auth,
-                 unsigned char sig_hdr,
+                 int sig_hdr,
                  void *key,
                  size_t klen,
                  void *value,
@@ -141,7 +251,7 @@ int send_to_peer(char *peer,
 int
 add_to_peer(char *peer,
             char *auth,
-            unsigned char sig,
+            int sig,
             void *key,
             size_t klen,
             void *value,
@@ -153,16 +263,30 @@ add_to_peer(char *peer,
 // fetch the value for a given key from a peer
 int fetch_from_peer(char *peer,
                     char *auth,
-                    unsigned char sig_hdr,
+                    int sig_hdr,
                     void *key,
                     size_t len,
                     fbuf_t *out,
                     int fd);
 
+// fetch the value for a given key from a peer only if its version stamp
+// differs from *version (see gets_from_peer()).
+// Returns 0 if the value has been fetched (and *version updated, 0 if the
+// key doesn't exist), 1 if the value hasn't changed (nothing is transferred),
+// SHARDCACHE_PEER_BUSY if the peer refused the command or -1 on errors
+int fetch_from_peer_if_modified(char *peer,
+                                char *auth,
+                                int sig_hdr,
+                                void *key,
+                                size_t len,
+                                uint64_t *version,
+                                fbuf_t *out,
+                                int fd);
+
 // fetch part of the value for a given key from a peer
 int offset_from_peer(char *peer,
                      char *auth,
-                     unsigned char sig_hdr,
+                     int sig_hdr,
                      void *key,
                      size_t len,
                      uint32_t offset,
@@ -173,7 +297,7 @@ int offset_from_peer(char *peer,
 // check if a key exists on a peer
 int exists_on_peer(char *peer,
                    char *auth,
-                   unsigned char sig_hdr,
+                   int sig_hdr,
                    void *key,
                    size_t len,
                    int fd,
@@ -183,7 +307,7 @@ int exists_on_peer(char *peer,
 int
 touch_on_peer(char *peer,
               char *auth,
-              unsigned char sig_hdr,
+              int sig_hdr,
               void *key,
               size_t klen,
               int fd);
@@ -191,7 +315,7 @@ touch_on_peer(char *peer,
 // retrieve all the stats counters from a peer
 int stats_from_peer(char *peer,
                     char *auth,
-                    unsigned char sig_hdr,
+                    int sig_hdr,
                     char **out,
                     size_t *len,
                     int fd);
@@ -199,34 +323,192 @@ int stats_from_peer(char *peer,
 // check if a peer is alive (using the CHK command)
 int check_peer(char *peer,
                char *auth,
-               unsigned char sig_hdr,
+               int sig_hdr,
                int fd);
 
 // start migration
 int migrate_peer(char *peer,
                  char *auth,
-                 unsigned char sig_hdr,
+                 int sig_hdr,
                  void *msgdata,
                  size_t len,
                  int fd);
 
 // abort migration
-int abort_migrate_peer(char *peer, char *auth, unsigned char sig_hdr, int fd);
+int abort_migrate_peer(char *peer, char *auth, int sig_hdr, int fd);
+
+
+// negotiate the capabilities to use on a connection.
+// NOTE: the accepted capabilities will be stored in *accepted, peers
+//       not supporting any capability will return 0
+int negotiate_peer_capabilities(char *peer,
+                                char *auth,
+                                int sig_hdr,
+                                uint32_t wanted,
+                                uint32_t *accepted,
+                                int fd);
+
+// negotiate the 'wanted' capabilities on a new connection.
+// If SHC_CAP_CRC32C is wanted (and a secret is configured) the connection
+// is also authenticated with a challenge-response handshake so that the
+// following messages can be sent using SHC_HDR_CSIGNATURE_CRC instead of
+// signing each of them.
+// Returns 0 and sets *accepted to the negotiated capabilities (0 if the
+// peer doesn't support any, the connection can still be used with V1
+// messages) or -1 on errors (including the peer failing to prove the secret).
+// Nodes pass their own label so that the peer knows who is requesting
+// its keys (NULL if the connection isn't used to cache the values)
+int open_peer_session(char *peer, char *auth, char *label, int fd, uint32_t wanted, uint32_t *accepted);
+
+// the two halves of open_peer_session() for callers driving the handshake
+// asynchronously. build_peer_session_request() builds the CHECK message
+// (*wanted is adjusted and nothing is built if it ends up empty) and
+// check_peer_session_response() verifies the records received in response.
+// The latter returns 0 if the session is open (*accepted holding the
+// negotiated capabilities), 1 if the AUTH message built in 'out' must be
+// sent (and answered with SHC_RES_OK) before or -1 on errors
+int build_peer_session_request(char *auth, char *label, uint32_t *wanted, uint64_t *client_nonce, fbuf_t *out);
+int check_peer_session_response(char *peer,
+                                char *auth,
+                                uint32_t wanted,
+                                uint64_t client_nonce,
+                                shardcache_hdr_t hdr,
+                                fbuf_t **records,
+                                int num_records,
+                                uint32_t *accepted,
+                                fbuf_t *out);
+
+// compute the proof of knowledge of the secret for the given nonces
+// ('role' is 'S' for the server side and 'C' for the client side)
+uint64_t session_proof(char *auth, char role, uint64_t nonce1, uint64_t nonce2);
+
+// fill buf with len random bytes (used to generate the nonces)
+void session_nonce(void *buf, size_t len);
+
+// prepend the tag envelope to a message being built in 'out'
+// (must be called before build_message())
+void add_message_tag(uint32_t tag, fbuf_t *out);
+
+// pack the keys of a *_MULTI request in the format expected
+// for its keys record (<32bit length><key>...).
+// NOTE: the values record of a SET_MULTI request uses the same format
+void pack_multi_keys(void **keys, size_t *klens, int num_keys, fbuf_t *out);
+
+// parse the keys record of a *_MULTI request, the returned arrays
+// (to be released by the caller) point to the data in the record.
+// Returns the number of keys or -1 if the record is malformed
+int unpack_multi_keys(void *data, size_t len, void ***keys, size_t **klens);
+
+// set the values for multiple keys on a peer with a single SET_MULTI
+// message ('expires' can be NULL, otherwise it holds the ttl of each key).
+// If provided, 'statuses' will be filled with the status (SHC_RES_OK or
+// SHC_RES_ERR) returned by the peer for each of the keys.
+// Returns 0 if the response has been received, SHARDCACHE_PEER_BUSY if
+// the peer refused the command or -1 on errors
+int set_multi_on_peer(char *peer,
+                      char *auth,
+                      int sig_hdr,
+                      void **keys,
+                      size_t *klens,
+                      void **values,
+                      size_t *vlens,
+                      uint32_t *expires,
+                      int num_keys,
+                      unsigned char *statuses,
+                      int fd);
+
+// delete multiple keys from a peer with a single DELETE_MULTI message
+// (same return values and statuses as set_multi_on_peer())
+int delete_multi_from_peer(char *peer,
+                           char *auth,
+                           int sig_hdr,
+                           void **keys,
+                           size_t *klens,
+                           int num_keys,
+                           unsigned char *statuses,
+                           int fd);
+
+// touch multiple keys on a peer with a single TOUCH_MULTI message
+// (same return values and statuses as set_multi_on_peer())
+int touch_multi_on_peer(char *peer,
+                        char *auth,
+                        int sig_hdr,
+                        void **keys,
+                        size_t *klens,
+                        int num_keys,
+                        unsigned char *statuses,
+                        int fd);
+
+// evict multiple keys from a peer with a single EVICT_MULTI message
+int evict_multi_from_peer(char *peer,
+                          char *auth,
+                          int sig_hdr,
+                          void **keys,
+                          size_t *klens,
+                          int num_keys,
+                          int fd,
+                          int expect_response);
 
+// fetch the value for a given key and its version stamp from a peer
+// (the version is 0 if the key doesn't exist)
+int gets_from_peer(char *peer,
+                   char *auth,
+                   int sig_hdr,
+                   void *key,
+                   size_t klen,
+                   fbuf_t *out,
+                   uint64_t *version,
+                   int fd);
+
+// set the value for a given key on a peer only if the version stamp of the
+// actual value matches 'version' (0 means that the key must not exist).
+// Returns 0 if the value has been set, 1 if the version doesn't match,
+// SHARDCACHE_PEER_BUSY if the peer refused the command or -1 on errors.
+// If provided, 'new_version' will be set to the version of the value
+// stored on the peer after the command
+int cas_on_peer(char *peer,
+                char *auth,
+                int sig_hdr,
+                void *key,
+                size_t klen,
+                uint64_t version,
+                void *value,
+                size_t vlen,
+                uint32_t expire,
+                uint64_t *new_version,
+                int fd);
+
+// add 'amount' (which can be negative) to the 64bit integer stored for a
+// given key on a peer (a missing key counts as 0) and set *value to the
+// result. Returns 0 on success, SHARDCACHE_PEER_BUSY if the peer refused
+// the command or -1 on errors (including a value which is not a 64bit integer)
+int increment_on_peer(char *peer,
+                      char *auth,
+                      int sig_hdr,
+                      void *key,
+                      size_t klen,
+                      int64_t amount,
+                      int64_t *value,
+                      int fd);
 
 // connect to a given peer and return the opened filedescriptor
 int connect_to_peer(char *address_string, unsigned int timeout);
 
+// start connecting to a given peer without blocking, *in_progress is set
+// if the returned (non-blocking) filedescriptor isn't connected yet
+int connect_to_peer_async(char *address_string, int *in_progress);
+
 // retrieve the index of keys stored in a given peer
 // NOTE: caller must use shardcache_free_index() to release memory used
 //       by the returned shardcache_storage_index_t pointer
 shardcache_storage_index_t *index_from_peer(char *peer,
                                             char *auth,
-                                            unsigned char sig_hdr,
+                                            int sig_hdr,
                                             int fd);
 
 // idx = -1 , data == NULL, len = 0 when finished
 // idx = -2 , data == NULL, len = 0 if an error occurred
+// idx = -4 , data == NULL, len = 0 if the peer is busy (instead of -1)
 typedef int (*async_read_callback_t)(void *data,
                                      size_t len,
                                      int  idx,
@@ -250,12 +532,29 @@ typedef enum {
     SHC_STATE_READING_AUTH    = 0x06,
     SHC_STATE_READING_DONE    = 0x07,
     SHC_STATE_READING_ERR     = 0x08,
-    SHC_STATE_AUTH_ERR        = 0x09
+    SHC_STATE_AUTH_ERR        = 0x09,
+    SHC_STATE_READING_TAG     = 0x0A
 } async_read_context_state_t;
 
 int async_read_context_state(async_read_ctx_t *ctx);
 shardcache_hdr_t async_read_context_hdr(async_read_ctx_t *ctx);
 shardcache_hdr_t async_read_context_sig_hdr(async_read_ctx_t *ctx);
+// returns 1 if the message being read is tagged (and sets *tag), 0 otherwise
+int async_read_context_tag(async_read_ctx_t *ctx, uint32_t *tag);
+// returns the amount of buffered input data not processed yet
+int async_read_context_pending(async_read_ctx_t *ctx);
+// mark the connection read by the context as authenticated so that
+// messages using SHC_HDR_CSIGNATURE_CRC are accepted
+// (-1 only queries the actual value)
+int async_read_context_session(async_read_ctx_t *ctx, int new_value);
+
+// true if the records of the message being read are
+// framed with 32bit chunk sizes (SHC_CAP_WIDE_RECORDS)
+int async_read_context_wide(async_read_ctx_t *ctx);
+
+// true if the records of the message being read are compressed
+// (the data passed to the callback is already decompressed)
+int async_read_context_compressed(async_read_ctx_t *ctx);
 
 async_read_context_state_t async_read_context_consume_data(async_read_ctx_t *ctx, rbuf_t *input);
 async_read_context_state_t async_read_context_input_data(async_read_ctx_t *ctx, void *data, int len, int *processed);
@@ -281,12 +580,15 @@ typedef struct {
     async_read_ctx_t *ctx;
     iomux_callbacks_t cbs;
     int fd;
+    // optionally called (by the thread running the iomux) once
+    // the filedescriptor has been added to the iomux
+    void (*mux_added)(iomux_t *iomux, int fd, void *priv);
 } async_read_wrk_t;
 #pragma pack(pop)
 
 int fetch_from_peer_async(char *peer,
                           char *auth,
-                          unsigned char sig_hdr,
+                          int sig_hdr,
                           void *key,
                           size_t klen,
                           size_t offset,
@@ -296,6 +598,46 @@ int fetch_from_peer_async(char *peer,
                           int fd,
                           async_read_wrk_t **async_read_wrk_t);
 
+// same as fetch_from_peer_async() (for the whole value) but sending
+// the SHC_GET_FLAG_* 'flags' along with the key
+int fetch_from_peer_async_flags(char *peer,
+                                char *auth,
+                                int sig_hdr,
+                                void *key,
+                                size_t klen,
+                                unsigned char flags,
+                                fetch_from_peer_async_cb cb,
+                                void *priv,
+                                int fd,
+                                async_read_wrk_t **async_read_wrk_t);
+
+// index = -1 , data == NULL, len = 0 once the request is over,
+//              status is 1 if all the values have been received (the
+//              connection can be reused) or -1 on errors
+typedef int (*fetch_multi_from_peer_async_cb)(char *peer,
+                                              int index,
+                                              void *data,
+                                              size_t len,
+                                              int status,
+                                              void *priv);
+
+// fetch the values for multiple keys from a peer with a single GET_MULTI
+// request (or pipelining a GET_ASYNC for each key if 'multi' is false
+// because the peer doesn't support SHC_CAP_MULTI).
+// The callback is called with the whole value of each key (as soon as
+// received and identified by its index in the keys array), a NULL value
+// means that the key was not found
+int fetch_multi_from_peer_async(char *peer,
+                                char *auth,
+                                int sig_hdr,
+                                void **keys,
+                                size_t *klens,
+                                int num_keys,
+                                int multi,
+                                fetch_multi_from_peer_async_cb cb,
+                                void *priv,
+                                int fd,
+                                async_read_wrk_t **wrk);
 
 int read_message_async(int fd,
                    char *auth,
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <hashtable.h>
+
+#include <atomic_defs.h>
+
+#include "peer_breakers.h"
+#include "shardcache.h"
+
+typedef enum {
+    PEER_BREAKER_CLOSED = 0,
+    PEER_BREAKER_OPEN,
+    PEER_BREAKER_HALF_OPEN
+} peer_breaker_state_t;
+
+struct __peer_breaker_s {
+    peer_breakers_t *breakers;
+    char *peer;
+    int state;
+    int failures;        // consecutive failures
+    uint64_t opened_at;  // when the circuit opened or the last probe was let
+                         // through (in milliseconds)
+};
+
+struct __peer_breakers_s {
+    hashtable_t *table;  // peer -> peer_breaker_t
+    pthread_mutex_t lock;
+    int threshold;
+    int cooldown;
+    uint64_t counters[PEER_BREAKERS_NUM_COUNTERS];
+};
+
+static inline uint64_t
+peer_breakers_now()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static void
+peer_breaker_destroy(peer_breaker_t *breaker)
+{
+    free(breaker->peer);
+    free(breaker);
+}
+
+peer_breakers_t *
+peer_breakers_create(int threshold, int cooldown)
+{
+    peer_breakers_t *breakers = calloc(1, sizeof(peer_breakers_t));
+    breakers->table = ht_create(128, 65535, (ht_free_item_callback_t)peer_breaker_destroy);
+    pthread_mutex_init(&breakers->lock, NULL);
+    breakers->threshold = threshold;
+    breakers->cooldown = cooldown;
+    return breakers;
+}
+
+void
+peer_breakers_destroy(peer_breakers_t *breakers)
+{
+    ht_destroy(breakers->table);
+    pthread_mutex_destroy(&breakers->lock);
+    free(breakers);
+}
+
+peer_breaker_t *
+peer_breakers_get(peer_breakers_t *breakers, char *peer)
+{
+    pthread_mutex_lock(&breakers->lock);
+    peer_breaker_t *breaker = ht_get(breakers->table, peer, strlen(peer), NULL);
+    if (!breaker) {
+        breaker = calloc(1, sizeof(peer_breaker_t));
+        breaker->breakers = breakers;
+        breaker->peer = strdup(peer);
+        ht_set(breakers->table, peer, strlen(peer), breaker, sizeof(peer_breaker_t));
+    }
+    pthread_mutex_unlock(&breakers->lock);
+    return breaker;
+}
+
+int
+peer_breaker_allow(peer_breaker_t *breaker)
+{
+    peer_breakers_t *breakers = breaker->breakers;
+    int state = ATOMIC_READ(breaker->state);
+    if (state == PEER_BREAKER_CLOSED || !ATOMIC_READ(breakers->threshold))
+        return 1;
+
+    // only one request per cooldown period gets through
+    uint64_t now = peer_breakers_now();
+    uint64_t opened_at = ATOMIC_READ(breaker->opened_at);
+    if (now - opened_at < (uint64_t)ATOMIC_READ(breakers->cooldown) ||
+        !ATOMIC_CAS(breaker->opened_at, opened_at, now))
+    {
+        return 0;
+    }
+
+    if (ATOMIC_CAS(breaker->state, PEER_BREAKER_OPEN, PEER_BREAKER_HALF_OPEN)) {
+        SHC_DEBUG("Circuit to peer %s half-open, probing it", breaker->peer);
+        ATOMIC_INCREMENT(breakers->counters[PEER_BREAKERS_COUNTER_HALF_OPENED]);
+    }
+    return 1;
+}
+
+void
+peer_breaker_success(peer_breaker_t *breaker)
+{
+    peer_breakers_t *breakers = breaker->breakers;
+    ATOMIC_SET(breaker->failures, 0);
+
+    int state = ATOMIC_READ(breaker->state);
+    if (state != PEER_BREAKER_CLOSED && ATOMIC_CAS(breaker->state, state, PEER_BREAKER_CLOSED)) {
+        SHC_NOTICE("Circuit to peer %s closed", breaker->peer);
+        ATOMIC_INCREMENT(breakers->counters[PEER_BREAKERS_COUNTER_CLOSED]);
+        ATOMIC_DECREMENT(breakers->counters[PEER_BREAKERS_COUNTER_OPEN]);
+    }
+}
+
+void
+peer_breaker_failure(peer_breaker_t *breaker)
+{
+    peer_breakers_t *breakers = breaker->breakers;
+    int threshold = ATOMIC_READ(breakers->threshold);
+    if (!threshold)
+        return;
+
+    int failures = ATOMIC_INCREASE(breaker->failures, 1);
+    int state = ATOMIC_READ(breaker->state);
+    if (state == PEER_BREAKER_HALF_OPEN) {
+        // the probe failed, wait for another cooldown period
+        ATOMIC_SET(breaker->opened_at, peer_breakers_now());
+        if (ATOMIC_CAS(breaker->state, PEER_BREAKER_HALF_OPEN, PEER_BREAKER_OPEN))
+            ATOMIC_INCREMENT(breakers->counters[PEER_BREAKERS_COUNTER_OPENED]);
+    } else if (state == PEER_BREAKER_CLOSED && failures >= threshold) {
+        ATOMIC_SET(breaker->opened_at, peer_breakers_now());
+        if (ATOMIC_CAS(breaker->state, PEER_BREAKER_CLOSED, PEER_BREAKER_OPEN)) {
+            SHC_WARNING("Circuit to peer %s open after %d consecutive failures",
+                        breaker->peer, failures);
+            ATOMIC_INCREMENT(breakers->counters[PEER_BREAKERS_COUNTER_OPENED]);
+            ATOMIC_INCREMENT(breakers->counters[PEER_BREAKERS_COUNTER_OPEN]);
+        }
+    }
+}
+
+int
+peer_breakers_threshold(peer_breakers_t *breakers, int new_value)
+{
+    int old_value = ATOMIC_READ(breakers->threshold);
+    if (new_value >= 0)
+        ATOMIC_SET(breakers->threshold, new_value);
+    return old_value;
+}
+
+int
+peer_breakers_cooldown(peer_breakers_t *breakers, int new_value)
+{
+    int old_value = ATOMIC_READ(breakers->cooldown);
+    if (new_value >= 0)
+        ATOMIC_SET(breakers->cooldown, new_value);
+    return old_value;
+}
+
+uint64_t *
+peer_breakers_counter(peer_breakers_t *breakers, int index)
+{
+    if (index < 0 || index >= PEER_BREAKERS_NUM_COUNTERS)
+        return NULL;
+    return &breakers->counters[index];
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,49 @@
+#ifndef __PEER_BREAKERS_H__
+#define __PEER_BREAKERS_H__
+
+#include <stdint.h>
+
+// Circuit breakers guarding the requests sent to each peer.
+// After 'threshold' consecutive failures the circuit to the peer opens and
+// no requests are sent to it. Once every 'cooldown' milliseconds a single
+// request is let through as a probe (half-open state): the circuit closes
+// again as soon as a request succeeds and reopens if the probe fails.
+typedef struct __peer_breakers_s peer_breakers_t;
+typedef struct __peer_breaker_s peer_breaker_t;
+
+peer_breakers_t *peer_breakers_create(int threshold, int cooldown);
+void peer_breakers_destroy(peer_breakers_t *breakers);
+
+// the breaker guarding 'peer' (created on first use, valid until
+// the breakers are destroyed)
+peer_breaker_t *peer_breakers_get(peer_breakers_t *breakers, char *peer);
+
+// returns 1 if a request can be sent to the peer, 0 if the circuit is open
+int peer_breaker_allow(peer_breaker_t *breaker);
+void peer_breaker_success(peer_breaker_t *breaker);
+void peer_breaker_failure(peer_breaker_t *breaker);
+
+// consecutive failures opening the circuit (0 disables the breakers)
+int peer_breakers_threshold(peer_breakers_t *breakers, int new_value);
+// milliseconds between the probes sent while the circuit is open
+int peer_breakers_cooldown(peer_breakers_t *breakers, int new_value);
+
+// state transitions (exported in the stats)
+#define PEER_BREAKERS_COUNTER_OPENED      0
+#define PEER_BREAKERS_COUNTER_HALF_OPENED 1
+#define PEER_BREAKERS_COUNTER_CLOSED      2
+#define PEER_BREAKERS_COUNTER_OPEN        3
+#define PEER_BREAKERS_NUM_COUNTERS        4
+
+#define PEER_BREAKERS_COUNTER_LABELS_ARRAY \
+        { "breakers_opened", "breakers_half_opened", \
+          "breakers_closed", "breakers_open" }
+
+// pointer to the value of a counter
+// (to be registered with shardcache_counter_add())
+uint64_t *peer_breakers_counter(peer_breakers_t *breakers, int index);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,628 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <fbuf.h>
+#include <hashtable.h>
+#include <linklist.h>
+#include <iomux.h>
+
+#include <atomic_defs.h>
+
+#include "peer_links.h"
+#include "shardcache.h"
+
+#define PEER_LINKS_MAX 16
+
+typedef struct {
+    uint32_t tag;
+    void *key;
+    size_t klen;
+    unsigned char flags;       // SHC_GET_FLAG_* sent along with the key
+    fetch_from_peer_async_cb cb;
+    void *priv;
+    char buf[32];
+} peer_link_request_t;
+
+typedef enum {
+    PEER_LINK_DOWN = 0,
+    PEER_LINK_CONNECTING,      // connecting and negotiating the session
+    PEER_LINK_READY
+} peer_link_state_t;
+
+typedef struct __peer_link_set_s peer_link_set_t;
+
+typedef struct {
+    peer_links_t *links;
+    peer_link_set_t *set;
+    char *peer;
+    pthread_mutex_t lock;
+    peer_link_state_t state;
+    int fd;                    // -1 if not connected
+    uint32_t caps;             // capabilities negotiated on the connection
+    async_read_ctx_t *reader;
+    iomux_t *iomux;            // the iomux driving the link
+    hashtable_t *requests;     // tag -> peer_link_request_t in-flight on the link
+    linked_list_t *backlog;    // requests waiting for the link to be ready
+    fbuf_t output;             // requests not yet handed over to the iomux
+    int flushing;              // a flush has been scheduled on the iomux
+    uint32_t tag;
+    struct timeval last_activity;
+
+    // session handshake
+    uint32_t wanted;
+    uint64_t nonce;
+    int authenticating;
+    fbuf_t records[3];
+    int num_records;
+} peer_link_t;
+
+struct __peer_link_set_s {
+    peer_link_t link[PEER_LINKS_MAX];
+    uint32_t next;
+    int untagged;              // the peer doesn't support tagged requests
+};
+
+struct __peer_links_s {
+    char *auth;
+    uint32_t wanted;           // capabilities to negotiate on the links
+    char *label;               // label identifying us on the links (if any)
+    int num_links;
+    hashtable_t *peers;        // address -> peer_link_set_t
+    pthread_mutex_t lock;
+    peer_links_dispatch_cb_t dispatch;
+    peer_links_schedule_cb_t schedule;
+    void *priv;
+};
+
+static void
+peer_link_request_destroy(peer_link_request_t *req)
+{
+    if (req->key != req->buf)
+        free(req->key);
+    free(req);
+}
+
+static int
+peer_link_collect_request(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    linked_list_t *failed = (linked_list_t *)user;
+    list_push_value(failed, value);
+    return -1;
+}
+
+static void
+peer_link_handshake_clear(peer_link_t *link)
+{
+    int i;
+    for (i = 0; i < 3; i++)
+        fbuf_clear(&link->records[i]);
+    link->num_records = 0;
+}
+
+// tear down the connection of the link, all the requests still waiting
+// for a response are failed
+static void
+peer_link_reset(peer_link_t *link)
+{
+    linked_list_t *failed = list_create();
+
+    pthread_mutex_lock(&link->lock);
+    if (link->fd >= 0)
+        close(link->fd);
+    link->fd = -1;
+    link->caps = 0;
+    link->state = PEER_LINK_DOWN;
+    link->iomux = NULL;
+    if (link->reader) {
+        async_read_context_destroy(link->reader);
+        link->reader = NULL;
+    }
+    link->authenticating = 0;
+    peer_link_handshake_clear(link);
+    fbuf_clear(&link->output);
+    ht_foreach_pair(link->requests, peer_link_collect_request, failed);
+    peer_link_request_t *req = list_shift_value(link->backlog);
+    while (req) {
+        list_push_value(failed, req);
+        req = list_shift_value(link->backlog);
+    }
+    pthread_mutex_unlock(&link->lock);
+
+    req = list_shift_value(failed);
+    while (req) {
+        if (req->cb)
+            req->cb(link->peer, req->key, req->klen, NULL, 0, -1, req->priv);
+        peer_link_request_destroy(req);
+        req = list_shift_value(failed);
+    }
+    list_destroy(failed);
+}
+
+// hand the queued requests over to the iomux driving the link
+// NOTE: must be called with the link locked by the async i/o thread
+//       driving the link
+static void
+peer_link_flush(peer_link_t *link)
+{
+    int used = fbuf_used(&link->output);
+    if (!used)
+        return;
+    if (iomux_write(link->iomux, link->fd, (unsigned char *)fbuf_data(&link->output), used, 1) != used) {
+        // the async reader will fail all the requests
+        SHC_WARNING("Can't send the fetch requests on the link to %s", link->peer);
+        shutdown(link->fd, SHUT_RDWR);
+    }
+    fbuf_clear(&link->output);
+}
+
+static void
+peer_link_flush_cb(iomux_t *iomux, void *priv)
+{
+    peer_link_t *link = (peer_link_t *)priv;
+    pthread_mutex_lock(&link->lock);
+    link->flushing = 0;
+    if (link->state == PEER_LINK_READY) {
+        if (link->iomux == iomux) {
+            peer_link_flush(link);
+        } else if (fbuf_used(&link->output)) {
+            // the link has been reconnected on another iomux in the meanwhile
+            link->flushing = 1;
+            link->links->schedule(link->links->priv, link->iomux, peer_link_flush_cb, link);
+        }
+    }
+    pthread_mutex_unlock(&link->lock);
+}
+
+// assign a tag to the request and queue it on the (ready) link,
+// it's sent once the link is flushed by the async i/o thread driving it.
+// On failure the request is not tracked anymore.
+// NOTE: must be called with the link locked
+static int
+peer_link_queue_request(peer_link_t *link, peer_link_request_t *req)
+{
+    // tag 0 is never used so that a stray untagged response can't match
+    if (++link->tag == 0)
+        link->tag++;
+    req->tag = link->tag;
+
+    shardcache_record_t records[2] = {
+        {
+            .v = req->key,
+            .l = req->klen
+        },
+        {
+            .v = &req->flags,
+            .l = 1
+        }
+    };
+    int used = fbuf_used(&link->output);
+    add_message_tag(req->tag, &link->output);
+    if (build_message(link->links->auth,
+                      SHC_CONNECTION_SIG_HDR(link->caps, SHC_HDR_CSIGNATURE_SIP),
+                      SHC_HDR_GET_ASYNC, records, req->flags ? 2 : 1, &link->output) != 0)
+    {
+        SHC_WARNING("Can't build the fetch request for the link to %s", link->peer);
+        fbuf_set_used(&link->output, used);
+        return -1;
+    }
+
+    if (!ht_count(link->requests))
+        gettimeofday(&link->last_activity, NULL);
+
+    ht_set(link->requests, &req->tag, sizeof(req->tag), req, sizeof(peer_link_request_t));
+    return 0;
+}
+
+// the link is now usable, send the requests queued while connecting.
+// NOTE: called by the async i/o thread driving the link
+static void
+peer_link_ready(peer_link_t *link, uint32_t caps)
+{
+    linked_list_t *failed = list_create();
+
+    pthread_mutex_lock(&link->lock);
+    link->caps = caps;
+    async_read_context_session(link->reader, (caps & SHC_CAP_CRC32C) ? 1 : 0);
+    link->state = PEER_LINK_READY;
+    peer_link_request_t *req = list_shift_value(link->backlog);
+    while (req) {
+        if (peer_link_queue_request(link, req) != 0)
+            list_push_value(failed, req);
+        req = list_shift_value(link->backlog);
+    }
+    peer_link_flush(link);
+    pthread_mutex_unlock(&link->lock);
+
+    req = list_shift_value(failed);
+    while (req) {
+        if (req->cb)
+            req->cb(link->peer, req->key, req->klen, NULL, 0, -1, req->priv);
+        peer_link_request_destroy(req);
+        req = list_shift_value(failed);
+    }
+    list_destroy(failed);
+}
+
+// handle the responses to the session handshake
+// (CHECK and, if the link must be authenticated, AUTH)
+static int
+peer_link_handshake(peer_link_t *link, void *data, size_t len, int idx)
+{
+    if (idx >= 0) {
+        if (idx < 3)
+            fbuf_add_binary(&link->records[idx], data, len);
+        if (idx >= link->num_records)
+            link->num_records = idx + 1;
+        return 0;
+    }
+
+    if (idx != -1)
+        return -1;
+
+    shardcache_hdr_t hdr = async_read_context_hdr(link->reader);
+    fbuf_t *records[3] = { &link->records[0], &link->records[1], &link->records[2] };
+    uint32_t caps = 0;
+
+    if (link->authenticating) {
+        if (hdr != SHC_HDR_RESPONSE || link->num_records != 1 || fbuf_used(records[0]) != 1 ||
+            *((char *)fbuf_data(records[0])) != SHC_RES_OK)
+        {
+            SHC_WARNING("Peer %s refused the authentication", link->peer);
+            return -1;
+        }
+        caps = link->caps;
+    } else {
+        fbuf_t msg = FBUF_STATIC_INITIALIZER;
+        int rc = check_peer_session_response(link->peer, link->links->auth, link->wanted,
+                                             link->nonce, hdr, records, link->num_records,
+                                             &caps, &msg);
+        if (rc == 1) {
+            // the link needs to be authenticated
+            link->authenticating = 1;
+            link->caps = caps;
+            peer_link_handshake_clear(link);
+            iomux_write(link->iomux, link->fd, (unsigned char *)fbuf_data(&msg), fbuf_used(&msg), 1);
+            fbuf_destroy(&msg);
+            return 0;
+        }
+        fbuf_destroy(&msg);
+        if (rc != 0) {
+            SHC_WARNING("Can't open a session on the link to %s", link->peer);
+            return -1;
+        }
+    }
+
+    peer_link_handshake_clear(link);
+
+    if (!(caps & SHC_CAP_TAGGED)) {
+        SHC_DEBUG("Peer %s doesn't support tagged requests, not linking it", link->peer);
+        ATOMIC_SET(link->set->untagged, 1);
+        return -1;
+    }
+
+    peer_link_ready(link, caps);
+    return 0;
+}
+
+// demultiplex the responses received on the link
+static int
+peer_link_read_cb(void *data, size_t len, int idx, void *priv)
+{
+    peer_link_t *link = (peer_link_t *)priv;
+
+    // errors are handled by tearing down the whole link
+    // (since the stream can't be trusted anymore)
+    if (idx == -2 || idx == -3)
+        return 0;
+
+    // only the async i/o thread driving the link changes it while connecting
+    if (link->state == PEER_LINK_CONNECTING)
+        return peer_link_handshake(link, data, len, idx);
+
+    uint32_t tag = 0;
+    if (!async_read_context_tag(link->reader, &tag)) {
+        SHC_WARNING("Untagged response received on the link to %s", link->peer);
+        return -1;
+    }
+
+    pthread_mutex_lock(&link->lock);
+    peer_link_request_t *req = ht_get(link->requests, &tag, sizeof(tag), NULL);
+    if (req && idx < 0)
+        ht_delete(link->requests, &tag, sizeof(tag), NULL, NULL);
+    pthread_mutex_unlock(&link->lock);
+
+    if (!req) {
+        SHC_WARNING("Response with unknown tag %u received on the link to %s", tag, link->peer);
+        return -1;
+    }
+
+    // NOTE: only this (async i/o) thread completes the requests,
+    //       so 'req' can be safely used without holding the lock
+    int ret = 0;
+    if (req->cb) {
+        if (idx >= 0) {
+            ret = req->cb(link->peer, req->key, req->klen, data, len, idx, req->priv);
+        } else if (idx == -1) {
+            ret = req->cb(link->peer, req->key, req->klen, NULL, 0, 0, req->priv);
+            if (ret == 0)
+                req->cb(link->peer, req->key, req->klen, NULL, 0, 1, req->priv);
+        } else {
+            req->cb(link->peer, req->key, req->klen, NULL, 0, -1, req->priv);
+        }
+        // a refused response is still consumed, nothing more
+        // will be passed to the callback though
+        if (ret != 0)
+            req->cb = NULL;
+    }
+
+    if (idx < 0)
+        peer_link_request_destroy(req);
+
+    return 0;
+}
+
+static int
+peer_link_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    peer_link_t *link = (peer_link_t *)priv;
+
+    gettimeofday(&link->last_activity, NULL);
+
+    int processed = 0;
+    async_read_context_state_t state = async_read_context_input_data(link->reader, data, len, &processed);
+    // there might be more (pipelined) responses in the buffer
+    while (state == SHC_STATE_READING_DONE && async_read_context_pending(link->reader))
+        state = async_read_context_update(link->reader);
+
+    if (state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR) {
+        SHC_WARNING("Bad response received on the link to %s", link->peer);
+        iomux_close(iomux, fd);
+        return len;
+    }
+
+    return processed;
+}
+
+static void
+peer_link_timeout(iomux_t *iomux, int fd, void *priv)
+{
+    peer_link_t *link = (peer_link_t *)priv;
+    int tcp_timeout = global_tcp_timeout(-1);
+    struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+
+    // idle links are kept open, a link is considered
+    // stuck only if responses are still expected
+    pthread_mutex_lock(&link->lock);
+    int pending = ht_count(link->requests) + list_count(link->backlog) +
+                  (link->state != PEER_LINK_READY);
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, &link->last_activity, &diff);
+    pthread_mutex_unlock(&link->lock);
+
+    if (pending && timercmp(&diff, &maxwait, >)) {
+        SHC_WARNING("Timeout while waiting for data on the link to %s (timeout: %d milliseconds)",
+                    link->peer, tcp_timeout);
+        iomux_close(iomux, fd);
+    } else {
+        iomux_set_timeout(iomux, fd, &maxwait);
+    }
+}
+
+static void
+peer_link_eof(iomux_t *iomux, int fd, void *priv)
+{
+    peer_link_t *link = (peer_link_t *)priv;
+    SHC_DEBUG("Link to %s closed", link->peer);
+    peer_link_reset(link);
+}
+
+// the link has been registered in the iomux of an async i/o thread,
+// start the session handshake
+static void
+peer_link_added(iomux_t *iomux, int fd, void *priv)
+{
+    peer_link_t *link = (peer_link_t *)priv;
+    link->iomux = iomux;
+
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    link->wanted = ATOMIC_READ(link->links->wanted) | SHC_CAP_TAGGED;
+    if (build_peer_session_request(link->links->auth, ATOMIC_READ(link->links->label),
+                                   &link->wanted, &link->nonce, &msg) != 0)
+    {
+        SHC_WARNING("Can't build the session request for the link to %s", link->peer);
+        fbuf_destroy(&msg);
+        iomux_close(iomux, fd);
+        return;
+    }
+    // the message is sent as soon as the connection is established
+    iomux_write(iomux, fd, (unsigned char *)fbuf_data(&msg), fbuf_used(&msg), 1);
+    fbuf_destroy(&msg);
+}
+
+// start connecting the link, the connection is established and
+// negotiated asynchronously by the async i/o thread it's handed to
+// NOTE: must be called with the link locked
+static int
+peer_link_connect(peer_link_t *link)
+{
+    peer_links_t *links = link->links;
+    int in_progress = 0;
+    int fd = connect_to_peer_async(link->peer, &in_progress);
+    if (fd < 0)
+        return -1;
+
+    link->reader = async_read_context_create(links->auth, peer_link_read_cb, link);
+    if (!link->reader) {
+        close(fd);
+        return -1;
+    }
+
+    async_read_wrk_t *wrk = calloc(1, sizeof(async_read_wrk_t));
+    wrk->ctx = link->reader;
+    wrk->fd = fd;
+    wrk->cbs.mux_input = peer_link_input;
+    wrk->cbs.mux_timeout = peer_link_timeout;
+    wrk->cbs.mux_eof = peer_link_eof;
+    wrk->cbs.priv = link;
+    wrk->mux_added = peer_link_added;
+
+    link->fd = fd;
+    link->state = PEER_LINK_CONNECTING;
+    gettimeofday(&link->last_activity, NULL);
+    links->dispatch(links->priv, wrk);
+    return 0;
+}
+
+peer_links_t *
+peer_links_create(char *auth,
+                  int num_links,
+                  peer_links_dispatch_cb_t dispatch,
+                  peer_links_schedule_cb_t schedule,
+                  void *priv)
+{
+    peer_links_t *links = calloc(1, sizeof(peer_links_t));
+    links->auth = auth;
+    links->num_links = (num_links > PEER_LINKS_MAX) ? PEER_LINKS_MAX : num_links;
+    links->peers = ht_create(128, 65535, NULL);
+    pthread_mutex_init(&links->lock, NULL);
+    links->dispatch = dispatch;
+    links->schedule = schedule;
+    links->priv = priv;
+    return links;
+}
+
+static int
+peer_link_set_destroy(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    peer_link_set_t *set = (peer_link_set_t *)value;
+    int i;
+    for (i = 0; i < PEER_LINKS_MAX; i++) {
+        peer_link_t *link = &set->link[i];
+        peer_link_reset(link);
+        ht_destroy(link->requests);
+        list_destroy(link->backlog);
+        fbuf_destroy(&link->output);
+        pthread_mutex_destroy(&link->lock);
+        free(link->peer);
+    }
+    free(set);
+    return -1;
+}
+
+void
+peer_links_destroy(peer_links_t *links)
+{
+    ht_foreach_pair(links->peers, peer_link_set_destroy, NULL);
+    ht_destroy(links->peers);
+    pthread_mutex_destroy(&links->lock);
+    free(links);
+}
+
+void
+peer_links_negotiate(peer_links_t *links, uint32_t wanted)
+{
+    ATOMIC_SET(links->wanted, wanted);
+}
+
+void
+peer_links_identify(peer_links_t *links, char *label)
+{
+    ATOMIC_SET(links->label, label);
+}
+
+int
+peer_links_num(peer_links_t *links, int new_value)
+{
+    int old_value = ATOMIC_READ(links->num_links);
+    if (new_value >= 0)
+        ATOMIC_SET(links->num_links, (new_value > PEER_LINKS_MAX) ? PEER_LINKS_MAX : new_value);
+    return old_value;
+}
+
+static peer_link_set_t *
+peer_link_set_get(peer_links_t *links, char *peer)
+{
+    pthread_mutex_lock(&links->lock);
+    peer_link_set_t *set = ht_get(links->peers, peer, strlen(peer), NULL);
+    if (!set) {
+        set = calloc(1, sizeof(peer_link_set_t));
+        int i;
+        for (i = 0; i < PEER_LINKS_MAX; i++) {
+            peer_link_t *link = &set->link[i];
+            link->links = links;
+            link->peer = strdup(peer);
+            link->fd = -1;
+            link->set = set;
+            link->requests = ht_create(128, 1<<20, NULL);
+            link->backlog = list_create();
+            pthread_mutex_init(&link->lock, NULL);
+        }
+        ht_set(links->peers, peer, strlen(peer), set, sizeof(peer_link_set_t));
+    }
+    pthread_mutex_unlock(&links->lock);
+    return set;
+}
+
+int
+peer_links_fetch(peer_links_t *links,
+                 char *peer,
+                 void *key,
+                 size_t klen,
+                 unsigned char flags,
+                 fetch_from_peer_async_cb cb,
+                 void *priv)
+{
+    int num_links = ATOMIC_READ(links->num_links);
+    if (!num_links)
+        return -1;
+
+    peer_link_set_t *set = peer_link_set_get(links, peer);
+    peer_link_t *link = &set->link[ATOMIC_INCREASE(set->next, 1) % num_links];
+
+    if (ATOMIC_READ(set->untagged))
+        return -1;
+
+    pthread_mutex_lock(&link->lock);
+    if (link->state == PEER_LINK_DOWN && peer_link_connect(link) != 0) {
+        pthread_mutex_unlock(&link->lock);
+        return -1;
+    }
+
+    peer_link_request_t *req = calloc(1, sizeof(peer_link_request_t));
+    if (klen > sizeof(req->buf))
+        req->key = malloc(klen);
+    else
+        req->key = req->buf;
+    memcpy(req->key, key, klen);
+    req->klen = klen;
+    req->flags = flags;
+    req->cb = cb;
+    req->priv = priv;
+
+    int rc = 0;
+    if (link->state == PEER_LINK_READY) {
+        // never write here: the caller might be the async i/o thread
+        // which must read the responses the peer is blocked on
+        rc = peer_link_queue_request(link, req);
+        if (rc != 0) {
+            peer_link_request_destroy(req);
+        } else if (!link->flushing) {
+            link->flushing = 1;
+            links->schedule(links->priv, link->iomux, peer_link_flush_cb, link);
+        }
+    } else {
+        // sent as soon as the link is ready
+        list_push_value(link->backlog, req);
+    }
+    pthread_mutex_unlock(&link->lock);
+
+    return rc;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,68 @@
+#ifndef __PEER_LINKS_H__
+#define __PEER_LINKS_H__
+
+#include <stdint.h>
+#include <iomux.h>
+#include "messaging.h"
+
+// Persistent links to the peers. Fetches are pipelined as tagged requests
+// on a small fixed set of connections to each peer and the (out-of-order)
+// responses are matched back to the requests using their tag.
+// The links are driven by the async i/o threads: the worker of each new
+// connection is handed over through the 'dispatch' callback
+typedef struct __peer_links_s peer_links_t;
+
+typedef void (*peer_links_dispatch_cb_t)(void *priv, async_read_wrk_t *wrk);
+
+// must run 'cb' (without blocking the caller) as soon as possible
+// in the async i/o thread driving 'iomux'
+typedef void (*peer_links_schedule_cb_t)(void *priv,
+                                         iomux_t *iomux,
+                                         void (*cb)(iomux_t *iomux, void *arg),
+                                         void *arg);
+
+// the links are connected without blocking and the session is negotiated
+// by the async i/o thread driving them, fetches issued in the meanwhile are
+// sent as soon as the link is ready.
+// Requests are never written by the caller: they are queued on the link
+// and the async i/o thread driving it is asked (through 'schedule')
+// to hand them over to its iomux.
+// Peers which don't support SHC_CAP_TAGGED can't be linked
+peer_links_t *peer_links_create(char *auth,
+                                int num_links,
+                                peer_links_dispatch_cb_t dispatch,
+                                peer_links_schedule_cb_t schedule,
+                                void *priv);
+
+// NOTE: the async i/o threads must have been stopped already
+void peer_links_destroy(peer_links_t *links);
+
+// the capabilities to negotiate on new links (SHC_CAP_TAGGED is implied)
+void peer_links_negotiate(peer_links_t *links, uint32_t wanted);
+
+// identify ourselves with 'label' when negotiating new links
+// (the string is not copied and must outlive the links)
+void peer_links_identify(peer_links_t *links, char *label);
+
+// the number of links to each peer (0 disables the links)
+int peer_links_num(peer_links_t *links, int new_value);
+
+// send a fetch request for 'key' (with the SHC_GET_FLAG_* 'flags')
+// on one of the links to 'peer'.
+// The callback is invoked as documented for fetch_from_peer_async()
+// (status 1 is still reported once the request is over, there is
+//  no connection to release though).
+// Returns 0 if the request has been queued, -1 if there is no usable
+// link to the peer (so that a dedicated connection should be used)
+int peer_links_fetch(peer_links_t *links,
+                     char *peer,
+                     void *key,
+                     size_t klen,
+                     unsigned char flags,
+                     fetch_from_peer_async_cb cb,
+                     void *priv);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
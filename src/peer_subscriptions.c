@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <hashtable.h>
+
+#include <atomic_defs.h>
+
+#include "peer_subscriptions.h"
+#include "crc32c.h"
+
+#define PEER_SUBSCRIPTIONS_LOCKS 64
+
+struct __peer_subscriptions_s {
+    hashtable_t *table;     // key -> peer_subscribers_t
+    // the updates of the keys mapped to the same stripe are serialized
+    pthread_mutex_t locks[PEER_SUBSCRIPTIONS_LOCKS];
+    int max_keys;
+    uint32_t generation;
+    time_t reset_time;
+};
+
+static inline pthread_mutex_t *
+peer_subscriptions_lock(peer_subscriptions_t *subs, void *key, size_t klen)
+{
+    return &subs->locks[crc32c(0, key, klen) % PEER_SUBSCRIPTIONS_LOCKS];
+}
+
+peer_subscriptions_t *
+peer_subscriptions_create(int max_keys)
+{
+    peer_subscriptions_t *subs = calloc(1, sizeof(peer_subscriptions_t));
+    subs->table = ht_create(1<<10, 1<<22, free);
+    int i;
+    for (i = 0; i < PEER_SUBSCRIPTIONS_LOCKS; i++)
+        pthread_mutex_init(&subs->locks[i], NULL);
+    subs->max_keys = max_keys;
+    subs->reset_time = time(NULL);
+    return subs;
+}
+
+void
+peer_subscriptions_destroy(peer_subscriptions_t *subs)
+{
+    ht_destroy(subs->table);
+    int i;
+    for (i = 0; i < PEER_SUBSCRIPTIONS_LOCKS; i++)
+        pthread_mutex_destroy(&subs->locks[i]);
+    free(subs);
+}
+
+void
+peer_subscriptions_add(peer_subscriptions_t *subs,
+                       void *key,
+                       size_t klen,
+                       int index,
+                       int num_peers)
+{
+    int max_keys = ATOMIC_READ(subs->max_keys);
+    if (!max_keys || index < 0 || index >= num_peers)
+        return;
+
+    pthread_mutex_t *lock = peer_subscriptions_lock(subs, key, klen);
+    pthread_mutex_lock(lock);
+    peer_subscribers_t *peers = ht_get(subs->table, key, klen, NULL);
+    if (!peers) {
+        if (ht_count(subs->table) >= (size_t)max_keys) {
+            pthread_mutex_unlock(lock);
+            // start over (the table can't be full anymore)
+            peer_subscriptions_reset(subs);
+            peer_subscriptions_add(subs, key, klen, index, num_peers);
+            return;
+        }
+        int num_words = (num_peers + 63) / 64;
+        size_t size = sizeof(peer_subscribers_t) + num_words * sizeof(uint64_t);
+        peers = calloc(1, size);
+        peers->num_words = num_words;
+        ht_set(subs->table, key, klen, peers, size);
+    }
+    if (index / 64 < peers->num_words)
+        peers->words[index / 64] |= (1ULL << (index % 64));
+    pthread_mutex_unlock(lock);
+}
+
+peer_subscribers_t *
+peer_subscriptions_take(peer_subscriptions_t *subs,
+                        void *key,
+                        size_t klen,
+                        uint32_t *generation)
+{
+    peer_subscribers_t *peers = NULL;
+    pthread_mutex_t *lock = peer_subscriptions_lock(subs, key, klen);
+    pthread_mutex_lock(lock);
+    ht_delete(subs->table, key, klen, (void **)&peers, NULL);
+    if (generation)
+        *generation = ATOMIC_READ(subs->generation);
+    pthread_mutex_unlock(lock);
+    return peers;
+}
+
+int
+peer_subscribers_check(peer_subscribers_t *peers, int index)
+{
+    if (index < 0 || index / 64 >= peers->num_words)
+        return 0;
+    return (peers->words[index / 64] & (1ULL << (index % 64))) ? 1 : 0;
+}
+
+void
+peer_subscriptions_reset(peer_subscriptions_t *subs)
+{
+    int i;
+    for (i = 0; i < PEER_SUBSCRIPTIONS_LOCKS; i++)
+        pthread_mutex_lock(&subs->locks[i]);
+
+    ht_clear(subs->table);
+    ATOMIC_INCREMENT(subs->generation);
+    ATOMIC_SET(subs->reset_time, time(NULL));
+
+    for (i = PEER_SUBSCRIPTIONS_LOCKS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&subs->locks[i]);
+}
+
+time_t
+peer_subscriptions_reset_time(peer_subscriptions_t *subs)
+{
+    return ATOMIC_READ(subs->reset_time);
+}
+
+uint32_t
+peer_subscriptions_generation(peer_subscriptions_t *subs)
+{
+    return ATOMIC_READ(subs->generation);
+}
+
+int
+peer_subscriptions_max_keys(peer_subscriptions_t *subs, int new_value)
+{
+    int old_value = ATOMIC_READ(subs->max_keys);
+    if (new_value >= 0) {
+        ATOMIC_SET(subs->max_keys, new_value);
+        // the copies sent while the tracking was disabled are unknown
+        if (new_value && !old_value)
+            peer_subscriptions_reset(subs);
+    }
+    return old_value;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
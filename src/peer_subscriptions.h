@@ -0,0 +1,56 @@
+#ifndef __PEER_SUBSCRIPTIONS_H__
+#define __PEER_SUBSCRIPTIONS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// The peers which got a copy of each of the keys we own since it last changed.
+// Peers are identified by their index in the list of nodes, so all the
+// subscriptions must be forgotten (reset) whenever the nodes change.
+// At most 'max_keys' keys are tracked, once the limit is reached all the
+// subscriptions are forgotten as well.
+// NOTE: a reset (or a key not being tracked) doesn't mean that no peer holds
+//       a copy, the caller has to deal with the copies obtained before the
+//       last reset (see peer_subscriptions_reset_time())
+typedef struct __peer_subscriptions_s peer_subscriptions_t;
+
+typedef struct {
+    int num_words;
+    uint64_t words[];    // bit N is set if the peer with index N got a copy
+} peer_subscribers_t;
+
+peer_subscriptions_t *peer_subscriptions_create(int max_keys);
+void peer_subscriptions_destroy(peer_subscriptions_t *subs);
+
+// record that the peer with the given index (out of 'num_peers')
+// got a copy of the key
+void peer_subscriptions_add(peer_subscriptions_t *subs,
+                            void *key,
+                            size_t klen,
+                            int index,
+                            int num_peers);
+
+// forget the subscribers of the key returning them (NULL if nobody got a
+// copy since the last reset). The returned structure must be released with
+// free(). *generation is set to the number of resets so far.
+peer_subscribers_t *peer_subscriptions_take(peer_subscriptions_t *subs,
+                                            void *key,
+                                            size_t klen,
+                                            uint32_t *generation);
+
+// returns 1 if the peer with the given index is among the subscribers
+int peer_subscribers_check(peer_subscribers_t *peers, int index);
+
+// forget all the subscriptions
+void peer_subscriptions_reset(peer_subscriptions_t *subs);
+time_t peer_subscriptions_reset_time(peer_subscriptions_t *subs);
+uint32_t peer_subscriptions_generation(peer_subscriptions_t *subs);
+
+// maximum number of keys tracked (0 disables the tracking)
+int peer_subscriptions_max_keys(peer_subscriptions_t *subs, int new_value);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
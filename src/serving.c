@@ -20,6 +20,7 @@
 #include "connections.h"
 #include "shardcache.h"
 #include "counters.h"
+#include "crc32c.h"
 
 #include "serving.h"
 
@@ -42,6 +43,13 @@ typedef struct {
     linked_list_t *prune;
     uint64_t numfds;
     //uint64_t pruning;
+    uint64_t busy;  // microseconds spent serving connections
+    uint64_t idle;  // microseconds spent waiting for something to do
+    uint64_t load;  // permille of busy time in the last sampling interval
+    uint64_t last_busy;
+    uint64_t pending; // requests being served (for admission control)
+    struct timeval last_sample;
+    TAILQ_HEAD(, __shardcache_connection_context_s) connections;
 } shardcache_worker_context_t;
 
 struct __shardcache_serving_s {
@@ -66,6 +74,8 @@ typedef struct __shardcache_request_s {
     int fd;
     shardcache_hdr_t hdr;
     shardcache_hdr_t sig_hdr;
+    int wide; // the request uses 32bit chunk sizes and so must the response
+    int compression; // algorithm used to compress the streamed value (if any)
     shardcache_connection_context_t *ctx;
 #ifdef __MACH__
     OSSpinLock output_lock;
@@ -74,11 +84,20 @@ typedef struct __shardcache_request_s {
 #endif
     fbuf_t output;
     sip_hash *fetch_shash;
+    uint32_t fetch_crc; // running checksum of streamed crc32c responses
     int error;
     int skipped;
     int copied;
     int done;
+    int tagged;
+    uint32_t tag;
     fbuf_t fetch_accumulator;
+    fbuf_t compress_accumulator; // streamed data not filling a compressed block yet
+    // keys of a GET_MULTI request (pointing to the data in records[0])
+    // and number of them whose value has not been sent yet
+    void **multi_keys;
+    size_t *multi_klens;
+    int multi_pending;
     TAILQ_ENTRY(__shardcache_request_s) next;
 } shardcache_request_t;
 
@@ -88,6 +107,9 @@ struct __shardcache_connection_context_s {
 
     TAILQ_HEAD (, __shardcache_request_s) requests;
     int num_requests;
+    // the request whose (partial) output is being
+    // streamed and which can't be interleaved with others
+    shardcache_request_t *streaming;
 
     fbuf_t records[SHARDCACHE_REQUEST_RECORDS_MAX];
 
@@ -100,6 +122,21 @@ struct __shardcache_connection_context_s {
     shardcache_worker_context_t *worker;
     int closed;
     struct timeval in_prune_since;
+    // microseconds spent serving this connection in
+    // the current sampling interval of the worker
+    uint64_t busy;
+    // no output is pending in the mux
+    int output_idle;
+    int linked;
+    // nonces of the pending authentication challenge (if any)
+    uint64_t client_nonce;
+    uint64_t server_nonce;
+    int challenged;
+    // algorithm negotiated to compress the responses (if any)
+    int compression;
+    // the label of the peer on the other side (if it identified itself)
+    char *peer;
+    TAILQ_ENTRY(__shardcache_connection_context_s) worker_next;
 };
 #pragma pack(pop)
 
@@ -127,6 +164,7 @@ shardcache_connection_context_create(shardcache_serving_t *serv, int fd)
 
     ctx->serv = serv;
     ctx->fd = fd;
+    ctx->output_idle = 1;
     ctx->reader_ctx = async_read_context_create((char *)serv->cache->auth,
                                                     async_read_handler,
                                                     ctx);
@@ -145,6 +183,8 @@ shardcache_connection_context_create(shardcache_serving_t *serv, int fd)
 static void
 shardcache_request_destroy(shardcache_request_t *req)
 {
+    ATOMIC_DECREMENT(req->ctx->worker->pending);
+
     int i;
     for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++) {
         fbuf_destroy(&req->records[i]);
@@ -154,12 +194,46 @@ shardcache_request_destroy(shardcache_request_t *req)
     if (req->fetch_shash)
         sip_hash_free(req->fetch_shash);
     fbuf_destroy(&req->fetch_accumulator);
+    fbuf_destroy(&req->compress_accumulator);
+    free(req->multi_keys);
+    free(req->multi_klens);
     free(req);
 }
 
+static inline void
+shardcache_worker_unlink_connection(shardcache_connection_context_t *ctx)
+{
+    if (ctx->linked) {
+        TAILQ_REMOVE(&ctx->worker->connections, ctx, worker_next);
+        ctx->linked = 0;
+    }
+}
+
+static inline void
+shardcache_worker_link_connection(shardcache_worker_context_t *wrk,
+                                  shardcache_connection_context_t *ctx)
+{
+    TAILQ_INSERT_TAIL(&wrk->connections, ctx, worker_next);
+    ctx->linked = 1;
+}
+
+static inline void
+shardcache_connection_account_busy(shardcache_connection_context_t *ctx,
+                                   struct timeval *start)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &diff);
+    uint64_t usecs = (diff.tv_sec * 1000000) + diff.tv_usec;
+    ctx->busy += usecs;
+    ATOMIC_INCREASE(ctx->worker->busy, usecs);
+}
+
 static void
 shardcache_connection_context_destroy(shardcache_connection_context_t *ctx)
 {
+    shardcache_worker_unlink_connection(ctx);
+
     int i;
     for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++) {
         fbuf_destroy(&ctx->records[i]);
@@ -173,6 +247,7 @@ shardcache_connection_context_destroy(shardcache_connection_context_t *ctx)
     }
     async_read_context_destroy(ctx->reader_ctx);
     ATOMIC_DECREMENT(ctx->serv->num_connections);
+    free(ctx->peer);
     free(ctx);
 }
 
@@ -184,12 +259,62 @@ send_data(shardcache_request_t *req, fbuf_t *data)
     SPIN_UNLOCK(&req->output_lock);
 }
 
+// the request has been received on an authenticated connection
+// using crc32c checksums and the response must be sent the same way
+#define REQUEST_USES_CRC(__req) ((__req)->sig_hdr == SHC_HDR_CSIGNATURE_CRC)
+
+// signature header to pass to build_message() to answer
+// the request using the same framing of the request
+#define RESPONSE_SIG_HDR(__req) \
+    ((__req)->sig_hdr | ((__req)->wide ? SHC_SIG_WIDE_RECORDS : 0) | \
+     SHC_SIG_COMPRESSION(ATOMIC_READ((__req)->ctx->compression)))
+
+static inline void
+add_fetch_crc(shardcache_request_t *req, fbuf_t *output)
+{
+    uint32_t crc_nbo = htonl(req->fetch_crc);
+    fbuf_add_binary(output, (void *)&crc_nbo, sizeof(crc_nbo));
+}
+
+// add the size of a chunk of a streamed response (or the EOR if 0),
+// 32bit wide if the request used wide records, and update the digest
+static inline void
+add_fetch_chunk_size(shardcache_request_t *req, fbuf_t *output, uint32_t size)
+{
+    char buf[sizeof(uint32_t)];
+    int len;
+    if (req->wide) {
+        uint32_t size_nbo = htonl(size);
+        len = sizeof(size_nbo);
+        memcpy(buf, &size_nbo, len);
+    } else {
+        uint16_t size_nbo = htons(size);
+        len = sizeof(size_nbo);
+        memcpy(buf, &size_nbo, len);
+    }
+    fbuf_add_binary(output, buf, len);
+    if (REQUEST_USES_CRC(req))
+        req->fetch_crc = crc32c(req->fetch_crc, buf, len);
+    else if (req->fetch_shash)
+        sip_hash_update(req->fetch_shash, (uint8_t *)buf, len);
+}
+
 #define WRITE_STATUS_MODE_SIMPLE  0x00
 #define WRITE_STATUS_MODE_BOOLEAN 0x01
 #define WRITE_STATUS_MODE_EXISTS  0x02
+
+static void write_busy(shardcache_request_t *req);
+
 static void
 write_status(shardcache_request_t *req, int rc, char mode)
 {
+    // the peer the command has been forwarded to refused it,
+    // let the client know that it can be retried later
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        write_busy(req);
+        return;
+    }
+
     // we are ensured that req exists until done is set to 1 and that
     // both req->output and req->ctx will never change, so we don't need a lock here
     char out[6] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x00 };
@@ -223,6 +348,20 @@ write_status(shardcache_request_t *req, int rc, char mode)
         }
     }
 
+    if (REQUEST_USES_CRC(req) || req->wide) {
+        shardcache_record_t record = {
+            .v = &out[2],
+            .l = 1
+        };
+        fbuf_t output = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+        build_message((char *)req->ctx->serv->cache->auth, RESPONSE_SIG_HDR(req),
+                      SHC_HDR_RESPONSE, &record, no_data ? 0 : 1, &output);
+        send_data(req, &output);
+        fbuf_destroy(&output);
+        ATOMIC_INCREMENT(req->done);
+        return;
+    }
+
     uint32_t magic = htonl(SHC_MAGIC);
     fbuf_t output = FBUF_STATIC_INITIALIZER;
     fbuf_minlen(&output, 64);
@@ -268,7 +407,11 @@ send_async_data_response_preamble(shardcache_request_t *req)
 {
     shardcache_hdr_t hdr = SHC_HDR_RESPONSE;
 
-    uint32_t magic = htonl(SHC_MAGIC);
+    unsigned char magic_flags = (req->wide ? SHC_MAGIC_WIDE_RECORDS : 0) |
+                                (req->compression ? SHC_MAGIC_COMPRESSED : 0);
+    uint32_t magic = htonl((REQUEST_USES_CRC(req) || magic_flags)
+                           ? SHC_MAGIC_V2|magic_flags
+                           : SHC_MAGIC);
 
     fbuf_t output = FBUF_STATIC_INITIALIZER;
     fbuf_minlen(&output, 64);
@@ -276,6 +419,16 @@ send_async_data_response_preamble(shardcache_request_t *req)
     fbuf_slowgrowsize(&output, 512);
     fbuf_add_binary(&output, (char *)&magic, sizeof(magic));
 
+    if (REQUEST_USES_CRC(req)) {
+        fbuf_add_binary(&output, (void *)&req->sig_hdr, 1);
+        fbuf_add_binary(&output, (void *)&hdr, 1);
+        req->fetch_crc = crc32c(0, &hdr, 1);
+        add_fetch_crc(req, &output);
+        send_data(req, &output);
+        fbuf_destroy(&output);
+        return 0;
+    }
+
     if (req->ctx->serv->cache->auth) {
         if (req->fetch_shash) {
             sip_hash_free(req->fetch_shash);
@@ -310,18 +463,19 @@ send_async_data_response_preamble(shardcache_request_t *req)
 static inline int
 send_async_data_response_epilogue(shardcache_request_t *req)
 {
-    uint16_t eor = 0;
     char eom = 0;
     fbuf_t output = FBUF_STATIC_INITIALIZER;
     fbuf_minlen(&output, 64);
     fbuf_fastgrowsize(&output, 1024);
     fbuf_slowgrowsize(&output, 512);
 
-    fbuf_add_binary(&output, (void *)&eor, 2);
+    add_fetch_chunk_size(req, &output, 0);
     fbuf_add_binary(&output, &eom, 1);
-    if (req->fetch_shash) {
+    if (REQUEST_USES_CRC(req)) {
+        req->fetch_crc = crc32c(req->fetch_crc, &eom, 1);
+        add_fetch_crc(req, &output);
+    } else if (req->fetch_shash) {
         uint64_t digest;
-        sip_hash_update(req->fetch_shash, (void *)&eor, 2);
         sip_hash_update(req->fetch_shash, (uint8_t *)&eom, 1);
         if (sip_hash_final_integer(req->fetch_shash, &digest)) {
             fbuf_add_binary(&output, (void *)&digest, sizeof(digest));
@@ -342,80 +496,31 @@ send_async_data_response_epilogue(shardcache_request_t *req)
     return 0;
 }
 
+// send a piece of the value being streamed framed in chunks
+// (the last chunk and the epilogue are sent once the value is complete)
 static int
-get_async_data_handler(void *key,
-                       size_t klen,
-                       void *data,
-                       size_t dlen,
-                       size_t total_size,
-                       struct timeval *timestamp,
-                       void *priv)
+send_async_data(shardcache_request_t *req, void *data, size_t dlen, int complete)
 {
-
-    shardcache_request_t *req =
-        (shardcache_request_t *)priv;
-
-    if (req->skipped == 0 && req->copied == 0) {
-        if (send_async_data_response_preamble(req) != 0) {
-            ATOMIC_INCREMENT(req->error);
-            return -1;
-        }
-    }
-
-    if (dlen == 0 && total_size == 0) {
-        if (!timestamp && (req->skipped || req->copied)) {
-            // if there is no timestamp here it means there was an
-            // error (and not just an empty item)
-            SHC_ERROR("Error notified to the get_async_data callback");
-            // XXX - at the moment the protocol doesn't allow to distinguish
-            //       between an empty value and an error, so for now we choose
-            //       to return a valid response for an empty value instead of
-            //       silently shutdown the connection.
-            //ATOMIC_INCREMENT(req->error);
-            //return -1;
-        }
-        if (send_async_data_response_epilogue(req) != 0) {
-            ATOMIC_INCREMENT(req->error);
-            return -1;
-        } 
-        return !timestamp ? -1 : 0;
-    }
-
-    uint32_t offset = 0;
-    uint32_t size = 0;
-
-    if (req->hdr == SHC_HDR_GET_OFFSET) {
-        memcpy(&offset, fbuf_data(&req->records[1]), sizeof(uint32_t));
-        offset = ntohl(offset);
-        memcpy(&size, fbuf_data(&req->records[2]), sizeof(uint32_t));
-        size = ntohl(size);
-    }
-
-    if (offset && (req->skipped + dlen) < offset) {
-        req->skipped += dlen;
-        return 0;
-    }
-
     static int max_chunk_size = (1<<16)-1;
 
     uint16_t accumulated_size = fbuf_used(&req->fetch_accumulator);
     size_t to_process = accumulated_size + dlen;
     size_t data_offset = 0;
-    while(to_process >= max_chunk_size) {
+    // with wide records there is no need to accumulate data,
+    // what we got is sent right away as a single chunk
+    size_t chunk_size = req->wide ? to_process : max_chunk_size;
+    while(to_process && to_process >= chunk_size) {
         fbuf_t output = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
-        size_t copy_size = max_chunk_size;
-
-        uint16_t clen = htons((uint16_t)copy_size);
+        size_t copy_size = chunk_size;
 
-        fbuf_add_binary(&output, (void *)&clen, sizeof(clen));
-
-        if (req->fetch_shash)
-            sip_hash_update(req->fetch_shash, (void *)&clen, sizeof(clen));
+        add_fetch_chunk_size(req, &output, copy_size);
 
         if (accumulated_size) {
             int copied = fbuf_concat(&output, &req->fetch_accumulator);
             if (req->fetch_shash)
                 sip_hash_update(req->fetch_shash, fbuf_data(&req->fetch_accumulator), copied);
+            else if (REQUEST_USES_CRC(req))
+                req->fetch_crc = crc32c(req->fetch_crc, fbuf_data(&req->fetch_accumulator), copied);
             copy_size -= copied;
             accumulated_size -= copied;
             fbuf_remove(&req->fetch_accumulator, copied);
@@ -424,10 +529,14 @@ get_async_data_handler(void *key,
             fbuf_add_binary(&output, data + data_offset, copy_size);
             if (req->fetch_shash)
                 sip_hash_update(req->fetch_shash, data + data_offset, copy_size);
+            else if (REQUEST_USES_CRC(req))
+                req->fetch_crc = crc32c(req->fetch_crc, data + data_offset, copy_size);
             data_offset += copy_size;
             req->copied += copy_size;
         }
-        if (req->fetch_shash && (req->sig_hdr&0x01)) {
+        if (REQUEST_USES_CRC(req)) {
+            add_fetch_crc(req, &output);
+        } else if (req->fetch_shash && (req->sig_hdr&0x01)) {
             uint64_t digest;
             if (!sip_hash_final_integer(req->fetch_shash, &digest)) {
                 SHC_ERROR("Can't compute the siphash digest!\n");
@@ -456,16 +565,16 @@ get_async_data_handler(void *key,
         }
     }
 
-    if (total_size > 0 && timestamp) {
+    if (complete) {
         if (accumulated_size) {
             fbuf_t output = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
             // flush what we have left in the accumulator
-            uint16_t clen = htons(accumulated_size);
-            fbuf_add_binary(&output, (void *)&clen, sizeof(clen));
-            if (req->fetch_shash)
-                sip_hash_update(req->fetch_shash, (void *)&clen, sizeof(clen));
+            add_fetch_chunk_size(req, &output, accumulated_size);
             int copied = fbuf_concat(&output, &req->fetch_accumulator);
-            if (req->fetch_shash) {
+            if (REQUEST_USES_CRC(req)) {
+                req->fetch_crc = crc32c(req->fetch_crc, fbuf_data(&req->fetch_accumulator), copied);
+                add_fetch_crc(req, &output);
+            } else if (req->fetch_shash) {
                 sip_hash_update(req->fetch_shash, fbuf_data(&req->fetch_accumulator), copied);
                 if (req->sig_hdr&0x01) {
                     uint64_t digest;
@@ -496,6 +605,113 @@ get_async_data_handler(void *key,
     return 0;
 }
 
+// compress the streamed data in blocks as soon as there is enough of it,
+// whatever is left is compressed once the value is complete
+static int
+send_async_compressed_data(shardcache_request_t *req, void *data, size_t dlen, int complete)
+{
+    void *src = data;
+    size_t len = dlen;
+    if (fbuf_used(&req->compress_accumulator)) {
+        fbuf_add_binary(&req->compress_accumulator, data, dlen);
+        src = fbuf_data(&req->compress_accumulator);
+        len = fbuf_used(&req->compress_accumulator);
+    }
+
+    size_t ready = complete ? len : len - (len % SHC_COMPRESSION_BLOCK_SIZE);
+
+    fbuf_t blocks = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    if (ready && shc_compress(req->compression, src, ready, &blocks) != 0) {
+        SHC_ERROR("Can't compress the streamed data");
+        fbuf_destroy(&blocks);
+        ATOMIC_INCREMENT(req->error);
+        return -1;
+    }
+
+    if (src == data) {
+        if (dlen > ready)
+            fbuf_add_binary(&req->compress_accumulator, data + ready, dlen - ready);
+    } else {
+        fbuf_remove(&req->compress_accumulator, ready);
+    }
+
+    // account for the data consumed even if no block has been sent yet
+    req->copied += dlen;
+
+    int rc = send_async_data(req, fbuf_data(&blocks), fbuf_used(&blocks), complete);
+    fbuf_destroy(&blocks);
+    return rc;
+}
+
+static int
+get_async_data_handler(void *key,
+                       size_t klen,
+                       void *data,
+                       size_t dlen,
+                       size_t total_size,
+                       struct timeval *timestamp,
+                       void *priv)
+{
+
+    shardcache_request_t *req =
+        (shardcache_request_t *)priv;
+
+    if (req->skipped == 0 && req->copied == 0) {
+        // the value is compressed (if negotiated on the connection)
+        // unless it's known in advance to be small
+        if (req->hdr != SHC_HDR_GET_OFFSET &&
+            (total_size == 0 || total_size >= (size_t)shc_compression_threshold(-1)))
+        {
+            req->compression = ATOMIC_READ(req->ctx->compression);
+        }
+        if (send_async_data_response_preamble(req) != 0) {
+            ATOMIC_INCREMENT(req->error);
+            return -1;
+        }
+    }
+
+    if (dlen == 0 && total_size == 0) {
+        if (!timestamp && (req->skipped || req->copied)) {
+            // if there is no timestamp here it means there was an
+            // error (and not just an empty item)
+            SHC_ERROR("Error notified to the get_async_data callback");
+            // XXX - at the moment the protocol doesn't allow to distinguish
+            //       between an empty value and an error, so for now we choose
+            //       to return a valid response for an empty value instead of
+            //       silently shutdown the connection.
+            //ATOMIC_INCREMENT(req->error);
+            //return -1;
+        }
+        if (send_async_data_response_epilogue(req) != 0) {
+            ATOMIC_INCREMENT(req->error);
+            return -1;
+        } 
+        return !timestamp ? -1 : 0;
+    }
+
+    uint32_t offset = 0;
+    uint32_t size = 0;
+
+    if (req->hdr == SHC_HDR_GET_OFFSET) {
+        memcpy(&offset, fbuf_data(&req->records[1]), sizeof(uint32_t));
+        offset = ntohl(offset);
+        memcpy(&size, fbuf_data(&req->records[2]), sizeof(uint32_t));
+        size = ntohl(size);
+    }
+
+    if (offset && (req->skipped + dlen) < offset) {
+        req->skipped += dlen;
+        return 0;
+    }
+
+    int complete = (total_size > 0 && timestamp);
+
+    if (req->compression)
+        return send_async_compressed_data(req, data, dlen, complete);
+
+    return send_async_data(req, data, dlen, complete);
+}
+
 static int
 get_async_data(shardcache_t *cache,
                void *key,
@@ -510,6 +726,11 @@ get_async_data(shardcache_t *cache,
         uint32_t offset = ntohl(*((uint32_t *)fbuf_data(&req->records[1])));
         uint32_t length = ntohl(*((uint32_t *)fbuf_data(&req->records[2])));
         rc = shardcache_get_offset_async(cache, key, klen, offset, length, cb, req);
+    } else if (fbuf_used(&req->records[1]) == 1 &&
+               (*((unsigned char *)fbuf_data(&req->records[1])) & SHC_GET_FLAG_LOCAL))
+    {
+        // a peer failing over to us, the owner of the key is unreachable
+        rc = shardcache_get_async_local(cache, key, klen, cb, req);
     } else {
         rc = shardcache_get_async(cache, key, klen, cb, req);
     }
@@ -527,11 +748,193 @@ get_async_data(shardcache_t *cache,
     return rc;
 }
 
+// send the value of one of the keys of a GET_MULTI request as a separate
+// response as soon as it's available (it might be called by other threads)
+static void
+get_multi_data_handler(void *key,
+                       size_t klen,
+                       int index,
+                       void *data,
+                       size_t dlen,
+                       void *priv)
+{
+    shardcache_request_t *req = (shardcache_request_t *)priv;
+
+    uint32_t index_nbo = htonl(index);
+    shardcache_record_t records[2] = {
+        {
+            .v = &index_nbo,
+            .l = sizeof(uint32_t)
+        },
+        {
+            .v = data,
+            .l = dlen
+        }
+    };
+
+    fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    // each response to a tagged request is wrapped in its own envelope
+    if (req->tagged)
+        add_message_tag(req->tag, &out);
+
+    if (build_message((char *)req->ctx->serv->cache->auth,
+                      RESPONSE_SIG_HDR(req),
+                      SHC_HDR_RESPONSE,
+                      records, 2, &out) == 0)
+    {
+        send_data(req, &out);
+    } else {
+        SHC_ERROR("Can't build the GET_MULTI response for key %d", index);
+        ATOMIC_INCREMENT(req->error);
+    }
+    fbuf_destroy(&out);
+
+    if (ATOMIC_DECREASE(req->multi_pending, 1) == 0)
+        ATOMIC_INCREMENT(req->done);
+}
+
+static void
+write_busy(shardcache_request_t *req)
+{
+    unsigned char status = SHC_RES_BUSY;
+    shardcache_record_t record = {
+        .v = &status,
+        .l = 1
+    };
+    fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    if (build_message((char *)req->ctx->serv->cache->auth,
+                      RESPONSE_SIG_HDR(req),
+                      SHC_HDR_BUSY,
+                      &record, 1, &out) == 0)
+    {
+        send_data(req, &out);
+        ATOMIC_INCREMENT(req->done);
+    } else {
+        SHC_ERROR("Can't build the BUSY response");
+        write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+    }
+    fbuf_destroy(&out);
+}
+
+// send a response message (with the given header) made of the provided records
+static void
+write_records(shardcache_request_t *req, shardcache_hdr_t hdr, shardcache_record_t *records, int num_records)
+{
+    fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    if (build_message((char *)req->ctx->serv->cache->auth,
+                      RESPONSE_SIG_HDR(req),
+                      hdr,
+                      records, num_records, &out) == 0)
+    {
+        send_data(req, &out);
+        ATOMIC_INCREMENT(req->done);
+    } else {
+        SHC_ERROR("Can't build the response for message %02x", req->hdr);
+        write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+    }
+    fbuf_destroy(&out);
+}
+
+// send the status (SHC_RES_OK or SHC_RES_ERR) of each of the keys
+// of a SET_MULTI, DELETE_MULTI, TOUCH_MULTI or EVICT_MULTI request
+static void
+write_multi_status(shardcache_request_t *req, int *results, int num_keys)
+{
+    unsigned char *statuses = malloc(num_keys);
+    int i;
+    for (i = 0; i < num_keys; i++)
+        statuses[i] = (results[i] == 0) ? SHC_RES_OK : SHC_RES_ERR;
+
+    shardcache_record_t record = {
+        .v = statuses,
+        .l = num_keys
+    };
+    write_records(req, SHC_HDR_RESPONSE, &record, 1);
+    free(statuses);
+}
+
+// returns 0 if the request can be served, otherwise the index of
+// the counter tracking the limit which has been exceeded
+static int
+admit_request(shardcache_request_t *req)
+{
+    shardcache_t *cache = req->ctx->serv->cache;
+
+    switch(req->hdr) {
+        case SHC_HDR_GET:
+        case SHC_HDR_GET_ASYNC:
+        case SHC_HDR_GET_OFFSET:
+        case SHC_HDR_SET:
+        case SHC_HDR_ADD:
+        case SHC_HDR_DELETE:
+        case SHC_HDR_EXISTS:
+        case SHC_HDR_TOUCH:
+        case SHC_HDR_GET_MULTI:
+        case SHC_HDR_SET_MULTI:
+        case SHC_HDR_DELETE_MULTI:
+        case SHC_HDR_TOUCH_MULTI:
+        case SHC_HDR_GET_IF_MODIFIED:
+        case SHC_HDR_CAS:
+        case SHC_HDR_GETS:
+        case SHC_HDR_INCR:
+        case SHC_HDR_DECR:
+            break;
+        default:
+            // administrative commands and evictions are always served
+            return 0;
+    }
+
+    int max_pending = ATOMIC_READ(cache->max_pending_requests);
+    if (max_pending && ATOMIC_READ(req->ctx->worker->pending) > (uint64_t)max_pending)
+        return SHARDCACHE_COUNTER_BUSY_PENDING;
+
+    // the keys of a multi-key command are most likely owned by different nodes
+    if (req->hdr == SHC_HDR_GET_MULTI ||
+        req->hdr == SHC_HDR_SET_MULTI ||
+        req->hdr == SHC_HDR_DELETE_MULTI ||
+        req->hdr == SHC_HDR_TOUCH_MULTI)
+    {
+        return 0;
+    }
+
+    int max_remote = ATOMIC_READ(cache->max_remote_requests);
+    int max_storage = ATOMIC_READ(cache->max_storage_requests);
+    if ((!max_remote && !max_storage) || !fbuf_used(&req->records[0]))
+        return 0;
+
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    if (!shardcache_test_ownership(cache,
+                                   fbuf_data(&req->records[0]),
+                                   fbuf_used(&req->records[0]),
+                                   node_name,
+                                   &node_len))
+    {
+        // the request will be most likely forwarded to the owner
+        if (max_remote && shardcache_remote_requests(cache) >= (uint64_t)max_remote)
+            return SHARDCACHE_COUNTER_BUSY_REMOTE;
+    } else if (max_storage && cache->use_persistent_storage &&
+               ATOMIC_READ(cache->storage_requests) >= (uint64_t)max_storage)
+    {
+        return SHARDCACHE_COUNTER_BUSY_STORAGE;
+    }
+
+    return 0;
+}
+
 static void
 shardcache_async_command_response(void *key, size_t klen, int ret, void *priv)
 {
     shardcache_request_t *req = (shardcache_request_t *)priv;
 
+    // the peer keeps a copy of what it stored (if cache_on_set is enabled),
+    // subscribe it only now so that it isn't notified of its own change
+    if (ret == 0 && (req->hdr == SHC_HDR_SET || req->hdr == SHC_HDR_ADD))
+        shardcache_subscribe(req->ctx->serv->cache,
+                             fbuf_data(&req->records[0]),
+                             fbuf_used(&req->records[0]),
+                             req->ctx->peer);
+
     write_status(req, ret, (req->hdr == SHC_HDR_ADD)
                            ? WRITE_STATUS_MODE_EXISTS
                            : (req->hdr == SHC_HDR_EXISTS)
@@ -568,9 +971,236 @@ process_request(shardcache_request_t *req)
                 }
             }
 
+            // subscribe before reading the value so that a concurrent change
+            // can't be missed by the copy the peer is getting
+            shardcache_subscribe(cache, key, klen, req->ctx->peer);
             get_async_data(cache, key, klen, get_async_data_handler, req);
             break;
         }
+        case SHC_HDR_GET_MULTI:
+        {
+            int num_keys = unpack_multi_keys(key, klen, &req->multi_keys, &req->multi_klens);
+            if (num_keys <= 0) {
+                SHC_WARNING("Bad record (0) format for message GET_MULTI");
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                break;
+            }
+
+            // the tag envelope is added to each response instead
+            if (req->tagged)
+                fbuf_set_used(&req->output, 0);
+
+            int i;
+            for (i = 0; i < num_keys; i++)
+                shardcache_subscribe(cache, req->multi_keys[i], req->multi_klens[i], req->ctx->peer);
+
+            req->multi_pending = num_keys;
+            if (shardcache_get_multi_async(cache, req->multi_keys, req->multi_klens,
+                                           num_keys, get_multi_data_handler, req) != 0)
+            {
+                SHC_ERROR("shardcache_get_multi_async returned error");
+                ATOMIC_INCREMENT(req->error);
+            }
+            break;
+        }
+        case SHC_HDR_SET_MULTI:
+        case SHC_HDR_DELETE_MULTI:
+        case SHC_HDR_TOUCH_MULTI:
+        case SHC_HDR_EVICT_MULTI:
+        {
+            void **keys = NULL;
+            size_t *klens = NULL;
+            int num_keys = unpack_multi_keys(key, klen, &keys, &klens);
+            if (num_keys <= 0) {
+                SHC_WARNING("Bad record (0) format for multi-key message %02x", req->hdr);
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                break;
+            }
+
+            int *results = calloc(num_keys, sizeof(int));
+            if (req->hdr == SHC_HDR_SET_MULTI) {
+                void **values = NULL;
+                size_t *vlens = NULL;
+                time_t *expires = NULL;
+                int num_values = unpack_multi_keys(fbuf_data(&req->records[1]),
+                                                   fbuf_used(&req->records[1]),
+                                                   &values, &vlens);
+                size_t expires_len = fbuf_used(&req->records[2]);
+                if (num_values != num_keys ||
+                    (expires_len && expires_len != num_keys * sizeof(uint32_t)))
+                {
+                    SHC_WARNING("Bad records format for message SET_MULTI");
+                    write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                    free(values);
+                    free(vlens);
+                    free(results);
+                    free(keys);
+                    free(klens);
+                    break;
+                }
+
+                if (expires_len) {
+                    expires = malloc(num_keys * sizeof(time_t));
+                    int i;
+                    for (i = 0; i < num_keys; i++) {
+                        uint32_t expire_nbo;
+                        memcpy(&expire_nbo, fbuf_data(&req->records[2]) + (i * sizeof(uint32_t)),
+                               sizeof(uint32_t));
+                        expires[i] = ntohl(expire_nbo);
+                    }
+                }
+
+                shardcache_set_multi(cache, keys, klens, values, vlens, expires, num_keys, results);
+                int i;
+                for (i = 0; i < num_keys; i++) {
+                    if (results[i] == 0)
+                        shardcache_subscribe(cache, keys[i], klens[i], req->ctx->peer);
+                }
+                free(values);
+                free(vlens);
+                free(expires);
+            } else if (req->hdr == SHC_HDR_DELETE_MULTI) {
+                shardcache_del_multi(cache, keys, klens, num_keys, results);
+            } else if (req->hdr == SHC_HDR_TOUCH_MULTI) {
+                shardcache_touch_multi(cache, keys, klens, num_keys, results);
+            } else {
+                shardcache_evict_multi(cache, keys, klens, num_keys);
+            }
+
+            write_multi_status(req, results, num_keys);
+            free(results);
+            free(keys);
+            free(klens);
+            break;
+        }
+        case SHC_HDR_GETS:
+        {
+            size_t vlen = 0;
+            uint64_t version = 0;
+            void *value = shardcache_gets(cache, key, klen, &vlen, &version);
+            uint64_t version_nbo = shc_hton64(version);
+            shardcache_record_t records[2] = {
+                {
+                    .v = value,
+                    .l = value ? vlen : 0
+                },
+                {
+                    .v = &version_nbo,
+                    .l = sizeof(uint64_t)
+                }
+            };
+            write_records(req, SHC_HDR_RESPONSE, records, 2);
+            free(value);
+            break;
+        }
+        case SHC_HDR_GET_IF_MODIFIED:
+        {
+            if (fbuf_used(&req->records[1]) != sizeof(uint64_t)) {
+                SHC_WARNING("Bad record (1) format for message GET_IF_MODIFIED");
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                break;
+            }
+
+            uint64_t version = 0;
+            memcpy(&version, fbuf_data(&req->records[1]), sizeof(uint64_t));
+            version = shc_ntoh64(version);
+
+            // the peer is revalidating its copy (which it will keep)
+            shardcache_subscribe(cache, key, klen, req->ctx->peer);
+
+            void *value = NULL;
+            size_t vlen = 0;
+            rc = shardcache_get_if_modified(cache, key, klen, &version, &value, &vlen);
+            if (rc == 1) {
+                write_records(req, SHC_HDR_NOT_MODIFIED, NULL, 0);
+            } else if (rc == 0) {
+                uint64_t version_nbo = shc_hton64(version);
+                shardcache_record_t records[2] = {
+                    {
+                        .v = value,
+                        .l = value ? vlen : 0
+                    },
+                    {
+                        .v = &version_nbo,
+                        .l = sizeof(uint64_t)
+                    }
+                };
+                write_records(req, SHC_HDR_RESPONSE, records, 2);
+                free(value);
+            } else {
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+            }
+            break;
+        }
+        case SHC_HDR_CAS:
+        {
+            uint32_t expire = 0;
+            if (fbuf_used(&req->records[3]) == sizeof(uint32_t)) {
+                memcpy(&expire, fbuf_data(&req->records[3]), sizeof(uint32_t));
+                expire = ntohl(expire);
+            }
+            if (fbuf_used(&req->records[1]) != sizeof(uint64_t) || !fbuf_used(&req->records[2])) {
+                SHC_WARNING("Bad records format for message CAS");
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                break;
+            }
+
+            uint64_t version = 0;
+            memcpy(&version, fbuf_data(&req->records[1]), sizeof(uint64_t));
+            version = shc_ntoh64(version);
+
+            uint64_t new_version = 0;
+            rc = shardcache_cas(cache, key, klen, version,
+                                fbuf_data(&req->records[2]),
+                                fbuf_used(&req->records[2]),
+                                expire, &new_version);
+
+            unsigned char status = (rc == 0) ? SHC_RES_OK : (rc == 1) ? SHC_RES_EXISTS : SHC_RES_ERR;
+            uint64_t version_nbo = shc_hton64(new_version);
+            shardcache_record_t records[2] = {
+                {
+                    .v = &status,
+                    .l = 1
+                },
+                {
+                    .v = &version_nbo,
+                    .l = sizeof(uint64_t)
+                }
+            };
+            write_records(req, SHC_HDR_RESPONSE, records, 2);
+            break;
+        }
+        case SHC_HDR_INCR:
+        case SHC_HDR_DECR:
+        {
+            if (fbuf_used(&req->records[1]) != sizeof(uint64_t)) {
+                SHC_WARNING("Bad record (1) format for message %s",
+                            req->hdr == SHC_HDR_INCR ? "INCR" : "DECR");
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                break;
+            }
+
+            uint64_t amount = 0;
+            memcpy(&amount, fbuf_data(&req->records[1]), sizeof(uint64_t));
+            amount = shc_ntoh64(amount);
+
+            int64_t result = 0;
+            rc = shardcache_increment(cache, key, klen,
+                                      (req->hdr == SHC_HDR_INCR) ? (int64_t)amount : -(int64_t)amount,
+                                      &result);
+            if (rc != 0) {
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                break;
+            }
+
+            uint64_t result_nbo = shc_hton64((uint64_t)result);
+            shardcache_record_t record = {
+                .v = &result_nbo,
+                .l = sizeof(uint64_t)
+            };
+            write_records(req, SHC_HDR_RESPONSE, &record, 1);
+            break;
+        }
         case SHC_HDR_ADD:
         case SHC_HDR_SET:
         {
@@ -618,11 +1248,12 @@ process_request(shardcache_request_t *req)
             while (s && *s) {
                 char *tok = strsep(&s, ",");
                 if(tok) {
-                    char *label = strsep(&tok, ":");
-                    char *addr = tok;
+                    // label[@weight]:address[;address...]
+                    shardcache_node_t *node = shardcache_node_create_from_string(tok);
+                    if (!node)
+                        continue;
                     size_t size = (num_shards + 1) * sizeof(shardcache_node_t *);
                     nodes = realloc(nodes, size);
-                    shardcache_node_t *node = shardcache_node_create(label, &addr, 1);
                     nodes[num_shards++] = node;
                 }
             }
@@ -654,10 +1285,101 @@ process_request(shardcache_request_t *req)
         }
         case SHC_HDR_CHECK:
         {
+            if (fbuf_used(&req->records[0]) == sizeof(uint32_t)) {
+                // capabilities negotiation, answer with the subset
+                // of the requested capabilities we support
+                uint32_t caps;
+                memcpy(&caps, fbuf_data(&req->records[0]), sizeof(uint32_t));
+                caps = ntohl(caps) & SHC_CAPS_SUPPORTED;
+
+                uint64_t proof = 0;
+                int num_records = 1;
+                if ((caps & SHC_CAP_CRC32C) && cache->auth) {
+                    // messages won't be signed anymore so the client needs to
+                    // authenticate the connection first. The nonce provided by
+                    // the client allows it to check that we know the secret as well
+                    if (fbuf_used(&req->records[1]) == SHARDCACHE_MSG_NONCE_LEN) {
+                        shardcache_connection_context_t *ctx = req->ctx;
+                        memcpy(&ctx->client_nonce, fbuf_data(&req->records[1]), SHARDCACHE_MSG_NONCE_LEN);
+                        session_nonce(&ctx->server_nonce, SHARDCACHE_MSG_NONCE_LEN);
+                        ctx->challenged = 1;
+                        proof = session_proof((char *)cache->auth, 'S',
+                                              ctx->client_nonce, ctx->server_nonce);
+                        num_records = 3;
+                    } else {
+                        caps &= ~SHC_CAP_CRC32C;
+                    }
+                }
+                // peers identify themselves so that we know who is
+                // getting a copy of the keys we own.
+                // NOTE: the label is verified only if a secret is shared,
+                //       otherwise it's trusted as the rest of the commands
+                //       (the labels of unknown nodes are ignored anyway)
+                if (fbuf_used(&req->records[2]) && !req->ctx->peer)
+                    req->ctx->peer = strndup(fbuf_data(&req->records[2]), fbuf_used(&req->records[2]));
+                int compression = shc_compression_select(caps);
+                caps = htonl(caps);
+                shardcache_record_t records[3] = {
+                    {
+                        .v = &caps,
+                        .l = sizeof(uint32_t)
+                    },
+                    {
+                        .v = &req->ctx->server_nonce,
+                        .l = SHARDCACHE_MSG_NONCE_LEN
+                    },
+                    {
+                        .v = &proof,
+                        .l = sizeof(proof)
+                    }
+                };
+                fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+                if (build_message((char *)req->ctx->serv->cache->auth,
+                                  RESPONSE_SIG_HDR(req),
+                                  SHC_HDR_RESPONSE,
+                                  records, num_records, &out) == 0)
+                {
+                    send_data(req, &out);
+                    ATOMIC_INCREMENT(req->done);
+                } else {
+                    SHC_ERROR("Can't build the CHECK response");
+                    write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                }
+                fbuf_destroy(&out);
+                // the following responses can be compressed
+                ATOMIC_SET(req->ctx->compression, compression);
+                break;
+            }
             // TODO - HEALTH CHECK
             write_status(req, 0, WRITE_STATUS_MODE_SIMPLE);
             break;
         }
+        case SHC_HDR_AUTH:
+        {
+            // answer to the challenge sent with the capabilities, if the
+            // client proves to know the secret the connection is authenticated
+            // and messages checksummed with crc32c will be accepted
+            shardcache_connection_context_t *ctx = req->ctx;
+            rc = -1;
+            if (ctx->challenged && cache->auth &&
+                fbuf_used(&req->records[0]) == SHARDCACHE_MSG_NONCE_LEN)
+            {
+                uint64_t proof;
+                memcpy(&proof, fbuf_data(&req->records[0]), sizeof(proof));
+                if (proof == session_proof((char *)cache->auth, 'C',
+                                           ctx->server_nonce, ctx->client_nonce))
+                {
+                    async_read_context_session(ctx->reader_ctx, 1);
+                    rc = 0;
+                } else {
+                    SHC_WARNING("Authentication failed on connection %d", ctx->fd);
+                }
+            }
+            // the challenge can't be reused
+            ctx->challenged = 0;
+            write_status(req, rc, WRITE_STATUS_MODE_SIMPLE);
+            break;
+        }
         case SHC_HDR_STATS:
         {
             fbuf_t buf = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
@@ -690,7 +1412,7 @@ process_request(shardcache_request_t *req)
                     .l = fbuf_used(&buf)
                 };
                 if (build_message((char *)req->ctx->serv->cache->auth,
-                                  req->sig_hdr,
+                                  RESPONSE_SIG_HDR(req),
                                   SHC_HDR_RESPONSE,
                                   &record, 1, &out) == 0)
                 {
@@ -738,7 +1460,7 @@ process_request(shardcache_request_t *req)
                 .l = fbuf_used(&buf)
             };
             if (build_message((char *)req->ctx->serv->cache->auth,
-                              req->sig_hdr,
+                              RESPONSE_SIG_HDR(req),
                               SHC_HDR_INDEX_RESPONSE,
                               &record, 1, &out) == 0)
             {
@@ -779,7 +1501,7 @@ process_request(shardcache_request_t *req)
                     .l = response_len
                 };
                 if (build_message((char *)req->ctx->serv->cache->auth,
-                                  req->sig_hdr, rhdr,
+                                  RESPONSE_SIG_HDR(req), rhdr,
                                   &record, 1, &out) == 0)
                 {
                     // destroy it early ... since we still need one more copy
@@ -813,8 +1535,29 @@ shardcache_select_worker(shardcache_serving_t *serv)
     if (ATOMIC_READ(serv->leave))
         return NULL;
 
-    shardcache_worker_context_t *wrk = list_pick_value(serv->workers,
-            __sync_fetch_and_add(&serv->next_worker_index, 1)%list_count(serv->workers));
+    // pick the least loaded worker (considering both the recent busy time
+    // and the number of handled connections), starting the scan from the
+    // next index so that ties are spread among workers
+    int num_workers = list_count(serv->workers);
+    int start = __sync_fetch_and_add(&serv->next_worker_index, 1) % num_workers;
+    shardcache_worker_context_t *wrk = NULL;
+    uint64_t min_score = UINT64_MAX;
+    int i;
+    for (i = 0; i < num_workers; i++) {
+        shardcache_worker_context_t *candidate =
+            list_pick_value(serv->workers, (start + i) % num_workers);
+        uint64_t score = (ATOMIC_READ(candidate->load) + 1) *
+                         (ATOMIC_READ(candidate->numfds) + 1);
+        if (score < min_score) {
+            min_score = score;
+            wrk = candidate;
+        }
+    }
+
+    // account for the new connection right away so that a burst of
+    // new connections won't be assigned all to the same worker
+    if (wrk)
+        ATOMIC_INCREMENT(wrk->numfds);
 
     return wrk;
 }
@@ -825,8 +1568,10 @@ shardcache_request_create(shardcache_connection_context_t *ctx)
     shardcache_request_t *req = calloc(1, sizeof(shardcache_request_t));
     req->hdr = async_read_context_hdr(ctx->reader_ctx);
     req->sig_hdr = async_read_context_sig_hdr(ctx->reader_ctx);
+    req->wide = async_read_context_wide(ctx->reader_ctx);
     req->ctx = ctx;
     SPIN_INIT(&req->output_lock);
+    ATOMIC_INCREMENT(ctx->worker->pending);
 
     int i;
     for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++) {
@@ -839,8 +1584,15 @@ shardcache_request_create(shardcache_connection_context_t *ctx)
     }
 
     FBUF_STATIC_INITIALIZER_POINTER(&req->fetch_accumulator, FBUF_MAXLEN_NONE, 64, 1024, 512);
+    FBUF_STATIC_INITIALIZER_POINTER(&req->compress_accumulator, FBUF_MAXLEN_NONE, 64, 1024, 512);
     FBUF_STATIC_INITIALIZER_POINTER(&req->output, FBUF_MAXLEN_NONE, 64, 1024, 512);
 
+    // responses to tagged requests are wrapped in the same tag envelope
+    // so that the client can match them even if sent out-of-order
+    req->tagged = async_read_context_tag(ctx->reader_ctx, &req->tag);
+    if (req->tagged)
+        add_message_tag(req->tag, &req->output);
+
     return req;
 }
 
@@ -858,7 +1610,15 @@ shardcache_check_context_state(iomux_t *iomux,
         shardcache_request_t *req = shardcache_request_create(ctx);
         TAILQ_INSERT_TAIL(&ctx->requests, req, next);
         ctx->num_requests++;
-        process_request(req);
+        ctx->output_idle = 0;
+        int busy = admit_request(req);
+        if (busy) {
+            // fail fast, the client can retry later
+            ATOMIC_INCREMENT(ctx->serv->cache->cnt[busy].value);
+            write_busy(req);
+        } else {
+            process_request(req);
+        }
         iomux_set_output_callback(iomux, fd, shardcache_output_handler);
     }
     else if (UNLIKELY(state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR))
@@ -877,6 +1637,10 @@ shardcache_check_context_state(iomux_t *iomux,
 }
 
 
+// upper bound for the amount of data gathered from the completed
+// requests at the head of the queue before handing it to the mux
+#define SHARDCACHE_OUTPUT_COALESCE_MAX (1<<16)
+
 static int
 shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len, void *priv)
 {
@@ -887,8 +1651,34 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
 
     shardcache_request_t *req = TAILQ_FIRST(&ctx->requests);
 
-    if (req) {
+    if (!req) {
+        // the mux asks for more output only once it flushed
+        // what we previously returned
+        ctx->output_idle = 1;
+        iomux_unset_output_callback(iomux, fd);
+        return IOMUX_OUTPUT_MODE_FREE;
+    }
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    // gather the output of all the completed requests (plus whatever is
+    // available for the first pending untagged one) so that pipelined
+    // responses go out with a single write.
+    // Responses to untagged requests are sent in order, while the ones
+    // to tagged requests are sent as soon as they are complete.
+    // Only complete responses can be sent out-of-order, so once a partial
+    // response has been flushed nothing else is sent until it's complete.
+    fbuf_t output = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+
+    int blocked = 0; // an untagged request is still pending
+    while (req) {
         if (UNLIKELY(ATOMIC_READ(req->error))) {
+            // flush what we have collected so far, the error
+            // will be handled at the next iteration
+            if (fbuf_used(&output))
+                break;
+
             // abort the request and close the connection
             // if there was an error while fetching a remote object
             if (!iomux_close(iomux, fd)) {
@@ -898,28 +1688,77 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
             return IOMUX_OUTPUT_MODE_NONE;
         }
 
+        if (ctx->streaming && req != ctx->streaming) {
+            req = ctx->streaming;
+            continue;
+        }
+
         int done = ATOMIC_READ(req->done);
 
+        if ((!done && req->tagged) || (blocked && !req->tagged)) {
+            // either the response is not complete yet or it
+            // must be sent after a pending untagged request
+            req = TAILQ_NEXT(req, next);
+            continue;
+        }
+
         SPIN_LOCK(&req->output_lock);
-        if (fbuf_used(&req->output))
-            *len = fbuf_detach(&req->output, (char **)out, NULL);
+        if (fbuf_used(&req->output)) {
+            if (fbuf_used(&output) == 0) {
+                // avoid copying the first chunk
+                char *buf = NULL;
+                int buflen = 0;
+                int used = fbuf_detach(&req->output, &buf, &buflen);
+                fbuf_attach(&output, buf, buflen, used);
+            } else {
+                fbuf_concat(&output, &req->output);
+                fbuf_set_used(&req->output, 0);
+            }
+            if (!done)
+                ctx->streaming = req;
+        }
         SPIN_UNLOCK(&req->output_lock);
 
-        if (done) {
-            TAILQ_REMOVE(&ctx->requests, req, next);
-            ctx->num_requests--;
-            shardcache_request_destroy(req);
-            // if we have pending input data this is time
-            // to process it and move to the next request
-            int state = async_read_context_update(ctx->reader_ctx);
-            if (shardcache_check_context_state(iomux, fd, ctx, state) != 0) {
-                iomux_close(iomux, fd);
-                *len = 0;
-            }
+        if (!done) {
+            if (ctx->streaming)
+                break;
+            blocked = 1;
+            req = TAILQ_NEXT(req, next);
+            continue;
         }
-    } else {
-        iomux_unset_output_callback(iomux, fd);
+
+        if (ctx->streaming == req)
+            ctx->streaming = NULL;
+
+        TAILQ_REMOVE(&ctx->requests, req, next);
+        ctx->num_requests--;
+        shardcache_request_destroy(req);
+
+        // if we have pending input data this is time
+        // to process it and move to the next request
+        int state = async_read_context_update(ctx->reader_ctx);
+        if (shardcache_check_context_state(iomux, fd, ctx, state) != 0) {
+            fbuf_destroy(&output);
+            shardcache_connection_account_busy(ctx, &start);
+            iomux_close(iomux, fd);
+            return IOMUX_OUTPUT_MODE_FREE;
+        }
+
+        if (fbuf_used(&output) >= SHARDCACHE_OUTPUT_COALESCE_MAX)
+            break;
+
+        // restart from the head since new requests might have been queued
+        req = TAILQ_FIRST(&ctx->requests);
+        blocked = 0;
     }
+
+    if (fbuf_used(&output))
+        *len = fbuf_detach(&output, (char **)out, NULL);
+
+    fbuf_destroy(&output);
+
+    shardcache_connection_account_busy(ctx, &start);
+
     return IOMUX_OUTPUT_MODE_FREE;
 }
 
@@ -942,14 +1781,20 @@ shardcache_input_handler(iomux_t *iomux,
             return 0;
         }
 
+        struct timeval start;
+        gettimeofday(&start, NULL);
+
         async_read_context_state_t state =
             async_read_context_input_data(ctx->reader_ctx, data, len, &processed);
 
         // updating the context state might eventually push a new requeset
         // (if entirely dowloaded) to a worker
-        if (shardcache_check_context_state(iomux, fd, ctx, state) != 0) {
+        int rc = shardcache_check_context_state(iomux, fd, ctx, state);
+
+        shardcache_connection_account_busy(ctx, &start);
+
+        if (rc != 0)
             iomux_close(iomux, fd);
-        }
     }
 
     return processed;
@@ -964,6 +1809,7 @@ shardcache_eof_handler(iomux_t *iomux, int fd, void *priv)
     close(fd);
 
     if (ctx) {
+        shardcache_worker_unlink_connection(ctx);
         if (TAILQ_FIRST(&ctx->requests) != NULL) {
             ctx->closed = 1;
             gettimeofday(&ctx->in_prune_since, NULL);
@@ -987,6 +1833,17 @@ shardcache_connection_handler(iomux_t *iomux, int fd, void *priv)
                 shardcache_connection_context_create(serv, fd);
 
             ctx->worker = wrkctx;
+
+            int busy_poll = ATOMIC_READ(serv->cache->so_busy_poll);
+            if (busy_poll > 0) {
+#ifdef SO_BUSY_POLL
+                if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) != 0)
+                    SHC_WARNING("Can't set SO_BUSY_POLL on fd %d: %s", fd, strerror(errno));
+#else
+                SHC_WARNING("SO_BUSY_POLL is not supported on this platform");
+#endif
+            }
+
             if (queue_push_right(wrkctx->jobs, ctx) != 0) {
                 close(fd);
                 SHC_WARNING("Can't push the new job to the worker queue");
@@ -1000,6 +1857,124 @@ shardcache_connection_handler(iomux_t *iomux, int fd, void *priv)
 }
 
 
+// how often the workers sample their load (and eventually rebalance)
+#define SHARDCACHE_WORKER_LOAD_INTERVAL 1000000 // 1 second
+// the minimum load (permille) above which a worker tries
+// to hand connections over to a less loaded worker
+#define SHARDCACHE_WORKER_REBALANCE_THRESHOLD 500
+
+static inline int
+shardcache_connection_is_idle(shardcache_connection_context_t *ctx)
+{
+    // there are no requests being served, no pending output
+    // and no partially received messages
+    return (!ctx->closed &&
+            ctx->num_requests == 0 &&
+            ctx->output_idle &&
+            async_read_context_state(ctx->reader_ctx) == SHC_STATE_READING_NONE &&
+            async_read_context_pending(ctx->reader_ctx) == 0);
+}
+
+static void
+shardcache_worker_rebalance(shardcache_worker_context_t *wrkctx, uint64_t interval)
+{
+    shardcache_serving_t *serv = wrkctx->serv;
+    shardcache_worker_context_t *target = NULL;
+    uint64_t min_load = UINT64_MAX;
+    uint64_t load = ATOMIC_READ(wrkctx->load);
+
+    if (ATOMIC_READ(serv->leave))
+        return;
+
+    int i;
+    int num_workers = list_count(serv->workers);
+    for (i = 0; i < num_workers; i++) {
+        shardcache_worker_context_t *wrk = list_pick_value(serv->workers, i);
+        uint64_t wrk_load = ATOMIC_READ(wrk->load);
+        if (wrk != wrkctx && wrk_load < min_load) {
+            min_load = wrk_load;
+            target = wrk;
+        }
+    }
+
+    if (!target || min_load * 2 > load)
+        return;
+
+    // move the busiest connection which is idle between requests
+    // and whose load is smaller than the difference between the two
+    // workers (so that the move actually improves the balance)
+    uint64_t gap = load - min_load;
+    uint64_t max_load = 0;
+    shardcache_connection_context_t *ctx, *candidate = NULL;
+    TAILQ_FOREACH(ctx, &wrkctx->connections, worker_next) {
+        uint64_t ctx_load = (ctx->busy * 1000) / interval;
+        if (ctx_load > max_load && ctx_load < gap && shardcache_connection_is_idle(ctx)) {
+            max_load = ctx_load;
+            candidate = ctx;
+        }
+    }
+
+    if (!candidate)
+        return;
+
+    shardcache_worker_unlink_connection(candidate);
+    iomux_remove(wrkctx->iomux, candidate->fd);
+    candidate->worker = target;
+    candidate->busy = 0;
+    if (queue_push_right(target->jobs, candidate) != 0) {
+        // can't hand it over, keep serving it here
+        candidate->worker = wrkctx;
+        iomux_callbacks_t connection_callbacks = {
+            .mux_connection = NULL,
+            .mux_input = shardcache_input_handler,
+            .mux_output = NULL,
+            .mux_eof = shardcache_eof_handler,
+            .priv = candidate
+        };
+        if (!iomux_add(wrkctx->iomux, candidate->fd, &connection_callbacks)) {
+            close(candidate->fd);
+            shardcache_connection_context_destroy(candidate);
+        } else {
+            shardcache_worker_link_connection(wrkctx, candidate);
+        }
+        return;
+    }
+    ATOMIC_INCREMENT(target->numfds);
+    ATOMIC_DECREMENT(wrkctx->numfds);
+    CONDITION_SIGNAL(&target->wakeup_cond, &target->wakeup_lock);
+    SHC_DEBUG2("Connection %d handed over to a less loaded worker (%llu/%llu)",
+               candidate->fd, load, min_load);
+}
+
+static void
+shardcache_worker_sample_load(shardcache_worker_context_t *wrkctx)
+{
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, &wrkctx->last_sample, &diff);
+    uint64_t elapsed = (diff.tv_sec * 1000000) + diff.tv_usec;
+    if (elapsed < SHARDCACHE_WORKER_LOAD_INTERVAL)
+        return;
+
+    uint64_t busy = ATOMIC_READ(wrkctx->busy);
+    uint64_t busy_delta = busy - wrkctx->last_busy;
+    if (busy_delta > elapsed)
+        busy_delta = elapsed;
+
+    ATOMIC_INCREASE(wrkctx->idle, elapsed - busy_delta);
+    ATOMIC_SET(wrkctx->load, (busy_delta * 1000) / elapsed);
+
+    if (ATOMIC_READ(wrkctx->load) >= SHARDCACHE_WORKER_REBALANCE_THRESHOLD)
+        shardcache_worker_rebalance(wrkctx, elapsed);
+
+    shardcache_connection_context_t *ctx;
+    TAILQ_FOREACH(ctx, &wrkctx->connections, worker_next)
+        ctx->busy = 0;
+
+    wrkctx->last_busy = busy;
+    wrkctx->last_sample = now;
+}
+
 static void *
 worker(void *priv)
 {
@@ -1021,12 +1996,16 @@ worker(void *priv)
             if (!iomux_add(wrkctx->iomux, ctx->fd, &connection_callbacks)) {
                 close(ctx->fd);
                 shardcache_connection_context_destroy(ctx);
+            } else {
+                shardcache_worker_link_connection(wrkctx, ctx);
             }
             ctx = queue_pop_left(jobs);
         }
 
 
-        int timeout = ATOMIC_READ(wrkctx->serv->cache->iomux_run_timeout_low);
+        // in busy-poll mode just check the sockets without ever sleeping
+        int busy_poll = ATOMIC_READ(wrkctx->serv->cache->busy_poll);
+        int timeout = busy_poll ? 0 : ATOMIC_READ(wrkctx->serv->cache->iomux_run_timeout_low);
         struct timeval tv = { timeout/1e6, timeout%(int)1e6 };
         iomux_run(wrkctx->iomux, &tv);
 
@@ -1058,7 +2037,9 @@ worker(void *priv)
 
         ATOMIC_SET(wrkctx->numfds, iomux_num_fds(wrkctx->iomux));
 
-        if (iomux_isempty(wrkctx->iomux)) {
+        shardcache_worker_sample_load(wrkctx);
+
+        if (!busy_poll && iomux_isempty(wrkctx->iomux)) {
             // we don't have any filedescriptor to handle in the mux,
             // let's sit for 1 second waiting for the listener thread to wake
             // us up if new filedescriptors arrive
@@ -1163,9 +2144,18 @@ shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers)
         wrk->prune = list_create();
         list_set_free_value_callback(wrk->prune, (free_value_callback_t)shardcache_connection_context_destroy);
 
+        TAILQ_INIT(&wrk->connections);
+        gettimeofday(&wrk->last_sample, NULL);
+
         char label[64];
         snprintf(label, sizeof(label), "worker[%d].numfds", i);
         shardcache_counter_add(cache->counters, label, &wrk->numfds);
+        snprintf(label, sizeof(label), "worker[%d].busy", i);
+        shardcache_counter_add(cache->counters, label, &wrk->busy);
+        snprintf(label, sizeof(label), "worker[%d].idle", i);
+        shardcache_counter_add(cache->counters, label, &wrk->idle);
+        snprintf(label, sizeof(label), "worker[%d].pending", i);
+        shardcache_counter_add(cache->counters, label, &wrk->pending);
         /*
         snprintf(label, sizeof(label), "worker[%d].pruning", i);
         shardcache_counter_add(cache->counters, label, &wrk->pruning);
@@ -1192,20 +2182,54 @@ shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers)
     return s;
 }
 
+int
+serving_set_cpu_affinity(shardcache_serving_t *s, int *cpus, int num_cpus)
+{
+    int i;
+    int rc = 0;
+    for (i = 0; i < list_count(s->workers); i++) {
+        shardcache_worker_context_t *wrk = list_pick_value(s->workers, i);
+        if (shardcache_thread_set_affinity(wrk->thread, cpus[i % num_cpus]) != 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+void
+serving_wakeup_workers(shardcache_serving_t *s)
+{
+    int i;
+    for (i = 0; i < list_count(s->workers); i++) {
+        shardcache_worker_context_t *wrk = list_pick_value(s->workers, i);
+        CONDITION_SIGNAL(&wrk->wakeup_cond, &wrk->wakeup_lock);
+    }
+}
+
 static void
 clear_workers_list(linked_list_t *list)
 {
-    shardcache_worker_context_t *wrk = list_shift_value(list);
+    int i;
+    shardcache_worker_context_t *wrk;
 
-    int cnt = 0;
-    while (wrk) {
+    // stop all the workers before releasing any resource since
+    // they can hand connections over to each other until they exit
+    for (i = 0; i < list_count(list); i++) {
+        wrk = list_pick_value(list, i);
         ATOMIC_INCREMENT(wrk->leave);
 
         // wake up the worker if slacking
         CONDITION_SIGNAL(&wrk->wakeup_cond, &wrk->wakeup_lock);
+    }
 
+    for (i = 0; i < list_count(list); i++) {
+        wrk = list_pick_value(list, i);
         pthread_join(wrk->thread, NULL);
+    }
+
+    wrk = list_shift_value(list);
 
+    int cnt = 0;
+    while (wrk) {
         queue_destroy(wrk->jobs);
 
         MUTEX_DESTROY(&wrk->wakeup_lock);
@@ -1229,6 +2253,12 @@ clear_workers_list(linked_list_t *list)
         char label[64];
         snprintf(label, sizeof(label), "worker[%d].numfds", cnt);
         shardcache_counter_remove(wrk->serv->cache->counters, label);
+        snprintf(label, sizeof(label), "worker[%d].busy", cnt);
+        shardcache_counter_remove(wrk->serv->cache->counters, label);
+        snprintf(label, sizeof(label), "worker[%d].idle", cnt);
+        shardcache_counter_remove(wrk->serv->cache->counters, label);
+        snprintf(label, sizeof(label), "worker[%d].pending", cnt);
+        shardcache_counter_remove(wrk->serv->cache->counters, label);
         //snprintf(label, sizeof(label), "worker[%d].pruning", cnt);
         //shardcache_counter_remove(wrk->serv->cache->counters, label);
         cnt++;
@@ -11,6 +11,12 @@ shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers);
 
 void stop_serving(shardcache_serving_t *s);
 
+// pin the worker i to cpus[i % num_cpus]
+int serving_set_cpu_affinity(shardcache_serving_t *s, int *cpus, int num_cpus);
+
+// wake up the workers waiting for new connections
+void serving_wakeup_workers(shardcache_serving_t *s);
+
 #endif
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
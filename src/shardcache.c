@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -13,12 +15,17 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "shardcache.h"
 #include "shardcache_internal.h"
 #include "arc_ops.h"
 #include "connections.h"
 #include "messaging.h"
+#include "crc32c.h"
 #include "shardcache_replica.h"
 
 const char *LIBSHARDCACHE_VERSION = "1.0";
@@ -27,6 +34,82 @@ extern int shardcache_log_initialized;
 extern unsigned int shardcache_loglevel;
 
 
+// build the topology for a copy of the given nodes
+static shardcache_topology_t *
+shardcache_topology_create(shardcache_t *cache, shardcache_node_t **nodes, int num_nodes)
+{
+    shardcache_topology_t *topology = calloc(1, sizeof(shardcache_topology_t));
+    topology->shards = malloc(sizeof(shardcache_node_t *) * num_nodes);
+    topology->num_shards = num_nodes;
+
+    char *labels[num_nodes];
+    int weights[num_nodes];
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        labels[i] = shardcache_node_get_label(nodes[i]);
+        weights[i] = shardcache_node_get_weight(nodes[i]);
+        int num_replicas = shardcache_node_num_addresses(nodes[i]);
+        char *addresses[num_replicas];
+        shardcache_node_get_all_addresses(nodes[i], addresses, num_replicas);
+        topology->shards[i] = shardcache_node_create(labels[i], addresses, num_replicas);
+        shardcache_node_set_weight(topology->shards[i], weights[i]);
+    }
+    topology->continuum = continuum_create(labels, weights, num_nodes, cache->me,
+                                           ATOMIC_READ(cache->bounded_load));
+    return topology;
+}
+
+static void
+shardcache_topology_destroy(shardcache_topology_t *topology)
+{
+    continuum_destroy(topology->continuum);
+    shardcache_free_nodes(topology->shards, topology->num_shards);
+    free(topology);
+}
+
+int
+shardcache_topology_enter(shardcache_t *cache)
+{
+    for (;;) {
+        int epoch = ATOMIC_READ(cache->topology_epoch);
+        ATOMIC_INCREMENT(cache->topology_readers[epoch & 1]);
+        // if the epoch changed in the meanwhile the topology
+        // which is going to be read might be already released
+        if (ATOMIC_READ(cache->topology_epoch) == epoch)
+            return epoch;
+        ATOMIC_DECREMENT(cache->topology_readers[epoch & 1]);
+    }
+}
+
+void
+shardcache_topology_exit(shardcache_t *cache, int epoch)
+{
+    ATOMIC_DECREMENT(cache->topology_readers[epoch & 1]);
+}
+
+// replace the topology at 'ptr' (either cache->topology or cache->migration)
+// and release the old one once no reader can be using it anymore
+// (each replacement starts a new epoch, see shardcache_topology_enter()).
+// NOTE: must be called with the migration_lock held
+static void
+shardcache_publish_topology(shardcache_t *cache,
+                            shardcache_topology_t **ptr,
+                            shardcache_topology_t *topology)
+{
+    shardcache_topology_t *old = ATOMIC_READ(*ptr);
+    ATOMIC_SET(*ptr, topology);
+
+    // the readers entering from now on get the new epoch (and can only find
+    // the new topology), those of the previous one are waited for
+    int epoch = ATOMIC_READ(cache->topology_epoch);
+    ATOMIC_INCREMENT(cache->topology_epoch);
+    while (ATOMIC_READ(cache->topology_readers[epoch & 1]))
+        usleep(10);
+
+    if (old)
+        shardcache_topology_destroy(old);
+}
+
 static int
 shardcache_test_ownership_internal(shardcache_t *cache,
                                    void *key,
@@ -35,45 +118,118 @@ shardcache_test_ownership_internal(shardcache_t *cache,
                                    size_t *len,
                                    int  migration)
 {
-    const char *node_name;
-    size_t name_len = 0;
-
     if (len && *len == 0)
         return -1;
 
-    if (cache->num_shards == 1)
-        return 1;
-
-    SPIN_LOCK(&cache->migration_lock);
-
-    chash_t *continuum = NULL;
-    if (cache->migration && cache->migration_done) { 
+    // the first one noticing that the migration is complete ends it
+    if (ATOMIC_READ(cache->migration_done) && ATOMIC_CAS(cache->migration_done, 1, 0))
         shardcache_migration_end(cache);
-    } 
 
-    if (migration) {
-        if (cache->migration) {
-            continuum = cache->migration;
-        } else {
-            SPIN_UNLOCK(&cache->migration_lock);
-            return -1;
-        }
-    } else {
-        continuum = cache->chash;
+    int epoch = shardcache_topology_enter(cache);
+    shardcache_topology_t *topology = ATOMIC_READ(cache->topology);
+    if (topology->num_shards == 1) {
+        shardcache_topology_exit(cache, epoch);
+        return 1;
+    }
+
+    if (migration)
+        topology = ATOMIC_READ(cache->migration);
+    if (!topology) {
+        shardcache_topology_exit(cache, epoch);
+        return -1;
     }
 
-    chash_lookup(continuum, key, klen, &node_name, &name_len);
+    continuum_t *continuum = topology->continuum;
+    int index = continuum_lookup(continuum, key, klen);
     if (owner) {
+        size_t name_len = 0;
+        char *node_name = continuum_label(continuum, index, &name_len);
         if (len && name_len + 1 > *len)
             name_len = *len - 1;
-        memcpy(owner, node_name, name_len);
+        if (node_name)
+            memcpy(owner, node_name, name_len);
         owner[name_len] = 0;
+        if (len)
+            *len = name_len;
+    }
+
+    int is_me = (index == continuum_me(continuum));
+    shardcache_topology_exit(cache, epoch);
+    return is_me;
+}
+
+int
+shardcache_test_failover_ownership(shardcache_t *cache,
+                                   void *key,
+                                   size_t klen,
+                                   char *failed,
+                                   char *owner,
+                                   size_t *len)
+{
+    size_t name_len = 0;
+
+    if (!len || *len == 0)
+        return -1;
+
+    continuum_t *created = NULL;
+    SPIN_LOCK(&cache->migration_lock);
+    // the topology is replaced only while holding the lock
+    shardcache_topology_t *topology = cache->topology;
+    if (topology->num_shards < 2) {
+        SPIN_UNLOCK(&cache->migration_lock);
+        return -1;
     }
-    if (len)
-        *len = name_len;
 
+    continuum_t *continuum = ht_get(cache->failover_continuums, failed, strlen(failed), NULL);
+    if (!continuum) {
+        // the continuum is built out of a copy of the nodes without holding
+        // the lock (it may take a while in bounded-load mode)
+        int generation = cache->failover_generation;
+        int num_nodes = topology->num_shards;
+        char *labels[num_nodes];
+        int weights[num_nodes];
+        int i, n = 0;
+        for (i = 0; i < num_nodes; i++) {
+            char *label = shardcache_node_get_label(topology->shards[i]);
+            if (strcmp(label, failed) == 0)
+                continue;
+            labels[n] = strdup(label);
+            weights[n++] = shardcache_node_get_weight(topology->shards[i]);
+        }
+        SPIN_UNLOCK(&cache->migration_lock);
+
+        // the keys of a node removed from the continuum
+        // are taken over by the nodes following it
+        created = continuum_create(labels, weights, n, cache->me, ATOMIC_READ(cache->bounded_load));
+        for (i = 0; i < n; i++)
+            free(labels[i]);
+
+        SPIN_LOCK(&cache->migration_lock);
+        continuum = ht_get(cache->failover_continuums, failed, strlen(failed), NULL);
+        if (!continuum) {
+            continuum = created;
+            // if the nodes changed in the meanwhile it's used only this time
+            if (generation == cache->failover_generation) {
+                ht_set(cache->failover_continuums, failed, strlen(failed), continuum, 0);
+                created = NULL;
+            }
+        }
+    }
+    int index = continuum_lookup(continuum, key, klen);
+    int is_me = (index == continuum_me(continuum));
+    char *node_name = continuum_label(continuum, index, &name_len);
+    if (name_len + 1 > *len)
+        name_len = *len - 1;
+    if (node_name)
+        memcpy(owner, node_name, name_len);
+    owner[name_len] = 0;
+    *len = name_len;
     SPIN_UNLOCK(&cache->migration_lock);
-    return (strcmp(owner, cache->me) == 0);
+
+    if (created)
+        continuum_destroy(created);
+
+    return is_me;
 }
 
 int
@@ -98,18 +254,27 @@ shardcache_test_ownership(shardcache_t *cache,
 }
 
 int
-shardcache_get_connection_for_peer(shardcache_t *cache, char *peer)
+shardcache_get_connection_for_peer_caps(shardcache_t *cache, char *peer, uint32_t *caps)
 {
+    if (caps)
+        *caps = 0;
+
     if (!ATOMIC_READ(cache->use_persistent_connections))
         return connect_to_peer(peer, cache->tcp_timeout);
 
     // this will reuse an available filedescriptor already connected to peer
     // or create a new connection if there isn't any available
-    return connections_pool_get(cache->connections_pool, peer);
+    return connections_pool_get_caps(cache->connections_pool, peer, caps);
+}
+
+int
+shardcache_get_connection_for_peer(shardcache_t *cache, char *peer)
+{
+    return shardcache_get_connection_for_peer_caps(cache, peer, NULL);
 }
 
 void
-shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd)
+shardcache_release_connection_for_peer_caps(shardcache_t *cache, char *peer, int fd, uint32_t caps)
 {
     if (fd < 0)
         return;
@@ -119,7 +284,13 @@ shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd)
         return;
     }
     // put back the fildescriptor into the connection cache
-    connections_pool_add(cache->connections_pool, peer, fd);
+    connections_pool_add_caps(cache->connections_pool, peer, fd, caps);
+}
+
+void
+shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd)
+{
+    shardcache_release_connection_for_peer_caps(cache, peer, fd, 0);
 }
 
 static void
@@ -139,34 +310,40 @@ typedef struct {
     int is_volatile;
 } expire_key_ctx_t;
 
-typedef shardcache_key_t shardcache_evictor_job_t;
+typedef struct {
+    void *key;
+    size_t klen;
+    peer_subscribers_t *peers; // the peers to notify (NULL to notify all of them)
+    uint32_t generation;       // the subscriptions generation 'peers' refers to
+    int refcnt;                // the batches holding the job (+1 while queued)
+} shardcache_evictor_job_t;
 
 static void
 destroy_evictor_job(shardcache_evictor_job_t *job)
 {
     free(job->key);
+    free(job->peers);
     free(job);
 }
 
 static
-shardcache_evictor_job_t *create_evictor_job(void *key, size_t klen)
+shardcache_evictor_job_t *create_evictor_job(void *key, size_t klen, peer_subscribers_t *peers, uint32_t generation)
 {
-    shardcache_evictor_job_t *job = malloc(sizeof(shardcache_evictor_job_t)); 
+    shardcache_evictor_job_t *job = calloc(1, sizeof(shardcache_evictor_job_t)); 
     job->key = malloc(klen);
     memcpy(job->key, key, klen);
     job->klen = klen; 
+    job->peers = peers;
+    job->generation = generation;
+    job->refcnt = 1;
     return job;
 }
 
-static int
-evict_key(hashtable_t *table, void *value, size_t vlen, void *user)
+static inline void
+release_evictor_job(shardcache_evictor_job_t *job)
 {
-    shardcache_evictor_job_t **job = (shardcache_evictor_job_t **)user;
-    *job = (shardcache_evictor_job_t *)value;
-    // remove the value from the table and stop the iteration 
-    // and since there is no free value callback the job won't
-    // be released on removal 
-    return -2;
+    if (--job->refcnt == 0)
+        destroy_evictor_job(job);
 }
 
 static inline void
@@ -181,189 +358,675 @@ shardcache_update_size_counters(shardcache_t *cache)
 }
 
 
-static void *
-evictor(void *priv)
+// maximum number of keys notified to the peers with a single EVICT_MULTI
+#define SHARDCACHE_EVICTOR_BATCH_MAX 256
+// maximum number of batches sent to a peer and still waiting for the response
+#define SHARDCACHE_EVICTOR_PEER_INFLIGHT 4
+// maximum number of batches queued for a peer (the oldest ones are dropped)
+#define SHARDCACHE_EVICTOR_PEER_BACKLOG 64
+
+// the keys extracted from the queue at once which have to be notified to a peer
+typedef struct {
+    shardcache_evictor_job_t *jobs[SHARDCACHE_EVICTOR_BATCH_MAX];
+    int num_jobs;
+} shardcache_evictor_batch_t;
+
+typedef struct {
+    shardcache_t *cache;
+    iomux_t *iomux;
+    hashtable_t *peers;     // label -> shardcache_evictor_peer_t
+} shardcache_evictor_t;
+
+// each peer is notified on its own connection (driven by the iomux
+// of the evictor thread) so that a slow peer doesn't hold up the others
+typedef struct {
+    shardcache_evictor_t *evictor;
+    char *label;
+    int fd;                 // -1 if not connected
+    uint32_t caps;          // capabilities negotiated on the connection
+    int connecting;         // connecting and negotiating the session
+    uint32_t wanted;        // capabilities asked when negotiating
+    fbuf_t records[3];      // the response to the session request
+    int num_records;
+    async_read_ctx_t *reader;
+    linked_list_t *queue;   // batches waiting to be sent
+    hashtable_t *pending;   // the keys in the batches waiting to be sent
+    linked_list_t *sent;    // batches sent and waiting for the response
+    int responses;          // responses received for the oldest batch sent
+    struct timeval last_activity;
+    time_t retry_at;        // don't try connecting again before this time
+} shardcache_evictor_peer_t;
+
+static void
+evictor_batch_release(shardcache_evictor_batch_t *batch)
 {
-    shardcache_t *cache = (shardcache_t *)priv;
-    hashtable_t *jobs = cache->evictor_jobs;
+    int i;
+    for (i = 0; i < batch->num_jobs; i++)
+        release_evictor_job(batch->jobs[i]);
+    free(batch);
+}
 
-    connections_pool_t *connections = connections_pool_create(ATOMIC_READ(cache->tcp_timeout),
-                                                              SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
-                                                              1);
+// track the keys of a batch while it's waiting to be sent
+static void
+evictor_batch_pending(shardcache_evictor_peer_t *peer, shardcache_evictor_batch_t *batch, int pending)
+{
+    int i;
+    for (i = 0; i < batch->num_jobs; i++) {
+        shardcache_evictor_job_t *job = batch->jobs[i];
+        if (pending)
+            ht_set(peer->pending, job->key, job->klen, job, 0);
+        else
+            ht_delete(peer->pending, job->key, job->klen, NULL, NULL);
+    }
+}
 
-    while (!ATOMIC_READ(cache->quit))
-    {
+// peers supporting EVICT_MULTI get a single command for the whole batch,
+// the others get a pipelined EVICT command for each key
+static inline int
+evictor_batch_is_multi(shardcache_evictor_peer_t *peer, shardcache_evictor_batch_t *batch)
+{
+    return (batch->num_jobs > 1 && (peer->caps & SHC_CAP_MULTI_WRITE));
+}
 
-        // this will extract only the first value
-        shardcache_evictor_job_t *job = NULL;
-        ht_foreach_value(jobs, evict_key, &job);
-        if (job) {
-            char keystr[1024] = { 0 };
+static int
+evictor_peer_send(shardcache_evictor_peer_t *peer, shardcache_evictor_batch_t *batch)
+{
+    char *auth = (char *)peer->evictor->cache->auth;
+    int sig_hdr = SHC_CONNECTION_SIG_HDR(peer->caps, SHC_HDR_SIGNATURE_SIP);
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    int rc = 0;
+    int i;
 
-            if (shardcache_loglevel >= LOG_DEBUG)
-                KEY2STR(job->key, job->klen, keystr, sizeof(keystr));
+    if (evictor_batch_is_multi(peer, batch)) {
+        void *keys[SHARDCACHE_EVICTOR_BATCH_MAX];
+        size_t klens[SHARDCACHE_EVICTOR_BATCH_MAX];
+        for (i = 0; i < batch->num_jobs; i++) {
+            keys[i] = batch->jobs[i]->key;
+            klens[i] = batch->jobs[i]->klen;
+        }
+        fbuf_t keys_buf = FBUF_STATIC_INITIALIZER;
+        pack_multi_keys(keys, klens, batch->num_jobs, &keys_buf);
+        shardcache_record_t record = {
+            .v = fbuf_data(&keys_buf),
+            .l = fbuf_used(&keys_buf)
+        };
+        rc = build_message(auth, sig_hdr, SHC_HDR_EVICT_MULTI, &record, 1, &msg);
+        fbuf_destroy(&keys_buf);
+    } else {
+        for (i = 0; i < batch->num_jobs && rc == 0; i++) {
+            shardcache_record_t record = {
+                .v = batch->jobs[i]->key,
+                .l = batch->jobs[i]->klen
+            };
+            rc = build_message(auth, sig_hdr, SHC_HDR_EVICT, &record, 1, &msg);
+        }
+    }
 
-            SHC_DEBUG2("Eviction job for key '%s' started", keystr);
+    if (rc == 0)
+        iomux_write(peer->evictor->iomux, peer->fd, (unsigned char *)fbuf_data(&msg), fbuf_used(&msg), 1);
+    fbuf_destroy(&msg);
+    return rc;
+}
 
-            int i;
-            for (i = 0; i < cache->num_shards; i++) {
-                char *peer = shardcache_node_get_label(cache->shards[i]);
-                if (strcmp(peer, cache->me) != 0) {
-                    SHC_DEBUG3("Sending Eviction command to %s", peer);
-                    int rindex = random()%shardcache_node_num_addresses(cache->shards[i]);
-                    char *addr = shardcache_node_get_address_at_index(cache->shards[i], rindex);
-                    int fd = connections_pool_get(connections, addr);
-                    if (fd < 0)
-                        break;
+// send the queued batches (as many as the pipeline allows)
+static void
+evictor_peer_flush(shardcache_evictor_peer_t *peer)
+{
+    while (peer->fd >= 0 && !peer->connecting && list_count(peer->sent) < SHARDCACHE_EVICTOR_PEER_INFLIGHT) {
+        shardcache_evictor_batch_t *batch = list_shift_value(peer->queue);
+        if (!batch)
+            break;
+
+        if (!list_count(peer->sent))
+            gettimeofday(&peer->last_activity, NULL);
+
+        evictor_batch_pending(peer, batch, 0);
+        list_push_value(peer->sent, batch);
+
+        SHC_DEBUG3("Sending eviction command for %d keys to %s", batch->num_jobs, peer->label);
+        if (evictor_peer_send(peer, batch) != 0) {
+            SHC_WARNING("Can't send the eviction command to peer %s", peer->label);
+            // the batches already sent will be queued again
+            iomux_close(peer->evictor->iomux, peer->fd);
+            break;
+        }
+    }
+}
 
-                    int retries = 0;
-                    for (;;) {
-                        int flags = fcntl(fd, F_GETFL, 0);
-                        if (flags == -1) {
-                            close(fd);
-                            fd = connections_pool_get(connections, addr);
-                            if (fd < 0)
-                                break;
-                            continue;
-                        }
+static void
+evictor_peer_handshake_clear(shardcache_evictor_peer_t *peer)
+{
+    int i;
+    for (i = 0; i < 3; i++)
+        fbuf_clear(&peer->records[i]);
+    peer->num_records = 0;
+}
 
-                        flags |= O_NONBLOCK;
-                        fcntl(fd, F_SETFL, flags);
+// handle the response to the session request sent when connecting
+// NOTE: the signing capabilities are not asked for, so the
+//       connection never needs to be authenticated
+static int
+evictor_peer_handshake(shardcache_evictor_peer_t *peer, void *data, size_t len, int idx)
+{
+    if (idx >= 0) {
+        if (idx < 3)
+            fbuf_add_binary(&peer->records[idx], data, len);
+        if (idx >= peer->num_records)
+            peer->num_records = idx + 1;
+        return 0;
+    }
 
-                        int rb = 0;
-                        do {
-                            char discard[1<<16];
-                            rb = read(fd, &discard, sizeof(discard));
-                        } while (rb > 0);
+    if (idx != -1)
+        return 0;
 
-                        if (rb == 0 || (rb == -1 && errno != EINTR && errno != EAGAIN)) {
-                            close(fd);
-                            fd = connections_pool_get(connections, addr);
-                            if (fd < 0)
-                                break;
-                            if (retries++ < 5)
-                                continue;
-                        }
-                        flags &= ~O_NONBLOCK;
-                        fcntl(fd, F_SETFL, flags);
-                        break;
-                    }
+    fbuf_t *records[3] = { &peer->records[0], &peer->records[1], &peer->records[2] };
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    uint32_t caps = 0;
+    int rc = check_peer_session_response(peer->label, (char *)peer->evictor->cache->auth,
+                                         peer->wanted, 0, async_read_context_hdr(peer->reader),
+                                         records, peer->num_records, &caps, &msg);
+    fbuf_destroy(&msg);
+    evictor_peer_handshake_clear(peer);
+    if (rc != 0) {
+        SHC_WARNING("Evictor can't open a session with peer %s", peer->label);
+        return -1;
+    }
 
-                    int rc = evict_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, job->key, job->klen, fd, 0);
-                    if (rc == 0) {
-                        connections_pool_add(connections, addr, fd);
-                    } else {
-                        SHC_WARNING("evict_from_peer return %d for peer %s", rc, peer);
-                        close(fd);
-                    }
-                }
-            }
+    peer->caps = caps;
+    peer->connecting = 0;
+    return 0;
+}
 
-            SHC_DEBUG2("Eviction job for key '%s' completed", keystr);
-            destroy_evictor_job(job);
-        }
+static int
+evictor_peer_read_cb(void *data, size_t len, int idx, void *priv)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
 
-        if (!ht_count(jobs)) {
-            // if we have no more jobs to handle let's sleep a bit
-            struct timeval now;
-            int rc = 0;
-            rc = gettimeofday(&now, NULL);
-            if (rc == 0) {
-                struct timespec abstime = { now.tv_sec + 1, now.tv_usec * 1000 };
-                MUTEX_LOCK(&cache->evictor_lock);
-                pthread_cond_timedwait(&cache->evictor_cond, &cache->evictor_lock, &abstime);
-                MUTEX_UNLOCK(&cache->evictor_lock);
-            } else {
-                // TODO - Error messsages
-            }
-        }
-        shardcache_update_size_counters(cache);
+    if (peer->connecting)
+        return evictor_peer_handshake(peer, data, len, idx);
+
+    // only the completion of the responses matters
+    // (errors are handled by closing the connection)
+    if (idx != -1)
+        return 0;
+
+    shardcache_evictor_batch_t *batch = list_pick_value(peer->sent, 0);
+    if (!batch) {
+        SHC_WARNING("Unexpected response received from peer %s by the evictor", peer->label);
+        return -1;
     }
-    connections_pool_destroy(connections);
-    return NULL;
+
+    int expected = evictor_batch_is_multi(peer, batch) ? 1 : batch->num_jobs;
+    if (++peer->responses == expected) {
+        list_shift_value(peer->sent);
+        peer->responses = 0;
+        evictor_batch_release(batch);
+        peer_breaker_success(peer_breakers_get(peer->evictor->cache->peer_breakers, peer->label));
+    }
+    return 0;
 }
 
-static void
-destroy_volatile(volatile_object_t *obj)
+static int
+evictor_peer_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
 {
-    if (obj->data)
-        free(obj->data);
-    free(obj);
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+
+    gettimeofday(&peer->last_activity, NULL);
+
+    int processed = 0;
+    async_read_context_state_t state = async_read_context_input_data(peer->reader, data, len, &processed);
+    // there might be more (pipelined) responses in the buffer
+    while (state == SHC_STATE_READING_DONE && async_read_context_pending(peer->reader))
+        state = async_read_context_update(peer->reader);
+
+    if (state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR) {
+        SHC_WARNING("Bad response received from peer %s by the evictor", peer->label);
+        iomux_close(iomux, fd);
+        return len;
+    }
+
+    // there is room for more batches in the pipeline
+    evictor_peer_flush(peer);
+
+    return (peer->fd == fd) ? processed : len;
 }
 
 static void
-shardcache_expire_key_cb(iomux_t *iomux, void *priv)
+evictor_peer_timeout(iomux_t *iomux, int fd, void *priv)
 {
-    expire_key_ctx_t *ctx = (expire_key_ctx_t *)priv;
-    void *ptr = NULL;
-    if (ctx->is_volatile) {
-        ht_delete(ctx->cache->volatile_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
-
-        free(ptr);
-        ht_delete(ctx->cache->volatile_storage, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (ptr) {
-            volatile_object_t *prev = (volatile_object_t *)ptr;
-            ATOMIC_DECREASE(ctx->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                            prev->dlen);
-            destroy_volatile(prev);
-        }
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+    int tcp_timeout = global_tcp_timeout(-1);
+    struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+
+    // idle connections are kept open, a connection is
+    // considered stuck only if responses are still expected
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, &peer->last_activity, &diff);
+
+    if ((list_count(peer->sent) || peer->connecting) && timercmp(&diff, &maxwait, >)) {
+        SHC_WARNING("Timeout while waiting for the eviction responses from %s (timeout: %d milliseconds)",
+                    peer->label, tcp_timeout);
+        iomux_close(iomux, fd);
     } else {
-        ht_delete(ctx->cache->cache_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
-        free(ptr);
+        iomux_set_timeout(iomux, fd, &maxwait);
     }
-    ATOMIC_INCREMENT(ctx->cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
-    arc_remove(ctx->cache->arc, (const void *)ctx->item.key, ctx->item.klen);
 }
 
-typedef struct {
-    int cmd;
-#define SHARDACHE_EXPIRE_SCHEDULE 1
-#define SHARDACHE_EXPIRE_UNSCHEDULE 2
-    void *key;
-    size_t klen;
-    time_t expire;
-    int is_volatile;
-} shardcache_expire_job_t;
+// the batches not acknowledged yet are queued again (in order)
+// and will be sent once the peer is connected again
+// (evicting a key twice is harmless)
+static void
+evictor_peer_eof(iomux_t *iomux, int fd, void *priv)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+    shardcache_t *cache = peer->evictor->cache;
+
+    if (peer->connecting) {
+        SHC_WARNING("Evictor can't connect to peer %s", peer->label);
+        peer_breaker_failure(peer_breakers_get(cache->peer_breakers, peer->label));
+        peer->retry_at = time(NULL) + 1;
+    } else if (list_count(peer->sent)) {
+        SHC_WARNING("Connection to peer %s closed by the evictor with %d commands pending",
+                    peer->label, list_count(peer->sent));
+        peer_breaker_failure(peer_breakers_get(cache->peer_breakers, peer->label));
+        peer->retry_at = time(NULL) + 1;
+    }
+
+    shardcache_evictor_batch_t *batch = list_pop_value(peer->sent);
+    while (batch) {
+        evictor_batch_pending(peer, batch, 1);
+        list_unshift_value(peer->queue, batch);
+        batch = list_pop_value(peer->sent);
+    }
+    peer->responses = 0;
+
+    close(fd);
+    peer->fd = -1;
+    peer->caps = 0;
+    peer->connecting = 0;
+    evictor_peer_handshake_clear(peer);
+    if (peer->reader) {
+        async_read_context_destroy(peer->reader);
+        peer->reader = NULL;
+    }
+}
 
 static void
-shardcache_expire_context_destroy(expire_key_ctx_t *ctx)
+evictor_peer_drop(shardcache_evictor_peer_t *peer)
 {
-    free(ctx->item.key);
-    free(ctx);
+    shardcache_evictor_batch_t *batch = list_shift_value(peer->queue);
+    while (batch) {
+        evictor_batch_release(batch);
+        batch = list_shift_value(peer->queue);
+    }
+    ht_clear(peer->pending);
 }
 
-void *
-shardcache_expire_keys(void *priv)
+// start connecting to the peer without blocking the evictor thread,
+// the session is negotiated by the mux callbacks and the queued batches
+// are sent once it's open. Peers whose circuit is open are skipped and
+// failed attempts are not retried for a second
+static int
+evictor_peer_connect(shardcache_evictor_peer_t *peer)
 {
-    shardcache_t *cache = (shardcache_t *)priv;
-    while (!ATOMIC_READ(cache->quit))
-    {
-        shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
-        while (job) {
-            if (job->cmd == SHARDACHE_EXPIRE_UNSCHEDULE) {
-                void *ptr = NULL;
-                hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
+    shardcache_t *cache = peer->evictor->cache;
 
-                ht_delete(table, job->key, job->klen, &ptr, NULL);
-                if (ptr) {
-                    iomux_timeout_id_t *tid = (iomux_timeout_id_t *)ptr;
-                    iomux_unschedule(cache->expirer_mux, *tid);
-                    free(tid);
-                } else {
-                    // TODO - Error messages ?
-                }
-                free(job->key);
-                free(job);
-                job = queue_pop_left(cache->expirer_queue);
-                continue;
-            }
+    shardcache_node_t *node = shardcache_node_select(cache, peer->label);
+    if (!node) {
+        // the peer isn't part of the cluster anymore
+        evictor_peer_drop(peer);
+        return -1;
+    }
 
-            expire_key_ctx_t *ctx = calloc(1, sizeof(expire_key_ctx_t));
-            ctx->item.key = job->key;
+    peer_breaker_t *breaker = peer_breakers_get(cache->peer_breakers, peer->label);
+    if (time(NULL) < peer->retry_at || !peer_breaker_allow(breaker)) {
+        shardcache_node_destroy(node);
+        return -1;
+    }
+
+    char *addr = connections_pool_select_address(cache->connections_pool, node);
+    int in_progress = 0;
+    int fd = connect_to_peer_async(addr, &in_progress);
+    if (fd < 0) {
+        SHC_WARNING("Evictor can't connect to peer %s (%s)", peer->label, addr);
+        peer_breaker_failure(breaker);
+        peer->retry_at = time(NULL) + 1;
+        shardcache_node_destroy(node);
+        return -1;
+    }
+    shardcache_node_destroy(node);
+
+    // peers supporting EVICT_MULTI are notified with a single command
+    uint64_t nonce = 0;
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    peer->wanted = SHC_CAP_MULTI_WRITE;
+    if (build_peer_session_request((char *)cache->auth, NULL, &peer->wanted, &nonce, &msg) != 0) {
+        SHC_WARNING("Evictor can't build the session request for peer %s", peer->label);
+        fbuf_destroy(&msg);
+        close(fd);
+        return -1;
+    }
+
+    peer->reader = async_read_context_create((char *)cache->auth, evictor_peer_read_cb, peer);
+
+    iomux_callbacks_t cbs = {
+        .mux_input = evictor_peer_input,
+        .mux_timeout = evictor_peer_timeout,
+        .mux_eof = evictor_peer_eof,
+        .priv = peer
+    };
+
+    if (!peer->reader || !iomux_add(peer->evictor->iomux, fd, &cbs)) {
+        SHC_WARNING("Evictor can't handle the connection to peer %s", peer->label);
+        if (peer->reader) {
+            async_read_context_destroy(peer->reader);
+            peer->reader = NULL;
+        }
+        fbuf_destroy(&msg);
+        close(fd);
+        return -1;
+    }
+
+    peer->fd = fd;
+    peer->caps = 0;
+    peer->connecting = 1;
+    gettimeofday(&peer->last_activity, NULL);
+
+    // the session request is sent as soon as the connection is established
+    iomux_write(peer->evictor->iomux, fd, (unsigned char *)fbuf_data(&msg), fbuf_used(&msg), 1);
+    fbuf_destroy(&msg);
+
+    int tcp_timeout = global_tcp_timeout(-1);
+    struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+    iomux_set_timeout(peer->evictor->iomux, fd, &maxwait);
+    return 0;
+}
+
+static int
+evictor_peer_kick(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)value;
+    if (list_count(peer->queue)) {
+        if (peer->fd < 0)
+            evictor_peer_connect(peer);
+        evictor_peer_flush(peer);
+    }
+    return 1;
+}
+
+static void
+evictor_peer_destroy(shardcache_evictor_peer_t *peer)
+{
+    if (peer->fd >= 0) {
+        iomux_remove(peer->evictor->iomux, peer->fd);
+        close(peer->fd);
+    }
+    if (peer->reader)
+        async_read_context_destroy(peer->reader);
+
+    shardcache_evictor_batch_t *batch = list_shift_value(peer->sent);
+    while (batch) {
+        evictor_batch_release(batch);
+        batch = list_shift_value(peer->sent);
+    }
+    evictor_peer_drop(peer);
+
+    int i;
+    for (i = 0; i < 3; i++)
+        fbuf_destroy(&peer->records[i]);
+    list_destroy(peer->queue);
+    list_destroy(peer->sent);
+    ht_destroy(peer->pending);
+    free(peer->label);
+    free(peer);
+}
+
+static shardcache_evictor_peer_t *
+evictor_peer_get(shardcache_evictor_t *evictor, char *label)
+{
+    size_t llen = strlen(label);
+    shardcache_evictor_peer_t *peer = ht_get(evictor->peers, label, llen, NULL);
+    if (!peer) {
+        peer = calloc(1, sizeof(shardcache_evictor_peer_t));
+        peer->evictor = evictor;
+        peer->label = strdup(label);
+        peer->fd = -1;
+        peer->queue = list_create();
+        peer->pending = ht_create(128, 0, NULL);
+        peer->sent = list_create();
+        ht_set(evictor->peers, label, llen, peer, sizeof(shardcache_evictor_peer_t));
+    }
+    return peer;
+}
+
+// returns 1 if the peer with the given index (in the shards array) holds a copy
+// of the key (or might hold one, if the subscriptions have been reset since)
+static inline int
+evictor_job_targets(shardcache_t *cache, shardcache_evictor_job_t *job, int index)
+{
+    if (!job->peers || job->generation != peer_subscriptions_generation(cache->subscriptions))
+        return 1;
+    return peer_subscribers_check(job->peers, index);
+}
+
+// queue a key to be notified to a peer. The keys still waiting to be sent
+// to the peer are skipped and the new ones are appended to the last batch
+// queued, so the backlog is exhausted (and the oldest keys are dropped) only
+// if the peer is behind by SHARDCACHE_EVICTOR_PEER_BACKLOG full batches
+static void
+evictor_peer_queue(shardcache_evictor_peer_t *peer, shardcache_evictor_job_t *job)
+{
+    shardcache_t *cache = peer->evictor->cache;
+
+    if (ht_exists(peer->pending, job->key, job->klen))
+        return;
+
+    int num_batches = list_count(peer->queue);
+    shardcache_evictor_batch_t *batch = num_batches ? list_pick_value(peer->queue, num_batches - 1) : NULL;
+    if (!batch || batch->num_jobs == SHARDCACHE_EVICTOR_BATCH_MAX) {
+        if (num_batches >= SHARDCACHE_EVICTOR_PEER_BACKLOG) {
+            shardcache_evictor_batch_t *oldest = list_shift_value(peer->queue);
+            SHC_WARNING("Too many evictions queued for peer %s, dropping %d of them",
+                        peer->label, oldest->num_jobs);
+            ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_EVICTIONS_DROPPED].value, oldest->num_jobs);
+            evictor_batch_pending(peer, oldest, 0);
+            evictor_batch_release(oldest);
+        }
+        batch = calloc(1, sizeof(shardcache_evictor_batch_t));
+        list_push_value(peer->queue, batch);
+    }
+
+    job->refcnt++;
+    batch->jobs[batch->num_jobs++] = job;
+    ht_set(peer->pending, job->key, job->klen, job, 0);
+}
+
+// extract the pending jobs (in the order they have been queued) and
+// queue them, in batches of up to SHARDCACHE_EVICTOR_BATCH_MAX keys,
+// for each of the peers holding a copy of the keys
+static void
+evictor_dispatch(shardcache_evictor_t *evictor)
+{
+    shardcache_t *cache = evictor->cache;
+
+    while (queue_count(cache->evictor_queue)) {
+        shardcache_evictor_job_t *jobs[SHARDCACHE_EVICTOR_BATCH_MAX];
+        int num_jobs = 0;
+        while (num_jobs < SHARDCACHE_EVICTOR_BATCH_MAX) {
+            shardcache_evictor_job_t *job = queue_pop_left(cache->evictor_queue);
+            if (!job)
+                break;
+            // new evictions of the key can be queued from now on
+            if (!job->peers)
+                ht_delete(cache->evictor_jobs, job->key, job->klen, NULL, NULL);
+            jobs[num_jobs++] = job;
+        }
+
+        if (!num_jobs)
+            break;
+
+        char keystr[1024] = { 0 };
+        if (shardcache_loglevel >= LOG_DEBUG)
+            KEY2STR(jobs[0]->key, jobs[0]->klen, keystr, sizeof(keystr));
+        SHC_DEBUG2("Eviction job for %d keys ('%s' ...) queued", num_jobs, keystr);
+
+        int i, n;
+        int epoch = shardcache_topology_enter(cache);
+        shardcache_topology_t *topology = ATOMIC_READ(cache->topology);
+        for (i = 0; i < topology->num_shards; i++) {
+            char *label = shardcache_node_get_label(topology->shards[i]);
+            if (strcmp(label, cache->me) == 0)
+                continue;
+
+            shardcache_evictor_peer_t *peer = NULL;
+            for (n = 0; n < num_jobs; n++) {
+                if (!evictor_job_targets(cache, jobs[n], i))
+                    continue;
+                if (!peer)
+                    peer = evictor_peer_get(evictor, label);
+                evictor_peer_queue(peer, jobs[n]);
+            }
+        }
+        shardcache_topology_exit(cache, epoch);
+
+        // the jobs not targeting any peer are released here
+        for (n = 0; n < num_jobs; n++)
+            release_evictor_job(jobs[n]);
+    }
+}
+
+static int
+evictor_wakeup_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    return len;
+}
+
+static void *
+evictor(void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+
+    shardcache_evictor_t evictor = {
+        .cache = cache,
+        .iomux = iomux_create(0, 0),
+        .peers = ht_create(32, 0, (ht_free_item_callback_t)evictor_peer_destroy)
+    };
+
+    iomux_callbacks_t wakeup_cbs = {
+        .mux_input = evictor_wakeup_input
+    };
+    if (!iomux_add(evictor.iomux, cache->evictor_wakeup_fd[0], &wakeup_cbs))
+        SHC_WARNING("Can't add the wakeup pipe to the evictor mux");
+
+    while (!ATOMIC_READ(cache->quit))
+    {
+        evictor_dispatch(&evictor);
+
+        // start sending to all the peers with pending evictions
+        ht_foreach_value(evictor.peers, evictor_peer_kick, NULL);
+
+        // the responses are handled (and the following batches are sent)
+        // while waiting for new jobs
+        struct timeval tv = { 1, 0 };
+        iomux_run(evictor.iomux, &tv);
+
+        shardcache_update_size_counters(cache);
+    }
+
+    ht_destroy(evictor.peers);
+    iomux_remove(evictor.iomux, cache->evictor_wakeup_fd[0]);
+    iomux_destroy(evictor.iomux);
+    return NULL;
+}
+
+static void
+destroy_volatile(volatile_object_t *obj)
+{
+    if (obj->data)
+        free(obj->data);
+    free(obj);
+}
+
+static void
+shardcache_expire_key_cb(iomux_t *iomux, void *priv)
+{
+    expire_key_ctx_t *ctx = (expire_key_ctx_t *)priv;
+    void *ptr = NULL;
+    if (ctx->is_volatile) {
+        ht_delete(ctx->cache->volatile_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
+        if (!ptr)
+            return;
+
+        free(ptr);
+        ht_delete(ctx->cache->volatile_storage, ctx->item.key, ctx->item.klen, &ptr, NULL);
+        if (ptr) {
+            volatile_object_t *prev = (volatile_object_t *)ptr;
+            ATOMIC_DECREASE(ctx->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                            prev->dlen);
+            destroy_volatile(prev);
+        }
+    } else {
+        ht_delete(ctx->cache->cache_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
+        if (!ptr)
+            return;
+        free(ptr);
+
+        // copies of keys owned by other nodes which are still being read are
+        // revalidated instead (the owner sends the value only if changed).
+        // NOTE: this blocks the expirer for a roundtrip to the owner
+        if (shardcache_revalidate_copy(ctx->cache, ctx->item.key, ctx->item.klen, 1) >= 0)
+            return;
+    }
+    ATOMIC_INCREMENT(ctx->cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
+    arc_remove(ctx->cache->arc, (const void *)ctx->item.key, ctx->item.klen);
+}
+
+typedef struct {
+    int cmd;
+#define SHARDACHE_EXPIRE_SCHEDULE 1
+#define SHARDACHE_EXPIRE_UNSCHEDULE 2
+    void *key;
+    size_t klen;
+    time_t expire;
+    int is_volatile;
+} shardcache_expire_job_t;
+
+static void
+shardcache_expire_context_destroy(expire_key_ctx_t *ctx)
+{
+    free(ctx->item.key);
+    free(ctx);
+}
+
+void *
+shardcache_expire_keys(void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+    while (!ATOMIC_READ(cache->quit))
+    {
+        shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
+        while (job) {
+            if (job->cmd == SHARDACHE_EXPIRE_UNSCHEDULE) {
+                void *ptr = NULL;
+                hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
+
+                ht_delete(table, job->key, job->klen, &ptr, NULL);
+                if (ptr) {
+                    iomux_timeout_id_t *tid = (iomux_timeout_id_t *)ptr;
+                    iomux_unschedule(cache->expirer_mux, *tid);
+                    free(tid);
+                } else {
+                    // TODO - Error messages ?
+                }
+                free(job->key);
+                free(job);
+                job = queue_pop_left(cache->expirer_queue);
+                continue;
+            }
+
+            expire_key_ctx_t *ctx = calloc(1, sizeof(expire_key_ctx_t));
+            ctx->item.key = job->key;
             ctx->item.klen = job->klen;
             ctx->cache = cache;
             ctx->is_volatile = job->is_volatile;
@@ -414,7 +1077,80 @@ shardcache_expire_keys(void *priv)
 void
 shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk)
 {
-    queue_push_right(cache->async_context[ATOMIC_INCREASE(cache->async_index, 1) % cache->num_async].queue, wrk);
+    shardcache_async_io_context_t *actx =
+        &cache->async_context[ATOMIC_INCREASE(cache->async_index, 1) % cache->num_async];
+    queue_push_right(actx->queue, wrk);
+}
+
+typedef struct {
+    struct timeval timeout;
+    void (*cb)(iomux_t *iomux, void *priv);
+    void *priv;
+    iomux_timeout_free_context_cb free_ctx;
+} shardcache_async_timer_t;
+
+static void
+shardcache_schedule_async_context(shardcache_async_io_context_t *actx,
+                                  struct timeval *timeout,
+                                  void (*cb)(iomux_t *iomux, void *priv),
+                                  void *priv,
+                                  iomux_timeout_free_context_cb free_ctx)
+{
+    shardcache_async_timer_t *timer = malloc(sizeof(shardcache_async_timer_t));
+    timer->timeout = *timeout;
+    timer->cb = cb;
+    timer->priv = priv;
+    timer->free_ctx = free_ctx;
+    queue_push_right(actx->timers, timer);
+    // the timeout might be shorter than the time spent sleeping in the mux
+    char byte = 0;
+    if (write(actx->wakeup_fd[1], &byte, 1) != 1 && errno != EAGAIN)
+        SHC_WARNING("Can't wake up the async i/o thread: %s", strerror(errno));
+}
+
+void
+shardcache_schedule_async(shardcache_t *cache,
+                          struct timeval *timeout,
+                          void (*cb)(iomux_t *iomux, void *priv),
+                          void *priv,
+                          iomux_timeout_free_context_cb free_ctx)
+{
+    shardcache_async_io_context_t *actx =
+        &cache->async_context[ATOMIC_INCREASE(cache->async_index, 1) % cache->num_async];
+    shardcache_schedule_async_context(actx, timeout, cb, priv, free_ctx);
+}
+
+// run 'cb' as soon as possible in the async i/o thread driving 'iomux'
+// (used by the peer links to flush the requests queued by other threads)
+static void
+shardcache_run_on_async_mux(shardcache_t *cache,
+                            iomux_t *iomux,
+                            void (*cb)(iomux_t *iomux, void *priv),
+                            void *priv)
+{
+    struct timeval now = { 0, 0 };
+    int i;
+    for (i = 0; i < cache->num_async; i++) {
+        if (cache->async_context[i].mux == iomux) {
+            shardcache_schedule_async_context(&cache->async_context[i], &now, cb, priv, NULL);
+            return;
+        }
+    }
+}
+
+static int
+shardcache_async_wakeup_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    return len;
+}
+
+// the requests are counted when sent (either pipelined on a peer link or on
+// a dedicated connection) and until their response is over, the number of
+// connections in the async muxes doesn't tell much since the links are shared
+uint64_t
+shardcache_remote_requests(shardcache_t *cache)
+{
+    return ATOMIC_READ(cache->remote_requests);
 }
 
 typedef struct {
@@ -427,11 +1163,21 @@ shardcache_run_async(void *priv)
 {
     shardcache_run_async_arg_t *arg = (shardcache_run_async_arg_t *)priv;
     shardcache_t *cache = arg->cache;
-    iomux_t *async_mux = arg->cache->async_context[arg->index % cache->num_async].mux;
-    queue_t *async_queue = arg->cache->async_context[arg->index % cache->num_async].queue;
+    shardcache_async_io_context_t *actx = &arg->cache->async_context[arg->index % cache->num_async];
+    iomux_t *async_mux = actx->mux;
+    queue_t *async_queue = actx->queue;
     shardcache_thread_init(cache);
+
+    iomux_callbacks_t wakeup_cbs = {
+        .mux_input = shardcache_async_wakeup_input
+    };
+    if (!iomux_add(async_mux, actx->wakeup_fd[0], &wakeup_cbs))
+        SHC_WARNING("Can't add the wakeup pipe to the async i/o mux");
+
     while (!ATOMIC_READ(cache->async_quit)) {
-        int timeout = ATOMIC_READ(cache->iomux_run_timeout_low);
+        // in busy-poll mode just check the sockets without ever sleeping
+        int timeout = ATOMIC_READ(cache->busy_poll)
+                    ? 0 : ATOMIC_READ(cache->iomux_run_timeout_low);
         struct timeval tv = { timeout/1e6, timeout%(int)1e6 };
         iomux_run(async_mux, &tv);
         async_read_wrk_t *wrk = queue_pop_left(async_queue);
@@ -441,13 +1187,26 @@ shardcache_run_async(void *priv)
                      wrk->cbs.mux_eof(async_mux, wrk->fd, wrk->cbs.priv);
                  else
                      async_read_context_destroy(wrk->ctx);
+            } else {
+                int tcp_timeout = global_tcp_timeout(-1);
+                struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+                iomux_set_timeout(async_mux, wrk->fd, &maxwait);
+                if (wrk->mux_added)
+                    wrk->mux_added(async_mux, wrk->fd, wrk->cbs.priv);
             }
-            int tcp_timeout = global_tcp_timeout(-1);
-            struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
-            iomux_set_timeout(async_mux, wrk->fd, &maxwait);
             free(wrk);
             wrk = queue_pop_left(async_queue);
         }
+        shardcache_async_timer_t *timer = queue_pop_left(actx->timers);
+        while (timer) {
+            if (!iomux_schedule(async_mux, &timer->timeout, timer->cb, timer->priv, timer->free_ctx) &&
+                timer->free_ctx)
+            {
+                timer->free_ctx(timer->priv);
+            }
+            free(timer);
+            timer = queue_pop_left(actx->timers);
+        }
     }
     free(arg);
     shardcache_thread_end(cache);
@@ -465,18 +1224,31 @@ shardcache_create(char *me,
                   size_t cache_size)
 {
     int i, n;
-    size_t shard_lens[nnodes];
-    char *shard_names[nnodes];
 
     shardcache_t *cache = calloc(1, sizeof(shardcache_t));
 
     cache->evict_on_delete = 1;
+    cache->evictor_wakeup_fd[0] = cache->evictor_wakeup_fd[1] = -1;
     cache->use_persistent_connections = 1;
     cache->tcp_timeout = SHARDCACHE_TCP_TIMEOUT_DEFAULT;
     cache->expire_time = SHARDCACHE_EXPIRE_TIME_DEFAULT;
     cache->serving_look_ahead = SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT;
     cache->iomux_run_timeout_low = SHARDCACHE_IOMUX_RUN_TIMEOUT_LOW;
     cache->iomux_run_timeout_high = SHARDCACHE_IOMUX_RUN_TIMEOUT_HIGH;
+    cache->max_pending_requests = SHARDCACHE_MAX_PENDING_REQUESTS_DEFAULT;
+    cache->max_remote_requests = SHARDCACHE_MAX_REMOTE_REQUESTS_DEFAULT;
+    cache->max_storage_requests = SHARDCACHE_MAX_STORAGE_REQUESTS_DEFAULT;
+    cache->busy_poll = SHARDCACHE_BUSY_POLL_DEFAULT;
+    cache->hedged_fetches = SHARDCACHE_HEDGED_FETCHES_DEFAULT;
+    cache->breaker_failover = SHARDCACHE_BREAKER_FAILOVER_DEFAULT;
+    cache->bounded_load = SHARDCACHE_BOUNDED_LOAD_DEFAULT;
+    cache->peer_breakers = peer_breakers_create(SHARDCACHE_BREAKER_THRESHOLD_DEFAULT,
+                                                SHARDCACHE_BREAKER_COOLDOWN_DEFAULT);
+    cache->fetch_latency = 10000; // until enough fetches have been measured
+    cache->so_busy_poll = SHARDCACHE_SO_BUSY_POLL_DEFAULT;
+    cache->compression = shc_compression_supported(SHARDCACHE_COMPRESSION_DEFAULT)
+                       ? SHARDCACHE_COMPRESSION_DEFAULT
+                       : SHARDCACHE_COMPRESSION_NONE;
     if (num_async > 0)
         cache->num_async = num_async;
     else if (num_async < 0)
@@ -486,13 +1258,25 @@ shardcache_create(char *me,
 
     SPIN_INIT(&cache->migration_lock);
 
+    for (i = 0; i < SHARDCACHE_ATOMIC_LOCKS; i++)
+        MUTEX_INIT_RECURSIVE(&cache->atomic_locks[i]);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    cache->versions = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+
     if (st) {
-        if (st->version != SHARDCACHE_STORAGE_API_VERSION) {
+        if (st->version < SHARDCACHE_STORAGE_API_VERSION_MIN || st->version > SHARDCACHE_STORAGE_API_VERSION) {
             SHC_ERROR("Storage module version mismatch: %u != %u", st->version, SHARDCACHE_STORAGE_API_VERSION);
             shardcache_destroy(cache);
             return NULL;
         }
-        memcpy(&cache->storage, st, sizeof(cache->storage));
+        // older structures end before the multi-key callbacks
+        // (which are left to NULL)
+        size_t size = (st->version < 0x02)
+                    ? offsetof(shardcache_storage_t, store_multi)
+                    : sizeof(cache->storage);
+        memcpy(&cache->storage, st, size);
         cache->use_persistent_storage = 1;
     } else {
         SHC_NOTICE("No storage callbacks provided,"
@@ -509,16 +1293,11 @@ shardcache_create(char *me,
     cache->ops.store   = arc_ops_store;
 
     cache->ops.priv = cache;
-    cache->shards = malloc(sizeof(shardcache_node_t *) * nnodes);
+    cache->topology = shardcache_topology_create(cache, nodes, nnodes);
     int me_found = 0;
     int my_index = -1;
     for (i = 0; i < nnodes; i++) {
-        shard_names[i] = shardcache_node_get_label(nodes[i]);
-        shard_lens[i] = strlen(shard_names[i]);
         int num_replicas = shardcache_node_num_addresses(nodes[i]);
-        char *replicas[num_replicas];
-        shardcache_node_get_all_addresses(nodes[i], replicas, num_replicas);
-        cache->shards[i] = shardcache_node_create(shard_names[i], replicas, num_replicas);
         char *label = shardcache_node_get_label(nodes[i]);
         if (strcmp(label, me) == 0) {
             me_found = 1;
@@ -548,9 +1327,7 @@ shardcache_create(char *me,
         return NULL;
     }
 
-    cache->num_shards = nnodes;
-
-    cache->chash = chash_create((const char **)shard_names, shard_lens, cache->num_shards, 200);
+    cache->failover_continuums = ht_create(32, 0, (ht_free_item_callback_t)continuum_destroy);
 
     // we need to tell the arc subsystem how big are the cached objects (well ... at least the container struct
     // which is attached to each cached object to encapsulate its actual data and extra flags/members
@@ -592,12 +1369,20 @@ shardcache_create(char *me,
     shardcache_counter_add(cache->counters, "mfu_size", (uint64_t *)cache->arc_lists_size[1]);
     shardcache_counter_add(cache->counters, "mrug_size", (uint64_t *)cache->arc_lists_size[2]);
     shardcache_counter_add(cache->counters, "mfug_size", (uint64_t *)cache->arc_lists_size[3]);
+    shardcache_counter_add(cache->counters, "fetch_latency_p95", &cache->fetch_latency);
 
-    if (ATOMIC_READ(cache->evict_on_delete)) {
-        MUTEX_INIT(&cache->evictor_lock);
-        CONDITION_INIT(&cache->evictor_cond);
-        cache->evictor_jobs = ht_create(128, 256, NULL);
-        pthread_create(&cache->evictor_th, NULL, evictor, cache);
+    const char *breakers_counters_names[PEER_BREAKERS_NUM_COUNTERS] =
+        PEER_BREAKERS_COUNTER_LABELS_ARRAY;
+    for (i = 0; i < PEER_BREAKERS_NUM_COUNTERS; i++) {
+        shardcache_counter_add(cache->counters, breakers_counters_names[i],
+                               peer_breakers_counter(cache->peer_breakers, i));
+    }
+
+    const char *compression_counters_names[SHC_COMPRESSION_NUM_COUNTERS] =
+        SHC_COMPRESSION_COUNTER_LABELS_ARRAY;
+    for (i = 0; i < SHC_COMPRESSION_NUM_COUNTERS; i++) {
+        shardcache_counter_add(cache->counters, compression_counters_names[i],
+                               shc_compression_counter(i));
     }
 
     struct timeval tv;
@@ -609,14 +1394,46 @@ shardcache_create(char *me,
     cache->connections_pool = connections_pool_create(cache->tcp_timeout,
                                                       SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
                                                       (num_workers/2)+ 1);
+    // the latency and the load of each peer address are exported in the stats
+    connections_pool_counters(cache->connections_pool, cache->counters);
+    // negotiate wide records and compression on the connections used to fetch
+    // remote items (and authenticate them once so that fetches aren't signed)
+    connections_pool_negotiate(cache->connections_pool, (char *)cache->auth,
+                               SHC_CAP_TAGGED|SHC_CAP_CRC32C|SHC_CAP_WIDE_RECORDS|SHC_CAP_MULTI|
+                               SHC_CAP_MULTI_WRITE|SHC_CAP_ATOMIC|SHC_CAP_CONDITIONAL|
+                               shc_compression_cap(cache->compression));
+    // let the owners know who is getting a copy of their keys
+    connections_pool_identify(cache->connections_pool, cache->me);
 
     global_tcp_timeout(ATOMIC_READ(cache->tcp_timeout));
 
+    if (ATOMIC_READ(cache->evict_on_delete)) {
+        if (pipe(cache->evictor_wakeup_fd) != 0) {
+            SHC_ERROR("Can't create the wakeup pipe for the evictor thread: %s", strerror(errno));
+            shardcache_destroy(cache);
+            return NULL;
+        }
+        fcntl(cache->evictor_wakeup_fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(cache->evictor_wakeup_fd[1], F_SETFL, O_NONBLOCK);
+        cache->evictor_queue = queue_create();
+        cache->evictor_jobs = ht_create(128, 256, NULL);
+        cache->subscriptions = peer_subscriptions_create(SHARDCACHE_TRACKED_EVICTIONS_DEFAULT);
+        pthread_create(&cache->evictor_th, NULL, evictor, cache);
+    }
+
     cache->async_context = calloc(1, sizeof(shardcache_async_io_context_t) * cache->num_async);
 
     for (i = 0; i < cache->num_async; i++) {
         cache ->async_context[i].queue = queue_create();
         queue_set_bpool_size(cache->async_context[i].queue, num_workers * 1024);
+        cache->async_context[i].timers = queue_create();
+        if (pipe(cache->async_context[i].wakeup_fd) != 0) {
+            SHC_ERROR("Can't create the wakeup pipe for the async i/o thread: %s", strerror(errno));
+            shardcache_destroy(cache);
+            return NULL;
+        }
+        fcntl(cache->async_context[i].wakeup_fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(cache->async_context[i].wakeup_fd[1], F_SETFL, O_NONBLOCK);
         cache->async_context[i].mux = iomux_create(1<<13, 0);
         shardcache_run_async_arg_t *arg = malloc(sizeof(shardcache_run_async_arg_t));
         arg->cache = cache;
@@ -628,6 +1445,17 @@ shardcache_create(char *me,
         }
     }
 
+    // remote fetches are pipelined on a few persistent links to each peer
+    cache->peer_links = peer_links_create((char *)cache->auth,
+                                          SHARDCACHE_PEER_LINKS_DEFAULT,
+                                          (peer_links_dispatch_cb_t)shardcache_queue_async_read_wrk,
+                                          (peer_links_schedule_cb_t)shardcache_run_on_async_mux,
+                                          cache);
+    peer_links_negotiate(cache->peer_links,
+                         SHC_CAP_CRC32C|SHC_CAP_WIDE_RECORDS|
+                         shc_compression_cap(cache->compression));
+    peer_links_identify(cache->peer_links, cache->me);
+
 
     cache->serv = start_serving(cache, num_workers); 
 
@@ -650,7 +1478,7 @@ shardcache_create(char *me,
     // NOTE: this needs to happen after the cache has been fully initialized
     for (i = 0; i < nnodes; i++) {
         if (shardcache_node_num_addresses(nodes[i]) > 1 && my_index >= 0)
-            cache->replica = shardcache_replica_create(cache, cache->shards[i], my_index, NULL);
+            cache->replica = shardcache_replica_create(cache, cache->topology->shards[i], my_index, NULL);
     }
     return cache;
 }
@@ -693,29 +1521,56 @@ shardcache_destroy(shardcache_t *cache)
                 }
                 queue_destroy(cache->async_context[i].queue);
             }
+            if (cache->async_context[i].timers) {
+                shardcache_async_timer_t *timer = queue_pop_left(cache->async_context[i].timers);
+                while (timer) {
+                    if (timer->free_ctx)
+                        timer->free_ctx(timer->priv);
+                    free(timer);
+                    timer = queue_pop_left(cache->async_context[i].timers);
+                }
+                queue_destroy(cache->async_context[i].timers);
+            }
             if (cache->async_context[i].mux)
                 iomux_destroy(cache->async_context[i].mux);
+            if (cache->async_context[i].wakeup_fd[0] > 0) {
+                close(cache->async_context[i].wakeup_fd[0]);
+                close(cache->async_context[i].wakeup_fd[1]);
+            }
         }
         free(cache->async_context);
     }
 
-    if (ATOMIC_READ(cache->evict_on_delete) && cache->evictor_jobs)
+    // NOTE : the links have been already torn down by the async i/o threads
+    if (cache->peer_links)
+        peer_links_destroy(cache->peer_links);
+
+    if (cache->evictor_jobs)
     {
         SHC_DEBUG2("Stopping evictor thread");
+        char byte = 0;
+        if (write(cache->evictor_wakeup_fd[1], &byte, 1) != 1)
+            SHC_WARNING("Can't wake up the evictor thread: %s", strerror(errno));
         pthread_join(cache->evictor_th, NULL);
-        MUTEX_DESTROY(&cache->evictor_lock);
-        CONDITION_DESTROY(&cache->evictor_cond);
-        ht_set_free_item_callback(cache->evictor_jobs,
-                (ht_free_item_callback_t)destroy_evictor_job);
+        // the jobs still queued are owned by the queue (not by the table)
+        queue_set_free_value_callback(cache->evictor_queue,
+                (queue_free_value_callback_t)destroy_evictor_job);
+        queue_destroy(cache->evictor_queue);
         ht_destroy(cache->evictor_jobs);
         SHC_DEBUG2("Evictor thread stopped");
     }
 
-    SPIN_LOCK(&cache->migration_lock);
-    if (cache->migration) {
-        shardcache_migration_abort(cache);    
+    if (cache->subscriptions)
+        peer_subscriptions_destroy(cache->subscriptions);
+
+    if (cache->evictor_wakeup_fd[0] >= 0) {
+        close(cache->evictor_wakeup_fd[0]);
+        close(cache->evictor_wakeup_fd[1]);
     }
-    SPIN_UNLOCK(&cache->migration_lock);
+
+    // NOTE: the abort takes the migration_lock
+    if (ATOMIC_READ(cache->migration))
+        shardcache_migration_abort(cache);
     SPIN_DESTROY(&cache->migration_lock);
 
     if (cache->expirer_th) {
@@ -735,6 +1590,17 @@ shardcache_destroy(shardcache_t *cache)
         shardcache_counter_remove(cache->counters, "mfu_size");
         shardcache_counter_remove(cache->counters, "mrug_size");
         shardcache_counter_remove(cache->counters, "mfug_size");
+        shardcache_counter_remove(cache->counters, "fetch_latency_p95");
+        const char *breakers_counters_names[PEER_BREAKERS_NUM_COUNTERS] =
+            PEER_BREAKERS_COUNTER_LABELS_ARRAY;
+        for (i = 0; i < PEER_BREAKERS_NUM_COUNTERS; i++)
+            shardcache_counter_remove(cache->counters, breakers_counters_names[i]);
+        if (cache->connections_pool)
+            connections_pool_counters(cache->connections_pool, NULL);
+        const char *compression_counters_names[SHC_COMPRESSION_NUM_COUNTERS] =
+            SHC_COMPRESSION_COUNTER_LABELS_ARRAY;
+        for (i = 0; i < SHC_COMPRESSION_NUM_COUNTERS; i++)
+            shardcache_counter_remove(cache->counters, compression_counters_names[i]);
         shardcache_release_counters(cache->counters);
     }
 
@@ -747,8 +1613,11 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->arc)
         arc_destroy(cache->arc);
 
-    if (cache->chash)
-        chash_free(cache->chash);
+    if (cache->topology)
+        shardcache_topology_destroy(cache->topology);
+
+    if (cache->failover_continuums)
+        ht_destroy(cache->failover_continuums);
 
     if (cache->expirer_mux)
         iomux_destroy(cache->expirer_mux);
@@ -775,12 +1644,16 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->addr)
         free(cache->addr);
 
-    if (cache->shards)
-        shardcache_free_nodes(cache->shards, cache->num_shards);
 
     if (cache->connections_pool)
         connections_pool_destroy(cache->connections_pool);
 
+    if (cache->peer_breakers)
+        peer_breakers_destroy(cache->peer_breakers);
+
+    for (i = 0; i < SHARDCACHE_ATOMIC_LOCKS; i++)
+        MUTEX_DESTROY(&cache->atomic_locks[i]);
+
     free(cache);
     SHC_DEBUG("Shardcache node stopped");
 }
@@ -922,11 +1795,17 @@ shardcache_get_offset_async(shardcache_t *cache,
             cache->expire_time > 0 && obj_expiration < time(NULL)))
         {
             MUTEX_UNLOCK(&obj->lock);
-            arc_drop_resource(cache->arc, res);
             free(data);
+            // a copy still valid for its owner is kept
+            if (shardcache_revalidate_copy(cache, key, klen, 0) >= 0) {
+                arc_release_resource(cache->arc, res);
+                return shardcache_get_offset_async(cache, key, klen, offset, length, cb, priv);
+            }
+            arc_drop_resource(cache->arc, res);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
             return shardcache_get_offset_async(cache, key, klen, offset, length, cb, priv);
         } else {
+            COBJ_SET_FLAG(obj, COBJ_FLAG_READ);
             cb(key, klen, data, dlen, dlen, &obj->ts, priv);
             MUTEX_UNLOCK(&obj->lock);
             arc_release_resource(cache->arc, res);
@@ -1083,11 +1962,17 @@ shardcache_get_async(shardcache_t *cache,
                      cache->expire_time > 0 && obj_expiration < time(NULL)))
         {
             MUTEX_UNLOCK(&obj->lock);
+            // a copy still valid for its owner is kept
+            if (shardcache_revalidate_copy(cache, key, klen, 0) >= 0) {
+                arc_release_resource(cache->arc, res);
+                return shardcache_get_async(cache, key, klen, cb, priv);
+            }
             arc_drop_resource(cache->arc, res);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
             return shardcache_get_async(cache, key, klen, cb, priv);
 
         } else {
+            COBJ_SET_FLAG(obj, COBJ_FLAG_READ);
             cb(key, klen, obj->data, obj->dlen, obj->dlen, &obj->ts, priv);
             MUTEX_UNLOCK(&obj->lock);
             arc_release_resource(cache->arc, res);
@@ -1112,6 +1997,20 @@ shardcache_get_async(shardcache_t *cache,
     return 0;
 }
 
+int
+shardcache_get_async_local(shardcache_t *cache,
+                           void *key,
+                           size_t klen,
+                           shardcache_get_async_callback_t cb,
+                           void *priv)
+{
+    // the key is loaded (if needed) by this thread while getting it
+    arc_ops_load_locally(1);
+    int rc = shardcache_get_async(cache, key, klen, cb, priv);
+    arc_ops_load_locally(0);
+    return rc;
+}
+
 typedef struct {
     pthread_mutex_t lock;
     pthread_cond_t cond;
@@ -1231,10 +2130,365 @@ shardcache_get(shardcache_t *cache,
     return NULL;
 }
 
-size_t
-shardcache_head(shardcache_t *cache,
-                void *key,
-                size_t len,
+// notify the value of a key if it's already cached (without
+// triggering a fetch), returns -1 if the key is not cached
+static int
+shardcache_get_multi_cached(shardcache_t *cache,
+                            void *key,
+                            size_t klen,
+                            int index,
+                            shardcache_get_multi_callback_t cb,
+                            void *priv)
+{
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_cached(cache->arc, key, klen, &obj_ptr);
+    if (!res)
+        return -1;
+
+    cached_object_t *obj = (cached_object_t *)obj_ptr;
+    MUTEX_LOCK(&obj->lock);
+    int hit = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+               !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
+
+    if (hit && cache->lazy_expiration && cache->expire_time > 0 &&
+        !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) &&
+        obj->ts.tv_sec + cache->expire_time < time(NULL))
+    {
+        // expired, it will be fetched again
+        hit = 0;
+    }
+
+    if (hit) {
+        COBJ_SET_FLAG(obj, COBJ_FLAG_READ);
+        cb(key, klen, index, obj->data, obj->dlen, priv);
+    }
+
+    MUTEX_UNLOCK(&obj->lock);
+    arc_release_resource(cache->arc, res);
+    return hit ? 0 : -1;
+}
+
+// keep a value obtained by shardcache_get_multi_async() or by
+// shardcache_get_if_modified() in the cache as if it had been fetched through
+// the arc (the copies of the keys owned by other nodes are kept with the same
+// probability applied by arc_ops_fetch()). 'version' is the one given by the
+// owner (0 if not known)
+static void
+shardcache_load_value(shardcache_t *cache,
+                      void *key,
+                      size_t klen,
+                      void *data,
+                      size_t len,
+                      uint64_t version,
+                      int owned)
+{
+    if (!data || !len)
+        return;
+
+    if (!owned && !cache->force_caching && random() % 10 != 0)
+        return;
+
+    // don't override an object being fetched (or loaded) in the meanwhile
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_cached(cache->arc, key, klen, &obj_ptr);
+    if (res) {
+        arc_release_resource(cache->arc, res);
+        return;
+    }
+
+    if (arc_load(cache->arc, key, klen, data, len) == -1)
+        return;
+
+    res = arc_lookup_cached(cache->arc, key, klen, &obj_ptr);
+    if (!res)
+        return;
+
+    cached_object_t *obj = (cached_object_t *)obj_ptr;
+    MUTEX_LOCK(&obj->lock);
+    gettimeofday(&obj->ts, NULL);
+    obj->version = version;
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+    MUTEX_UNLOCK(&obj->lock);
+    arc_release_resource(cache->arc, res);
+
+    if (cache->expire_time > 0 && !cache->lazy_expiration)
+        shardcache_schedule_expiration(cache, key, klen, cache->expire_time, 0);
+
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+}
+
+// keys of a shardcache_get_multi_async() call owned by the same node
+typedef struct {
+    shardcache_t *cache;
+    char *label; // the node owning the keys
+    char *peer;  // the address of the node the keys are requested to
+    void **keys;
+    size_t *klens;
+    int *indexes; // the index of each key in the array provided by the caller
+    char *notified;
+    int num_keys;
+    int fd;
+    uint32_t caps;
+    shardcache_get_multi_callback_t cb;
+    void *priv;
+} shardcache_get_multi_batch_t;
+
+static shardcache_get_multi_batch_t *
+shardcache_get_multi_batch_create(shardcache_t *cache,
+                                  char *label,
+                                  char *peer,
+                                  shardcache_get_multi_callback_t cb,
+                                  void *priv)
+{
+    shardcache_get_multi_batch_t *batch = calloc(1, sizeof(shardcache_get_multi_batch_t));
+    batch->cache = cache;
+    batch->label = label ? strdup(label) : NULL;
+    batch->peer = peer ? strdup(peer) : NULL;
+    batch->fd = -1;
+    batch->cb = cb;
+    batch->priv = priv;
+    return batch;
+}
+
+static void
+shardcache_get_multi_batch_add(shardcache_get_multi_batch_t *batch,
+                               void *key,
+                               size_t klen,
+                               int index)
+{
+    int n = batch->num_keys + 1;
+    batch->keys = realloc(batch->keys, n * sizeof(void *));
+    batch->klens = realloc(batch->klens, n * sizeof(size_t));
+    batch->indexes = realloc(batch->indexes, n * sizeof(int));
+    batch->keys[batch->num_keys] = key;
+    batch->klens[batch->num_keys] = klen;
+    batch->indexes[batch->num_keys] = index;
+    batch->num_keys = n;
+}
+
+// notify the keys whose value has not been received and release the batch
+static void
+shardcache_get_multi_batch_destroy(shardcache_get_multi_batch_t *batch)
+{
+    int i;
+    for (i = 0; i < batch->num_keys; i++) {
+        if (!batch->notified || !batch->notified[i])
+            batch->cb(batch->keys[i], batch->klens[i], batch->indexes[i], NULL, 0, batch->priv);
+    }
+    free(batch->keys);
+    free(batch->klens);
+    free(batch->indexes);
+    free(batch->notified);
+    free(batch->label);
+    free(batch->peer);
+    free(batch);
+}
+
+static int
+shardcache_get_multi_peer_cb(char *peer,
+                             int index,
+                             void *data,
+                             size_t len,
+                             int status,
+                             void *priv)
+{
+    shardcache_get_multi_batch_t *batch = (shardcache_get_multi_batch_t *)priv;
+    shardcache_t *cache = batch->cache;
+
+    if (index >= 0) {
+        if (!batch->notified[index]) {
+            batch->notified[index] = 1;
+            // without a session the owner doesn't know we got a copy
+            if (batch->caps || !shardcache_tracked_evictions_enabled(cache))
+                shardcache_load_value(cache, batch->keys[index], batch->klens[index], data, len, 0, 0);
+            batch->cb(batch->keys[index], batch->klens[index],
+                      batch->indexes[index], data, len, batch->priv);
+        }
+        return 0;
+    }
+
+    // the request is over
+    ATOMIC_DECREMENT(cache->remote_requests);
+    if (status == 1) {
+        shardcache_release_connection_for_peer_caps(cache, peer, batch->fd, batch->caps);
+    } else {
+        SHC_WARNING("Can't fetch multiple keys from peer %s", peer);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        if (batch->fd >= 0)
+            close(batch->fd);
+    }
+    shardcache_get_multi_batch_destroy(batch);
+    return 0;
+}
+
+// fetch all the keys of the batch with a single request to the owner
+static void
+shardcache_get_multi_from_peer(shardcache_t *cache, shardcache_get_multi_batch_t *batch)
+{
+    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value, batch->num_keys);
+    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_FETCH_REMOTE].value, batch->num_keys);
+
+    batch->notified = calloc(1, batch->num_keys);
+    batch->fd = shardcache_get_connection_for_peer_caps(cache, batch->peer, &batch->caps);
+
+    // peers not supporting GET_MULTI get a pipelined GET_ASYNC for each key
+    async_read_wrk_t *wrk = NULL;
+    ATOMIC_INCREMENT(cache->remote_requests);
+    int rc = fetch_multi_from_peer_async(batch->peer,
+                                         (char *)cache->auth,
+                                         SHC_CONNECTION_SIG_HDR(batch->caps, SHC_HDR_CSIGNATURE_SIP),
+                                         batch->keys,
+                                         batch->klens,
+                                         batch->num_keys,
+                                         (batch->caps & SHC_CAP_MULTI) ? 1 : 0,
+                                         shardcache_get_multi_peer_cb,
+                                         batch,
+                                         batch->fd,
+                                         &wrk);
+    if (rc == 0) {
+        shardcache_queue_async_read_wrk(cache, wrk);
+    } else {
+        ATOMIC_DECREMENT(cache->remote_requests);
+        SHC_WARNING("Can't send the multi-get request to peer %s", batch->peer);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        if (batch->fd >= 0)
+            close(batch->fd);
+        shardcache_get_multi_batch_destroy(batch);
+    }
+}
+
+// fetch all the keys of the batch with a single call to the storage
+static void
+shardcache_get_multi_from_storage(shardcache_t *cache, shardcache_get_multi_batch_t *batch)
+{
+    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value, batch->num_keys);
+    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_FETCH_LOCAL].value, batch->num_keys);
+
+    void **values = calloc(batch->num_keys, sizeof(void *));
+    size_t *vlens = calloc(batch->num_keys, sizeof(size_t));
+
+    ATOMIC_INCREMENT(cache->storage_requests);
+    int rc = cache->storage.fetch_multi(batch->keys, batch->klens, batch->num_keys,
+                                        values, vlens, cache->storage.priv);
+    ATOMIC_DECREMENT(cache->storage_requests);
+
+    if (rc != 0) {
+        SHC_ERROR("Fetch multi storage callback returned an error (%d)", rc);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+    }
+
+    batch->notified = calloc(1, batch->num_keys);
+    int i;
+    for (i = 0; i < batch->num_keys; i++) {
+        if (rc == 0) {
+            if (!values[i])
+                ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_NOT_FOUND].value);
+            shardcache_load_value(cache, batch->keys[i], batch->klens[i], values[i], vlens[i], 0, 1);
+            batch->cb(batch->keys[i], batch->klens[i], batch->indexes[i],
+                      values[i], values[i] ? vlens[i] : 0, batch->priv);
+            batch->notified[i] = 1;
+        }
+        free(values[i]);
+    }
+    free(values);
+    free(vlens);
+
+    shardcache_get_multi_batch_destroy(batch);
+}
+
+int
+shardcache_get_multi_async(shardcache_t *cache,
+                           void **keys,
+                           size_t *klens,
+                           int num_keys,
+                           shardcache_get_multi_callback_t cb,
+                           void *priv)
+{
+    if (!keys || !klens || num_keys <= 0 || !cb)
+        return -1;
+
+    // keys owned by other nodes (one batch per node)
+    linked_list_t *remote = list_create();
+    // storage misses for the keys owned by this node
+    shardcache_get_multi_batch_t *local = NULL;
+
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        void *key = keys[i];
+        size_t klen = klens[i];
+
+        if (!key || !klen) {
+            cb(key, klen, i, NULL, 0, priv);
+            continue;
+        }
+
+        if (shardcache_get_multi_cached(cache, key, klen, i, cb, priv) == 0) {
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+            continue;
+        }
+
+        char node_name[1024];
+        size_t node_len = sizeof(node_name);
+        memset(node_name, 0, node_len);
+        if (!shardcache_test_ownership(cache, key, klen, node_name, &node_len)) {
+            shardcache_node_t *node = shardcache_node_select(cache, node_name);
+            if (node) {
+                ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+                // one request per node, whichever of its addresses is picked
+                char *label = shardcache_node_get_label(node);
+                shardcache_get_multi_batch_t *batch = NULL;
+                int n;
+                for (n = 0; n < list_count(remote); n++) {
+                    shardcache_get_multi_batch_t *b = list_pick_value(remote, n);
+                    if (strcmp(b->label, label) == 0) {
+                        batch = b;
+                        break;
+                    }
+                }
+                if (!batch) {
+                    char *addr = connections_pool_select_address(cache->connections_pool, node);
+                    batch = shardcache_get_multi_batch_create(cache, label, addr, cb, priv);
+                    list_push_value(remote, batch);
+                }
+                shardcache_node_destroy(node);
+                shardcache_get_multi_batch_add(batch, key, klen, i);
+                continue;
+            }
+        } else if (cache->use_persistent_storage && cache->storage.fetch_multi &&
+                   !ht_exists(cache->volatile_storage, key, klen))
+        {
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+            if (!local)
+                local = shardcache_get_multi_batch_create(cache, NULL, NULL, cb, priv);
+            shardcache_get_multi_batch_add(local, key, klen, i);
+            continue;
+        }
+
+        // let the cache fetch the value as usual
+        // (volatile keys or storage not supporting fetch_multi)
+        size_t vlen = 0;
+        void *value = shardcache_get(cache, key, klen, &vlen, NULL);
+        cb(key, klen, i, value, value ? vlen : 0, priv);
+        free(value);
+    }
+
+    // the requests to the peers are sent first so that
+    // they are served while we are querying the storage
+    shardcache_get_multi_batch_t *batch;
+    while ((batch = list_shift_value(remote)))
+        shardcache_get_multi_from_peer(cache, batch);
+    list_destroy(remote);
+
+    if (local)
+        shardcache_get_multi_from_storage(cache, local);
+
+    return 0;
+}
+
+size_t
+shardcache_head(shardcache_t *cache,
+                void *key,
+                size_t len,
                 void *head,
                 size_t hlen,
                 struct timeval *timestamp)
@@ -1255,9 +2509,10 @@ typedef struct {
     shardcache_async_response_callback_t cb;
     void *priv;
     int done;
-    char *addr;
+    char *addr;    // a copy of the address of the peer
     int fd;
     shardcache_hdr_t hdr;
+    uint32_t caps; // capabilities negotiated on fd
     shardcache_t *cache;
     int error;
 } shardcache_async_command_helper_arg_t;
@@ -1273,6 +2528,7 @@ static int shardcache_async_command_helper(void *data,
     // idx == -1 means that reading finished 
     // idx == -2 means error
     // idx == -3 means the async connection can been closed
+    // idx == -4 means that the peer refused the command (instead of -1)
     // any idx >= 0 refers to the record index
 
     // XXX - works only for the first record
@@ -1300,24 +2556,41 @@ static int shardcache_async_command_helper(void *data,
         }
         arg->cb(arg->key, arg->klen, rc, arg->priv);
         arg->done = 1;
-    } else if (idx == -1) {
+    } else if (idx == -1 || idx == -4) {
         if (!arg->done)
-            arg->cb(arg->key, arg->klen, -1, arg->priv);
+            arg->cb(arg->key, arg->klen, (idx == -4) ? SHARDCACHE_PEER_BUSY : -1, arg->priv);
+        arg->done = 1;
     } else if (idx == -2) {
         arg->error = 1;
     } else if (idx == -3) {
+        ATOMIC_DECREMENT(arg->cache->remote_requests);
         if (arg->fd >= 0) {
             if (arg->error)
                 close(arg->fd);
             else
-                shardcache_release_connection_for_peer(arg->cache, arg->addr, arg->fd);
+                shardcache_release_connection_for_peer_caps(arg->cache, arg->addr, arg->fd, arg->caps);
         }
         free(arg->key);
+        free(arg->addr);
         free(arg);
     }
     return 0;
 }
 
+static int
+shardcache_async_command_read(shardcache_t *cache, shardcache_async_command_helper_arg_t *arg)
+{
+    async_read_wrk_t *wrk = NULL;
+    int rc = read_message_async(arg->fd, (char *)cache->auth, shardcache_async_command_helper, arg, &wrk);
+    if (rc != 0 || !wrk)
+        return -1;
+    // responses received on an authenticated session are checksummed
+    async_read_context_session(wrk->ctx, (arg->caps & SHC_CAP_CRC32C) ? 1 : 0);
+    ATOMIC_INCREMENT(cache->remote_requests);
+    shardcache_queue_async_read_wrk(cache, wrk);
+    return 0;
+}
+
 int
 shardcache_exists_async(shardcache_t *cache,
                         void *key,
@@ -1362,15 +2635,17 @@ shardcache_exists_async(shardcache_t *cache,
     } else {
         shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name); 
         if (!peer) {
-            SHC_ERROR("Can't find address for node %s", peer);
+            SHC_ERROR("Can't find address for node %s", node_name);
             if (cb)
                 cb(key, klen, -1, priv);
             return -1;
         }
-        char *addr = shardcache_node_get_address(peer);
-        int fd = shardcache_get_connection_for_peer(cache, addr);
+        char *addr = connections_pool_select_address(cache->connections_pool, peer);
+        uint32_t caps = 0;
+        int fd = shardcache_get_connection_for_peer_caps(cache, addr, &caps);
+        int sig_hdr = SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP);
         if (cb) {
-            rc = exists_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 0);
+            rc = exists_on_peer(addr, (char *)cache->auth, sig_hdr, key, klen, fd, 0);
             if (rc == 0) {
                 shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
                 arg->key = malloc(klen);
@@ -1379,21 +2654,29 @@ shardcache_exists_async(shardcache_t *cache,
                 arg->cb = cb;
                 arg->priv = priv;
                 arg->cache = cache;
-                arg->addr = addr;
+                arg->addr = strdup(addr);
                 arg->fd = fd;
                 arg->hdr = SHC_HDR_EXISTS;
-                async_read_wrk_t *wrk = NULL;
-                rc = read_message_async(fd, (char *)cache->auth, shardcache_async_command_helper, arg, &wrk);
-                if (rc == 0 && wrk) {
-                    shardcache_queue_async_read_wrk(cache, wrk);
+                arg->caps = caps;
+                rc = shardcache_async_command_read(cache, arg);
+                if (rc != 0) {
+                    free(arg->key);
+                    free(arg->addr);
+                    free(arg);
+                    close(fd);
+                    cb(key, klen, -1, priv);
                 }
             } else {
                 cb(key, klen, -1, priv);
             }
         } else {
-            rc = exists_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
-            shardcache_release_connection_for_peer(cache, addr, fd);
+            rc = exists_on_peer(addr, (char *)cache->auth, sig_hdr, key, klen, fd, 1);
+            if (rc == -1)
+                close(fd);
+            else
+                shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
         }
+        shardcache_node_destroy(peer);
     }
 
     return rc;
@@ -1436,38 +2719,109 @@ shardcache_touch(shardcache_t *cache, void *key, size_t klen)
     } else {
         shardcache_node_t *peer = shardcache_node_select(cache, node_name);
         if (!peer) {
-            SHC_ERROR("Can't find address for node %s", peer);
+            SHC_ERROR("Can't find address for node %s", node_name);
             return -1;
         }
-        char *addr = shardcache_node_get_address(peer);
-        int fd = shardcache_get_connection_for_peer(cache, addr);
-        int rc = touch_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd);
-        shardcache_release_connection_for_peer(cache, addr, fd);
+        char *addr = connections_pool_select_address(cache->connections_pool, peer);
+        uint32_t caps = 0;
+        int fd = shardcache_get_connection_for_peer_caps(cache, addr, &caps);
+        int rc = touch_on_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                               key, klen, fd);
+        if (rc == -1)
+            close(fd);
+        else
+            shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
+        shardcache_node_destroy(peer);
         return rc;
     }
 
     return -1;
 }
 
+// the peers holding a copy of the keys we own are known only if no copy
+// obtained before the subscriptions were last forgotten can still be around
+static int
+shardcache_subscriptions_reliable(shardcache_t *cache)
+{
+    // the instances of a node with multiple addresses serve copies of the
+    // same keys (and only the one receiving a write notifies the evictions)
+    // but none of them knows about the copies served by the others
+    if (!shardcache_tracked_evictions_enabled(cache) || cache->migration || cache->replica)
+        return 0;
+    int expire_time = ATOMIC_READ(cache->expire_time);
+    return (time(NULL) > peer_subscriptions_reset_time(cache->subscriptions) + expire_time + 1);
+}
+
+int
+shardcache_tracked_evictions_enabled(shardcache_t *cache)
+{
+    return (cache->subscriptions && ATOMIC_READ(cache->expire_time) > 0 &&
+            peer_subscriptions_max_keys(cache->subscriptions, -1) > 0);
+}
+
+void
+shardcache_subscribe(shardcache_t *cache, void *key, size_t klen, char *peer)
+{
+    if (!peer || !shardcache_tracked_evictions_enabled(cache) || cache->replica)
+        return;
+
+    // copies of the keys we don't own are tracked by their owners
+    // (the nodes have the same index in the continuum and in the shards array)
+    int epoch = shardcache_topology_enter(cache);
+    continuum_t *continuum = ATOMIC_READ(cache->topology)->continuum;
+    int index = -1;
+    if (continuum_lookup(continuum, key, klen) == continuum_me(continuum))
+        index = continuum_index(continuum, peer, strlen(peer));
+    int num_nodes = continuum_num_nodes(continuum);
+    shardcache_topology_exit(cache, epoch);
+
+    if (index >= 0)
+        peer_subscriptions_add(cache->subscriptions, key, klen, index, num_nodes);
+}
+
 static void
 shardcache_commence_eviction(shardcache_t *cache, void *key, size_t klen)
 {
-    shardcache_evictor_job_t *job = create_evictor_job(key, klen);
+    peer_subscribers_t *peers = NULL;
+    uint32_t generation = 0;
+
+    // only the owner knows which peers got a copy of the key
+    if (cache->subscriptions && shardcache_test_ownership(cache, key, klen, NULL, NULL) == 1) {
+        // the subscriptions are taken anyway since all
+        // the peers holding a copy are going to be notified
+        peers = peer_subscriptions_take(cache->subscriptions, key, klen, &generation);
+        if (!shardcache_subscriptions_reliable(cache)) {
+            free(peers);
+            peers = NULL;
+        } else if (!peers) {
+            // nobody got a copy since the key last changed
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EVICTIONS_SKIPPED].value);
+            return;
+        } else {
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EVICTIONS_TRACKED].value);
+        }
+    }
+
+    shardcache_evictor_job_t *job = create_evictor_job(key, klen, peers, generation);
 
     char keystr[1024];
     KEY2STR(key, klen, keystr, sizeof(keystr));
     SHC_DEBUG2("Adding evictor job for key %s", keystr);
 
-    int rc = ht_set_if_not_exists(cache->evictor_jobs, key, klen, job, sizeof(shardcache_evictor_job_t));
+    // an eviction of the key which wasn't notified yet is already queued
+    // (only the evictions notified to all the peers are coalesced)
+    int rc = peers ? 0 : ht_set_if_not_exists(cache->evictor_jobs, key, klen, job, sizeof(shardcache_evictor_job_t));
 
     if (rc != 0) {
         destroy_evictor_job(job);
         return;
     }
 
-    MUTEX_LOCK(&cache->evictor_lock);
-    pthread_cond_signal(&cache->evictor_cond);
-    MUTEX_UNLOCK(&cache->evictor_lock);
+    queue_push_right(cache->evictor_queue, job);
+
+    char byte = 0;
+    if (write(cache->evictor_wakeup_fd[1], &byte, 1) != 1 && errno != EAGAIN)
+        SHC_WARNING("Can't wake up the evictor thread: %s", strerror(errno));
 }
 
 static inline int
@@ -1508,6 +2862,14 @@ shardcache_schedule_expiration(shardcache_t *cache,
     return shardcache_queue_expiration_job(cache, key, klen, expire, is_volatile, SHARDACHE_EXPIRE_SCHEDULE);
 }
 
+// the atomic commands (and the sets) on keys mapped to the same stripe
+// are serialized, the atomic commands hold the lock while setting the value
+static pthread_mutex_t *
+shardcache_atomic_lock(shardcache_t *cache, void *key, size_t klen)
+{
+    return &cache->atomic_locks[crc32c(0, key, klen) % SHARDCACHE_ATOMIC_LOCKS];
+}
+
 static inline int
 shardcache_store(shardcache_t *cache,
                  void *key,
@@ -1536,7 +2898,9 @@ shardcache_store(shardcache_t *cache,
         return rc;
     }
 
+    ATOMIC_INCREMENT(cache->storage_requests);
     rc = cache->storage.store(key, klen, value, vlen, cache->storage.priv);
+    ATOMIC_DECREMENT(cache->storage_requests);
 
     if (cache->cache_on_set)
         arc_load(cache->arc, (const void *)key, klen, value, vlen);
@@ -1588,6 +2952,12 @@ shardcache_set_internal(shardcache_t *cache,
                    shardcache_hex_escape(value, vlen, DEBUG_DUMP_MAXSIZE, 0),
                    (int)vlen, keystr);
 
+        // don't interleave with a CAS/INCR/DECR on the same key
+        // (the replicated sets are already ordered by the consensus)
+        pthread_mutex_t *lock = cache->replica ? NULL : shardcache_atomic_lock(cache, key, klen);
+        if (lock)
+            MUTEX_LOCK(lock);
+
         if (!cache->use_persistent_storage || expire) {
             volatile_object_t *prev = NULL;
             // ensure removing this key from the persistent storage (if present)
@@ -1597,6 +2967,8 @@ shardcache_set_internal(shardcache_t *cache,
 
             if (inx && ht_exists(cache->volatile_storage, key, klen)) {
                 SHC_DEBUG("A volatile value already exists for key %s", keystr);
+                if (lock)
+                    MUTEX_UNLOCK(lock);
                 if (cb)
                     cb(key, klen, 1, priv);
                 return 1;
@@ -1650,6 +3022,9 @@ shardcache_set_internal(shardcache_t *cache,
         } else {
             rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
         }
+
+        if (lock)
+            MUTEX_UNLOCK(lock);
     }
     else if (node_len)
     {
@@ -1659,7 +3034,7 @@ shardcache_set_internal(shardcache_t *cache,
 
         shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
         if (!peer) {
-            SHC_ERROR("Can't find address for node %s", peer);
+            SHC_ERROR("Can't find address for node %s", node_name);
             if (cache->use_persistent_storage && cache->storage.global)
                 rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
             
@@ -1668,13 +3043,15 @@ shardcache_set_internal(shardcache_t *cache,
 
             return rc;
         }
-        char *addr = shardcache_node_get_address(peer);
+        char *addr = connections_pool_select_address(cache->connections_pool, peer);
 
-        int fd = shardcache_get_connection_for_peer(cache, addr);
+        uint32_t caps = 0;
+        int fd = shardcache_get_connection_for_peer_caps(cache, addr, &caps);
 
         if (inx) {
             if (cb) {
-                rc = add_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 0);
+                rc = add_to_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                 key, klen, value, vlen, expire, fd, 0);
                 if (rc == 0) {
                     shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
                     arg->key = malloc(klen);
@@ -1683,16 +3060,16 @@ shardcache_set_internal(shardcache_t *cache,
                     arg->cb = cb;
                     arg->priv = priv;
                     arg->cache = cache;
-                    arg->addr = addr;
+                    arg->addr = strdup(addr);
                     arg->fd = fd;
                     arg->hdr = SHC_HDR_SET;
-                    async_read_wrk_t *wrk = NULL;
-                    rc = read_message_async(fd, (char *)cache->auth, shardcache_async_command_helper, arg, &wrk);
-                    if (rc == 0 && wrk) {
-                        shardcache_queue_async_read_wrk(cache, wrk);
+                    arg->caps = caps;
+                    rc = shardcache_async_command_read(cache, arg);
+                    if (rc == 0) {
                         async = 1;
                     } else {
                         free(arg->key);
+                        free(arg->addr);
                         free(arg);
                     }
                 } else {
@@ -1700,9 +3077,10 @@ shardcache_set_internal(shardcache_t *cache,
                         rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
                 }
             } else {
-                rc = add_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 1);
+                rc = add_to_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                 key, klen, value, vlen, expire, fd, 1);
                 if (rc == 0) {
-                    shardcache_release_connection_for_peer(cache, addr, fd);
+                    shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
                 } else {
                     close(fd);
                     if (cache->use_persistent_storage && cache->storage.global)
@@ -1710,7 +3088,8 @@ shardcache_set_internal(shardcache_t *cache,
                 }
             }
         } else if (cb) {
-            rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 0);
+            rc = send_to_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                              key, klen, value, vlen, expire, fd, 0);
             if (rc == 0) {
                 shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
                 arg->key = malloc(klen);
@@ -1719,25 +3098,26 @@ shardcache_set_internal(shardcache_t *cache,
                 arg->cb = cb;
                 arg->priv = priv;
                 arg->cache = cache;
-                arg->addr = addr;
+                arg->addr = strdup(addr);
                 arg->fd = fd;
                 arg->hdr = SHC_HDR_SET;
-                async_read_wrk_t *wrk = NULL;
-                rc = read_message_async(fd, (char *)cache->auth, shardcache_async_command_helper, arg, &wrk);
-                if (rc == 0 && wrk) {
-                    shardcache_queue_async_read_wrk(cache, wrk);
+                arg->caps = caps;
+                rc = shardcache_async_command_read(cache, arg);
+                if (rc == 0) {
                     async = 1;
                 } else {
                     free(arg->key);
+                    free(arg->addr);
                     free(arg);
                 }
             } else if (cache->use_persistent_storage && cache->storage.global) {
                 rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
             }
         } else {
-            rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 1);
+            rc = send_to_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                              key, klen, value, vlen, expire, fd, 1);
             if (rc == 0) {
-                shardcache_release_connection_for_peer(cache, addr, fd);
+                shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
             } else {
                 close(fd);
                 if (cache->use_persistent_storage && cache->storage.global)
@@ -1752,6 +3132,7 @@ shardcache_set_internal(shardcache_t *cache,
                 arc_remove(cache->arc, (const void *)key, klen);
         }
 
+        shardcache_node_destroy(peer);
     }
 
     if (cb && !async)
@@ -1889,7 +3270,9 @@ shardcache_del_internal(shardcache_t *cache,
         if (rc != 0) {
             if (cache->use_persistent_storage) {
                 if (cache->storage.remove) {
+                    ATOMIC_INCREMENT(cache->storage_requests);
                     rc = cache->storage.remove(key, klen, cache->storage.priv);
+                    ATOMIC_DECREMENT(cache->storage_requests);
                 } else {
                     // if there is a readonly persistent storage
                     // we want to return a 'success' return code,
@@ -1899,137 +3282,1140 @@ shardcache_del_internal(shardcache_t *cache,
                     rc = 0;
                 }
             }
-        } else if (prev_ptr) {
-            shardcache_unschedule_expiration(cache, key, klen, 1);
-            volatile_object_t *prev_item = (volatile_object_t *)prev_ptr;
-            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                            prev_item->dlen);
-            destroy_volatile(prev_item);
-        }
-
-        if (ATOMIC_READ(cache->evict_on_delete))
-        {
-            arc_remove(cache->arc, (const void *)key, klen);
-
-            if (!replica)
-                shardcache_commence_eviction(cache, key, klen);
+        } else if (prev_ptr) {
+            shardcache_unschedule_expiration(cache, key, klen, 1);
+            volatile_object_t *prev_item = (volatile_object_t *)prev_ptr;
+            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                            prev_item->dlen);
+            destroy_volatile(prev_item);
+        }
+
+        if (ATOMIC_READ(cache->evict_on_delete))
+        {
+            arc_remove(cache->arc, (const void *)key, klen);
+
+            if (!replica)
+                shardcache_commence_eviction(cache, key, klen);
+        }
+
+        if (cb)
+            cb(key, klen, rc, priv);
+
+    } else if (!replica) {
+        shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
+        if (!peer) {
+            SHC_ERROR("Can't find address for node %s", node_name);
+            if (cb)
+                cb(key, klen, -1, priv);
+            return -1;
+        }
+        char *addr = connections_pool_select_address(cache->connections_pool, peer);
+        uint32_t caps = 0;
+        int fd = shardcache_get_connection_for_peer_caps(cache, addr, &caps);
+        int sig_hdr = SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP);
+        int rc = -1;
+        if (cb) {
+            rc = delete_from_peer(addr, (char *)cache->auth, sig_hdr, key, klen, fd, 0);
+            if (rc == 0) {
+                shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
+                arg->key = malloc(klen);
+                memcpy(arg->key, key, klen);
+                arg->klen = klen;
+                arg->cb = cb;
+                arg->priv = priv;
+                arg->cache = cache;
+                arg->addr = strdup(addr);
+                arg->fd = fd;
+                arg->hdr = SHC_HDR_DELETE;
+                arg->caps = caps;
+                rc = shardcache_async_command_read(cache, arg);
+                if (rc != 0) {
+                    free(arg->key);
+                    free(arg->addr);
+                    free(arg);
+                    cb(key, klen, -1, priv);
+                }
+            } else {
+                cb(key, klen, -1, priv);
+            }
+        } else {
+            rc = delete_from_peer(addr, (char *)cache->auth, sig_hdr, key, klen, fd, 1);
+            if (rc == 0)
+                shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
+            else
+                close(fd);
+        }
+        shardcache_node_destroy(peer);
+    }
+
+    return rc;
+}
+
+int
+shardcache_del(shardcache_t *cache, void *key, size_t klen)
+{
+    if (!key || !key)
+        return -1;
+
+    if (cache->replica)
+        return shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_DELETE, key, klen, NULL, 0, 0);
+
+    return shardcache_del_internal(cache, key, klen, 0, NULL, NULL);
+}
+
+int
+shardcache_del_async(shardcache_t *cache,
+                     void *key,
+                     size_t klen,
+                     shardcache_async_response_callback_t cb,
+                     void *priv)
+{
+    if (!key || !key)
+        return -1;
+
+    if (cache->replica) {
+        int rc = shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_DELETE, key, klen, NULL, 0, 0);
+        if (cb)
+            cb(key, klen, rc, priv);
+        return rc;
+    }
+
+    return shardcache_del_internal(cache, key, klen, 0, cb, priv);
+}
+
+int
+shardcache_evict(shardcache_t *cache, void *key, size_t klen)
+{
+    if (!key || !klen)
+        return -1;
+
+    if (cache->replica)
+        return shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_EVICT, key, klen, NULL, 0, 0);
+
+    arc_remove(cache->arc, (const void *)key, klen);
+
+    return 0;
+}
+
+// keys of a multi-key mutation owned by the same node
+typedef struct {
+    char *peer; // the address of the owner (NULL for the keys owned by this node)
+    int *indexes; // the index of each key in the array provided by the caller
+    int num_keys;
+} shardcache_multi_group_t;
+
+static void
+shardcache_multi_group_add(shardcache_multi_group_t *group, int index)
+{
+    group->indexes = realloc(group->indexes, (group->num_keys + 1) * sizeof(int));
+    group->indexes[group->num_keys++] = index;
+}
+
+static void
+shardcache_multi_group_destroy(shardcache_multi_group_t *group)
+{
+    free(group->peer);
+    free(group->indexes);
+    free(group);
+}
+
+// split the keys among their owners (one group per node),
+// invalid keys and keys with an unknown owner are marked as failed
+static linked_list_t *
+shardcache_multi_group_by_owner(shardcache_t *cache,
+                                void **keys,
+                                size_t *klens,
+                                int num_keys,
+                                int *results)
+{
+    linked_list_t *groups = list_create();
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        results[i] = -1;
+
+        if (!keys[i] || !klens[i])
+            continue;
+
+        char node_name[1024];
+        size_t node_len = sizeof(node_name);
+        memset(node_name, 0, node_len);
+
+        int is_mine = shardcache_test_migration_ownership(cache, keys[i], klens[i], node_name, &node_len);
+        if (is_mine == -1)
+            is_mine = shardcache_test_ownership(cache, keys[i], klens[i], node_name, &node_len);
+
+        char *addr = NULL;
+        if (is_mine != 1) {
+            shardcache_node_t *peer = shardcache_node_select(cache, node_name);
+            if (!peer) {
+                SHC_ERROR("Can't find address for node %s", node_name);
+                continue;
+            }
+            addr = strdup(connections_pool_select_address(cache->connections_pool, peer));
+            shardcache_node_destroy(peer);
+        }
+
+        shardcache_multi_group_t *group = NULL;
+        int n;
+        for (n = 0; n < list_count(groups); n++) {
+            shardcache_multi_group_t *g = list_pick_value(groups, n);
+            if ((!g->peer && !addr) || (g->peer && addr && strcmp(g->peer, addr) == 0)) {
+                group = g;
+                break;
+            }
+        }
+        if (!group) {
+            group = calloc(1, sizeof(shardcache_multi_group_t));
+            group->peer = addr;
+            list_push_value(groups, group);
+        } else {
+            free(addr);
+        }
+        shardcache_multi_group_add(group, i);
+    }
+    return groups;
+}
+
+// run the command for a single key of a multi-key mutation
+static int
+shardcache_multi_command_single(shardcache_t *cache,
+                                unsigned char hdr,
+                                void *key,
+                                size_t klen,
+                                void *value,
+                                size_t vlen,
+                                time_t expire)
+{
+    switch(hdr) {
+        case SHC_HDR_SET_MULTI:
+            return shardcache_set_internal(cache, key, klen, value, vlen, expire, 0, 0, NULL, NULL);
+        case SHC_HDR_DELETE_MULTI:
+            return shardcache_del_internal(cache, key, klen, 0, NULL, NULL);
+        case SHC_HDR_TOUCH_MULTI:
+            return shardcache_touch(cache, key, klen);
+        default:
+            break;
+    }
+    return -1;
+}
+
+// forward all the keys of the group to their owner with a single command,
+// returns -1 if the peer doesn't support the multi-key commands
+static int
+shardcache_multi_command_on_peer(shardcache_t *cache,
+                                 unsigned char hdr,
+                                 shardcache_multi_group_t *group,
+                                 void **keys,
+                                 size_t *klens,
+                                 void **values,
+                                 size_t *vlens,
+                                 time_t *expires,
+                                 int *results)
+{
+    uint32_t caps = 0;
+    int fd = shardcache_get_connection_for_peer_caps(cache, group->peer, &caps);
+    if (fd < 0) {
+        SHC_WARNING("Can't connect to peer %s", group->peer);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        return 0;
+    }
+
+    if (!(caps & SHC_CAP_MULTI_WRITE)) {
+        shardcache_release_connection_for_peer_caps(cache, group->peer, fd, caps);
+        return -1;
+    }
+
+    int num_keys = group->num_keys;
+    void **gkeys = malloc(num_keys * sizeof(void *));
+    size_t *gklens = malloc(num_keys * sizeof(size_t));
+    void **gvalues = values ? malloc(num_keys * sizeof(void *)) : NULL;
+    size_t *gvlens = values ? malloc(num_keys * sizeof(size_t)) : NULL;
+    uint32_t *gexpires = (values && expires) ? malloc(num_keys * sizeof(uint32_t)) : NULL;
+    unsigned char *statuses = malloc(num_keys);
+
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        int index = group->indexes[i];
+        gkeys[i] = keys[index];
+        gklens[i] = klens[index];
+        if (gvalues) {
+            gvalues[i] = values[index];
+            gvlens[i] = vlens[index];
+        }
+        if (gexpires)
+            gexpires[i] = expires[index];
+    }
+
+    int sig_hdr = SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP);
+    int rc = -1;
+    switch(hdr) {
+        case SHC_HDR_SET_MULTI:
+            rc = set_multi_on_peer(group->peer, (char *)cache->auth, sig_hdr, gkeys, gklens,
+                                   gvalues, gvlens, gexpires, num_keys, statuses, fd);
+            break;
+        case SHC_HDR_DELETE_MULTI:
+            rc = delete_multi_from_peer(group->peer, (char *)cache->auth, sig_hdr,
+                                        gkeys, gklens, num_keys, statuses, fd);
+            break;
+        case SHC_HDR_TOUCH_MULTI:
+            rc = touch_multi_on_peer(group->peer, (char *)cache->auth, sig_hdr,
+                                     gkeys, gklens, num_keys, statuses, fd);
+            break;
+        default:
+            break;
+    }
+
+    if (rc == 0) {
+        shardcache_release_connection_for_peer_caps(cache, group->peer, fd, caps);
+        for (i = 0; i < num_keys; i++) {
+            int index = group->indexes[i];
+            results[index] = (statuses[i] == SHC_RES_OK) ? 0 : -1;
+            if (hdr == SHC_HDR_SET_MULTI && results[index] == 0) {
+                if (cache->cache_on_set)
+                    arc_load(cache->arc, (const void *)gkeys[i], gklens[i], gvalues[i], gvlens[i]);
+                else
+                    arc_remove(cache->arc, (const void *)gkeys[i], gklens[i]);
+            }
+        }
+    } else {
+        SHC_WARNING("Multi command %02x for %d keys failed on peer %s (%d)",
+                    hdr, num_keys, group->peer, rc);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        close(fd);
+    }
+
+    free(gkeys);
+    free(gklens);
+    free(gvalues);
+    free(gvlens);
+    free(gexpires);
+    free(statuses);
+    return 0;
+}
+
+// store all the persistent keys of the group with a single call to the storage
+static void
+shardcache_set_multi_on_storage(shardcache_t *cache,
+                                shardcache_multi_group_t *group,
+                                void **keys,
+                                size_t *klens,
+                                void **values,
+                                size_t *vlens,
+                                time_t *expires,
+                                int *results)
+{
+    int num_keys = 0;
+    int *indexes = malloc(group->num_keys * sizeof(int));
+    void **skeys = malloc(group->num_keys * sizeof(void *));
+    size_t *sklens = malloc(group->num_keys * sizeof(size_t));
+    void **svalues = malloc(group->num_keys * sizeof(void *));
+    size_t *svlens = malloc(group->num_keys * sizeof(size_t));
+
+    int i;
+    for (i = 0; i < group->num_keys; i++) {
+        int index = group->indexes[i];
+        if ((expires && expires[index]) || !values[index] || !vlens[index]) {
+            // volatile keys (and invalid values) go through the usual path
+            results[index] = shardcache_set_internal(cache, keys[index], klens[index],
+                                                     values[index], vlens[index],
+                                                     expires ? expires[index] : 0,
+                                                     0, 0, NULL, NULL);
+            continue;
+        }
+        indexes[num_keys] = index;
+        skeys[num_keys] = keys[index];
+        sklens[num_keys] = klens[index];
+        svalues[num_keys] = values[index];
+        svlens[num_keys] = vlens[index];
+        num_keys++;
+    }
+
+    if (num_keys) {
+        ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_SETS].value, num_keys);
+
+        ATOMIC_INCREMENT(cache->storage_requests);
+        int rc = cache->storage.store_multi(skeys, sklens, num_keys,
+                                            svalues, svlens, cache->storage.priv);
+        ATOMIC_DECREMENT(cache->storage_requests);
+
+        if (rc != 0) {
+            SHC_ERROR("Store multi storage callback returned an error (%d)", rc);
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        }
+
+        for (i = 0; i < num_keys; i++) {
+            results[indexes[i]] = (rc == 0) ? 0 : -1;
+
+            if (cache->cache_on_set)
+                arc_load(cache->arc, (const void *)skeys[i], sklens[i], svalues[i], svlens[i]);
+            else
+                arc_remove(cache->arc, (const void *)skeys[i], sklens[i]);
+
+            // the evictor will notify all the keys to each peer at once
+            shardcache_commence_eviction(cache, skeys[i], sklens[i]);
+        }
+    }
+
+    free(indexes);
+    free(skeys);
+    free(sklens);
+    free(svalues);
+    free(svlens);
+}
+
+// remove all the keys of the group with a single call to the storage
+static void
+shardcache_del_multi_on_storage(shardcache_t *cache,
+                                shardcache_multi_group_t *group,
+                                void **keys,
+                                size_t *klens,
+                                int *results)
+{
+    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_DELS].value, group->num_keys);
+
+    int num_keys = 0;
+    int *indexes = malloc(group->num_keys * sizeof(int));
+    void **skeys = malloc(group->num_keys * sizeof(void *));
+    size_t *sklens = malloc(group->num_keys * sizeof(size_t));
+
+    int i;
+    for (i = 0; i < group->num_keys; i++) {
+        int index = group->indexes[i];
+        void *prev_ptr = NULL;
+        if (ht_delete(cache->volatile_storage, keys[index], klens[index], &prev_ptr, NULL) == 0) {
+            if (prev_ptr) {
+                shardcache_unschedule_expiration(cache, keys[index], klens[index], 1);
+                volatile_object_t *prev_item = (volatile_object_t *)prev_ptr;
+                ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                                prev_item->dlen);
+                destroy_volatile(prev_item);
+            }
+            results[index] = 0;
+            continue;
+        }
+        indexes[num_keys] = index;
+        skeys[num_keys] = keys[index];
+        sklens[num_keys] = klens[index];
+        num_keys++;
+    }
+
+    if (num_keys) {
+        ATOMIC_INCREMENT(cache->storage_requests);
+        int rc = cache->storage.remove_multi(skeys, sklens, num_keys, cache->storage.priv);
+        ATOMIC_DECREMENT(cache->storage_requests);
+
+        if (rc != 0) {
+            SHC_ERROR("Remove multi storage callback returned an error (%d)", rc);
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        }
+
+        for (i = 0; i < num_keys; i++)
+            results[indexes[i]] = (rc == 0) ? 0 : -1;
+    }
+
+    if (ATOMIC_READ(cache->evict_on_delete)) {
+        for (i = 0; i < group->num_keys; i++) {
+            int index = group->indexes[i];
+            arc_remove(cache->arc, (const void *)keys[index], klens[index]);
+            shardcache_commence_eviction(cache, keys[index], klens[index]);
+        }
+    }
+
+    free(indexes);
+    free(skeys);
+    free(sklens);
+}
+
+static int
+shardcache_multi_command(shardcache_t *cache,
+                         unsigned char hdr,
+                         void **keys,
+                         size_t *klens,
+                         void **values,
+                         size_t *vlens,
+                         time_t *expires,
+                         int num_keys,
+                         int *results)
+{
+    if (!keys || !klens || num_keys <= 0)
+        return -1;
+
+    int *res = results ? results : malloc(num_keys * sizeof(int));
+
+    linked_list_t *groups = shardcache_multi_group_by_owner(cache, keys, klens, num_keys, res);
+
+    shardcache_multi_group_t *local = NULL;
+    shardcache_multi_group_t *group;
+    while ((group = list_shift_value(groups))) {
+        if (!group->peer) {
+            local = group;
+            continue;
+        }
+        if (shardcache_multi_command_on_peer(cache, hdr, group, keys, klens,
+                                             values, vlens, expires, res) != 0)
+        {
+            // the peer doesn't understand the multi-key commands
+            int i;
+            for (i = 0; i < group->num_keys; i++) {
+                int index = group->indexes[i];
+                res[index] = shardcache_multi_command_single(cache, hdr, keys[index], klens[index],
+                                                             values ? values[index] : NULL,
+                                                             values ? vlens[index] : 0,
+                                                             expires ? expires[index] : 0);
+            }
+        }
+        shardcache_multi_group_destroy(group);
+    }
+    list_destroy(groups);
+
+    if (local) {
+        if (hdr == SHC_HDR_SET_MULTI && cache->use_persistent_storage && cache->storage.store_multi) {
+            shardcache_set_multi_on_storage(cache, local, keys, klens, values, vlens, expires, res);
+        } else if (hdr == SHC_HDR_DELETE_MULTI && cache->use_persistent_storage && cache->storage.remove_multi) {
+            shardcache_del_multi_on_storage(cache, local, keys, klens, res);
+        } else {
+            int i;
+            for (i = 0; i < local->num_keys; i++) {
+                int index = local->indexes[i];
+                res[index] = shardcache_multi_command_single(cache, hdr, keys[index], klens[index],
+                                                             values ? values[index] : NULL,
+                                                             values ? vlens[index] : 0,
+                                                             expires ? expires[index] : 0);
+            }
+        }
+        shardcache_multi_group_destroy(local);
+    }
+
+    int rc = 0;
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        if (res[i] != 0)
+            rc = -1;
+    }
+
+    if (res != results)
+        free(res);
+
+    return rc;
+}
+
+// run a multi-key command through the replica one key at a time
+static int
+shardcache_multi_command_replica(shardcache_t *cache,
+                                 unsigned char hdr,
+                                 void **keys,
+                                 size_t *klens,
+                                 void **values,
+                                 size_t *vlens,
+                                 time_t *expires,
+                                 int num_keys,
+                                 int *results)
+{
+    int rc = 0;
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        int r = -1;
+        switch(hdr) {
+            case SHC_HDR_SET_MULTI:
+                if (expires && expires[i])
+                    r = shardcache_set_volatile(cache, keys[i], klens[i], values[i], vlens[i], expires[i]);
+                else
+                    r = shardcache_set(cache, keys[i], klens[i], values[i], vlens[i]);
+                break;
+            case SHC_HDR_DELETE_MULTI:
+                r = shardcache_del(cache, keys[i], klens[i]);
+                break;
+            default:
+                break;
+        }
+        if (results)
+            results[i] = r;
+        if (r != 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+int
+shardcache_set_multi(shardcache_t *cache,
+                     void **keys,
+                     size_t *klens,
+                     void **values,
+                     size_t *vlens,
+                     time_t *expires,
+                     int num_keys,
+                     int *results)
+{
+    if (!keys || !klens || !values || !vlens || num_keys <= 0)
+        return -1;
+
+    if (cache->replica)
+        return shardcache_multi_command_replica(cache, SHC_HDR_SET_MULTI, keys, klens,
+                                                values, vlens, expires, num_keys, results);
+
+    return shardcache_multi_command(cache, SHC_HDR_SET_MULTI, keys, klens,
+                                    values, vlens, expires, num_keys, results);
+}
+
+int
+shardcache_del_multi(shardcache_t *cache,
+                     void **keys,
+                     size_t *klens,
+                     int num_keys,
+                     int *results)
+{
+    if (!keys || !klens || num_keys <= 0)
+        return -1;
+
+    if (cache->replica)
+        return shardcache_multi_command_replica(cache, SHC_HDR_DELETE_MULTI, keys, klens,
+                                                NULL, NULL, NULL, num_keys, results);
+
+    return shardcache_multi_command(cache, SHC_HDR_DELETE_MULTI, keys, klens,
+                                    NULL, NULL, NULL, num_keys, results);
+}
+
+int
+shardcache_touch_multi(shardcache_t *cache,
+                       void **keys,
+                       size_t *klens,
+                       int num_keys,
+                       int *results)
+{
+    return shardcache_multi_command(cache, SHC_HDR_TOUCH_MULTI, keys, klens,
+                                    NULL, NULL, NULL, num_keys, results);
+}
+
+int
+shardcache_evict_multi(shardcache_t *cache, void **keys, size_t *klens, int num_keys)
+{
+    if (!keys || !klens || num_keys <= 0)
+        return -1;
+
+    int rc = 0;
+    int i;
+    for (i = 0; i < num_keys; i++) {
+        if (shardcache_evict(cache, keys[i], klens[i]) != 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+// the version of the data of a cached object we own, a new one is taken
+// from the counter the first time it's asked after the data changed
+// (so the same data stored again gets a different version)
+static uint64_t
+shardcache_object_version(shardcache_t *cache, cached_object_t *obj)
+{
+    if (!obj->version)
+        obj->version = ATOMIC_INCREASE(cache->versions, 1);
+    return obj->version;
+}
+
+// returns 1 if we own the key, 0 if it's owned by a peer
+// (and copies its address to 'addr') or -1 on errors
+static int
+shardcache_atomic_owner(shardcache_t *cache, void *key, size_t klen, char *addr, size_t alen)
+{
+    char node_name[1024];
+    size_t node_len = sizeof(node_name);
+    memset(node_name, 0, node_len);
+
+    int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
+    if (is_mine == -1)
+        is_mine = shardcache_test_ownership(cache, key, klen, node_name, &node_len);
+
+    if (is_mine == 1)
+        return 1;
+
+    shardcache_node_t *peer = shardcache_node_select(cache, node_name);
+    if (!peer) {
+        SHC_ERROR("Can't find address for node %s", node_name);
+        return -1;
+    }
+    snprintf(addr, alen, "%s", connections_pool_select_address(cache->connections_pool, peer));
+    shardcache_node_destroy(peer);
+    return 0;
+}
+
+// a connection to the owner of a key, only if it supports the atomic commands
+static int
+shardcache_atomic_connection(shardcache_t *cache, char *addr, uint32_t *caps)
+{
+    int fd = shardcache_get_connection_for_peer_caps(cache, addr, caps);
+    if (fd < 0) {
+        SHC_WARNING("Can't connect to peer %s", addr);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        return -1;
+    }
+
+    if (!(*caps & SHC_CAP_ATOMIC)) {
+        SHC_WARNING("Peer %s doesn't support the atomic commands", addr);
+        shardcache_release_connection_for_peer_caps(cache, addr, fd, *caps);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+shardcache_atomic_connection_done(shardcache_t *cache, char *addr, int fd, uint32_t caps, int rc)
+{
+    if (rc >= 0) {
+        shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
+    } else {
+        close(fd);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+    }
+}
+
+int
+shardcache_revalidate_copy(shardcache_t *cache, void *key, size_t klen, int if_read)
+{
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_cached(cache->arc, key, klen, &obj_ptr);
+    if (!res)
+        return -1;
+
+    cached_object_t *obj = (cached_object_t *)obj_ptr;
+    MUTEX_LOCK(&obj->lock);
+    int valid = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) && obj->data &&
+                 !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) &&
+                 !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) &&
+                 !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) &&
+                 (!if_read || COBJ_CHECK_FLAGS(obj, COBJ_FLAG_READ)));
+    // a copy whose version isn't known yet is fetched again (the owner
+    // sends its version together with the value)
+    uint64_t version = obj->version;
+    MUTEX_UNLOCK(&obj->lock);
+
+    char addr[1024];
+    if (!valid || shardcache_atomic_owner(cache, key, klen, addr, sizeof(addr)) != 0) {
+        arc_release_resource(cache->arc, res);
+        return -1;
+    }
+
+    uint32_t caps = 0;
+    int fd = shardcache_get_connection_for_peer_caps(cache, addr, &caps);
+    if (fd < 0 || !(caps & SHC_CAP_CONDITIONAL)) {
+        if (fd >= 0)
+            shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
+        arc_release_resource(cache->arc, res);
+        return -1;
+    }
+
+    fbuf_t out = FBUF_STATIC_INITIALIZER;
+    uint64_t new_version = version;
+    int moved = 0;
+    int rc = fetch_from_peer_if_modified(addr, (char *)cache->auth,
+                                         SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                         key, klen, &new_version, &out, fd);
+    if (rc == 0 || rc == 1) {
+        shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_FETCH_REMOTE].value);
+    } else {
+        close(fd);
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+    }
+
+    // a key removed by the owner (or unknown to it) can't be revalidated
+    if ((rc == 0 && !fbuf_used(&out)) || (rc == 1 && !version))
+        rc = -1;
+
+    if (rc == 0 || rc == 1) {
+        MUTEX_LOCK(&obj->lock);
+        if (obj->version != version || COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) ||
+            COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT))
+        {
+            // the copy has been evicted or reloaded in the meanwhile
+            rc = -1;
+        } else {
+            if (rc == 0) {
+                if (obj->data && obj->data != obj->dbuf)
+                    free(obj->data);
+                obj->dlen = fbuf_used(&out);
+                obj->data = fbuf_data(&out);
+                obj->version = new_version;
+                moved = 1;
+                arc_update_resource_size(cache->arc, res, obj->dlen);
+                rc = 1;
+            } else {
+                rc = 0;
+            }
+            gettimeofday(&obj->ts, NULL);
+            COBJ_UNSET_FLAG(obj, COBJ_FLAG_READ);
+        }
+        MUTEX_UNLOCK(&obj->lock);
+    }
+    // if succeeded the fbuf buffer has been moved to the obj structure
+    if (!moved)
+        fbuf_destroy(&out);
+    arc_release_resource(cache->arc, res);
+
+    if (rc >= 0 && cache->expire_time > 0 && !cache->lazy_expiration)
+        shardcache_schedule_expiration(cache, key, klen, cache->expire_time, 0);
+
+    return rc;
+}
+
+// the value of a key we own together with its version stamp.
+// The versions are kept by the cached objects, so the key is looked up
+// through the arc (which keeps the object) and a miss is returned if it
+// can't be cached
+static void *
+shardcache_gets_local(shardcache_t *cache,
+                      void *key,
+                      size_t klen,
+                      size_t *vlen,
+                      uint64_t *version)
+{
+    *version = 0;
+
+    int retry = 1;
+    for (;;) {
+        void *obj_ptr = NULL;
+        arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 0);
+        if (!res)
+            return NULL;
+
+        if (!obj_ptr) {
+            arc_release_resource(cache->arc, res);
+            return NULL;
+        }
+
+        cached_object_t *obj = (cached_object_t *)obj_ptr;
+        MUTEX_LOCK(&obj->lock);
+        int stale = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) ||
+                    (cache->lazy_expiration && cache->expire_time > 0 &&
+                     obj->ts.tv_sec + cache->expire_time < time(NULL));
+
+        if (stale && retry) {
+            // load it again
+            MUTEX_UNLOCK(&obj->lock);
+            arc_drop_resource(cache->arc, res);
+            retry = 0;
+            continue;
+        }
+
+        void *value = NULL;
+        if (!stale && COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) && obj->data && obj->dlen) {
+            value = malloc(obj->dlen);
+            memcpy(value, obj->data, obj->dlen);
+            if (vlen)
+                *vlen = obj->dlen;
+            *version = shardcache_object_version(cache, obj);
+        }
+        MUTEX_UNLOCK(&obj->lock);
+        arc_release_resource(cache->arc, res);
+        return value;
+    }
+}
+
+void *
+shardcache_gets(shardcache_t *cache,
+                void *key,
+                size_t klen,
+                size_t *vlen,
+                uint64_t *version)
+{
+    uint64_t v = 0;
+
+    if (!key || !klen)
+        return NULL;
+
+    char addr[1024];
+    int is_mine = shardcache_atomic_owner(cache, key, klen, addr, sizeof(addr));
+    if (is_mine == -1)
+        return NULL;
+
+    void *value = NULL;
+    if (is_mine) {
+        value = shardcache_gets_local(cache, key, klen, vlen, &v);
+    } else {
+        uint32_t caps = 0;
+        int fd = shardcache_atomic_connection(cache, addr, &caps);
+        if (fd < 0)
+            return NULL;
+        fbuf_t out = FBUF_STATIC_INITIALIZER;
+        int rc = gets_from_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                key, klen, &out, &v, fd);
+        shardcache_atomic_connection_done(cache, addr, fd, caps, rc);
+        if (rc == 0 && fbuf_used(&out)) {
+            if (vlen)
+                *vlen = fbuf_used(&out);
+            value = fbuf_data(&out);
+        } else {
+            fbuf_destroy(&out);
+            v = 0;
+        }
+    }
+
+    if (version)
+        *version = v;
+
+    return value;
+}
+
+int
+shardcache_get_if_modified(shardcache_t *cache,
+                           void *key,
+                           size_t klen,
+                           uint64_t *version,
+                           void **value,
+                           size_t *vlen)
+{
+    if (!key || !klen || !version)
+        return -1;
+
+    char addr[1024];
+    int is_mine = shardcache_atomic_owner(cache, key, klen, addr, sizeof(addr));
+    if (is_mine == -1)
+        return -1;
+
+    size_t len = 0;
+    uint64_t current = 0;
+    void *data = NULL;
+
+    if (is_mine) {
+        data = shardcache_gets_local(cache, key, klen, &len, &current);
+    } else {
+        // check the cached copy first (if the version given by the owner is known)
+        void *obj_ptr = NULL;
+        arc_resource_t res = arc_lookup_cached(cache->arc, key, klen, &obj_ptr);
+        if (res) {
+            cached_object_t *obj = (cached_object_t *)obj_ptr;
+            int rc = -1;
+            MUTEX_LOCK(&obj->lock);
+            int hit = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+                       !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) && obj->data);
+
+            if (hit && (!obj->version || (cache->lazy_expiration && cache->expire_time > 0 &&
+                                          obj->ts.tv_sec + cache->expire_time < time(NULL))))
+            {
+                // revalidate the copy, it's updated in place if changed
+                MUTEX_UNLOCK(&obj->lock);
+                hit = (shardcache_revalidate_copy(cache, key, klen, 0) >= 0);
+                MUTEX_LOCK(&obj->lock);
+                if (hit)
+                    hit = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) && obj->data && obj->version);
+            }
+
+            if (hit) {
+                if (obj->version == *version) {
+                    rc = 1;
+                } else {
+                    if (value) {
+                        *value = malloc(obj->dlen);
+                        memcpy(*value, obj->data, obj->dlen);
+                    }
+                    if (vlen)
+                        *vlen = obj->dlen;
+                    *version = obj->version;
+                    rc = 0;
+                }
+            }
+            MUTEX_UNLOCK(&obj->lock);
+            arc_release_resource(cache->arc, res);
+            if (rc >= 0)
+                return rc;
         }
 
-        if (cb)
-            cb(key, klen, rc, priv);
-
-    } else if (!replica) {
-        shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
-        if (!peer) {
-            SHC_ERROR("Can't find address for node %s", peer);
-            if (cb)
-                cb(key, klen, -1, priv);
-            return -1;
-        }
-        char *addr = shardcache_node_get_address(peer);
-        int fd = shardcache_get_connection_for_peer(cache, addr);
-        int rc = -1;
-        if (cb) {
-            rc = delete_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 0);
-            if (rc == 0) {
-                shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
-                arg->key = malloc(klen);
-                memcpy(arg->key, key, klen);
-                arg->klen = klen;
-                arg->cb = cb;
-                arg->priv = priv;
-                arg->cache = cache;
-                arg->addr = addr;
-                arg->fd = fd;
-                arg->hdr = SHC_HDR_DELETE;
-                async_read_wrk_t *wrk = NULL;
-                rc = read_message_async(fd, (char *)cache->auth, shardcache_async_command_helper, arg, &wrk);
-                if (rc == 0 && wrk) {
-                    shardcache_queue_async_read_wrk(cache, wrk);
-                } else {
-                    free(arg->key);
-                    free(arg);
-                    cb(key, klen, -1, priv);
+        // revalidate against the owner, the value is transferred only if changed
+        uint32_t caps = 0;
+        int fd = shardcache_get_connection_for_peer_caps(cache, addr, &caps);
+        if (fd >= 0 && (caps & SHC_CAP_CONDITIONAL)) {
+            fbuf_t out = FBUF_STATIC_INITIALIZER;
+            uint64_t new_version = *version;
+            int rc = fetch_from_peer_if_modified(addr, (char *)cache->auth,
+                                                 SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                                 key, klen, &new_version, &out, fd);
+            if (rc == 0 || rc == 1) {
+                shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
+                ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_FETCH_REMOTE].value);
+                if (rc == 0) {
+                    // the owner now knows we have a copy of this version
+                    shardcache_load_value(cache, key, klen, fbuf_data(&out), fbuf_used(&out), new_version, 0);
+                    if (vlen)
+                        *vlen = fbuf_used(&out);
+                    if (value)
+                        *value = fbuf_used(&out) ? fbuf_data(&out) : NULL;
+                    if (!value || !fbuf_used(&out))
+                        fbuf_destroy(&out);
+                    *version = new_version;
                 }
-            } else {
-                cb(key, klen, -1, priv);
+                return rc;
             }
-        } else {
-            rc = delete_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
-            if (rc == 0)
-                shardcache_release_connection_for_peer(cache, addr, fd);
-            else
-                close(fd);
+            close(fd);
+            fbuf_destroy(&out);
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+            return -1;
+        } else if (fd >= 0) {
+            shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
         }
+
+        // only the owner knows the version of the value
+        data = shardcache_gets(cache, key, klen, &len, &current);
     }
 
-    return rc;
+    if (current == *version) {
+        free(data);
+        return 1;
+    }
+
+    if (value)
+        *value = data;
+    else
+        free(data);
+    if (vlen)
+        *vlen = len;
+    *version = current;
+    return 0;
 }
 
 int
-shardcache_del(shardcache_t *cache, void *key, size_t klen)
+shardcache_cas(shardcache_t *cache,
+               void *key,
+               size_t klen,
+               uint64_t version,
+               void *value,
+               size_t vlen,
+               time_t expire,
+               uint64_t *new_version)
 {
-    if (!key || !key)
+    if (!key || !klen || !value || !vlen)
         return -1;
 
-    if (cache->replica)
-        return shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_DELETE, key, klen, NULL, 0, 0);
+    char addr[1024];
+    int is_mine = shardcache_atomic_owner(cache, key, klen, addr, sizeof(addr));
+    if (is_mine == -1)
+        return -1;
 
-    return shardcache_del_internal(cache, key, klen, 0, NULL, NULL);
+    if (!is_mine) {
+        uint32_t caps = 0;
+        int fd = shardcache_atomic_connection(cache, addr, &caps);
+        if (fd < 0)
+            return -1;
+        int rc = cas_on_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                             key, klen, version, value, vlen, expire, new_version, fd);
+        shardcache_atomic_connection_done(cache, addr, fd, caps, rc);
+        return (rc == 0 || rc == 1) ? rc : -1;
+    }
+
+    pthread_mutex_t *lock = shardcache_atomic_lock(cache, key, klen);
+    MUTEX_LOCK(lock);
+
+    uint64_t current = 0;
+    void *prev = shardcache_gets_local(cache, key, klen, NULL, &current);
+    if (prev)
+        free(prev);
+
+    int rc = 1;
+    if (current == version) {
+        rc = expire ? shardcache_set_volatile(cache, key, klen, value, vlen, expire)
+                    : shardcache_set(cache, key, klen, value, vlen);
+        if (rc == 0) {
+            // the value we just stored gets a new version
+            // (the lock is held, so nobody else changed it)
+            prev = shardcache_gets_local(cache, key, klen, NULL, &current);
+            if (prev)
+                free(prev);
+        } else {
+            rc = -1;
+        }
+    }
+
+    MUTEX_UNLOCK(lock);
+
+    if (new_version)
+        *new_version = current;
+
+    return rc;
 }
 
 int
-shardcache_del_async(shardcache_t *cache,
+shardcache_increment(shardcache_t *cache,
                      void *key,
                      size_t klen,
-                     shardcache_async_response_callback_t cb,
-                     void *priv)
+                     int64_t amount,
+                     int64_t *result)
 {
-    if (!key || !key)
+    if (!key || !klen)
         return -1;
 
-    if (cache->replica) {
-        int rc = shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_DELETE, key, klen, NULL, 0, 0);
-        if (cb)
-            cb(key, klen, rc, priv);
-        return rc;
+    char addr[1024];
+    int is_mine = shardcache_atomic_owner(cache, key, klen, addr, sizeof(addr));
+    if (is_mine == -1)
+        return -1;
+
+    if (!is_mine) {
+        uint32_t caps = 0;
+        int fd = shardcache_atomic_connection(cache, addr, &caps);
+        if (fd < 0)
+            return -1;
+        int rc = increment_on_peer(addr, (char *)cache->auth, SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                   key, klen, amount, result, fd);
+        shardcache_atomic_connection_done(cache, addr, fd, caps, rc);
+        return (rc == 0) ? 0 : -1;
     }
 
-    return shardcache_del_internal(cache, key, klen, 0, cb, priv);
-}
+    pthread_mutex_t *lock = shardcache_atomic_lock(cache, key, klen);
+    MUTEX_LOCK(lock);
 
-int
-shardcache_evict(shardcache_t *cache, void *key, size_t klen)
-{
-    if (!key || !klen)
-        return -1;
+    int rc = -1;
+    size_t vlen = 0;
+    uint64_t version = 0;
+    uint64_t counter = 0;
+    void *value = shardcache_gets_local(cache, key, klen, &vlen, &version);
+    if (value && vlen != sizeof(uint64_t)) {
+        char keystr[1024];
+        KEY2STR(key, klen, keystr, sizeof(keystr));
+        SHC_WARNING("The value for key %s is not a 64bit integer", keystr);
+    } else {
+        if (value) {
+            memcpy(&counter, value, sizeof(uint64_t));
+            counter = shc_ntoh64(counter);
+        }
+        // wrap around on overflow
+        counter += (uint64_t)amount;
+        uint64_t counter_nbo = shc_hton64(counter);
+        rc = shardcache_set(cache, key, klen, &counter_nbo, sizeof(uint64_t));
+        if (rc == 0 && result)
+            *result = (int64_t)counter;
+    }
 
-    if (cache->replica)
-        return shardcache_replica_dispatch(cache->replica, SHARDCACHE_REPLICA_OP_EVICT, key, klen, NULL, 0, 0);
+    MUTEX_UNLOCK(lock);
 
-    arc_remove(cache->arc, (const void *)key, klen);
+    if (value)
+        free(value);
 
-    return 0;
+    return (rc == 0) ? 0 : -1;
 }
 
-shardcache_node_t **
-shardcache_get_nodes(shardcache_t *cache, int *num_nodes)
+static shardcache_node_t **
+shardcache_copy_nodes(shardcache_node_t **nodes, int num_nodes)
 {
     int i;
-    int num = 0;
-    SPIN_LOCK(&cache->migration_lock);
-    num = cache->num_shards;
-    if (num_nodes)
-        *num_nodes = num;
-    shardcache_node_t **list = malloc(sizeof(shardcache_node_t *) * num);
-    for (i = 0; i < num; i++) {
-        shardcache_node_t *orig = cache->shards[i];
+    shardcache_node_t **list = malloc(sizeof(shardcache_node_t *) * num_nodes);
+    for (i = 0; i < num_nodes; i++) {
+        shardcache_node_t *orig = nodes[i];
         char *label = shardcache_node_get_label(orig);
         int num_replicas = shardcache_node_num_addresses(orig);
         char *addresses[num_replicas];
         shardcache_node_get_all_addresses(orig, addresses, num_replicas);
         list[i] = shardcache_node_create(label, addresses, num_replicas);
+        shardcache_node_set_weight(list[i], shardcache_node_get_weight(orig));
     }
+    return list;
+}
+
+shardcache_node_t **
+shardcache_get_nodes(shardcache_t *cache, int *num_nodes)
+{
+    int num = 0;
+    SPIN_LOCK(&cache->migration_lock);
+    num = cache->topology->num_shards;
+    if (num_nodes)
+        *num_nodes = num;
+    shardcache_node_t **list = shardcache_copy_nodes(cache->topology->shards, num);
     SPIN_UNLOCK(&cache->migration_lock);
     return list;
 }
@@ -2183,12 +4569,16 @@ migrate(void *priv)
                 if (value) {
                     shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
                     if (peer) {
-                        char *addr = shardcache_node_get_address(peer);
+                        char *addr = connections_pool_select_address(cache->connections_pool, peer);
                         SHC_DEBUG("Migrator copying %s to peer %s (%s)", keystr, node_name, addr);
-                        int fd = shardcache_get_connection_for_peer(cache, addr);
-                        rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, 0, fd, 1);
+                        // large values are compressed if the peer supports it
+                        uint32_t caps = 0;
+                        int fd = shardcache_get_connection_for_peer_caps(cache, addr, &caps);
+                        rc = send_to_peer(addr, (char *)cache->auth,
+                                          SHC_CONNECTION_SIG_HDR(caps, SHC_HDR_SIGNATURE_SIP),
+                                          key, klen, value, vlen, 0, fd, 1);
                         if (rc == 0) {
-                            shardcache_release_connection_for_peer(cache, addr, fd);
+                            shardcache_release_connection_for_peer_caps(cache, addr, fd, caps);
                             ATOMIC_INCREMENT(migrated_items);
                             list_push_value(to_delete, &index->items[i]);
                         } else {
@@ -2196,6 +4586,7 @@ migrate(void *priv)
                             SHC_WARNING("Errors copying %s to peer %s (%s)", keystr, node_name, addr);
                             ATOMIC_INCREMENT(errors);
                         }
+                        shardcache_node_destroy(peer);
                     } else {
                         SHC_ERROR("Can't find address for peer %s (me : %s)", node_name, cache->me);
                         ATOMIC_INCREMENT(errors);
@@ -2256,7 +4647,7 @@ shardcache_check_migration_continuum(shardcache_t *cache,
     int ignore = 0;
     int i,n;
 
-    if (num_nodes == cache->num_shards) {
+    if (num_nodes == cache->topology->num_shards) {
         // let's assume the lists are the same, if not
         // ignore will be set again to 0
         ignore = 1;
@@ -2264,7 +4655,7 @@ shardcache_check_migration_continuum(shardcache_t *cache,
             int found = 0;
             for (n = 0; n < num_nodes; n++) {
                 char *label1 = shardcache_node_get_label(nodes[i]);
-                char *label2 = shardcache_node_get_label(cache->shards[n]);
+                char *label2 = shardcache_node_get_label(cache->topology->shards[n]);
                 if (*label1 == *label2 && strcmp(label1, label2) == 0) {
                     found = 1;
                     break;
@@ -2286,43 +4677,38 @@ shardcache_set_migration_continuum(shardcache_t *cache,
                                    shardcache_node_t **nodes,
                                    int num_nodes)
 {
-    size_t shard_lens[num_nodes];
-    char *shard_names[num_nodes];
+    for (;;) {
+        SPIN_LOCK(&cache->migration_lock);
 
-    SPIN_LOCK(&cache->migration_lock);
+        if (cache->migration) {
+            // already in a migration, ignore this command
+            SPIN_UNLOCK(&cache->migration_lock);
+            return -1;
+        }
 
-    if (cache->migration) {
-        // already in a migration, ignore this command
-        SPIN_UNLOCK(&cache->migration_lock);
-        return -1;
-    }
+        if (shardcache_check_migration_continuum(cache, nodes, num_nodes) != 0) {
+            SPIN_UNLOCK(&cache->migration_lock);
+            return -1;
+        }
 
-    if (shardcache_check_migration_continuum(cache, nodes, num_nodes) != 0) {
+        int epoch = cache->topology_epoch;
         SPIN_UNLOCK(&cache->migration_lock);
-        return -1;
-    }
 
-    cache->migration_done = 0;
-    cache->migration_shards = malloc(sizeof(shardcache_node_t *) * num_nodes);
-    cache->num_migration_shards = num_nodes;
-    int i;
-    for (i = 0; i < cache->num_migration_shards; i++) {
-        shardcache_node_t *node = nodes[i];
-        shard_names[i] = shardcache_node_get_label(node);
-        int num_replicas = shardcache_node_num_addresses(node);
-        char *addresses[num_replicas];
-        shardcache_node_get_all_addresses(node, addresses, num_replicas);
-        cache->migration_shards[i] = shardcache_node_create(shard_names[i], addresses, num_replicas);
-        shard_lens[i] = strlen(shard_names[i]);
-    }
+        // the continuum is built without holding the lock
+        // (it may take a while in bounded-load mode)
+        shardcache_topology_t *migration = shardcache_topology_create(cache, nodes, num_nodes);
 
-    cache->migration = chash_create((const char **)shard_names,
-                                    shard_lens,
-                                    num_nodes,
-                                    200);
-
-    SPIN_UNLOCK(&cache->migration_lock);
-    return 0;
+        SPIN_LOCK(&cache->migration_lock);
+        if (cache->topology_epoch == epoch) {
+            cache->migration_done = 0;
+            shardcache_publish_topology(cache, &cache->migration, migration);
+            SPIN_UNLOCK(&cache->migration_lock);
+            return 0;
+        }
+        // the topologies changed in the meanwhile, check again
+        SPIN_UNLOCK(&cache->migration_lock);
+        shardcache_topology_destroy(migration);
+    }
 }
 
 static int
@@ -2352,11 +4738,17 @@ shardcache_migration_begin_internal(shardcache_t *cache,
             char *label = shardcache_node_get_label(nodes[i]);
             int rindex = random()%num_replicas;
             char *addr = shardcache_node_get_address_at_index(nodes[i], rindex);
-            fbuf_printf(&mgb_message, "%s:%s", label, addr);
+            int weight = shardcache_node_get_weight(nodes[i]);
+            if (weight > 1 || strchr(label, '@'))
+                fbuf_printf(&mgb_message, "%s@%d:%s", label, weight, addr);
+            else
+                fbuf_printf(&mgb_message, "%s:%s", label, addr);
         }
 
-        for (i = 0; i < cache->num_shards; i++) {
-            if (strcmp(shardcache_node_get_label(cache->shards[i]), cache->me) != 0) {
+        int num_current = 0;
+        shardcache_node_t **current = shardcache_get_nodes(cache, &num_current);
+        for (i = 0; i < num_current; i++) {
+            if (strcmp(shardcache_node_get_label(current[i]), cache->me) != 0) {
                 int num_replicas = shardcache_node_num_addresses(nodes[i]);
                 char *label = shardcache_node_get_label(nodes[i]);
                 int rindex = random()%num_replicas;
@@ -2374,6 +4766,7 @@ shardcache_migration_begin_internal(shardcache_t *cache,
                 }
             }
         }
+        shardcache_free_nodes(current, num_current);
         fbuf_destroy(&mgb_message);
     }
 
@@ -2398,15 +4791,10 @@ shardcache_migration_abort_internal(shardcache_t *cache)
     int ret = -1;
     SPIN_LOCK(&cache->migration_lock);
     if (cache->migration) {
-        chash_free(cache->migration);
-        free(cache->migration_shards);
+        shardcache_publish_topology(cache, &cache->migration, NULL);
         SHC_NOTICE("Migration aborted");
         ret = 0;
     }
-    cache->migration = NULL;
-    cache->migration_shards = NULL;
-    cache->num_migration_shards = 0;
-
     SPIN_UNLOCK(&cache->migration_lock);
     pthread_join(cache->migrate_th, NULL);
     return ret;
@@ -2426,14 +4814,15 @@ shardcache_migration_end_internal(shardcache_t *cache)
     int ret = -1;
     SPIN_LOCK(&cache->migration_lock);
     if (cache->migration) {
-        chash_free(cache->chash);
-        shardcache_free_nodes(cache->shards, cache->num_shards);
-        cache->chash = cache->migration;
-        cache->shards = cache->migration_shards;
-        cache->num_shards = cache->num_migration_shards;
-        cache->migration = NULL;
-        cache->migration_shards = NULL;
-        cache->num_migration_shards = 0;
+        // the new nodes and their continuum are published at once
+        shardcache_topology_t *migration = cache->migration;
+        shardcache_publish_topology(cache, &cache->topology, migration);
+        ATOMIC_SET(cache->migration, NULL);
+        ht_clear(cache->failover_continuums);
+        cache->failover_generation++;
+        // the peers are identified by their index in the list of nodes
+        if (cache->subscriptions)
+            peer_subscriptions_reset(cache->subscriptions);
         SHC_NOTICE("Migration ended");
         ret = 0;
     }
@@ -2535,7 +4924,12 @@ shardcache_iomux_run_timeout_high(shardcache_t *cache, int new_value)
 int
 shardcache_expire_time(shardcache_t *cache, int new_value)
 {
-    return shardcache_get_set_option(&cache->expire_time, new_value);
+    int old_value = shardcache_get_set_option(&cache->expire_time, new_value);
+    // copies obtained while expiration was disabled (or with a
+    // different expiration time) might outlive the subscriptions
+    if (new_value >= 0 && new_value != old_value && cache->subscriptions)
+        peer_subscriptions_reset(cache->subscriptions);
+    return old_value;
 }
 
 int
@@ -2544,6 +4938,203 @@ shardcache_serving_look_ahead(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->serving_look_ahead, new_value);
 }
 
+int
+shardcache_max_pending_requests(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->max_pending_requests, new_value);
+}
+
+int
+shardcache_max_remote_requests(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->max_remote_requests, new_value);
+}
+
+int
+shardcache_max_storage_requests(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->max_storage_requests, new_value);
+}
+
+int
+shardcache_peer_links(shardcache_t *cache, int new_value)
+{
+    return peer_links_num(cache->peer_links, new_value);
+}
+
+int
+shardcache_hedged_fetches(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->hedged_fetches, (new_value > 100) ? 100 : new_value);
+}
+
+int
+shardcache_breaker_threshold(shardcache_t *cache, int new_value)
+{
+    return peer_breakers_threshold(cache->peer_breakers, new_value);
+}
+
+int
+shardcache_breaker_cooldown(shardcache_t *cache, int new_value)
+{
+    return peer_breakers_cooldown(cache->peer_breakers, new_value);
+}
+
+int
+shardcache_breaker_failover(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->breaker_failover, new_value);
+}
+
+int
+shardcache_bounded_load(shardcache_t *cache, int new_value)
+{
+    int old_value = shardcache_get_set_option(&cache->bounded_load, new_value);
+    if (new_value < 0 || new_value == old_value)
+        return old_value;
+
+    // the owners of the keys change right away. The continuums are built
+    // without holding the lock (the load of the nodes is computed on a
+    // sample of the keys) out of a copy of the nodes, and built again if
+    // the nodes changed in the meanwhile
+    for (;;) {
+        SPIN_LOCK(&cache->migration_lock);
+        int epoch = cache->topology_epoch;
+        int num_nodes = cache->topology->num_shards;
+        shardcache_node_t **nodes = shardcache_copy_nodes(cache->topology->shards, num_nodes);
+        int num_migration_nodes = 0;
+        shardcache_node_t **migration_nodes = NULL;
+        if (cache->migration) {
+            num_migration_nodes = cache->migration->num_shards;
+            migration_nodes = shardcache_copy_nodes(cache->migration->shards, num_migration_nodes);
+        }
+        SPIN_UNLOCK(&cache->migration_lock);
+
+        shardcache_topology_t *topology = shardcache_topology_create(cache, nodes, num_nodes);
+        shardcache_topology_t *migration = NULL;
+        if (migration_nodes)
+            migration = shardcache_topology_create(cache, migration_nodes, num_migration_nodes);
+        shardcache_free_nodes(nodes, num_nodes);
+        if (migration_nodes)
+            shardcache_free_nodes(migration_nodes, num_migration_nodes);
+
+        SPIN_LOCK(&cache->migration_lock);
+        if (cache->topology_epoch == epoch) {
+            shardcache_publish_topology(cache, &cache->topology, topology);
+            if (migration)
+                shardcache_publish_topology(cache, &cache->migration, migration);
+            ht_clear(cache->failover_continuums);
+            cache->failover_generation++;
+            // the new owners don't know who got a copy of their keys
+            if (cache->subscriptions)
+                peer_subscriptions_reset(cache->subscriptions);
+            SPIN_UNLOCK(&cache->migration_lock);
+            break;
+        }
+        SPIN_UNLOCK(&cache->migration_lock);
+        shardcache_topology_destroy(topology);
+        if (migration)
+            shardcache_topology_destroy(migration);
+    }
+    return old_value;
+}
+
+int
+shardcache_tracked_evictions(shardcache_t *cache, int new_value)
+{
+    if (!cache->subscriptions)
+        return 0;
+    return peer_subscriptions_max_keys(cache->subscriptions, new_value);
+}
+
+int
+shardcache_busy_poll(shardcache_t *cache, int new_value)
+{
+    int old_value = shardcache_get_set_option(&cache->busy_poll, new_value);
+    // wake up the workers eventually waiting for new connections
+    if (new_value > 0 && old_value == 0 && cache->serv)
+        serving_wakeup_workers(cache->serv);
+    return old_value;
+}
+
+int
+shardcache_so_busy_poll(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->so_busy_poll, new_value);
+}
+
+int
+shardcache_thread_set_affinity(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int rc = pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+    if (rc != 0) {
+        SHC_ERROR("Can't pin thread to cpu %d: %s", cpu, strerror(rc));
+        return -1;
+    }
+    return 0;
+#else
+    SHC_WARNING("CPU affinity is not supported on this platform");
+    return -1;
+#endif
+}
+
+int
+shardcache_workers_cpu_affinity(shardcache_t *cache, int *cpus, int num_cpus)
+{
+    if (!cpus || num_cpus <= 0 || !cache->serv)
+        return -1;
+    return serving_set_cpu_affinity(cache->serv, cpus, num_cpus);
+}
+
+int
+shardcache_async_cpu_affinity(shardcache_t *cache, int *cpus, int num_cpus)
+{
+    if (!cpus || num_cpus <= 0)
+        return -1;
+
+    int i;
+    int rc = 0;
+    for (i = 0; i < cache->num_async; i++) {
+        if (shardcache_thread_set_affinity(cache->async_context[i].io_th,
+                                           cpus[i % num_cpus]) != 0)
+        {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+int
+shardcache_compression(shardcache_t *cache, int new_value)
+{
+    if (new_value >= 0) {
+        if (!shc_compression_supported(new_value)) {
+            SHC_ERROR("Compression algorithm %d is not supported", new_value);
+            return -1;
+        }
+        // only new connections will be affected
+        connections_pool_negotiate(cache->connections_pool, (char *)cache->auth,
+                                   SHC_CAP_TAGGED|SHC_CAP_CRC32C|SHC_CAP_WIDE_RECORDS|SHC_CAP_MULTI|
+                                   SHC_CAP_MULTI_WRITE|SHC_CAP_ATOMIC|SHC_CAP_CONDITIONAL|
+                                   shc_compression_cap(new_value));
+        if (cache->peer_links)
+            peer_links_negotiate(cache->peer_links,
+                                 SHC_CAP_CRC32C|SHC_CAP_WIDE_RECORDS|
+                                 shc_compression_cap(new_value));
+    }
+    return shardcache_get_set_option(&cache->compression, new_value);
+}
+
+int
+shardcache_compression_threshold(shardcache_t *cache, int new_value)
+{
+    return shc_compression_threshold(new_value);
+}
+
 int
 shardcache_lazy_expiration(shardcache_t *cache, int new_value)
 {
@@ -2589,7 +5180,7 @@ shardcache_storage_load(char *filename, char **options)
         return NULL;
     }
 
-    if (*version != SHARDCACHE_STORAGE_API_VERSION) {
+    if (*version < SHARDCACHE_STORAGE_API_VERSION_MIN || *version > SHARDCACHE_STORAGE_API_VERSION) {
         SHC_ERROR("The storage plugin version doesn't match (%d != %d)",
                     *version, SHARDCACHE_STORAGE_API_VERSION);
         dlclose(st->internal.handle);
@@ -34,6 +34,36 @@ typedef struct __shardcache_s shardcache_t;
                                                      // requests to handle ahead
 #define SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT  1      // number of async i/o threads used
                                                      // for inter-node communication
+#define SHARDCACHE_MAX_PENDING_REQUESTS_DEFAULT 8192 // requests being served by a worker
+                                                     // above which new ones are refused
+#define SHARDCACHE_MAX_REMOTE_REQUESTS_DEFAULT  4096 // requests in-flight to remote peers
+                                                     // above which new ones are refused
+#define SHARDCACHE_MAX_STORAGE_REQUESTS_DEFAULT 0    // concurrent storage operations above
+                                                     // which new requests are refused (0 == no limit)
+#define SHARDCACHE_BUSY_POLL_DEFAULT          0      // workers sleep in the mux when idle
+#define SHARDCACHE_SO_BUSY_POLL_DEFAULT       0      // (in microsecs) SO_BUSY_POLL disabled
+#define SHARDCACHE_PEER_LINKS_DEFAULT         2      // persistent connections to each peer
+                                                     // used to pipeline the remote fetches
+#define SHARDCACHE_HEDGED_FETCHES_DEFAULT     5      // (in percent) max remote fetches which
+                                                     // can be hedged (0 == no hedging)
+#define SHARDCACHE_BREAKER_THRESHOLD_DEFAULT  5      // consecutive failures opening the circuit
+                                                     // to a peer (0 == no circuit breakers)
+#define SHARDCACHE_BREAKER_COOLDOWN_DEFAULT   1000   // (in millisecs) time between the probes
+                                                     // sent to a peer whose circuit is open
+#define SHARDCACHE_BREAKER_FAILOVER_DEFAULT   0      // fail over to the global storage only
+#define SHARDCACHE_TRACKED_EVICTIONS_DEFAULT  0      // keys whose copies are tracked by
+                                                     // the owner (0 == broadcast evictions)
+#define SHARDCACHE_BOUNDED_LOAD_DEFAULT      0      // (in percent) share of the keys a node
+                                                     // can own in excess (0 == no bound)
+
+// algorithms which can be used to compress the messages
+// exchanged with peers and clients (if supported by both ends)
+#define SHARDCACHE_COMPRESSION_NONE           0
+#define SHARDCACHE_COMPRESSION_LZ4            1
+#define SHARDCACHE_COMPRESSION_ZSTD           2
+#define SHARDCACHE_COMPRESSION_DEFAULT        SHARDCACHE_COMPRESSION_LZ4
+#define SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT 1024 // (in bytes) smaller records
+                                                      // are never compressed
 extern const char *LIBSHARDCACHE_VERSION;
 
 /*
@@ -230,6 +260,272 @@ int shardcache_expire_time(shardcache_t *cache, int new_value);
  */
 int shardcache_serving_look_ahead(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Allows to change the maximum number of requests a serving worker
+ *        can have in progress before refusing new ones
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The maximum amount of pending requests (0 means no limit).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the max_pending_requests setting
+ * @note Refused requests are answered with a BUSY response so that
+ *       clients can retry them later
+ * @note defaults to SHARDCACHE_MAX_PENDING_REQUESTS_DEFAULT
+ */
+int shardcache_max_pending_requests(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the maximum number of requests in-flight to remote
+ *        peers above which new requests for keys owned by other nodes are refused
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The maximum amount of in-flight remote requests (0 means no limit).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the max_remote_requests setting
+ * @note defaults to SHARDCACHE_MAX_REMOTE_REQUESTS_DEFAULT
+ */
+int shardcache_max_remote_requests(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the maximum number of concurrent storage operations
+ *        above which new requests for keys owned by this node are refused
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The maximum amount of concurrent storage operations (0 means no limit).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the max_storage_requests setting
+ * @note defaults to SHARDCACHE_MAX_STORAGE_REQUESTS_DEFAULT
+ */
+int shardcache_max_storage_requests(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to enable/disable the 'busy_poll' mode
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   1 if busy_poll is desired, 0 otherwise.\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the busy_poll setting
+ * @note When busy polling is enabled both the serving workers and the async i/o
+ *       threads poll their sockets without ever sleeping, trading one full cpu
+ *       per thread for a lower latency. It should be used together with
+ *       shardcache_workers_cpu_affinity() and shardcache_async_cpu_affinity()
+ *       so that the spinning threads don't compete for the same cpus
+ * @note defaults to SHARDCACHE_BUSY_POLL_DEFAULT
+ */
+int shardcache_busy_poll(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Set the number of persistent links used to fetch items from each peer
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The number of links (at most 16), 0 to use a dedicated
+ *                    connection for each remote fetch.\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the peer_links setting
+ * @note The asynchronous fetches are sent as tagged requests and pipelined on
+ *       the links, the responses are matched back to the waiting requests.
+ *       Peers not supporting tagged requests are always reached through
+ *       dedicated connections
+ * @note defaults to SHARDCACHE_PEER_LINKS_DEFAULT
+ */
+int shardcache_peer_links(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Set the maximum rate of hedged remote fetches
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The maximum percentage of the remote fetches which can be
+ *                    hedged (0 disables hedging).\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the hedged_fetches setting
+ * @note If the owner of an item has multiple addresses and the first byte
+ *       of the response doesn't arrive within the 95th percentile of the
+ *       latency observed so far, the same request is also sent to another
+ *       address of the owner. The first response is used and the other
+ *       request is cancelled. The 'hedged_fetches' and 'hedged_fetches_won'
+ *       counters track how many hedged requests were sent and answered first
+ * @note defaults to SHARDCACHE_HEDGED_FETCHES_DEFAULT
+ */
+int shardcache_hedged_fetches(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Set the number of consecutive failures opening the circuit to a peer
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The number of consecutive failed fetches after which no
+ *                    more requests are sent to the peer (0 disables the
+ *                    circuit breakers).\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the breaker_threshold setting
+ * @note While the circuit is open the fetches for the keys owned by the peer
+ *       fail immediately (falling back to the global storage if any, or to
+ *       the next node on the continuum if enabled with
+ *       shardcache_breaker_failover()). A single probe is let through every
+ *       'breaker_cooldown' milliseconds and the circuit closes as soon as one
+ *       succeeds. The transitions are counted by the 'breakers_opened',
+ *       'breakers_half_opened' and 'breakers_closed' counters
+ * @note defaults to SHARDCACHE_BREAKER_THRESHOLD_DEFAULT
+ */
+int shardcache_breaker_threshold(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Set the time between the probes sent to a peer whose circuit is open
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The cooldown period in milliseconds.\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the breaker_cooldown setting
+ * @note defaults to SHARDCACHE_BREAKER_COOLDOWN_DEFAULT
+ */
+int shardcache_breaker_cooldown(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Fail over to the next node on the continuum when the circuit to the
+ *        owner of a key is open
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   1 to fetch the key from the node which would own it if
+ *                    the unreachable owner was removed, 0 to only fall back
+ *                    to the global storage.\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the breaker_failover setting
+ * @note defaults to SHARDCACHE_BREAKER_FAILOVER_DEFAULT
+ */
+int shardcache_breaker_failover(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Set the maximum number of keys for which the owner tracks the peers
+ *        which got a copy, so that evictions are sent only to them
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The maximum number of tracked keys (0 disables the
+ *                    tracking and evictions are broadcast to all peers).\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the tracked_evictions setting
+ * @note The tracking is used only if expire_time is set: once the limit is
+ *       reached (or the nodes change) all the subscriptions are forgotten and
+ *       evictions are broadcast until the copies obtained in the meanwhile
+ *       are expired. The setting (and the expire_time) is expected to be the
+ *       same on all the nodes and all of them must identify themselves when
+ *       fetching from the owner: the nodes running older versions don't, so
+ *       the tracking must be enabled only once all the nodes have been
+ *       upgraded or their copies won't be evicted. The copies fetched
+ *       through connections not identifying this node (for instance when
+ *       persistent connections are disabled) aren't kept in the cache
+ * @note The nodes with multiple addresses (replicated) always broadcast the
+ *       evictions, since each instance knows only about the copies it served
+ * @note Unless a secret is shared the label the peers identify themselves
+ *       with can't be verified: anybody able to connect to the node can
+ *       claim to be one of the nodes (so that copies it fetches are tracked
+ *       for that node) and force the subscriptions to be forgotten by
+ *       fetching more keys than the limit
+ * @note defaults to SHARDCACHE_TRACKED_EVICTIONS_DEFAULT
+ */
+int shardcache_tracked_evictions(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Bound the share of the keys owned by each node
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   The percent of its (weighted) share of the keys a node
+ *                    can own in excess, the keys above the bound are spilled
+ *                    to the nodes following it on the continuum
+ *                    (0 disables the bounded-load mode).\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the bounded_load setting
+ * @note The owners of the keys are computed out of the list of nodes, their
+ *       weights and this setting, which therefore must be the same on all the
+ *       nodes and clients (see shardcache_client_bounded_load()).
+ *       Changing it moves the keys without migrating them, so it should be
+ *       done only before the node starts serving requests
+ * @note defaults to SHARDCACHE_BOUNDED_LOAD_DEFAULT
+ */
+int shardcache_bounded_load(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the SO_BUSY_POLL value set on the served connections
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The amount of microseconds the kernel will busy poll the
+ *                  device queue on blocking reads (0 disables SO_BUSY_POLL).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the so_busy_poll setting
+ * @note Only connections accepted after the change are affected.
+ *       Setting SO_BUSY_POLL requires CAP_NET_ADMIN and is ignored
+ *       (with a warning) on platforms not supporting it
+ * @note defaults to SHARDCACHE_SO_BUSY_POLL_DEFAULT
+ */
+int shardcache_so_busy_poll(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Set the algorithm used to compress the messages exchanged with the peers
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value One of the SHARDCACHE_COMPRESSION_* values
+ *                  (SHARDCACHE_COMPRESSION_NONE disables compression).\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the compression setting or -1 if the
+ *         requested algorithm is not supported by this build
+ * @note Compression is negotiated on each new connection so it's used only if
+ *       the peer supports the same algorithm, and only records bigger than
+ *       the compression threshold are compressed.
+ *       Responses to clients are compressed with whichever algorithm
+ *       the client asked for (if supported).
+ *       LZ4 and ZSTD support must be enabled at build time
+ *       (make WITH_LZ4=1 WITH_ZSTD=1)
+ * @note defaults to SHARDCACHE_COMPRESSION_DEFAULT
+ */
+int shardcache_compression(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Set the minimum size of the records worth compressing
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param new_value The size in bytes.\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the compression_threshold setting
+ * @note The threshold is global to the process, it's shared by all the
+ *       shardcache and shardcache_client instances
+ * @note defaults to SHARDCACHE_COMPRESSION_THRESHOLD_DEFAULT
+ */
+int shardcache_compression_threshold(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Pin the serving workers to the provided cpus
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param cpus     An array of cpu numbers, the worker i will be pinned
+ *                 to cpus[i % num_cpus]
+ * @param num_cpus The number of cpus in the array
+ * @return 0 on success, -1 if any of the workers couldn't be pinned
+ * @note CPU affinity is supported only on linux
+ */
+int shardcache_workers_cpu_affinity(shardcache_t *cache, int *cpus, int num_cpus);
+
+/*
+ * @brief Pin the async i/o threads to the provided cpus
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param cpus     An array of cpu numbers, the async thread i will be pinned
+ *                 to cpus[i % num_cpus]
+ * @param num_cpus The number of cpus in the array
+ * @return 0 on success, -1 if any of the threads couldn't be pinned
+ * @note CPU affinity is supported only on linux
+ */
+int shardcache_async_cpu_affinity(shardcache_t *cache, int *cpus, int num_cpus);
+
 /*
  * @brief Allows to enable/disable the 'lazy_expiration' mode
  * @param cache       A valid pointer to a shardcache_t structure
@@ -409,6 +705,51 @@ shardcache_get_offset_async(shardcache_t *cache,
                             shardcache_get_async_callback_t cb,
                             void *priv);
 
+/**
+ * @brief Callback passed to shardcache_get_multi_async() to receive the values
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ * @param index   The index of the key in the array passed to shardcache_get_multi_async()
+ * @param data    The value (NULL if not found or if an error occurred)
+ * @param dlen    The length of the value
+ * @param priv    The priv pointer passed to shardcache_get_multi_async()
+ * @note The callback is called exactly once for each key, as soon as its value
+ *       is available (so not necessarily in the order of the keys) and possibly
+ *       by a different thread, hence it needs to be thread-safe.
+ *       The data is valid only until the callback returns
+ */
+typedef void (*shardcache_get_multi_callback_t)(void *key,
+                                                size_t klen,
+                                                int index,
+                                                void *data,
+                                                size_t dlen,
+                                                void *priv);
+
+/**
+ * @brief Get the values for multiple keys asynchronously
+ * @param cache     A valid pointer to a shardcache_t structure
+ * @param keys      An array of pointers to the keys
+ * @param klens     An array holding the length of each key
+ * @param num_keys  The number of keys
+ * @param cb        The shardcache_get_multi_callback_t which will be
+ *                  called with the value of each key
+ * @param priv      A pointer which will be passed to the callback
+ *
+ * @return 0 on success, -1 otherwise
+ *
+ * @note The values cached locally are returned immediately, the ones owned by
+ *       other peers are fetched with a single batched request per peer and the
+ *       ones owned by this node are fetched from the storage with a single call
+ *       to its fetch_multi callback (if provided, they are not cached though).
+ *       The keys must stay valid until the callback has been called for all of them
+ */
+int shardcache_get_multi_async(shardcache_t *cache,
+                               void **keys,
+                               size_t *klens,
+                               int num_keys,
+                               shardcache_get_multi_callback_t cb,
+                               void *priv);
+
 /**
  * @brief Callback expected by all the _async() routines returning an integer result
  *        (basically all apart shardcache_get_async() shardcache_offset_async())
@@ -594,6 +935,180 @@ int shardcache_del_async(shardcache_t *cache,
  */
 int shardcache_evict(shardcache_t *cache, void *key, size_t klen);
 
+/**
+ * @brief Set the values for multiple keys at once
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param keys     An array of pointers to the keys
+ * @param klens    An array holding the length of each key
+ * @param values   An array of pointers to the values
+ * @param vlens    An array holding the length of each value
+ * @param expires  If not NULL, an array holding the number of seconds after
+ *                 which each value expires (0 for non-volatile values)
+ * @param num_keys The number of keys
+ * @param results  If not NULL, the result (0 on success, -1 otherwise)
+ *                 for each key will be stored in this array
+ * @return 0 if all the values have been set, -1 otherwise
+ *
+ * @note The keys owned by other peers are forwarded with a single SET_MULTI
+ *       command to each owner (if supported by the peer), the non-volatile
+ *       ones owned by this node are passed to the storage with a single call
+ *       to its store_multi callback (if provided)
+ */
+int shardcache_set_multi(shardcache_t *cache,
+                         void **keys,
+                         size_t *klens,
+                         void **values,
+                         size_t *vlens,
+                         time_t *expires,
+                         int num_keys,
+                         int *results);
+
+/**
+ * @brief Remove the values for multiple keys at once
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param keys     An array of pointers to the keys
+ * @param klens    An array holding the length of each key
+ * @param num_keys The number of keys
+ * @param results  If not NULL, the result (0 on success, -1 otherwise)
+ *                 for each key will be stored in this array
+ * @return 0 if all the keys have been removed, -1 otherwise
+ * @see shardcache_set_multi()
+ */
+int shardcache_del_multi(shardcache_t *cache,
+                         void **keys,
+                         size_t *klens,
+                         int num_keys,
+                         int *results);
+
+/**
+ * @brief Touch multiple keys at once
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param keys     An array of pointers to the keys
+ * @param klens    An array holding the length of each key
+ * @param num_keys The number of keys
+ * @param results  If not NULL, the result (0 on success, -1 otherwise)
+ *                 for each key will be stored in this array
+ * @return 0 if all the keys have been touched, -1 otherwise
+ * @see shardcache_touch()
+ */
+int shardcache_touch_multi(shardcache_t *cache,
+                           void **keys,
+                           size_t *klens,
+                           int num_keys,
+                           int *results);
+
+/**
+ * @brief Remove the values for multiple keys from the cache
+ * @note the values will not be removed from the underlying storage
+ * @param cache    A valid pointer to a shardcache_t structure
+ * @param keys     An array of pointers to the keys
+ * @param klens    An array holding the length of each key
+ * @param num_keys The number of keys
+ * @return 0 on success, -1 otherwise
+ */
+int shardcache_evict_multi(shardcache_t *cache, void **keys, size_t *klens, int num_keys);
+
+/**
+ * @brief Get the value of a key together with its version stamp
+ *
+ * The value is always retrieved from the owner of the key.
+ * The version stamp changes whenever the value changes and can be
+ * provided to shardcache_cas() to update the value only if it has
+ * not been modified in the meanwhile.
+ * Version stamps are never reused (storing the same data again gives
+ * a new one), but the owner might assign a new version to an unchanged
+ * value which has been evicted from its cache in the meanwhile
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ * @param vlen    If provided the length of the returned value will be stored
+ *                at the location pointed by vlen
+ * @param version If provided the version stamp of the returned value will be
+ *                stored at the location pointed by version (0 if the key doesn't exist)
+ * @return A pointer to the stored value if any, NULL otherwise
+ * @note The caller is responsible of releasing the memory of the returned value
+ */
+void *shardcache_gets(shardcache_t *cache,
+                      void *key,
+                      size_t klen,
+                      size_t *vlen,
+                      uint64_t *version);
+
+/**
+ * @brief Get the value of a key only if it changed since a known version
+ *
+ * Allows to revalidate a copy of a value without transferring it again.
+ * If the value is not cached locally, non-owner nodes revalidate it
+ * against the owner (the value is transferred only if it changed) and
+ * keep the value obtained in the cache
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ * @param version A pointer to the known version stamp (as returned by
+ *                shardcache_gets()), updated if the value changed
+ *                (0 if the key doesn't exist anymore)
+ * @param value   If provided and the value changed, *value will point to
+ *                the new value (NULL if the key doesn't exist)
+ * @param vlen    If provided and the value changed, the length of the new
+ *                value will be stored at the location pointed by vlen
+ * @return 0 if the value changed, 1 if it didn't change, -1 in case of errors
+ * @note The caller is responsible of releasing the memory of the returned value
+ */
+int shardcache_get_if_modified(shardcache_t *cache,
+                               void *key,
+                               size_t klen,
+                               uint64_t *version,
+                               void **value,
+                               size_t *vlen);
+
+/**
+ * @brief Set the value of a key only if its version stamp matches
+ *
+ * The comparison and the update are executed atomically by the owner of the key
+ * with respect to the other CAS/INCR/DECR and SET commands.
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param key         A valid pointer to the key
+ * @param klen        The length of the key
+ * @param version     The expected version stamp (as returned by shardcache_gets()),
+ *                    0 means that the key must not exist
+ * @param value       A valid pointer to the value
+ * @param vlen        The length of the value
+ * @param expire      The number of seconds after which the value will expire
+ *                    (0 means that the value will be stored as by shardcache_set())
+ * @param new_version If provided the version stamp of the value stored after the
+ *                    command will be stored at the location pointed by new_version
+ * @return 0 if the value has been set, 1 if the version stamp doesn't match,
+ *         -1 in case of errors
+ */
+int shardcache_cas(shardcache_t *cache,
+                   void *key,
+                   size_t klen,
+                   uint64_t version,
+                   void *value,
+                   size_t vlen,
+                   time_t expire,
+                   uint64_t *new_version);
+
+/**
+ * @brief Atomically add a (possibly negative) amount to a 64bit counter
+ *
+ * Counters are stored as 8 bytes integers in network byte order,
+ * a missing key counts as 0. The command is executed by the owner of the key
+ * @param cache  A valid pointer to a shardcache_t structure
+ * @param key    A valid pointer to the key
+ * @param klen   The length of the key
+ * @param amount The amount to add to the counter
+ * @param result If provided the new value of the counter will be stored
+ *               at the location pointed by result
+ * @return 0 on success, -1 otherwise (including if the value stored
+ *         for the key is not a 64bit integer)
+ */
+int shardcache_increment(shardcache_t *cache,
+                         void *key,
+                         size_t klen,
+                         int64_t amount,
+                         int64_t *result);
+
 /**
  * @brief Get the node owning a specific key
  * @param cache A valid pointer to a shardcache_t structure
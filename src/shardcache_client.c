@@ -1,4 +1,5 @@
 #include <sys/types.h>
+#include <sys/time.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,25 +8,28 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <limits.h>
-#include <chash.h>
 #include <fbuf.h>
 #include <rbuf.h>
 #include <linklist.h>
 #include <queue.h>
 #include <iomux.h>
+#include <hashtable.h>
 
 #include <pthread.h>
 
 #include "connections.h"
 #include "messaging.h"
 #include "connections_pool.h"
+#include "continuum.h"
 #include "shardcache_internal.h"
 #include "shardcache_client.h"
 
 #define SHC_PIPELINE_MAX_DEFAULT SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT
+#define SHC_BUSY_BACKOFF_BASE 10000 // (in microsecs) doubled at each retry
 
 struct shardcache_client_s {
-    chash_t *chash;
+    continuum_t *continuum; // resolves the keys to their owner in 'shards'
+    int bounded_load;       // (see shardcache_client_bounded_load())
     shardcache_node_t **shards;
     connections_pool_t *connections;
     int num_shards;
@@ -41,8 +45,32 @@ struct shardcache_client_s {
     pthread_cond_t wakeup_cond;
     pthread_mutex_t wakeup_lock;
     int quit;
+    int tagged_requests;
+    int busy_retries;
+    int use_sessions;
+    int wide_records;
+    int compression;
 };
 
+// signature header to use on a connection (messages sent on authenticated
+// connections are just checksummed instead of being signed)
+#define SHC_CLIENT_SIG_HDR(__caps) SHC_CONNECTION_SIG_HDR(__caps, SHC_HDR_SIGNATURE_SIP)
+
+static void
+shc_update_negotiation(shardcache_client_t *c)
+{
+    // the capabilities used by the multi-key commands are negotiated on
+    // each connection as well, so they always reflect what the peer
+    // accepted on the connection actually used to send the requests
+    uint32_t wanted = SHC_CAP_TAGGED|SHC_CAP_MULTI|SHC_CAP_MULTI_WRITE;
+    if (c->use_sessions)
+        wanted |= SHC_CAP_CRC32C;
+    if (c->wide_records)
+        wanted |= SHC_CAP_WIDE_RECORDS;
+    wanted |= shc_compression_cap(c->compression);
+    connections_pool_negotiate(c->connections, (char *)c->auth, wanted);
+}
+
 int
 shardcache_client_tcp_timeout(shardcache_client_t *c, int new_value)
 {
@@ -54,6 +82,32 @@ int shardcache_client_check_connection_timeout(shardcache_client_t *c, int new_v
     return connections_pool_expire_time(c->connections, new_value);
 }
 
+// the nodes must build the same continuum (see shardcache_bounded_load())
+static continuum_t *
+shardcache_client_continuum_create(shardcache_client_t *c)
+{
+    char *labels[c->num_shards];
+    int weights[c->num_shards];
+    int i;
+    for (i = 0; i < c->num_shards; i++) {
+        labels[i] = shardcache_node_get_label(c->shards[i]);
+        weights[i] = shardcache_node_get_weight(c->shards[i]);
+    }
+    return continuum_create(labels, weights, c->num_shards, NULL, c->bounded_load);
+}
+
+int
+shardcache_client_bounded_load(shardcache_client_t *c, int new_value)
+{
+    int old_value = c->bounded_load;
+    if (new_value >= 0 && new_value != old_value) {
+        c->bounded_load = new_value;
+        continuum_destroy(c->continuum);
+        c->continuum = shardcache_client_continuum_create(c);
+    }
+    return old_value;
+}
+
 int
 shardcache_client_use_random_node(shardcache_client_t *c, int new_value)
 {
@@ -79,6 +133,63 @@ shardcache_client_pipeline_max(shardcache_client_t *c, int new_value)
     return old_value;
 }
 
+int
+shardcache_client_tagged_requests(shardcache_client_t *c, int new_value)
+{
+    int old_value = c->tagged_requests;
+    if (new_value >= 0)
+        c->tagged_requests = new_value;
+    return old_value;
+}
+
+int
+shardcache_client_busy_retries(shardcache_client_t *c, int new_value)
+{
+    int old_value = c->busy_retries;
+    if (new_value >= 0)
+        c->busy_retries = new_value;
+    return old_value;
+}
+
+int
+shardcache_client_use_sessions(shardcache_client_t *c, int new_value)
+{
+    int old_value = c->use_sessions;
+    if (new_value >= 0) {
+        c->use_sessions = new_value;
+        shc_update_negotiation(c);
+    }
+    return old_value;
+}
+
+int
+shardcache_client_wide_records(shardcache_client_t *c, int new_value)
+{
+    int old_value = c->wide_records;
+    if (new_value >= 0) {
+        c->wide_records = new_value;
+        shc_update_negotiation(c);
+    }
+    return old_value;
+}
+
+int
+shardcache_client_compression(shardcache_client_t *c, int new_value)
+{
+    int old_value = c->compression;
+    if (new_value >= 0) {
+        if (!shc_compression_supported(new_value)) {
+            snprintf(c->errstr, sizeof(c->errstr),
+                     "Compression algorithm %d is not supported", new_value);
+            c->errno = SHARDCACHE_CLIENT_ERROR_ARGS;
+            return -1;
+        }
+        c->compression = new_value;
+        shc_update_negotiation(c);
+    }
+    return old_value;
+}
+
 shardcache_client_t *
 shardcache_client_create(shardcache_node_t **nodes, int num_nodes, char *auth)
 {
@@ -88,8 +199,6 @@ shardcache_client_create(shardcache_node_t **nodes, int num_nodes, char *auth)
         return NULL;
     }
     shardcache_client_t *c = calloc(1, sizeof(shardcache_client_t));
-    size_t shard_lens[num_nodes];
-    char *shard_names[num_nodes];
 
     c->shards = malloc(sizeof(shardcache_node_t *) * num_nodes);
     c->connections = connections_pool_create(SHARDCACHE_TCP_TIMEOUT_DEFAULT,
@@ -97,14 +206,11 @@ shardcache_client_create(shardcache_node_t **nodes, int num_nodes, char *auth)
                                              1);
     for (i = 0; i < num_nodes; i++) {
         c->shards[i] = shardcache_node_copy(nodes[i]);
-
-        shard_names[i] = shardcache_node_get_label(c->shards[i]);
-        shard_lens[i] = strlen(shard_names[i]);
     }
 
     c->num_shards = num_nodes;
 
-    c->chash = chash_create((const char **)shard_names, shard_lens, c->num_shards, 200);
+    c->continuum = shardcache_client_continuum_create(c);
 
     if (auth && *auth) {
         c->auth = calloc(1, 16);
@@ -116,6 +222,15 @@ shardcache_client_create(shardcache_node_t **nodes, int num_nodes, char *auth)
 
     c->pipeline_max = SHC_PIPELINE_MAX_DEFAULT;
 
+    c->tagged_requests = 1;
+    c->busy_retries = SHARDCACHE_CLIENT_BUSY_RETRIES_DEFAULT;
+    c->use_sessions = 1;
+    c->wide_records = 1;
+    c->compression = shc_compression_supported(SHARDCACHE_COMPRESSION_DEFAULT)
+                   ? SHARDCACHE_COMPRESSION_DEFAULT
+                   : SHARDCACHE_COMPRESSION_NONE;
+    shc_update_negotiation(c);
+
     c->async_jobs = queue_create();
 
     return c;
@@ -139,11 +254,8 @@ select_other_node(shardcache_client_t *c, char *addr)
 }
 
 static inline char *
-select_node(shardcache_client_t *c, void *key, size_t klen, int *fd)
+select_node(shardcache_client_t *c, void *key, size_t klen, int *fd, uint32_t *caps)
 {
-    const char *node_name;
-    size_t name_len = 0;
-    int i;
     char *addr = NULL;
     shardcache_node_t *node = NULL;
 
@@ -156,25 +268,23 @@ select_node(shardcache_client_t *c, void *key, size_t klen, int *fd)
             c->current_node = node;
         }
     } else {
-        chash_lookup(c->chash, key, klen, &node_name, &name_len);
-
-        for (i = 0; i < c->num_shards; i++) {
-            if (strncmp(node_name, shardcache_node_get_label(c->shards[i]), name_len) == 0)
-            {
-                node = c->shards[i];
-                c->current_node = node;
-                break;
-            }
+        int index = continuum_lookup(c->continuum, key, klen);
+        if (index >= 0) {
+            node = c->shards[index];
+            c->current_node = node;
         }
     }
 
     if (node) {
-        addr = shardcache_node_get_address(node);
+        addr = connections_pool_select_address(c->connections, node);
         if (fd) {
             int retries = 3;
             do {
-                *fd = connections_pool_get(c->connections, addr);
+                *fd = connections_pool_get_caps(c->connections, addr, caps);
                 if (*fd < 0) {
+                    // the address can't be reached, account the failure
+                    connections_pool_request(c->connections, addr);
+                    connections_pool_sample(c->connections, addr, 0, 1);
                     char *other_addr = select_other_node(c, addr);
                     if (other_addr == addr)
                         break;
@@ -187,11 +297,57 @@ select_node(shardcache_client_t *c, void *key, size_t klen, int *fd)
     return addr;
 }
 
+// the commands sent to the address chosen by select_node() are accounted to
+// it, so that the next selections prefer the fastest (and working) addresses
+static inline void
+shc_request_begin(shardcache_client_t *c, char *addr, struct timeval *start)
+{
+    connections_pool_request(c->connections, addr);
+    gettimeofday(start, NULL);
+}
+
+// 'rc' is the return code of the command (a refusal counts as an error)
+static inline void
+shc_request_end(shardcache_client_t *c, char *addr, struct timeval *start, int rc)
+{
+    struct timeval now, elapsed;
+    gettimeofday(&now, NULL);
+    timersub(&now, start, &elapsed);
+    connections_pool_sample(c->connections, addr,
+                            (uint64_t)elapsed.tv_sec * 1000000 + elapsed.tv_usec, (rc < 0));
+}
+
+// waits before retrying a command refused by a busy node
+// returns 1 if the command should be retried, 0 otherwise
+static inline int
+shc_busy_backoff(shardcache_client_t *c, int rc, int *attempt)
+{
+    if (rc != SHARDCACHE_PEER_BUSY || *attempt >= c->busy_retries)
+        return 0;
+
+    // exponential backoff with some jitter to avoid retrying
+    // all at the same time when many clients are refused
+    useconds_t delay = SHC_BUSY_BACKOFF_BASE << *attempt;
+    usleep((delay / 2) + (random() % ((delay / 2) + 1)));
+    (*attempt)++;
+    return 1;
+}
+
+static inline void
+shc_busy_error(shardcache_client_t *c, char *addr, int fd, uint32_t caps)
+{
+    // the whole response has been read, the connection can be reused
+    connections_pool_add_caps(c->connections, addr, fd, caps);
+    c->errno = SHARDCACHE_CLIENT_ERROR_BUSY;
+    snprintf(c->errstr, sizeof(c->errstr), "Node '%s' is busy, retry later", addr);
+}
+
 size_t
 shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **data)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
 
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
@@ -200,7 +356,14 @@ shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **dat
     }
 
     fbuf_t value = FBUF_STATIC_INITIALIZER;
-    int rc = fetch_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, &value, fd);
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = fetch_from_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, &value, fd);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
     if (rc == 0) {
         size_t size = fbuf_used(&value);
         if (data)
@@ -211,8 +374,11 @@ shardcache_client_get(shardcache_client_t *c, void *key, size_t klen, void **dat
         c->errno = SHARDCACHE_CLIENT_OK;
         c->errstr[0] = 0;
 
-        connections_pool_add(c->connections, addr, fd);
+        connections_pool_add_caps(c->connections, addr, fd, caps);
         return size;
+    } else if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        return 0;
     } else {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
@@ -226,7 +392,8 @@ size_t
 shardcache_client_offset(shardcache_client_t *c, void *key, size_t klen, uint32_t offset, void *data, uint32_t dlen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
@@ -234,7 +401,14 @@ shardcache_client_offset(shardcache_client_t *c, void *key, size_t klen, uint32_
     }
 
     fbuf_t value = FBUF_STATIC_INITIALIZER;
-    int rc = offset_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, offset, dlen, &value, fd);
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = offset_from_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, offset, dlen, &value, fd);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
     if (rc == 0) {
         uint32_t to_copy = dlen > fbuf_used(&value) ? fbuf_used(&value) : dlen;
         if (data)
@@ -243,9 +417,11 @@ shardcache_client_offset(shardcache_client_t *c, void *key, size_t klen, uint32_
         c->errno = SHARDCACHE_CLIENT_OK;
         c->errstr[0] = 0;
 
-        connections_pool_add(c->connections, addr, fd);
+        connections_pool_add_caps(c->connections, addr, fd, caps);
         fbuf_destroy(&value);
         return to_copy;
+    } else if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
     } else {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
@@ -259,20 +435,31 @@ int
 shardcache_client_exists(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
         return -1;
     }
-    int rc = exists_on_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
-    if (rc == -1) {
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = exists_on_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, fd, 1);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        rc = -1;
+    } else if (rc == -1) {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
         snprintf(c->errstr, sizeof(c->errstr),
                 "Can't check existance of data on node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
+        connections_pool_add_caps(c->connections, addr, fd, caps);
         c->errno = SHARDCACHE_CLIENT_OK;
         c->errstr[0] = 0;
     }
@@ -283,20 +470,31 @@ int
 shardcache_client_touch(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
         return -1;
     }
-    int rc = touch_on_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd);
-    if (rc == -1) {
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = touch_on_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, fd);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        rc = -1;
+    } else if (rc == -1) {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
         snprintf(c->errstr, sizeof(c->errstr),
                  "Can't touch key '%s' on node '%s'", (char *)key, addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
+        connections_pool_add_caps(c->connections, addr, fd, caps);
         c->errno = SHARDCACHE_CLIENT_OK;
         c->errstr[0] = 0;
     }
@@ -307,7 +505,8 @@ static inline int
 shardcache_client_set_internal(shardcache_client_t *c, void *key, size_t klen, void *data, size_t dlen, uint32_t expire, int inx)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
@@ -315,17 +514,26 @@ shardcache_client_set_internal(shardcache_client_t *c, void *key, size_t klen, v
     }
 
     int rc = -1;
-    if (inx)
-        rc = add_to_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, data, dlen, expire, fd, 1);
-    else
-        rc = send_to_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, data, dlen, expire, fd, 1);
-
-    if (rc == -1) {
+    int attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        if (inx)
+            rc = add_to_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, data, dlen, expire, fd, 1);
+        else
+            rc = send_to_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, data, dlen, expire, fd, 1);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        rc = -1;
+    } else if (rc == -1) {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
         snprintf(c->errstr, sizeof(c->errstr), "Can't set new data on node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
+        connections_pool_add_caps(c->connections, addr, fd, caps);
         c->errno = SHARDCACHE_CLIENT_OK;
         c->errstr[0] = 0;
     }
@@ -348,19 +556,30 @@ int
 shardcache_client_del(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
         return -1;
     }
-    int rc = delete_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
-    if (rc != 0) {
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = delete_from_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, fd, 1);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        rc = -1;
+    } else if (rc != 0) {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
         snprintf(c->errstr, sizeof(c->errstr), "Can't delete data from node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
+        connections_pool_add_caps(c->connections, addr, fd, caps);
         c->errno = SHARDCACHE_CLIENT_OK;
         c->errstr[0] = 0;
     }
@@ -371,20 +590,31 @@ int
 shardcache_client_evict(shardcache_client_t *c, void *key, size_t klen)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
         return -1;
     }
 
-    int rc = evict_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
-    if (rc != 0) {
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = evict_from_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, fd, 1);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        rc = -1;
+    } else if (rc != 0) {
         close(fd);
         c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
         snprintf(c->errstr, sizeof(c->errstr), "Can't evict data from node '%s'", addr);
     } else {
-        connections_pool_add(c->connections, addr, fd);
+        connections_pool_add_caps(c->connections, addr, fd, caps);
         c->errno = SHARDCACHE_CLIENT_OK;
         c->errstr[0] = 0;
     }
@@ -392,19 +622,212 @@ shardcache_client_evict(shardcache_client_t *c, void *key, size_t klen)
     return rc;
 }
 
-static inline shardcache_node_t *
-shardcache_get_node(shardcache_client_t *c, char *node_name)
+size_t
+shardcache_client_gets(shardcache_client_t *c, void *key, size_t klen, void **data, uint64_t *version)
 {
-    shardcache_node_t *node = NULL;
+    int fd = -1;
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return 0;
+    }
 
-    int i;
-    for (i = 0; i < c->num_shards; i++) {
-        if (strcmp(node_name, shardcache_node_get_label(c->shards[i])) == 0) {
-            node = c->shards[i];
-            break;
+    fbuf_t value = FBUF_STATIC_INITIALIZER;
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        fbuf_set_used(&value, 0);
+        rc = gets_from_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, &value, version, fd);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == 0) {
+        size_t size = fbuf_used(&value);
+        if (data)
+            *data = fbuf_data(&value);
+        else
+            fbuf_destroy(&value);
+
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+
+        connections_pool_add_caps(c->connections, addr, fd, caps);
+        return size;
+    } else if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+    } else {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't fetch data from node '%s'", addr);
+    }
+    fbuf_destroy(&value);
+    return 0;
+}
+
+int
+shardcache_client_get_if_modified(shardcache_client_t *c,
+                                  void *key,
+                                  size_t klen,
+                                  uint64_t *version,
+                                  void **data,
+                                  size_t *dlen)
+{
+    if (!version) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_ARGS;
+        snprintf(c->errstr, sizeof(c->errstr), "No version provided");
+        return -1;
+    }
+
+    int fd = -1;
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
+    }
+
+    fbuf_t value = FBUF_STATIC_INITIALIZER;
+    uint64_t new_version;
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        fbuf_set_used(&value, 0);
+        new_version = *version;
+        rc = fetch_from_peer_if_modified(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps),
+                                         key, klen, &new_version, &value, fd);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == 0 || rc == 1) {
+        if (rc == 0) {
+            *version = new_version;
+            if (dlen)
+                *dlen = fbuf_used(&value);
+            if (data)
+                *data = fbuf_used(&value) ? fbuf_data(&value) : NULL;
+            if (!data || !fbuf_used(&value))
+                fbuf_destroy(&value);
         }
+
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+
+        connections_pool_add_caps(c->connections, addr, fd, caps);
+        return rc;
+    } else if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+    } else {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't fetch data from node '%s'", addr);
+    }
+    fbuf_destroy(&value);
+    return -1;
+}
+
+int
+shardcache_client_cas(shardcache_client_t *c,
+                      void *key,
+                      size_t klen,
+                      uint64_t version,
+                      void *data,
+                      size_t dlen,
+                      uint32_t expire,
+                      uint64_t *new_version)
+{
+    int fd = -1;
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
+    }
+
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = cas_on_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen,
+                         version, data, dlen, expire, new_version, fd);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        rc = -1;
+    } else if (rc == -1) {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't set new data on node '%s'", addr);
+    } else {
+        connections_pool_add_caps(c->connections, addr, fd, caps);
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+    }
+
+    return rc;
+}
+
+static int
+shardcache_client_increment(shardcache_client_t *c, void *key, size_t klen, int64_t amount, int64_t *value)
+{
+    int fd = -1;
+    uint32_t caps = 0;
+    char *addr = select_node(c, key, klen, &fd, &caps);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
     }
 
+    int rc, attempt = 0;
+    struct timeval start;
+    shc_request_begin(c, addr, &start);
+    do {
+        rc = increment_on_peer(addr, (char *)c->auth, SHC_CLIENT_SIG_HDR(caps), key, klen, amount, value, fd);
+    } while (shc_busy_backoff(c, rc, &attempt));
+    shc_request_end(c, addr, &start, rc);
+
+    if (rc == SHARDCACHE_PEER_BUSY) {
+        shc_busy_error(c, addr, fd, caps);
+        rc = -1;
+    } else if (rc != 0) {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't update the counter on node '%s'", addr);
+    } else {
+        connections_pool_add_caps(c->connections, addr, fd, caps);
+        c->errno = SHARDCACHE_CLIENT_OK;
+        c->errstr[0] = 0;
+    }
+
+    return rc;
+}
+
+int
+shardcache_client_incr(shardcache_client_t *c, void *key, size_t klen, uint64_t amount, int64_t *value)
+{
+    return shardcache_client_increment(c, key, klen, (int64_t)amount, value);
+}
+
+int
+shardcache_client_decr(shardcache_client_t *c, void *key, size_t klen, uint64_t amount, int64_t *value)
+{
+    return shardcache_client_increment(c, key, klen, -(int64_t)amount, value);
+}
+
+static inline shardcache_node_t *
+shardcache_get_node(shardcache_client_t *c, char *node_name)
+{
+    int index = continuum_index(c->continuum, node_name, strlen(node_name));
+    shardcache_node_t *node = (index >= 0) ? c->shards[index] : NULL;
+
     if (!node) {
         c->errno = SHARDCACHE_CLIENT_ERROR_ARGS;
         snprintf(c->errstr, sizeof(c->errstr), "Unknown node '%s'", node_name);
@@ -484,7 +907,7 @@ shardcache_client_destroy(shardcache_client_t *c)
         MUTEX_DESTROY(&c->wakeup_lock);
     }
     queue_destroy(c->async_jobs);
-    chash_free(c->chash);
+    continuum_destroy(c->continuum);
     shardcache_free_nodes(c->shards, c->num_shards);
     if (c->auth)
         free((void *)c->auth);
@@ -543,7 +966,7 @@ shardcache_client_migration_begin(shardcache_client_t *c, shardcache_node_t **no
     for (i = 0; i < num_nodes; i++) {
         if (i > 0)
             fbuf_add(&mgb_message, ",");
-        fbuf_printf(&mgb_message, "%s:%s", shardcache_node_get_string(nodes[i]));
+        fbuf_printf(&mgb_message, "%s", shardcache_node_get_string(nodes[i]));
     }
 
     for (i = 0; i < c->num_shards; i++) {
@@ -618,6 +1041,8 @@ typedef struct {
     void *priv;
     int fd;
     connections_pool_t *connections;
+    struct timeval start; // when the request has been sent
+    int sampled;          // the first response has been accounted
 } shardcache_client_get_async_data_arg_t;
 
 static int
@@ -631,9 +1056,24 @@ shardcache_client_get_async_data_helper(char *node,
 {
     shardcache_client_get_async_data_arg_t *arg = (shardcache_client_get_async_data_arg_t *)priv;
     int rc = -1;
+
+    if (!arg->sampled) {
+        struct timeval now, elapsed;
+        gettimeofday(&now, NULL);
+        timersub(&now, &arg->start, &elapsed);
+        connections_pool_sample(arg->connections, node,
+                                (uint64_t)elapsed.tv_sec * 1000000 + elapsed.tv_usec, (status == -1));
+        arg->sampled = 1;
+    }
+
     switch(status) {
         case 0:
+            // the helper keeps being called until the response
+            // is over, unless the callback refuses the data
             rc = arg->cb(node, key, klen, data, dlen, 0, arg->priv);
+            if (rc == 0)
+                return 0;
+            close(arg->fd);
             break;
         case -1:
             arg->cb(node, key, klen, data, dlen, 1, arg->priv);
@@ -657,18 +1097,19 @@ shardcache_client_get_async(shardcache_client_t *c,
                             void *priv)
 {
     int fd = -1;
-    char *addr = select_node(c, key, klen, &fd);
+    char *addr = select_node(c, key, klen, &fd, NULL);
     if (fd < 0) {
         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
         return -1;
     }
 
-    shardcache_client_get_async_data_arg_t *arg = malloc(sizeof(shardcache_client_get_async_data_arg_t));
+    shardcache_client_get_async_data_arg_t *arg = calloc(1, sizeof(shardcache_client_get_async_data_arg_t));
     arg->connections = c->connections;
     arg->fd = fd;
     arg->cb = data_cb;
     arg->priv = priv;
+    shc_request_begin(c, addr, &arg->start);
     return fetch_from_peer_async(addr,
                                  (char *)c->auth,
                                  SHC_HDR_CSIGNATURE_SIP,
@@ -719,7 +1160,7 @@ shc_split_buckets(shardcache_client_t *c, shc_multi_item_t **items, int *num_ite
         shc_multi_item_t *item = items[i];
         item->idx = i;
 
-        char *addr = select_node(c, item->key, item->klen, NULL);
+        char *addr = select_node(c, item->key, item->klen, NULL, NULL);
 
         tagged_value_t *tval = list_get_tagged_value(pools, addr);
         if (!tval || list_count((linked_list_t *)tval->value) > c->pipeline_max)
@@ -756,19 +1197,98 @@ struct shc_multi_ctx_s {
     uint32_t *total_count;
     struct timeval last_update;
     int fd;
+    uint32_t caps;  // capabilities negotiated on the connection
+    int tagged;
+    // index record of the GET_MULTI response being read
+    char multi_index[sizeof(uint32_t)];
+    int multi_index_len;
+    // statuses received so far for a multi-key mutation
+    int multi_statuses;
     int (*cb)(shc_multi_ctx_t *, int);
     void *priv;
 };
 
+// true if a single request (and a single response) covers all the items
+static inline int
+shc_multi_mutation(shardcache_hdr_t cmd)
+{
+    return (cmd == SHC_HDR_SET_MULTI ||
+            cmd == SHC_HDR_DELETE_MULTI ||
+            cmd == SHC_HDR_TOUCH_MULTI ||
+            cmd == SHC_HDR_EVICT_MULTI);
+}
+
+// returns the index of the item the response being read refers to
+// (the index sent by the node for GET_MULTI responses, the tag if
+//  requests have been tagged, the response index otherwise)
+static inline int
+shc_multi_response_item(shc_multi_ctx_t *ctx)
+{
+    if (ctx->cmd == SHC_HDR_GET_MULTI) {
+        uint32_t index_nbo;
+        if (ctx->multi_index_len != sizeof(index_nbo))
+            return -1;
+        memcpy(&index_nbo, ctx->multi_index, sizeof(index_nbo));
+        uint32_t index = ntohl(index_nbo);
+        return (index < ctx->num_requests) ? index : -1;
+    }
+
+    uint32_t tag = 0;
+    if (ctx->tagged && async_read_context_tag(ctx->reader, &tag))
+        return (tag < ctx->num_requests) ? tag : -1;
+
+    return (ctx->response_index < ctx->num_requests) ? ctx->response_index : -1;
+}
+
 static int
 shc_multi_collect_data(void *data, size_t len, int idx, void *priv)
 {
-    if (idx != 0)
+    shc_multi_ctx_t *ctx = (shc_multi_ctx_t *)priv;
+
+    if (ctx->cmd == SHC_HDR_GET_MULTI) {
+        // GET_MULTI responses hold the index of the item
+        // followed by its value
+        if (idx == 0) {
+            if (ctx->multi_index_len + len > sizeof(ctx->multi_index))
+                return -1;
+            memcpy(ctx->multi_index + ctx->multi_index_len, data, len);
+            ctx->multi_index_len += len;
+            return 0;
+        }
+        if (idx == 1)
+            idx = 0;
+        else if (idx != -4)
+            return 0;
+    } else if (idx != 0 && idx != -4) {
+        return 0;
+    }
+
+    if (idx == 0 && shc_multi_mutation(ctx->cmd)) {
+        // the response holds the status of each of the items
+        int i;
+        for (i = 0; i < len; i++) {
+            if (ctx->multi_statuses >= ctx->num_requests)
+                return -1;
+            ctx->items[ctx->multi_statuses++]->status = (int)((char *)data)[i];
+        }
         return 0;
+    }
 
-    shc_multi_ctx_t *ctx = (shc_multi_ctx_t *)priv;
+    if (idx == -4 && (ctx->cmd == SHC_HDR_GET_MULTI || shc_multi_mutation(ctx->cmd))) {
+        // the node refused the whole batch
+        int i;
+        for (i = 0; i < ctx->num_requests; i++) {
+            if (!ctx->items[i]->dlen)
+                ctx->items[i]->status = SHC_RES_BUSY;
+        }
+        ctx->client->errno = SHARDCACHE_CLIENT_ERROR_BUSY;
+        snprintf(ctx->client->errstr, sizeof(ctx->client->errstr),
+                 "Node '%s' is busy, retry later", ctx->peer);
+        return 0;
+    }
 
-    if (ctx->response_index >= ctx->num_requests) {
+    int item_index = shc_multi_response_item(ctx);
+    if (item_index < 0) {
         ctx->client->errno = SHARDCACHE_CLIENT_ERROR_PROTOCOL;
         snprintf(ctx->client->errstr, sizeof(ctx->client->errstr),
                 "Unexpected response (response_index: %d, expected_requests: %d)",
@@ -776,9 +1296,18 @@ shc_multi_collect_data(void *data, size_t len, int idx, void *priv)
         return -1;
     }
 
-    shc_multi_item_t *item = ctx->items[ctx->response_index];
+    shc_multi_item_t *item = ctx->items[item_index];
+    if (idx == -4) {
+        // the node refused the command, the caller can retry it later
+        item->status = SHC_RES_BUSY;
+        ctx->client->errno = SHARDCACHE_CLIENT_ERROR_BUSY;
+        snprintf(ctx->client->errstr, sizeof(ctx->client->errstr),
+                 "Node '%s' is busy, retry later", ctx->peer);
+        return 0;
+    }
+
     if (len) {
-        if (ctx->cmd == SHC_HDR_GET) {
+        if (ctx->cmd == SHC_HDR_GET || ctx->cmd == SHC_HDR_GET_MULTI) {
             item->data = realloc(item->data, item->dlen + len);
             memcpy(item->data + item->dlen, data, len);
             item->dlen += len;
@@ -800,7 +1329,7 @@ shc_multi_context_destroy(shc_multi_ctx_t *ctx)
 
     if (ctx->fd >= 0) {
         if (ctx->response_index == ctx->num_requests)
-            connections_pool_add(ctx->client->connections, ctx->peer, ctx->fd);
+            connections_pool_add_caps(ctx->client->connections, ctx->peer, ctx->fd, ctx->caps);
         else
             close(ctx->fd);
     }
@@ -814,6 +1343,8 @@ shc_multi_context_create(shardcache_client_t *c,
                          char *peer,
                          char *secret,
                          linked_list_t *items,
+                         uint32_t caps,
+                         int tagged,
                          uint32_t *total_count,
                          int (*cb)(shc_multi_ctx_t *, int ),
                          void *priv)
@@ -824,15 +1355,126 @@ shc_multi_context_create(shardcache_client_t *c,
     ctx->num_requests = list_count(items);
     ctx->items = calloc(1, sizeof(shc_multi_item_t *) * (ctx->num_requests+1));
     ctx->reader = async_read_context_create(secret, shc_multi_collect_data, ctx);
+    async_read_context_session(ctx->reader, (caps & SHC_CAP_CRC32C) ? 1 : 0);
+    ctx->caps = caps;
     ctx->cmd = cmd;
     ctx->peer = peer;
     ctx->total_count = total_count;
     ctx->cb = cb;
     ctx->priv = priv;
+    ctx->tagged = tagged;
     int n;
+    for (n = 0; n < ctx->num_requests; n++)
+        ctx->items[n] = list_pick_value(items, n);
+
+    if (cmd == SHC_HDR_GET_MULTI) {
+        // a single request for all the items
+        void **keys = malloc(sizeof(void *) * ctx->num_requests);
+        size_t *klens = malloc(sizeof(size_t) * ctx->num_requests);
+        for (n = 0; n < ctx->num_requests; n++) {
+            keys[n] = ctx->items[n]->key;
+            klens[n] = ctx->items[n]->klen;
+        }
+        fbuf_t keys_buf = FBUF_STATIC_INITIALIZER;
+        pack_multi_keys(keys, klens, ctx->num_requests, &keys_buf);
+        free(keys);
+        free(klens);
+
+        shardcache_record_t record = {
+            .v = fbuf_data(&keys_buf),
+            .l = fbuf_used(&keys_buf)
+        };
+        int rc = build_message(secret, SHC_CLIENT_SIG_HDR(caps), cmd, &record, 1, ctx->commands);
+        fbuf_destroy(&keys_buf);
+        if (rc != 0) {
+            c->errno = SHARDCACHE_CLIENT_ERROR_INTERNAL;
+            snprintf(c->errstr, sizeof(c->errstr), "Can't create new command!");
+            fbuf_free(ctx->commands);
+            free(ctx->items);
+            async_read_context_destroy(ctx->reader);
+            free(ctx);
+            return NULL;
+        }
+        gettimeofday(&ctx->last_update, NULL);
+        return ctx;
+    }
+
+    if (shc_multi_mutation(cmd)) {
+        // a single request for all the items
+        void **keys = malloc(sizeof(void *) * ctx->num_requests);
+        size_t *klens = malloc(sizeof(size_t) * ctx->num_requests);
+        void **values = malloc(sizeof(void *) * ctx->num_requests);
+        size_t *vlens = malloc(sizeof(size_t) * ctx->num_requests);
+        int has_expires = 0;
+        for (n = 0; n < ctx->num_requests; n++) {
+            keys[n] = ctx->items[n]->key;
+            klens[n] = ctx->items[n]->klen;
+            values[n] = ctx->items[n]->data;
+            vlens[n] = ctx->items[n]->dlen;
+            if (ctx->items[n]->expire)
+                has_expires = 1;
+        }
+
+        fbuf_t keys_buf = FBUF_STATIC_INITIALIZER;
+        fbuf_t values_buf = FBUF_STATIC_INITIALIZER;
+        fbuf_t expires_buf = FBUF_STATIC_INITIALIZER;
+        pack_multi_keys(keys, klens, ctx->num_requests, &keys_buf);
+
+        shardcache_record_t records[3] = {
+            {
+                .v = fbuf_data(&keys_buf),
+                .l = fbuf_used(&keys_buf)
+            },
+            {
+                .v = NULL,
+                .l = 0
+            },
+            {
+                .v = NULL,
+                .l = 0
+            }
+        };
+        int num_records = 1;
+
+        if (cmd == SHC_HDR_SET_MULTI) {
+            pack_multi_keys(values, vlens, ctx->num_requests, &values_buf);
+            records[1].v = fbuf_data(&values_buf);
+            records[1].l = fbuf_used(&values_buf);
+            num_records = 2;
+            if (has_expires) {
+                for (n = 0; n < ctx->num_requests; n++) {
+                    uint32_t expire_nbo = htonl(ctx->items[n]->expire);
+                    fbuf_add_binary(&expires_buf, (char *)&expire_nbo, sizeof(expire_nbo));
+                }
+                records[2].v = fbuf_data(&expires_buf);
+                records[2].l = fbuf_used(&expires_buf);
+                num_records = 3;
+            }
+        }
+        free(keys);
+        free(klens);
+        free(values);
+        free(vlens);
+
+        int rc = build_message(secret, SHC_CLIENT_SIG_HDR(caps), cmd, records, num_records, ctx->commands);
+        fbuf_destroy(&keys_buf);
+        fbuf_destroy(&values_buf);
+        fbuf_destroy(&expires_buf);
+        if (rc != 0) {
+            c->errno = SHARDCACHE_CLIENT_ERROR_INTERNAL;
+            snprintf(c->errstr, sizeof(c->errstr), "Can't create new command!");
+            fbuf_free(ctx->commands);
+            free(ctx->items);
+            async_read_context_destroy(ctx->reader);
+            free(ctx);
+            return NULL;
+        }
+        gettimeofday(&ctx->last_update, NULL);
+        return ctx;
+    }
+
     for (n = 0; n < ctx->num_requests; n++) {
-        shc_multi_item_t *item = list_pick_value(items, n);
-        ctx->items[n] = item;
+        shc_multi_item_t *item = ctx->items[n];
 
         shardcache_record_t record[3] = {
             {
@@ -849,7 +1491,6 @@ shc_multi_context_create(shardcache_client_t *c,
             }
         };
         int num_records = 1;
-        unsigned char sig_hdr = secret ? SHC_HDR_SIGNATURE_SIP : 0;
 
         if (cmd == SHC_HDR_SET) {
             record[1].v = item->data;
@@ -863,7 +1504,11 @@ shc_multi_context_create(shardcache_client_t *c,
             }
         }
 
-        if (build_message(secret, sig_hdr, cmd, record, num_records, ctx->commands) != 0) {
+        // when tagged, responses are matched using the item index
+        if (tagged)
+            add_message_tag(n, ctx->commands);
+
+        if (build_message(secret, SHC_CLIENT_SIG_HDR(caps), cmd, record, num_records, ctx->commands) != 0) {
             c->errno = SHARDCACHE_CLIENT_ERROR_INTERNAL;
             snprintf(c->errstr, sizeof(c->errstr), "Can't create new command!");
             fbuf_free(ctx->commands);
@@ -900,14 +1545,24 @@ shc_multi_fetch_response(iomux_t *iomux, int fd, unsigned char *data, int len, v
     SHC_DEBUG3("received %d\n", len);
     async_read_context_state_t state = async_read_context_input_data(ctx->reader, data, len, &processed);
     while (state == SHC_STATE_READING_DONE) {
-        if (ctx->cb && ctx->cb(ctx, 0) != 0) {
+        // a busy response to a GET_MULTI refers to all the items
+        // (as well as any response to a multi-key mutation)
+        int responses = 1;
+        if (ctx->cmd == SHC_HDR_GET_MULTI &&
+            async_read_context_hdr(ctx->reader) == SHC_HDR_BUSY)
+        {
+            responses = ctx->num_requests - ctx->response_index;
+        } else if (shc_multi_mutation(ctx->cmd)) {
+            responses = ctx->num_requests - ctx->response_index;
+        } else if (ctx->cb && ctx->cb(ctx, 0) != 0) {
             iomux_close(iomux, fd);
             return processed;
         }
 
-        ctx->response_index++;
+        ctx->multi_index_len = 0;
+        ctx->response_index += responses;
         if (ctx->total_count)
-            ctx->total_count[0]++;
+            ctx->total_count[0] += responses;
         state = async_read_context_update(ctx->reader);
     }
 
@@ -983,6 +1638,17 @@ shardcache_client_multi_loop(shardcache_client_t *c, iomux_t *iomux, int num_ite
     return rc;
 }
 
+// check if a peer accepts tagged requests on a connection
+// where the capabilities 'caps' have been negotiated
+static inline int
+shc_peer_accepts_tags(shardcache_client_t *c, uint32_t caps)
+{
+    if (!c->tagged_requests)
+        return 0;
+
+    return (caps & SHC_CAP_TAGGED) ? 1 : 0;
+}
+
 static inline linked_list_t *
 shardcache_client_multi_send_requests(shardcache_client_t *c,
                                       shardcache_hdr_t cmd,
@@ -1009,11 +1675,12 @@ shardcache_client_multi_send_requests(shardcache_client_t *c,
         tagged_value_t *tval = list_pick_tagged_value(pools, i);
         linked_list_t *items = (linked_list_t *)tval->value;
         char *addr = tval->tag;
-        int fd = connections_pool_get(c->connections, addr);
+        uint32_t peer_caps = 0;
+        int fd = connections_pool_get_caps(c->connections, addr, &peer_caps);
         if (fd < 0) {
             // 1 retry
             addr = select_other_node(c, addr);
-            fd = connections_pool_get(c->connections, addr);
+            fd = connections_pool_get_caps(c->connections, addr, &peer_caps);
         }
 
         if (fd < 0) {
@@ -1029,8 +1696,38 @@ shardcache_client_multi_send_requests(shardcache_client_t *c,
             return NULL;
         }
 
-        shc_multi_ctx_t *ctx = shc_multi_context_create(c, cmd, addr, (char *)c->auth, items, total_count, cb, priv);
+        // the node can fetch all the values with a single GET_MULTI
+        // (fanning out the request to the owners of the keys itself)
+        // (and can apply a batch of mutations with a single command as well)
+        shardcache_hdr_t pool_cmd = cmd;
+        if (cmd == SHC_HDR_GET && (peer_caps & SHC_CAP_MULTI)) {
+            pool_cmd = SHC_HDR_GET_MULTI;
+        } else if (peer_caps & SHC_CAP_MULTI_WRITE) {
+            switch(cmd) {
+                case SHC_HDR_SET:
+                    pool_cmd = SHC_HDR_SET_MULTI;
+                    break;
+                case SHC_HDR_DELETE:
+                    pool_cmd = SHC_HDR_DELETE_MULTI;
+                    break;
+                case SHC_HDR_TOUCH:
+                    pool_cmd = SHC_HDR_TOUCH_MULTI;
+                    break;
+                case SHC_HDR_EVICT:
+                    pool_cmd = SHC_HDR_EVICT_MULTI;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        int tagged = 0;
+        if (pool_cmd == cmd)
+            tagged = shc_peer_accepts_tags(c, peer_caps);
+
+        shc_multi_ctx_t *ctx = shc_multi_context_create(c, pool_cmd, addr, (char *)c->auth, items, peer_caps, tagged, total_count, cb, priv);
         if (!ctx) {
+            close(fd);
             while ((ctx = list_shift_value(contexts))) {
                 iomux_remove(iomux, ctx->fd);
                 shc_multi_context_destroy(ctx);
@@ -1136,6 +1833,30 @@ shardcache_client_set_multi(shardcache_client_t *c,
     return shardcache_client_multi(c, items, SHC_HDR_SET);
 }
 
+int
+shardcache_client_del_multi(shardcache_client_t *c,
+                            shc_multi_item_t **items)
+
+{
+    return shardcache_client_multi(c, items, SHC_HDR_DELETE);
+}
+
+int
+shardcache_client_touch_multi(shardcache_client_t *c,
+                              shc_multi_item_t **items)
+
+{
+    return shardcache_client_multi(c, items, SHC_HDR_TOUCH);
+}
+
+int
+shardcache_client_evict_multi(shardcache_client_t *c,
+                              shc_multi_item_t **items)
+
+{
+    return shardcache_client_multi(c, items, SHC_HDR_EVICT);
+}
+
 shardcache_node_t *
 shardcache_client_current_node(shardcache_client_t *c)
 {
@@ -1299,8 +2020,7 @@ static int
 async_thread_get_multi(shc_multi_ctx_t *ctx, int eof)
 {
     async_job_t *job = (async_job_t *)ctx->priv;
-    shc_multi_item_t *item = ctx->items[ctx->response_index];
-    
+
     int pending = fbuf_used(&job->buf);
     if (pending) {
         int wb = write(job->pipe[1], fbuf_data(&job->buf), pending);
@@ -1319,6 +2039,12 @@ async_thread_get_multi(shc_multi_ctx_t *ctx, int eof)
         return 0;
     }
 
+    int item_index = shc_multi_response_item(ctx);
+    if (item_index < 0)
+        return -1;
+
+    shc_multi_item_t *item = ctx->items[item_index];
+
     uint32_t idx_nbo = htonl(item->idx);
     uint32_t dlen_nbo = htonl(item->dlen);
     if (fbuf_used(&job->buf)) {
@@ -1364,7 +2090,7 @@ async_thread(void *priv)
                 case JOB_CMD_GET:
                 {
                     job->arg.single.fd = -1;
-                    char *addr = select_node(c, job->arg.single.key, job->arg.single.klen, &job->arg.single.fd);
+                    char *addr = select_node(c, job->arg.single.key, job->arg.single.klen, &job->arg.single.fd, NULL);
                     if (job->arg.single.fd < 0) {
                         c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
                         snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
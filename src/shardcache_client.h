@@ -9,6 +9,9 @@
 #define SHARDCACHE_CLIENT_ERROR_ARGS     3
 #define SHARDCACHE_CLIENT_ERROR_PROTOCOL 4
 #define SHARDCACHE_CLIENT_ERROR_INTERNAL 5
+#define SHARDCACHE_CLIENT_ERROR_BUSY     6
+
+#define SHARDCACHE_CLIENT_BUSY_RETRIES_DEFAULT 3
 
 /**
  * @brief Opaque structure representing the shardcache client
@@ -79,6 +82,19 @@ int shardcache_client_multi_command_max_wait(shardcache_client_t *c, int new_val
  */
 int shardcache_client_use_random_node(shardcache_client_t *c, int new_value);
 
+/**
+ * @brief Get and/or set the bounded-load mode used to determine the owner of the keys
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set.
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ * @note  Must match the value configured on the nodes (see shardcache_bounded_load())
+ *        and should be set before sending any command
+ * @note  defaults to 0 (no bound)
+ * @return The previously configured value for the bounded_load option
+ */
+int shardcache_client_bounded_load(shardcache_client_t *c, int new_value);
+
 /**
  * @brief Get and/or set the maximum number of requests that can be pipelined
  *        on a single connection
@@ -94,6 +110,96 @@ int shardcache_client_use_random_node(shardcache_client_t *c, int new_value);
  */
 int shardcache_client_pipeline_max(shardcache_client_t *c, int new_value);
 
+/**
+ * @brief Get and/or set the tagged_requests mode on a shardcache client instance.
+ *        When on, pipelined requests sent by the _multi commands are tagged so
+ *        that the nodes can return the responses out-of-order (as soon as they
+ *        are available) instead of in the same order as the requests
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  Tagged requests are used only with nodes which accepted them
+ *        when negotiating the capabilities, others will be sent plain
+ *        (in-order) requests
+ * @note  defaults to 1
+ * @return The previously configured value for the tagged_requests option
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_tagged_requests(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set how many times a command refused by a busy node is retried
+ *        (waiting an exponentially growing amount of time between the attempts)
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  If the node is still busy after the last attempt the internal errno
+ *        will be set to SHARDCACHE_CLIENT_ERROR_BUSY.\n
+ *        The _multi commands are not retried, the status of the refused
+ *        items will be set to SHC_RES_BUSY instead
+ * @note  defaults to SHARDCACHE_CLIENT_BUSY_RETRIES_DEFAULT
+ * @return The previously configured value for the busy_retries option
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_busy_retries(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the use_sessions mode on a shardcache client instance.
+ *        When on (and a secret has been provided), new connections are
+ *        authenticated once with a challenge-response handshake and the
+ *        messages sent on them are then protected by a CRC32C checksum
+ *        instead of being signed with siphash
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  Nodes which don't support sessions keep receiving signed messages.
+ *        Only the single-key commands make use of sessions
+ * @note  defaults to 1
+ * @return The previously configured value for the use_sessions option
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_use_sessions(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the wide_records mode on a shardcache client instance.
+ *        When on, the records sent and received on new connections are
+ *        framed with 32bit chunk sizes (if supported by the node) so that
+ *        large values are transferred as a single chunk instead of being
+ *        split in 64KB chunks
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value If greater or equal to 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  Only the single-key commands make use of wide records
+ * @note  defaults to 1
+ * @return The previously configured value for the wide_records option
+ *         (still valid if no new value has been provided)
+ */
+int shardcache_client_wide_records(shardcache_client_t *c, int new_value);
+
+/**
+ * @brief Get and/or set the compression algorithm used on new connections.
+ *        Values bigger than the compression threshold
+ *        (see shardcache_compression_threshold()) are sent and received
+ *        compressed if the node supports the same algorithm
+ * @param c         A valid pointer to a shardcache_client_t structure
+ * @param new_value One of the SHARDCACHE_COMPRESSION_* values
+ *                  (SHARDCACHE_COMPRESSION_NONE disables compression).
+ *                  If greater or equal to 0 the new value will be set.
+ *                  Otherwise the old value will be queried but no new value
+ *                  will be set
+ * @note  Only the single-key commands send compressed values, but compressed
+ *        responses are accepted by all of them
+ * @note  defaults to SHARDCACHE_COMPRESSION_DEFAULT (if supported by the build)
+ * @return The previously configured value for the compression option
+ *         (still valid if no new value has been provided) or -1 if
+ *         the requested algorithm is not supported
+ */
+int shardcache_client_compression(shardcache_client_t *c, int new_value);
+
 /**
  * @brief Get the value for a key
  * @param c       A valid pointer to a shardcache_client_t structure
@@ -252,6 +358,101 @@ int shardcache_client_del(shardcache_client_t *c, void *key, size_t klen);
  */
 int shardcache_client_evict(shardcache_client_t *c, void *key, size_t klen);
 
+/**
+ * @brief Get the value for a key together with its version stamp
+ * @param c       A valid pointer to a shardcache_client_t structure
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ * @param data    A reference to the pointer which will be set to point
+ *                to the memory holding the retrieved value
+ * @param version If provided the version stamp of the value will be stored
+ *                at the location pointed by version (0 if the key doesn't exist)
+ * @return The size of the retrieved value (0 if the key doesn't exist or
+ *         in case of errors, in which case the internal errno is set)
+ * @note The caller is responsible of releasing the memory pointed by *data
+ * @see shardcache_client_cas()
+ */
+size_t shardcache_client_gets(shardcache_client_t *c, void *key, size_t klen, void **data, uint64_t *version);
+
+/**
+ * @brief Get the value for a key only if it changed since a known version
+ *
+ * Allows to revalidate a locally cached copy of a value without
+ * transferring it again if it didn't change
+ * @param c       A valid pointer to a shardcache_client_t structure
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ * @param version A pointer to the known version stamp (as returned by
+ *                shardcache_client_gets()), updated if the value changed
+ *                (0 if the key doesn't exist anymore)
+ * @param data    If provided and the value changed, *data will point to the
+ *                memory holding the new value (NULL if the key doesn't exist)
+ * @param dlen    If provided and the value changed, the length of the new
+ *                value will be stored at the location pointed by dlen
+ * @return 0 if the value changed, 1 if it didn't change, -1 in case of
+ *         errors and the internal errno is set
+ * @note The caller is responsible of releasing the memory pointed by *data
+ */
+int shardcache_client_get_if_modified(shardcache_client_t *c,
+                                      void *key,
+                                      size_t klen,
+                                      uint64_t *version,
+                                      void **data,
+                                      size_t *dlen);
+
+/**
+ * @brief Set the value for a key only if its version stamp matches
+ * @param c           A valid pointer to a shardcache_client_t structure
+ * @param key         A valid pointer to the key
+ * @param klen        The length of the key
+ * @param version     The expected version stamp (as returned by
+ *                    shardcache_client_gets()), 0 if the key must not exist
+ * @param data        A valid pointer to the new value
+ * @param dlen        The length of the new value
+ * @param expire      The ttl in seconds for the new value (0 for no expiration)
+ * @param new_version If provided the version stamp of the value stored on
+ *                    the node after the command will be stored at the
+ *                    location pointed by new_version
+ * @return 0 if the value has been set, 1 if the version stamp doesn't match,
+ *         -1 in case of errors and the internal errno is set
+ * @note The comparison is executed atomically by the node owning the key
+ */
+int shardcache_client_cas(shardcache_client_t *c,
+                          void *key,
+                          size_t klen,
+                          uint64_t version,
+                          void *data,
+                          size_t dlen,
+                          uint32_t expire,
+                          uint64_t *new_version);
+
+/**
+ * @brief Atomically increment a 64bit counter
+ * @param c      A valid pointer to a shardcache_client_t structure
+ * @param key    A valid pointer to the key
+ * @param klen   The length of the key
+ * @param amount The amount to add to the counter
+ * @param value  If provided the new value of the counter will be stored
+ *               at the location pointed by value
+ * @return 0 on success, -1 otherwise and the internal errno is set
+ * @note Counters are stored as 8 bytes integers in network byte order,
+ *       a missing key counts as 0
+ */
+int shardcache_client_incr(shardcache_client_t *c, void *key, size_t klen, uint64_t amount, int64_t *value);
+
+/**
+ * @brief Atomically decrement a 64bit counter
+ * @param c      A valid pointer to a shardcache_client_t structure
+ * @param key    A valid pointer to the key
+ * @param klen   The length of the key
+ * @param amount The amount to subtract from the counter
+ * @param value  If provided the new value of the counter will be stored
+ *               at the location pointed by value
+ * @return 0 on success, -1 otherwise and the internal errno is set
+ * @see shardcache_client_incr()
+ */
+int shardcache_client_decr(shardcache_client_t *c, void *key, size_t klen, uint64_t amount, int64_t *value);
+
 /**
  * @brief Get the stats from a shardcache node
  * @param c     A valid pointer to a shardcache_client_t structure
@@ -385,16 +586,60 @@ void shc_multi_item_destroy(shc_multi_item_t *item);
 int shardcache_client_get_multi(shardcache_client_t *c,
                                 shc_multi_item_t **items);
 /**
- * @brief Get multiple keys at once
+ * @brief Set multiple keys at once
  *
  * @param c          A valid pointer to a shardcache_client_t structure to release
  * @param items      A NULL-terminated array of shc_multi_item_t structures
  *
- * @note the operation will per parallelized among multiple nodes if possible
+ * @note the operation will per parallelized among multiple nodes if possible,
+ *       the keys owned by the same node are sent with a single SET_MULTI
+ *       command if the node supports it
  */
 int shardcache_client_set_multi(shardcache_client_t *c,
                                 shc_multi_item_t **items);
 
+/**
+ * @brief Delete multiple keys at once
+ *
+ * @param c          A valid pointer to a shardcache_client_t structure
+ * @param items      A NULL-terminated array of shc_multi_item_t structures
+ *                   (only the keys are used, the status of each item
+ *                    will be updated with the result)
+ *
+ * @note the keys owned by the same node are deleted with a single
+ *       DELETE_MULTI command if the node supports it
+ */
+int shardcache_client_del_multi(shardcache_client_t *c,
+                                shc_multi_item_t **items);
+
+/**
+ * @brief Touch multiple keys at once
+ *
+ * @param c          A valid pointer to a shardcache_client_t structure
+ * @param items      A NULL-terminated array of shc_multi_item_t structures
+ *                   (only the keys are used, the status of each item
+ *                    will be updated with the result)
+ *
+ * @note the keys owned by the same node are touched with a single
+ *       TOUCH_MULTI command if the node supports it
+ */
+int shardcache_client_touch_multi(shardcache_client_t *c,
+                                  shc_multi_item_t **items);
+
+/**
+ * @brief Evict multiple keys at once
+ *
+ * @param c          A valid pointer to a shardcache_client_t structure
+ * @param items      A NULL-terminated array of shc_multi_item_t structures
+ *                   (only the keys are used, the status of each item
+ *                    will be updated with the result)
+ *
+ * @note the keys owned by the same node are evicted with a single
+ *       EVICT_MULTI command if the node supports it
+ */
+int shardcache_client_evict_multi(shardcache_client_t *c,
+                                  shc_multi_item_t **items);
+
 /**
  * @brief Get the node used to fulfil last request
  * @param c          A valid pointer to a shardcache_Client_t structure
@@ -8,13 +8,16 @@
  */
 
 #include <linklist.h>
-#include <chash.h>
 #include <hashtable.h>
 #include <queue.h>
 #include <iomux.h>
 #include <atomic_defs.h>
 
 #include "connections_pool.h"
+#include "peer_links.h"
+#include "peer_breakers.h"
+#include "peer_subscriptions.h"
+#include "continuum.h"
 #include "arc.h"
 #include "serving.h"
 #include "counters.h"
@@ -33,7 +36,9 @@
 #define LIKELY(__e) __builtin_expect((__e), 1)
 #define UNLIKELY(__e) __builtin_expect((__e), 0)
 
+#ifndef __USE_UNIX98
 #define __USE_UNIX98
+#endif
 #include <pthread.h>
 
 #ifdef __MACH__
@@ -111,15 +116,23 @@
 }
 
 
-typedef struct chash_t chash_t;
-
 typedef struct {
     pthread_t io_th; // the thread taking care of spooling the asynchronous
                      // i/o operations
     iomux_t *mux;    // the iomux instance used for the asynchronous i/o;
                      // operations
     queue_t *queue;
+    queue_t *timers;  // timeouts to schedule on the mux (see shardcache_schedule_async())
+    int wakeup_fd[2]; // pipe used to wake up the thread when a timeout is queued
 } shardcache_async_io_context_t;
+
+// the nodes and the continuum built out of them, published together so that
+// the readers (which don't lock) always find the nodes the continuum refers to
+typedef struct {
+    shardcache_node_t **shards; // the nodes (with the same index they have in the continuum)
+    int num_shards;             // the number of nodes in the shards array
+    continuum_t *continuum;
+} shardcache_topology_t;
  
 struct __shardcache_s {
     char *me;   // a copy of the label for this node
@@ -128,11 +141,6 @@ struct __shardcache_s {
 
     shardcache_replica_t *replica;
 
-    shardcache_node_t **shards; // a copy of the shards array provided
-                               // at construction time
-
-    int num_shards;   // the number of shards in the array
-
     arc_t *arc;       // the internal arc instance
     arc_ops_t ops;    // the structure holding the arc operations callbacks
     size_t arc_size;  // the actual size of the arc cache
@@ -141,19 +149,24 @@ struct __shardcache_s {
                       // (see deps/libhl/src/atomic_defs.h)
     size_t *arc_lists_size[4];
 
-    // lock used internally during the migration procedures
-    // and when selecting the node owner for a key
+    // lock serializing the migration procedures (the owner of a key
+    // is selected without locking, see shardcache_publish_topology())
 #ifdef __MACH__
     OSSpinLock migration_lock;
 #else
     pthread_spinlock_t migration_lock;
 #endif
 
-    chash_t *chash;   // the internal chash instance
+    shardcache_topology_t *topology; // the nodes in use (to be accessed using ATOMIC_READ()
+                                     // between shardcache_topology_enter()/exit())
+    int topology_epoch;              // the readers of the topologies are counted
+    int topology_readers[2];         // separately for the actual epoch and the previous one
 
-    chash_t *migration;                  // the migration continuum
-    shardcache_node_t **migration_shards; // the new shards array after the migration
-    int num_migration_shards;            // the new number of shards in the migration_shards array
+    hashtable_t *failover_continuums; // node label -> continuum without that node
+                                      // (see shardcache_test_failover_ownership())
+    int failover_generation;          // bumped each time the failover continuums are dropped
+
+    shardcache_topology_t *migration;    // the nodes after the migration (accessed as 'topology')
     int migration_done;                  // boolean value indicating that the migration is complete
                                          // (to be accessed using ATOMIC_READ())
 
@@ -204,6 +217,25 @@ struct __shardcache_s {
     int serving_look_ahead;     // amount of pipelined requests to handle in parallel
                                 // while the current is being served
 
+    int max_pending_requests;   // admission control limits, when exceeded new
+    int max_remote_requests;    // requests are refused with a BUSY response
+    int max_storage_requests;   // (0 means no limit)
+
+    uint64_t storage_requests;  // storage operations currently in progress
+    uint64_t remote_requests;   // fetches and commands sent to the peers and
+                                // still waiting for their response
+
+    int busy_poll;              // boolean flag indicating if the workers and the async
+                                // threads should spin on their sockets instead of sleeping
+    int so_busy_poll;           // SO_BUSY_POLL value for the served connections (0 == off)
+
+    int compression;            // algorithm used to compress the messages sent to peers
+
+    int hedged_fetches;         // max percentage of the remote fetches which can be hedged
+    int hedge_budget;           // hedges which can be sent now (in hundredths of a hedge)
+    uint64_t fetch_latency;     // estimated 95th percentile of the time needed to receive
+                                // the first byte of a remote fetch (in microsecs)
+
     shardcache_serving_t *serv; // the serving-subsystem instance
 
     const char *auth;     // the secret to use for signing messages
@@ -213,19 +245,32 @@ struct __shardcache_s {
 
     pthread_t evictor_th; // the evictor thread
 
-    pthread_cond_t evictor_cond;  // condition variable used by the evictor thread
-                                  // when waiting for new jobs (instead of actively
-                                  // polling on the linked list used as queue)
-    pthread_mutex_t evictor_lock; // mutex to use when accessing the evictor_cond
-                                  //condition variable
-    hashtable_t *evictor_jobs;    // linked list used as queue for eviction jobs
+    int evictor_wakeup_fd[2];     // pipe used to wake up the evictor thread
+                                  // when new jobs are queued
+    queue_t *evictor_queue;       // the eviction jobs in the order they have been queued
+    hashtable_t *evictor_jobs;    // the keys with an eviction job in the queue
+
+    peer_subscriptions_t *subscriptions; // the peers which got a copy of the keys we own
+                                         // (so that only them are notified of changes)
+
+#define SHARDCACHE_ATOMIC_LOCKS 64
+    pthread_mutex_t atomic_locks[SHARDCACHE_ATOMIC_LOCKS]; // striped (recursive) locks serializing
+                                                           // the CAS/INCR/DECR and SET commands
+                                                           // on the keys owned by this node
+
+    uint64_t versions; // the last version assigned to the cached data of a key we own
+                       // (starts from the creation time in microseconds, so that the
+                       //  versions are never reused, not even across restarts)
 
     shardcache_counters_t *counters; // the internal counters instance
 
 #define SHARDCACHE_COUNTER_LABELS_ARRAY  \
         { "gets", "sets", "dels", "heads", "evicts", "expires", \
           "cache_misses", "fetch_remote", "fetch_local", "not_found", \
-          "volatile_table_size", "cache_size", "cached_items", "errors" }
+          "volatile_table_size", "cache_size", "cached_items", "errors", \
+          "busy_pending_requests", "busy_remote_requests", "busy_storage_requests", \
+          "hedged_fetches", "hedged_fetches_won", \
+          "tracked_evictions", "skipped_evictions", "dropped_evictions" }
 
 #define SHARDCACHE_COUNTER_GETS             0
 #define SHARDCACHE_COUNTER_SETS             1
@@ -241,7 +286,15 @@ struct __shardcache_s {
 #define SHARDCACHE_COUNTER_CACHE_SIZE       11
 #define SHARDCACHE_COUNTER_CACHED_ITEMS     12
 #define SHARDCACHE_COUNTER_ERRORS           13
-#define SHARDCACHE_NUM_COUNTERS             14
+#define SHARDCACHE_COUNTER_BUSY_PENDING      14
+#define SHARDCACHE_COUNTER_BUSY_REMOTE       15
+#define SHARDCACHE_COUNTER_BUSY_STORAGE      16
+#define SHARDCACHE_COUNTER_HEDGES           17
+#define SHARDCACHE_COUNTER_HEDGES_WON       18
+#define SHARDCACHE_COUNTER_EVICTIONS_TRACKED 19
+#define SHARDCACHE_COUNTER_EVICTIONS_SKIPPED 20
+#define SHARDCACHE_COUNTER_EVICTIONS_DROPPED 21
+#define SHARDCACHE_NUM_COUNTERS             22
     struct {
         const char *name; // the exported label of the counter
         uint64_t value;   // the actual value (accessed using the atomic builtins)
@@ -252,6 +305,16 @@ struct __shardcache_s {
                                           // filedescriptors // when using persistent
                                           // connections
 
+    peer_links_t *peer_links; // persistent links to the peers used to
+                              // pipeline the remote fetches
+
+    peer_breakers_t *peer_breakers; // circuit breakers guarding the remote fetches
+    int breaker_failover;           // boolean flag indicating if the fetches for keys owned
+                                    // by a peer whose circuit is open should be sent to the
+                                    // next node on the continuum
+    int bounded_load;               // percent of its share of the keys a node can own
+                                    // in excess before spilling them (0 == no bound)
+
     int tcp_timeout;        // the tcp timeout to use when setting up new connections
 
     shardcache_async_io_context_t *async_context;
@@ -268,6 +331,16 @@ typedef struct {
     uint32_t expire;
 } volatile_object_t;
 
+// find the node which would own the key if 'failed' was taken out of the
+// continuum. Returns 1 if it's us, 0 if it's another node (whose label is
+// copied to 'owner') or -1 if there is no other node
+int shardcache_test_failover_ownership(shardcache_t *cache,
+                                       void *key,
+                                       size_t klen,
+                                       char *failed,
+                                       char *owner,
+                                       size_t *len);
+
 int shardcache_test_migration_ownership(shardcache_t *cache,
         void *key, size_t klen, char *owner, size_t *len);
 
@@ -275,6 +348,13 @@ int shardcache_get_connection_for_peer(shardcache_t *cache, char *peer);
 
 void shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd);
 
+// as above but, if caps is not NULL, the capabilities are negotiated on new
+// connections (see open_peer_session()) and *caps is set accordingly, so that
+// messages can be checksummed instead of being signed and use wide records
+int shardcache_get_connection_for_peer_caps(shardcache_t *cache, char *peer, uint32_t *caps);
+
+void shardcache_release_connection_for_peer_caps(shardcache_t *cache, char *peer, int fd, uint32_t caps);
+
 int shardcache_set_internal(shardcache_t *cache,
                             void *key,
                             size_t klen,
@@ -298,7 +378,53 @@ int shardcache_set_migration_continuum(shardcache_t *cache, shardcache_node_t **
 int shardcache_schedule_expiration(shardcache_t *cache, void *key, size_t klen, time_t expire, int is_volatile);
 int shardcache_unschedule_expiration(shardcache_t *cache, void *key, size_t klen, int is_volatile);
 
+// same as shardcache_get_async() but, if it must be loaded, the key is
+// fetched from the local storage even if owned by another node
+// (used to serve the peers failing over to us, see SHC_GET_FLAG_LOCAL)
+int shardcache_get_async_local(shardcache_t *cache,
+                               void *key,
+                               size_t klen,
+                               shardcache_get_async_callback_t cb,
+                               void *priv);
+
+// revalidate the cached copy of a key owned by another node, which the owner
+// transfers again only if its version changed (the copy is updated in place).
+// If 'if_read' is true copies which haven't been served since they were
+// (re)validated are left alone.
+// Returns 0 if the copy is still valid, 1 if it has been updated or -1 if
+// it can't be revalidated (and should be dropped)
+int shardcache_revalidate_copy(shardcache_t *cache, void *key, size_t klen, int if_read);
+
 void shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk);
 
+// run 'cb' in one of the async i/o threads once 'timeout' expires,
+// 'free_ctx' (if any) is called afterwards to release 'priv'
+void shardcache_schedule_async(shardcache_t *cache,
+                               struct timeval *timeout,
+                               void (*cb)(iomux_t *iomux, void *priv),
+                               void *priv,
+                               iomux_timeout_free_context_cb free_ctx);
+
+// record that the node labeled 'peer' is getting a copy of a key we own
+// ('peer' is NULL if the requester didn't identify itself)
+void shardcache_subscribe(shardcache_t *cache, void *key, size_t klen, char *peer);
+
+// returns 1 if the owners track the peers holding a copy of their keys
+// (so copies not obtained from the owner must not be kept)
+int shardcache_tracked_evictions_enabled(shardcache_t *cache);
+
+// the topologies (and the nodes and continuums they hold) are accessed without
+// locking between these calls, the ones replaced are released only once all
+// the readers which might be using them are gone.
+// NOTE: the migration_lock must not be acquired in between
+int shardcache_topology_enter(shardcache_t *cache);
+void shardcache_topology_exit(shardcache_t *cache, int epoch);
+
+// returns the number of requests in-flight to remote peers
+uint64_t shardcache_remote_requests(shardcache_t *cache);
+
+// pin a thread to the given cpu (returns 0 on success, -1 otherwise)
+int shardcache_thread_set_affinity(pthread_t thread, int cpu);
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
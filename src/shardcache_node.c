@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <regex.h>
@@ -13,6 +14,7 @@ struct __shardcache_node_s {
     char *label;
     char **address;
     int num_replicas;
+    int weight;     // share of the keys relative to the other nodes
     char *string;
 }; 
 
@@ -45,6 +47,28 @@ shardcache_node_create_from_string(char *str)
     char *string = copy;
     char *label = strsep(&string, ":");
     char *addrstring = string;
+    int weight = 1;
+
+    if (!addrstring || !*addrstring) {
+        SHC_ERROR("No address for peer: '%s'", str);
+        free(copy);
+        return NULL;
+    }
+
+    // the label can be followed by the weight of the node (label@weight),
+    // an '@' not followed by a number is part of the label
+    char *weightstring = strrchr(label, '@');
+    if (weightstring && weightstring[1] &&
+        strspn(weightstring + 1, "0123456789") == strlen(weightstring + 1))
+    {
+        *weightstring++ = 0;
+        weight = strtol(weightstring, NULL, 10);
+        if (weight < 1 || weight > SHARDCACHE_NODE_WEIGHT_MAX) {
+            SHC_ERROR("Bad weight for peer %s: '%s'", label, weightstring);
+            free(copy);
+            return NULL;
+        }
+    }
     char *addr = NULL;
     char **addrlist = NULL;
     int num_addresses = 0;
@@ -69,6 +93,7 @@ shardcache_node_create_from_string(char *str)
     node->address = addrlist;
     node->string = strdup(str);
     node->num_replicas = num_addresses;
+    node->weight = weight;
 
     free(copy);
     return node;
@@ -81,6 +106,7 @@ shardcache_node_create(char *label, char **addresses, int num_addresses)
     shardcache_node_t *node = calloc(1, sizeof(shardcache_node_t));
     node->label = strdup(label);
     node->num_replicas = num_addresses;
+    node->weight = 1;
     node->address = calloc(num_addresses, sizeof(char *));
     int slen = strlen(node->label) + 3;
     char *node_string = malloc(slen);
@@ -94,6 +120,9 @@ shardcache_node_create(char *label, char **addresses, int num_addresses)
         node->address[i] = strdup(addresses[i]);
     }
     node->string = node_string;
+    // an '@' in the label must be followed by the weight in the node string
+    if (strchr(node->label, '@'))
+        shardcache_node_set_weight(node, 1);
     return node;
 }
 
@@ -108,6 +137,7 @@ shardcache_node_copy(shardcache_node_t *node)
     for (i = 0; i < node->num_replicas; i++)
         copy->address[i] = strdup(node->address[i]);
     copy->num_replicas = node->num_replicas;
+    copy->weight = node->weight;
     copy->string = strdup(node->string);
     return copy;
 }
@@ -136,6 +166,33 @@ shardcache_node_get_label(shardcache_node_t *node)
     return node->label;
 }
 
+int
+shardcache_node_get_weight(shardcache_node_t *node)
+{
+    return node->weight;
+}
+
+int
+shardcache_node_set_weight(shardcache_node_t *node, int weight)
+{
+    if (weight < 1 || weight > SHARDCACHE_NODE_WEIGHT_MAX)
+        return -1;
+
+    // rebuild the node string (label[@weight]:address[;address...])
+    char *addresses = strchr(node->string, ':');
+    size_t slen = strlen(node->label) + 16 + (addresses ? strlen(addresses) : 0);
+    char *node_string = malloc(slen);
+    // the weight is always there if the label contains an '@'
+    if (weight > 1 || strchr(node->label, '@'))
+        snprintf(node_string, slen, "%s@%d%s", node->label, weight, addresses ? addresses : ":");
+    else
+        snprintf(node_string, slen, "%s%s", node->label, addresses ? addresses : ":");
+    free(node->string);
+    node->string = node_string;
+    node->weight = weight;
+    return 0;
+}
+
 char *
 shardcache_node_get_address(shardcache_node_t *node)
 {
@@ -147,22 +204,26 @@ shardcache_node_select(shardcache_t *cache, char *label)
 {
     shardcache_node_t *node = NULL;
     int i;
-    for (i = 0; i < cache->num_shards; i++ ){
-        if (strcmp(cache->shards[i]->label, label) == 0) {
-            node = cache->shards[i];
+    int epoch = shardcache_topology_enter(cache);
+    shardcache_topology_t *topology = ATOMIC_READ(cache->topology);
+    for (i = 0; i < topology->num_shards; i++ ){
+        if (strcmp(topology->shards[i]->label, label) == 0) {
+            node = shardcache_node_copy(topology->shards[i]);
             break;
         }
     }
-    SPIN_LOCK(&cache->migration_lock);
-    if (cache->migration && !node) {
-        for (i = 0; i < cache->num_migration_shards; i++) {
-            if (strcmp(cache->migration_shards[i]->label, label) == 0) {
-                node = cache->migration_shards[i];
+    topology = ATOMIC_READ(cache->migration);
+    if (topology && !node) {
+        for (i = 0; i < topology->num_shards; i++) {
+            if (strcmp(topology->shards[i]->label, label) == 0) {
+                node = shardcache_node_copy(topology->shards[i]);
                 break;
             }
         }
     }
-    SPIN_UNLOCK(&cache->migration_lock);
+    // the node is copied before leaving the epoch,
+    // the topology might be released right after
+    shardcache_topology_exit(cache, epoch);
     return node;
 }
 
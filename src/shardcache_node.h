@@ -10,6 +10,8 @@ typedef struct __shardcache_node_s shardcache_node_t;
 
 #include <shardcache.h>
 
+#define SHARDCACHE_NODE_WEIGHT_MAX 100
+
 /**
  * @brief Create a new shardcache_node_t structure
  * @param label The label of the node
@@ -23,8 +25,10 @@ shardcache_node_t *shardcache_node_create(char *label, char **addresses, int num
 
 /**
  * @brief Create a new shardcache_node_t structure by parsing a full node string
- * @param str A valid node string
+ * @param str A valid node string (label[@weight]:address[;address...])
  * @return A newly initialized shardcache_node_t structure
+ * @note The weight is what follows the last '@' if it's a number (so labels
+ *       ending with '@' and a number need the weight to be explicit)
  * @note The caller MUST release the resources used to represent the node by calling
  *       shardcache_node_destroy() on the returned pointer
  */
@@ -53,6 +57,25 @@ void shardcache_node_destroy(shardcache_node_t *node);
 char *shardcache_node_get_label(shardcache_node_t *node);
 
 
+/**
+ * @brief Get the weight of a given node
+ * @param node A previously initialized and valid shardcache_node_t structure
+ * @return The weight for the node passed as argument
+ * @note Each node owns a share of the keys proportional to its weight
+ *       (nodes created without an explicit weight have weight 1).
+ *       All the nodes and clients must agree on the weights
+ */
+int shardcache_node_get_weight(shardcache_node_t *node);
+
+/**
+ * @brief Set the weight of a given node
+ * @param node   A previously initialized and valid shardcache_node_t structure
+ * @param weight The new weight (from 1 to SHARDCACHE_NODE_WEIGHT_MAX)
+ * @return 0 on success, -1 if the weight is out of range
+ * @note The node string is updated accordingly
+ */
+int shardcache_node_set_weight(shardcache_node_t *node, int weight);
+
 /**
  * @brief Get the node-string representing a given node
  * @param node A previously initialized and valid shardcache_node_t structure
@@ -107,8 +130,11 @@ char *shardcache_node_get_address_at_index(shardcache_node_t *node, int index);
  * @brief Select a node by its label
  * @param cache   A valid pointer to a shardcache_t structure
  * @param label   The label of the node to select
- * @return A valid shardcache_node_t structure representing the requested node,
+ * @return A copy of the shardcache_node_t structure representing the requested node,
  *         NULL if no node has been found matching the label passed as argument
+ * @note The caller must release the returned copy using shardcache_node_destroy()
+ *       (the nodes owned by the cache are released once the nodes change,
+ *       when a migration ends or the bounded load is changed)
  */
 shardcache_node_t * shardcache_node_select(shardcache_t *cache, char *label);
 
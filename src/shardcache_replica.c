@@ -274,11 +274,12 @@ kepaxos_commit(unsigned char type,
             while (s && *s) {
                 char *tok = strsep(&s, ",");
                 if(tok) {
-                    char *label = strsep(&tok, ":");
-                    char *addr = tok;
+                    // label[@weight]:address[;address...]
+                    shardcache_node_t *node = shardcache_node_create_from_string(tok);
+                    if (!node)
+                        continue;
                     size_t size = (num_shards + 1) * sizeof(shardcache_node_t *);
                     nodes = realloc(nodes, size);
-                    shardcache_node_t *node = shardcache_node_create(label, &addr, 1);
                     nodes[num_shards++] = node;
                 } 
             }
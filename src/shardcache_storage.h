@@ -79,6 +79,27 @@ typedef int (*shardcache_fetch_items_callback_t)
 typedef int (*shardcache_store_item_callback_t)
     (void *key, size_t klen, void *value, size_t vlen, void *priv);
 
+/**
+ * @brief Callback to store new values for multiple keys at once.
+ *
+ *        The shardcache instance will call this callback
+ *        if new values for multiple keys owned by this node
+ *        need to be set in the underlying storage (SET_MULTI)
+ *
+ * @param keys   A valid pointer to an array of keys
+ * @param klens  An array containing the length of the keys
+ * @param nkeys  The number of keys in the key array
+ * @param values An array containing the values to store
+ *               (the value at a given index refers to the key
+ *                at the same index in the keys array)
+ * @param vlens  An array containing the length of the values
+ * @param priv   The 'priv' pointer previously stored in the shardcache_storage_t
+ *               structure at initialization time
+ * @return 0 if all the values have been stored, -1 otherwise
+ */
+typedef int (*shardcache_store_items_callback_t)
+    (void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv);
+
 /**
  * @brief Callback to remove an existing value for a given key.
  *
@@ -95,6 +116,20 @@ typedef int (*shardcache_store_item_callback_t)
 typedef int
 (*shardcache_remove_item_callback_t)(void *key, size_t klen, void *priv);
 
+/**
+ * @brief Callback to remove the values for multiple keys at once
+ *        (DELETE_MULTI)
+ *
+ * @param keys  A valid pointer to an array of keys
+ * @param klens An array containing the length of the keys
+ * @param nkeys The number of keys in the key array
+ * @param priv  The 'priv' pointer previously stored in the shardcache_storage_t
+ *              structure at initialization time
+ * @return 0 if all the keys have been removed, -1 otherwise
+ */
+typedef int
+(*shardcache_remove_items_callback_t)(void **keys, size_t *klens, int nkeys, void *priv);
+
 /**
  * @brief Callback to check if a specific key exists on the storage
  * @param key  A valid pointer to the key
@@ -205,7 +240,9 @@ typedef void (*shardcache_thread_start_callback_t)(void *priv);
 typedef void (*shardcache_thread_exit_callback_t)(void *priv);
 
 
-#define SHARDCACHE_STORAGE_API_VERSION 0x01
+#define SHARDCACHE_STORAGE_API_VERSION 0x02
+// the oldest version of the storage structure still accepted
+#define SHARDCACHE_STORAGE_API_VERSION_MIN 0x01
 
 typedef struct __shardcache_storage_s shardcache_storage_t;
 typedef int (*shardcache_storage_init_t)(shardcache_storage_t *, char **);
@@ -225,7 +262,7 @@ struct __shardcache_storage_s {
     //! The fecth callback
     shardcache_fetch_item_callback_t       fetch;
 
-    //! The fetch multiple items callback (XXX - still unused)
+    //! The fetch multiple items callback (optional, used by shardcache_get_multi_async())
     shardcache_fetch_items_callback_t      fetch_multi;
 
     //! The store callback (optional if the storage is indended to be read-only)
@@ -293,6 +330,13 @@ struct __shardcache_storage_s {
         shardcache_storage_reset_t reset;
     } internal;
 
+    // the following members are available since version 0x02 of the structure
+    // (they are considered NULL for storages providing a version 0x01 structure)
+
+    //! The store multiple items callback (optional, used by shardcache_set_multi())
+    shardcache_store_items_callback_t      store_multi;
+    //! The remove multiple items callback (optional, used by shardcache_del_multi())
+    shardcache_remove_items_callback_t     remove_multi;
 };
 
 /**
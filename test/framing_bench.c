@@ -0,0 +1,184 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <fbuf.h>
+#include <messaging.h>
+
+// Microbenchmark of the record framing: builds and parses (both with the
+// async reader and with the blocking one) messages carrying a single value,
+// using the 16bit chunks and the 32bit (wide) records.
+//
+// usage: framing_bench [ value_size_in_MB [ iterations ] ]
+
+typedef struct {
+    fbuf_t *msg;
+    int fd;
+    int iterations;
+} framing_bench_writer_t;
+
+static uint64_t
+framing_bench_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int
+framing_bench_cb(void *data, size_t len, int idx, void *priv)
+{
+    if (idx == 0)
+        *((size_t *)priv) += len;
+    return 0;
+}
+
+static void *
+framing_bench_write(void *priv)
+{
+    framing_bench_writer_t *writer = (framing_bench_writer_t *)priv;
+    int i;
+    for (i = 0; i < writer->iterations; i++) {
+        char *data = fbuf_data(writer->msg);
+        size_t left = fbuf_used(writer->msg);
+        while (left) {
+            ssize_t wb = write(writer->fd, data, left);
+            if (wb <= 0)
+                return NULL;
+            data += wb;
+            left -= wb;
+        }
+    }
+    return NULL;
+}
+
+static void
+framing_bench_report(char *framing, char *what, size_t bytes, int iterations, uint64_t elapsed)
+{
+    double secs = (double)elapsed / 1000000;
+    printf("%-8s %-12s %8.2f ms/msg %10.2f MB/s\n", framing, what,
+           (double)elapsed / iterations / 1000,
+           secs ? ((double)bytes * iterations / (1024 * 1024)) / secs : 0);
+}
+
+static int
+framing_bench_run(char *framing, int sig_hdr, void *value, size_t size, int iterations)
+{
+    shardcache_record_t record = { .v = value, .l = size };
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    int i;
+
+    uint64_t start = framing_bench_now();
+    for (i = 0; i < iterations; i++) {
+        fbuf_clear(&msg);
+        if (build_message(NULL, sig_hdr, SHC_HDR_RESPONSE, &record, 1, &msg) != 0) {
+            fprintf(stderr, "Can't build the message\n");
+            fbuf_destroy(&msg);
+            return -1;
+        }
+    }
+    framing_bench_report(framing, "build", size, iterations, framing_bench_now() - start);
+
+    // feed the async reader with the same pieces it would get from the socket
+    size_t received = 0;
+    async_read_ctx_t *ctx = async_read_context_create(NULL, framing_bench_cb, &received);
+    start = framing_bench_now();
+    for (i = 0; i < iterations; i++) {
+        char *data = fbuf_data(&msg);
+        size_t left = fbuf_used(&msg);
+        while (left) {
+            int len = left > 65536 ? 65536 : left;
+            int processed = 0;
+            async_read_context_state_t state = async_read_context_input_data(ctx, data, len, &processed);
+            while (state == SHC_STATE_READING_DONE)
+                state = async_read_context_update(ctx);
+            if (state == SHC_STATE_READING_ERR) {
+                fprintf(stderr, "Can't parse the message\n");
+                async_read_context_destroy(ctx);
+                fbuf_destroy(&msg);
+                return -1;
+            }
+            data += len;
+            left -= len;
+        }
+    }
+    framing_bench_report(framing, "async read", size, iterations, framing_bench_now() - start);
+    async_read_context_destroy(ctx);
+
+    if (received != size * iterations) {
+        fprintf(stderr, "Received %zu bytes instead of %zu\n", received, size * iterations);
+        fbuf_destroy(&msg);
+        return -1;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fbuf_destroy(&msg);
+        return -1;
+    }
+
+    framing_bench_writer_t writer = { &msg, fds[1], iterations };
+    pthread_t writer_thread;
+    pthread_create(&writer_thread, NULL, framing_bench_write, &writer);
+
+    int rc = 0;
+    start = framing_bench_now();
+    for (i = 0; i < iterations; i++) {
+        fbuf_t out = FBUF_STATIC_INITIALIZER;
+        fbuf_t *outp = &out;
+        shardcache_hdr_t hdr = 0;
+        if (read_message(fds[0], NULL, &outp, 1, &hdr, 0) != 1 || fbuf_used(&out) != size) {
+            fprintf(stderr, "Can't read the message\n");
+            fbuf_destroy(&out);
+            rc = -1;
+            break;
+        }
+        fbuf_destroy(&out);
+    }
+    if (rc == 0)
+        framing_bench_report(framing, "sync read", size, iterations, framing_bench_now() - start);
+
+    close(fds[0]);
+    pthread_join(writer_thread, NULL);
+    close(fds[1]);
+    fbuf_destroy(&msg);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = 50;
+    int iterations = 10;
+
+    if (argc > 1)
+        size = strtol(argv[1], NULL, 10);
+    if (argc > 2)
+        iterations = strtol(argv[2], NULL, 10);
+    if (!size || iterations <= 0) {
+        fprintf(stderr, "usage: %s [ value_size_in_MB [ iterations ] ]\n", argv[0]);
+        exit(-1);
+    }
+    size *= 1024 * 1024;
+
+    char *value = malloc(size);
+    size_t i;
+    for (i = 0; i < size; i++)
+        value[i] = i % 251;
+
+    printf("%zu MB values, %d iterations\n", size / (1024 * 1024), iterations);
+
+    int rc = framing_bench_run("16bit", SHC_HDR_SIGNATURE_SIP, value, size, iterations);
+    if (rc == 0)
+        rc = framing_bench_run("32bit", SHC_HDR_SIGNATURE_SIP|SHC_SIG_WIDE_RECORDS, value, size, iterations);
+
+    free(value);
+    exit(rc == 0 ? 0 : -1);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -1,9 +1,459 @@
+#define _GNU_SOURCE
 #include <shardcache_client.h>
+#include <shardcache_storage.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <ut.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#include <messaging.h>
+#include <compression.h>
+#include <shardcache_internal.h>
+#include <continuum.h>
+
+// a minimal memory storage whose fetches can be slowed down
+// (to control the order in which responses are completed)
+#define TEST_STORAGE_MAX_ITEMS 1024
+
+typedef struct {
+    pthread_mutex_t lock;
+    char *keys[TEST_STORAGE_MAX_ITEMS];
+    size_t klens[TEST_STORAGE_MAX_ITEMS];
+    void *values[TEST_STORAGE_MAX_ITEMS];
+    size_t vlens[TEST_STORAGE_MAX_ITEMS];
+    int num_items;
+    int slow_ms; // delay applied to the fetch of the keys starting with "slow"
+    int fetches; // number of keys fetched so far
+} test_storage_t;
+
+static int
+test_storage_find(test_storage_t *st, void *key, size_t klen)
+{
+    int i;
+    for (i = 0; i < st->num_items; i++) {
+        if (st->klens[i] == klen && memcmp(st->keys[i], key, klen) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int
+test_storage_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    if (st->slow_ms && klen > 4 && memcmp(key, "slow", 4) == 0)
+        usleep(st->slow_ms * 1000);
+
+    pthread_mutex_lock(&st->lock);
+    st->fetches++;
+    int i = test_storage_find(st, key, klen);
+    if (i >= 0) {
+        *value = malloc(st->vlens[i]);
+        memcpy(*value, st->values[i], st->vlens[i]);
+        if (vlen)
+            *vlen = st->vlens[i];
+    }
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int
+test_storage_fetch_multi(void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv)
+{
+    int i;
+    for (i = 0; i < nkeys; i++) {
+        values[i] = NULL;
+        vlens[i] = 0;
+        test_storage_fetch(keys[i], klens[i], &values[i], &vlens[i], priv);
+    }
+    return 0;
+}
+
+static int
+test_storage_store(void *key, size_t klen, void *value, size_t vlen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    pthread_mutex_lock(&st->lock);
+    int i = test_storage_find(st, key, klen);
+    if (i < 0) {
+        if (st->num_items == TEST_STORAGE_MAX_ITEMS) {
+            pthread_mutex_unlock(&st->lock);
+            return -1;
+        }
+        i = st->num_items++;
+        st->keys[i] = malloc(klen);
+        memcpy(st->keys[i], key, klen);
+        st->klens[i] = klen;
+    } else {
+        free(st->values[i]);
+    }
+    st->values[i] = malloc(vlen);
+    memcpy(st->values[i], value, vlen);
+    st->vlens[i] = vlen;
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int
+test_storage_remove(void *key, size_t klen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    pthread_mutex_lock(&st->lock);
+    int i = test_storage_find(st, key, klen);
+    if (i >= 0) {
+        free(st->keys[i]);
+        free(st->values[i]);
+        st->num_items--;
+        st->keys[i] = st->keys[st->num_items];
+        st->klens[i] = st->klens[st->num_items];
+        st->values[i] = st->values[st->num_items];
+        st->vlens[i] = st->vlens[st->num_items];
+    }
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int
+test_storage_exist(void *key, size_t klen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    pthread_mutex_lock(&st->lock);
+    int i = test_storage_find(st, key, klen);
+    pthread_mutex_unlock(&st->lock);
+    return (i >= 0);
+}
+
+static int
+test_storage_fetches(test_storage_t *st)
+{
+    pthread_mutex_lock(&st->lock);
+    int fetches = st->fetches;
+    pthread_mutex_unlock(&st->lock);
+    return fetches;
+}
+
+static void
+test_storage_init(test_storage_t *st, shardcache_storage_t *storage)
+{
+    memset(st, 0, sizeof(test_storage_t));
+    pthread_mutex_init(&st->lock, NULL);
+    memset(storage, 0, sizeof(shardcache_storage_t));
+    storage->version = SHARDCACHE_STORAGE_API_VERSION;
+    storage->fetch = test_storage_fetch;
+    storage->fetch_multi = test_storage_fetch_multi;
+    storage->store = test_storage_store;
+    storage->remove = test_storage_remove;
+    storage->exist = test_storage_exist;
+    storage->priv = st;
+}
+
+static void
+test_storage_destroy(test_storage_t *st)
+{
+    int i;
+    for (i = 0; i < st->num_items; i++) {
+        free(st->keys[i]);
+        free(st->values[i]);
+    }
+    pthread_mutex_destroy(&st->lock);
+}
+
+// find a key (with the given prefix) owned by the node 'cache' (or
+// by another node if 'owned' is 0)
+static void
+test_find_key(shardcache_t *cache, char *prefix, int owned, char *key, size_t size)
+{
+    int i;
+    for (i = 0; i < 10000; i++) {
+        snprintf(key, size, "%s%d", prefix, i);
+        if (shardcache_test_ownership(cache, key, strlen(key), NULL, NULL) == owned)
+            return;
+    }
+}
+
+// open a new connection to a node and wait for it to be served
+static int
+test_connect(char *addr)
+{
+    int fd = connect_to_peer(addr, 5000);
+    if (fd >= 0 && check_peer(addr, NULL, 0, fd) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// keeps the storage of a node busy fetching a slow key
+typedef struct {
+    shardcache_node_t *node;
+    char *key;
+} test_slow_get_arg_t;
+
+static void *
+test_slow_get(void *priv)
+{
+    test_slow_get_arg_t *arg = (test_slow_get_arg_t *)priv;
+    shardcache_client_t *c = shardcache_client_create(&arg->node, 1, NULL);
+    void *value = NULL;
+    shardcache_client_get(c, arg->key, strlen(arg->key), &value);
+    free(value);
+    shardcache_client_destroy(c);
+    return NULL;
+}
+
+// fetches a key through a node
+typedef struct {
+    shardcache_t *cache;
+    char key[32];
+    void *value;
+    size_t vlen;
+} test_get_arg_t;
+
+static void *
+test_get(void *priv)
+{
+    test_get_arg_t *arg = (test_get_arg_t *)priv;
+    arg->value = shardcache_get(arg->cache, arg->key, strlen(arg->key), &arg->vlen, NULL);
+    return NULL;
+}
+
+#ifdef __linux__
+// count the threads of this process which are allowed to run only on 'cpu'
+static int
+test_threads_pinned_to(int cpu)
+{
+    int count = 0;
+    char expected[32];
+    snprintf(expected, sizeof(expected), "%d\n", cpu);
+    DIR *dir = opendir("/proc/self/task");
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        char path[256];
+        snprintf(path, sizeof(path), "/proc/self/task/%s/status", entry->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "Cpus_allowed_list:", 18) == 0) {
+                char *p = line + 18;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (strcmp(p, expected) == 0)
+                    count++;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if (dir)
+        closedir(dir);
+    return count;
+}
+#endif
+
+// the number of connections handled by each of the workers of a node
+static int
+test_worker_fds(shardcache_t *cache, uint64_t *fds, int num_workers)
+{
+    shardcache_counter_t *counters = NULL;
+    int num_counters = shardcache_get_counters(cache, &counters);
+    int i, found = 0;
+    for (i = 0; i < num_counters; i++) {
+        int worker = -1;
+        if (strstr(counters[i].name, ".numfds") &&
+            sscanf(counters[i].name, "worker[%d]", &worker) == 1 &&
+            worker >= 0 && worker < num_workers)
+        {
+            fds[worker] = counters[i].value;
+            found++;
+        }
+    }
+    free(counters);
+    return found;
+}
+
+// the value of a counter of a node
+static uint64_t
+test_counter(shardcache_t *cache, char *name)
+{
+    shardcache_counter_t *counters = NULL;
+    int num_counters = shardcache_get_counters(cache, &counters);
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < num_counters; i++) {
+        if (strcmp(counters[i].name, name) == 0) {
+            value = counters[i].value;
+            break;
+        }
+    }
+    free(counters);
+    return value;
+}
+
+// whether a node holds a copy of a key in its cache
+static int
+test_cached(shardcache_t *cache, char *key)
+{
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_cached(cache->arc, key, strlen(key), &obj_ptr);
+    if (!res)
+        return 0;
+    arc_release_resource(cache->arc, res);
+    return 1;
+}
+
+// collects the tags of the responses read from a connection
+typedef struct {
+    async_read_ctx_t *reader;
+    uint32_t tags[8];
+    char values[8][64];
+    int num_responses;
+} test_tagged_responses_t;
+
+static int
+test_tagged_responses_cb(void *data, size_t len, int idx, void *priv)
+{
+    test_tagged_responses_t *responses = (test_tagged_responses_t *)priv;
+    if (responses->num_responses == 8)
+        return -1;
+
+    char *value = responses->values[responses->num_responses];
+    if (idx == 0 && len) {
+        size_t used = strlen(value);
+        if (used + len >= sizeof(responses->values[0]))
+            return -1;
+        memcpy(value + used, data, len);
+        value[used + len] = 0;
+    } else if (idx == -1) {
+        if (!async_read_context_tag(responses->reader, &responses->tags[responses->num_responses]))
+            return -1;
+        responses->num_responses++;
+    }
+    return 0;
+}
+
+// read responses from fd until 'expected' responses have been received
+static int
+test_read_tagged_responses(int fd, test_tagged_responses_t *responses, int expected)
+{
+    char buf[1024];
+    while (responses->num_responses < expected) {
+        int rb = read(fd, buf, sizeof(buf));
+        if (rb <= 0)
+            return -1;
+        int processed = 0;
+        async_read_context_state_t state =
+            async_read_context_input_data(responses->reader, buf, rb, &processed);
+        while (state == SHC_STATE_READING_DONE)
+            state = async_read_context_update(responses->reader);
+        if (state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR)
+            return -1;
+    }
+    return 0;
+}
+
+// writes a message to a socket in pieces of the given size
+typedef struct {
+    int fd;
+    fbuf_t *msg;
+    int piece;
+} test_writer_arg_t;
+
+static void *
+test_write_pieces(void *priv)
+{
+    test_writer_arg_t *arg = (test_writer_arg_t *)priv;
+    char *data = fbuf_data(arg->msg);
+    int left = fbuf_used(arg->msg);
+    while (left > 0) {
+        int len = (arg->piece && arg->piece < left) ? arg->piece : left;
+        int wb = write(arg->fd, data, len);
+        if (wb <= 0)
+            break;
+        data += wb;
+        left -= wb;
+        if (arg->piece)
+            usleep(1000);
+    }
+    return NULL;
+}
+
+// read with read_message() the data written to the other end of a socket pair
+// (in pieces of 'piece' bytes, all at once if 0)
+static int
+test_read_message(fbuf_t *msg, int piece, char *auth, fbuf_t **records, int expected)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return -1;
+
+    pthread_t writer;
+    test_writer_arg_t arg = { fds[1], msg, piece };
+    pthread_create(&writer, NULL, test_write_pieces, &arg);
+
+    shardcache_hdr_t hdr = 0;
+    int rc = read_message(fds[0], auth, records, expected, &hdr, 0);
+    if (rc > 0 && hdr != SHC_HDR_RESPONSE)
+        rc = -1;
+
+    pthread_join(writer, NULL);
+    close(fds[0]);
+    close(fds[1]);
+    return rc;
+}
+
+// collects the first record of the message parsed by an async reader
+typedef struct {
+    fbuf_t value;
+    int done;
+} test_async_value_t;
+
+static int
+test_async_value_cb(void *data, size_t len, int idx, void *priv)
+{
+    test_async_value_t *arg = (test_async_value_t *)priv;
+    if (idx == 0 && len)
+        fbuf_add_binary(&arg->value, data, len);
+    else if (idx == -1)
+        arg->done = 1;
+    else if (idx == -2)
+        return -1;
+    return 0;
+}
+
+// feed a message to a new async reader in pieces of 'piece' bytes
+static int
+test_async_read(char *auth, fbuf_t *msg, int piece, test_async_value_t *arg)
+{
+    async_read_ctx_t *ctx = async_read_context_create(auth, test_async_value_cb, arg);
+    char *data = fbuf_data(msg);
+    int left = fbuf_used(msg);
+    int rc = 0;
+    while (left > 0 && rc == 0) {
+        int len = left > piece ? piece : left;
+        int processed = 0;
+        async_read_context_state_t state = async_read_context_input_data(ctx, data, len, &processed);
+        while (state == SHC_STATE_READING_DONE)
+            state = async_read_context_update(ctx);
+        if (state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR)
+            rc = -1;
+        data += len;
+        left -= len;
+    }
+    async_read_context_destroy(ctx);
+    return (rc == 0 && arg->done) ? 0 : -1;
+}
 
 int main(int argc, char **argv)
 {
@@ -47,6 +497,39 @@ int main(int argc, char **argv)
         }
     }
 
+    // a second set of servers backed by the test storage
+    shardcache_node_t *nodes2[num_nodes];
+    shardcache_t *servers2[num_nodes];
+    test_storage_t storages2[num_nodes];
+    for (i = 0; i < num_nodes; i++) {
+        char label[32];
+        sprintf(label, "tpeer%d", i);
+        char address[32];
+        sprintf(address, "127.0.0.1:976%d", i);
+        char *address_array[1] = { address };
+        nodes2[i] = shardcache_node_create(label, address_array, 1);
+    }
+
+    for (i = 0; i < num_nodes; i++) {
+        shardcache_storage_t storage;
+        test_storage_init(&storages2[i], &storage);
+        ut_testing("shardcache_create(nodes2[%d].label, nodes2, num_nodes, &storage, NULL, 5, 1<<29", i);
+        servers2[i] = shardcache_create(shardcache_node_get_label(nodes2[i]),
+                                        nodes2,
+                                        num_nodes,
+                                        &storage,
+                                        NULL,
+                                        5,
+                                        0,
+                                        1<<29);
+        if (servers2[i]) {
+            ut_success();
+            shardcache_iomux_run_timeout_low(servers2[i], 5000);
+        } else {
+            ut_failure("Errors creating the shardcache instance");
+        }
+    }
+
     sleep(1); // let the servers complete their startup
 
     // now create a client to communicate with the servers
@@ -191,6 +674,33 @@ int main(int argc, char **argv)
     if (!failed)
         ut_success();
 
+    for (i = 0; i < 10; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "test_key%d", 100+i);
+        items[i] = shc_multi_item_create(key, strlen(key), NULL, 0);
+    }
+
+    failed = 0;
+    ut_testing("shardcache_client_get_multi(c, items) (untagged requests)");
+    shardcache_client_tagged_requests(client, 0);
+    shardcache_client_get_multi(client, items);
+    shardcache_client_tagged_requests(client, 1);
+
+    for (i = 0; i < 10; i++) {
+        char v[64];
+        if (!failed) {
+            sprintf(v, "test_value%d", 100+i);
+            if (!items[i]->data || strncmp(items[i]->data, v, items[i]->dlen) != 0)
+            { 
+                ut_failure("%s != %s", items[i]->data, v);
+                failed = 1;
+            }
+        }
+        shc_multi_item_destroy(items[i]);
+    }
+    if (!failed)
+        ut_success();
+
     for (i = 0; i < 10; i++) {
         char key[32];
         char value[32];
@@ -229,6 +739,43 @@ int main(int argc, char **argv)
     if (!failed)
         ut_success();
 
+    for (i = 0; i < 5; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "test_key%d", 200+i);
+        items[i] = shc_multi_item_create(key, strlen(key), NULL, 0);
+    }
+    items[5] = NULL;
+
+    ut_testing("shardcache_client_del_multi(c, items)");
+    shardcache_client_del_multi(client, items);
+
+    failed = 0;
+    for (i = 0; i < 5; i++) {
+        void *value = NULL;
+        if (!failed) {
+            if (items[i]->status != 0) {
+                ut_failure("status for key %d != 0", 200+i);
+                failed = 1;
+            } else if (shardcache_client_get(client, items[i]->key, items[i]->klen, &value) != 0) {
+                ut_failure("key %d still exists", 200+i);
+                failed = 1;
+            }
+        }
+        free(value);
+        shc_multi_item_destroy(items[i]);
+    }
+    if (!failed)
+        ut_success();
+
+    // restore the deleted keys
+    for (i = 0; i < 5; i++) {
+        char key[32];
+        char value[32];
+        snprintf(key, sizeof(key), "test_key%d", 200+i);
+        snprintf(value, sizeof(value), "test_value%d", 200+i);
+        shardcache_client_set(client, key, strlen(key), value, strlen(value), 0);
+    }
+
     ut_testing("shardcache_client_getf(client, test_key200) == test_value200");
     int fd = shardcache_client_getf(client, "test_key200", 11);
     if (fd >= 0) {
@@ -324,6 +871,964 @@ int main(int argc, char **argv)
     size = shardcache_client_get(client, volatile_key, strlen(volatile_key), (void **)&value);
     ut_validate_int(size, 0);
 
+    char *counter_key = "counter_key";
+    int64_t counter = 0;
+    ut_testing("shardcache_client_incr(client, counter_key, 5) == 5");
+    shardcache_client_incr(client, counter_key, strlen(counter_key), 5, &counter);
+    ut_validate_int((int)counter, 5);
+
+    ut_testing("shardcache_client_decr(client, counter_key, 7) == -2");
+    shardcache_client_decr(client, counter_key, strlen(counter_key), 7, &counter);
+    ut_validate_int((int)counter, -2);
+
+    uint64_t version = 0;
+    ut_testing("shardcache_client_cas(client, test_key200) with a stale version");
+    size = shardcache_client_gets(client, "test_key200", 11, (void **)&value, &version);
+    free(value);
+    rc = shardcache_client_cas(client, "test_key200", 11, version + 1, "test_value200", 13, 0, NULL);
+    ut_validate_int(rc, 1);
+
+    uint64_t new_version = 0;
+    ut_testing("shardcache_client_cas(client, test_key200) with the actual version");
+    rc = shardcache_client_cas(client, "test_key200", 11, version, "test_value200", 13, 0, &new_version);
+    ut_validate_int(rc, 0);
+
+    // versions are never reused, not even when storing the same value
+    ut_testing("shardcache_client_cas(client, test_key200) gave a new version to the same value");
+    ut_validate_int(new_version != 0 && new_version != version, 1);
+
+    ut_testing("shardcache_client_get_if_modified(client, test_key200) not modified");
+    rc = shardcache_client_get_if_modified(client, "test_key200", 11, &new_version, NULL, NULL);
+    ut_validate_int(rc, 1);
+
+    ut_testing("shardcache_client_cas(client, test_key200) after a set of the same value");
+    shardcache_client_set(client, "test_key200", 11, "test_value200", 13, 0);
+    rc = shardcache_client_cas(client, "test_key200", 11, new_version, "test_value200", 13, 0, NULL);
+    ut_validate_int(rc, 1);
+
+    // a slow request (a remote fetch from a node whose storage is slow)
+    // must not delay the response to the tagged request following it
+    char slow_key[32];
+    char fast_key[32];
+    test_find_key(servers2[0], "slow_key", 0, slow_key, sizeof(slow_key));
+    test_find_key(servers2[0], "fast_key", 1, fast_key, sizeof(fast_key));
+    test_storage_store(slow_key, strlen(slow_key), "slow_value", 10, &storages2[1]);
+    test_storage_store(fast_key, strlen(fast_key), "fast_value", 10, &storages2[0]);
+    storages2[1].slow_ms = 500;
+
+    ut_testing("tagged requests are answered out of order");
+    fd = connect_to_peer("127.0.0.1:9760", 5000);
+    if (fd >= 0) {
+        fbuf_t out = FBUF_STATIC_INITIALIZER;
+        shardcache_record_t record = { .v = slow_key, .l = strlen(slow_key) };
+        add_message_tag(1, &out);
+        build_message(NULL, 0, SHC_HDR_GET, &record, 1, &out);
+        record.v = fast_key;
+        record.l = strlen(fast_key);
+        add_message_tag(2, &out);
+        build_message(NULL, 0, SHC_HDR_GET, &record, 1, &out);
+        rc = write(fd, fbuf_data(&out), fbuf_used(&out));
+        fbuf_destroy(&out);
+
+        test_tagged_responses_t responses;
+        memset(&responses, 0, sizeof(responses));
+        responses.reader = async_read_context_create(NULL, test_tagged_responses_cb, &responses);
+        if (rc <= 0 || test_read_tagged_responses(fd, &responses, 2) != 0) {
+            ut_failure("Can't read the responses to the tagged requests");
+        } else if (responses.tags[0] != 2 || responses.tags[1] != 1) {
+            ut_failure("responses received in order (tags %u, %u)", responses.tags[0], responses.tags[1]);
+        } else if (strcmp(responses.values[0], "fast_value") != 0 ||
+                   strcmp(responses.values[1], "slow_value") != 0)
+        {
+            ut_failure("%s != fast_value or %s != slow_value", responses.values[0], responses.values[1]);
+        } else {
+            ut_success();
+        }
+        async_read_context_destroy(responses.reader);
+        close(fd);
+    } else {
+        ut_failure("Can't connect to 127.0.0.1:9760");
+    }
+    storages2[1].slow_ms = 0;
+
+    // concurrent remote fetches are pipelined on the persistent links
+    // to the owner instead of using a dedicated connection each
+    ut_testing("concurrent remote fetches are multiplexed on the peer links");
+    test_get_arg_t link_gets[8];
+    pthread_t link_threads[8];
+    uint64_t fds_before[5] = { 0, 0, 0, 0, 0 };
+    uint64_t fds_during[5] = { 0, 0, 0, 0, 0 };
+    test_worker_fds(servers2[1], fds_before, 5);
+    storages2[1].slow_ms = 200;
+    for (i = 0; i < 8; i++) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "slow_linked%d_", i);
+        memset(&link_gets[i], 0, sizeof(test_get_arg_t));
+        link_gets[i].cache = servers2[0];
+        test_find_key(servers2[0], prefix, 0, link_gets[i].key, sizeof(link_gets[i].key));
+        test_storage_store(link_gets[i].key, strlen(link_gets[i].key), "linked_value", 12, &storages2[1]);
+        pthread_create(&link_threads[i], NULL, test_get, &link_gets[i]);
+    }
+    usleep(100000);
+    test_worker_fds(servers2[1], fds_during, 5);
+    int linked = 0;
+    for (i = 0; i < 8; i++) {
+        pthread_join(link_threads[i], NULL);
+        if (link_gets[i].value && link_gets[i].vlen == 12 &&
+            memcmp(link_gets[i].value, "linked_value", 12) == 0)
+        {
+            linked++;
+        }
+        free(link_gets[i].value);
+    }
+    storages2[1].slow_ms = 0;
+    int new_fds = 0;
+    for (i = 0; i < 5; i++)
+        new_fds += (int)fds_during[i] - (int)fds_before[i];
+    if (linked != 8)
+        ut_failure("%d values fetched instead of 8", linked);
+    else if (new_fds > SHARDCACHE_PEER_LINKS_DEFAULT)
+        ut_failure("%d new connections to the owner for 8 fetches", new_fds);
+    else
+        ut_success();
+
+    // the links are connected without blocking: the fetches sent on a link
+    // to a peer which is down fail as soon as the connection is refused
+    // and the link is connected again once the peer is up
+    shardcache_node_t *lnodes[2];
+    for (i = 0; i < 2; i++) {
+        char label[32];
+        sprintf(label, "lpeer%d", i);
+        char address[32];
+        sprintf(address, "127.0.0.1:977%d", i);
+        char *address_array[1] = { address };
+        lnodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+    test_storage_t lstorage;
+    shardcache_storage_t lstorage_ops;
+    test_storage_init(&lstorage, &lstorage_ops);
+    shardcache_t *lserver0 = shardcache_create("lpeer0", lnodes, 2, NULL, NULL, 5, 0, 1<<29);
+    shardcache_t *lserver1 = NULL;
+    char lkey[32];
+    test_find_key(lserver0, "link_key", 0, lkey, sizeof(lkey));
+    test_storage_store(lkey, strlen(lkey), "link_value", 10, &lstorage);
+
+    ut_testing("a fetch from a peer which is down fails without waiting for the tcp timeout");
+    struct timeval lstart, lend, lelapsed;
+    gettimeofday(&lstart, NULL);
+    size_t llen = 0;
+    void *lvalue = shardcache_get(lserver0, lkey, strlen(lkey), &llen, NULL);
+    gettimeofday(&lend, NULL);
+    timersub(&lend, &lstart, &lelapsed);
+    if (lvalue)
+        ut_failure("Got a value from a node which is down");
+    else if (lelapsed.tv_sec >= 1)
+        ut_failure("The fetch failed after %d.%06d seconds", (int)lelapsed.tv_sec, (int)lelapsed.tv_usec);
+    else
+        ut_success();
+    free(lvalue);
+
+    ut_testing("the link is connected again once the peer is up");
+    lserver1 = shardcache_create("lpeer1", lnodes, 2, &lstorage_ops, NULL, 5, 0, 1<<29);
+    usleep(500000);
+    lvalue = shardcache_get(lserver0, lkey, strlen(lkey), &llen, NULL);
+    if (!lvalue)
+        ut_failure("Can't fetch the value once the peer is up");
+    else
+        ut_validate_buffer(lvalue, llen, "link_value", 10);
+    free(lvalue);
+
+    shardcache_destroy(lserver0);
+    if (lserver1)
+        shardcache_destroy(lserver1);
+    for (i = 0; i < 2; i++)
+        shardcache_node_destroy(lnodes[i]);
+    test_storage_destroy(&lstorage);
+
+    // the owner of the next keys has two addresses (served by two instances
+    // which can't tell each other apart), one of which is slow to answer:
+    // the fetches sent to it must be hedged to the other one
+    shardcache_node_t *hnodes[2];
+    shardcache_node_t *hnodes_owner[2][2];
+    char *haddrs[3] = { "127.0.0.1:9780", "127.0.0.1:9781", "127.0.0.1:9782" };
+    hnodes[0] = shardcache_node_create("hpeer0", &haddrs[0], 1);
+    hnodes[1] = shardcache_node_create("hpeer1", &haddrs[1], 2);
+    test_storage_t hstorages[2];
+    shardcache_t *hservers[2];
+    for (i = 0; i < 2; i++) {
+        shardcache_storage_t hstorage;
+        test_storage_init(&hstorages[i], &hstorage);
+        hnodes_owner[i][0] = shardcache_node_create("hpeer0", &haddrs[0], 1);
+        hnodes_owner[i][1] = shardcache_node_create("hpeer1", &haddrs[1 + i], 1);
+        hservers[i] = shardcache_create("hpeer1", hnodes_owner[i], 2, &hstorage, NULL, 5, 0, 1<<29);
+    }
+    hstorages[0].slow_ms = 1000;
+    shardcache_t *hserver = shardcache_create("hpeer0", hnodes, 2, NULL, NULL, 5, 0, 1<<29);
+    // let every remote fetch be hedged
+    shardcache_hedged_fetches(hserver, 100);
+
+    ut_testing("fetches from a slow address of the owner are hedged to another address");
+    int hedged_ok = 0;
+    for (i = 0; i < 4; i++) {
+        char prefix[32];
+        char hkey[32];
+        snprintf(prefix, sizeof(prefix), "slow_hedged%d_", i);
+        test_find_key(hserver, prefix, 0, hkey, sizeof(hkey));
+        test_storage_store(hkey, strlen(hkey), "hedged_value", 12, &hstorages[0]);
+        test_storage_store(hkey, strlen(hkey), "hedged_value", 12, &hstorages[1]);
+
+        struct timeval hstart, hend, helapsed;
+        gettimeofday(&hstart, NULL);
+        size_t hlen = 0;
+        void *hvalue = shardcache_get(hserver, hkey, strlen(hkey), &hlen, NULL);
+        gettimeofday(&hend, NULL);
+        timersub(&hend, &hstart, &helapsed);
+        if (hvalue && hlen == 12 && memcmp(hvalue, "hedged_value", 12) == 0 &&
+            helapsed.tv_sec == 0 && helapsed.tv_usec < 500000)
+        {
+            hedged_ok++;
+        }
+        free(hvalue);
+    }
+    // addresses never used are preferred, so at least one of the
+    // first two fetches has been sent to the slow address first
+    if (hedged_ok != 4)
+        ut_failure("%d fetches answered in time out of 4", hedged_ok);
+    else if (test_counter(hserver, "hedged_fetches_won") == 0)
+        ut_failure("No hedged fetch won the race");
+    else
+        ut_success();
+
+    shardcache_destroy(hserver);
+    for (i = 0; i < 2; i++) {
+        shardcache_destroy(hservers[i]);
+        shardcache_node_destroy(hnodes_owner[i][0]);
+        shardcache_node_destroy(hnodes_owner[i][1]);
+        shardcache_node_destroy(hnodes[i]);
+        test_storage_destroy(&hstorages[i]);
+    }
+
+    // the owner of the next keys (fpeer1) is down: once its circuit is open
+    // the fetches fail over to the next node on the continuum (fpeer2), which
+    // must load them from its own storage instead of asking fpeer1 again
+    shardcache_node_t *fnodes[3];
+    for (i = 0; i < 3; i++) {
+        char label[32];
+        char address[32];
+        snprintf(label, sizeof(label), "fpeer%d", i);
+        snprintf(address, sizeof(address), "127.0.0.1:%d", 9790 + i);
+        char *address_array[1] = { address };
+        fnodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+    test_storage_t fstorages[2];
+    shardcache_storage_t fstorage_ops[2];
+    for (i = 0; i < 2; i++)
+        test_storage_init(&fstorages[i], &fstorage_ops[i]);
+    shardcache_t *fserver0 = shardcache_create("fpeer0", fnodes, 3, NULL, NULL, 5, 0, 1<<29);
+    shardcache_t *fserver2 = shardcache_create("fpeer2", fnodes, 3, &fstorage_ops[1], NULL, 5, 0, 1<<29);
+    shardcache_t *fserver1 = NULL;
+    shardcache_breaker_threshold(fserver0, 1);
+    shardcache_breaker_cooldown(fserver0, 500);
+    shardcache_breaker_failover(fserver0, 1);
+
+    // keys owned by fpeer1 and taken over by fpeer2 when fpeer1 is out
+    char fkeys[3][32];
+    for (i = 0; i < 3; i++) {
+        int n;
+        for (n = 0; n < 10000; n++) {
+            char owner[1024];
+            size_t owner_len = sizeof(owner);
+            snprintf(fkeys[i], sizeof(fkeys[i]), "failover%d_%d", i, n);
+            if (shardcache_test_ownership(fserver0, fkeys[i], strlen(fkeys[i]), owner, &owner_len) == 0 &&
+                strcmp(owner, "fpeer1") == 0 &&
+                shardcache_test_failover_ownership(fserver0, fkeys[i], strlen(fkeys[i]),
+                                                   "fpeer1", owner, &owner_len) == 0 &&
+                strcmp(owner, "fpeer2") == 0)
+            {
+                break;
+            }
+        }
+        test_storage_store(fkeys[i], strlen(fkeys[i]), "failover_value", 14, &fstorages[1]);
+        test_storage_store(fkeys[i], strlen(fkeys[i]), "owner_value", 11, &fstorages[0]);
+    }
+
+    ut_testing("a fetch from a peer which is down opens its circuit");
+    size_t flen = 0;
+    void *fvalue = shardcache_get(fserver0, fkeys[0], strlen(fkeys[0]), &flen, NULL);
+    if (fvalue)
+        ut_failure("Got a value from a node which is down");
+    else if (test_counter(fserver0, "breakers_opened") != 1)
+        ut_failure("The circuit to the node is not open");
+    else
+        ut_success();
+    free(fvalue);
+
+    ut_testing("while the circuit is open the fetches fail over to the next node");
+    fvalue = shardcache_get(fserver0, fkeys[1], strlen(fkeys[1]), &flen, NULL);
+    if (!fvalue)
+        ut_failure("The fetch didn't fail over to the next node");
+    else
+        ut_validate_buffer(fvalue, flen, "failover_value", 14);
+    free(fvalue);
+
+    ut_testing("the circuit is closed once the peer is up again");
+    fserver1 = shardcache_create("fpeer1", fnodes, 3, &fstorage_ops[0], NULL, 5, 0, 1<<29);
+    // let the cooldown expire so that the next fetch probes the peer
+    usleep(1000000);
+    fvalue = shardcache_get(fserver0, fkeys[2], strlen(fkeys[2]), &flen, NULL);
+    if (!fvalue)
+        ut_failure("Can't fetch the value once the peer is up");
+    else if (test_counter(fserver0, "breakers_closed") != 1)
+        ut_failure("The circuit to the node is still open");
+    else
+        ut_validate_buffer(fvalue, flen, "owner_value", 11);
+    free(fvalue);
+
+    shardcache_destroy(fserver0);
+    shardcache_destroy(fserver2);
+    if (fserver1)
+        shardcache_destroy(fserver1);
+    for (i = 0; i < 3; i++)
+        shardcache_node_destroy(fnodes[i]);
+    for (i = 0; i < 2; i++)
+        test_storage_destroy(&fstorages[i]);
+
+    // the evictions for a peer which is down are queued until it's up again:
+    // the keys already queued must be coalesced instead of exhausting the
+    // backlog (and dropping the oldest evictions)
+    shardcache_node_t *enodes[2];
+    for (i = 0; i < 2; i++) {
+        char label[32];
+        char address[32];
+        snprintf(label, sizeof(label), "epeer%d", i);
+        snprintf(address, sizeof(address), "127.0.0.1:%d", 9795 + i);
+        char *address_array[1] = { address };
+        enodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+    test_storage_t estorage;
+    shardcache_storage_t estorage_ops;
+    test_storage_init(&estorage, &estorage_ops);
+    shardcache_t *eserver = shardcache_create("epeer0", enodes, 2, &estorage_ops, NULL, 5, 0, 1<<29);
+    // notify the evictions to all the peers
+    shardcache_tracked_evictions(eserver, 0);
+
+    ut_testing("evictions of the same key queued for a peer which is down are coalesced");
+    char ekey[32];
+    test_find_key(eserver, "evicted_key", 1, ekey, sizeof(ekey));
+    for (i = 0; i < 2000; i++)
+        shardcache_set(eserver, ekey, strlen(ekey), "evicted_value", 13);
+    usleep(100000);
+    if (test_counter(eserver, "dropped_evictions") != 0)
+        ut_failure("%d evictions dropped", (int)test_counter(eserver, "dropped_evictions"));
+    else
+        ut_success();
+
+    ut_testing("evictions of distinct keys queued for a peer which is down are batched together");
+    int n, num_ekeys = 0;
+    for (n = 0; n < 10000 && num_ekeys < 1000; n++) {
+        snprintf(ekey, sizeof(ekey), "evicted_key%d_", n);
+        if (shardcache_test_ownership(eserver, ekey, strlen(ekey), NULL, NULL) != 1)
+            continue;
+        shardcache_set(eserver, ekey, strlen(ekey), "evicted_value", 13);
+        num_ekeys++;
+    }
+    usleep(100000);
+    if (test_counter(eserver, "dropped_evictions") != 0)
+        ut_failure("%d evictions dropped", (int)test_counter(eserver, "dropped_evictions"));
+    else
+        ut_success();
+
+    shardcache_destroy(eserver);
+    for (i = 0; i < 2; i++)
+        shardcache_node_destroy(enodes[i]);
+    test_storage_destroy(&estorage);
+
+    // the owner notifies the evictions only to the peers which fetched the
+    // keys, unless it can't know about all the copies which might be around
+    shardcache_node_t *tnodes[3];
+    for (i = 0; i < 3; i++) {
+        char label[32];
+        char address[32];
+        snprintf(label, sizeof(label), "tpeer%d", i);
+        snprintf(address, sizeof(address), "127.0.0.1:%d", 9810 + i);
+        char *address_array[1] = { address };
+        tnodes[i] = shardcache_node_create(label, address_array, 1);
+    }
+    test_storage_t tstorages[3];
+    shardcache_storage_t tstorage_ops[3];
+    shardcache_t *tservers[3];
+    for (i = 0; i < 3; i++) {
+        test_storage_init(&tstorages[i], &tstorage_ops[i]);
+        tservers[i] = shardcache_create(shardcache_node_get_label(tnodes[i]), tnodes, 3,
+                                        &tstorage_ops[i], NULL, 5, 0, 1<<29);
+        shardcache_expire_time(tservers[i], 2);
+        shardcache_tracked_evictions(tservers[i], 1024);
+        shardcache_force_caching(tservers[i], 1);
+    }
+    // the third node fetches through dedicated connections which
+    // don't tell the owner who is asking
+    shardcache_peer_links(tservers[2], 0);
+    shardcache_use_persistent_connections(tservers[2], 0);
+    // the subscriptions are used only once the copies obtained
+    // before they were last reset are expired
+    sleep(4);
+
+    ut_testing("an eviction is notified only to the peers which fetched the key");
+    char tkey[32];
+    size_t tlen = 0;
+    test_find_key(tservers[0], "tracked_key", 1, tkey, sizeof(tkey));
+    test_storage_store(tkey, strlen(tkey), "tracked_value1", 14, &tstorages[0]);
+    void *tvalue = shardcache_get(tservers[1], tkey, strlen(tkey), &tlen, NULL);
+    int fetched = (tvalue && test_cached(tservers[1], tkey));
+    free(tvalue);
+    // a copy the owner doesn't know about
+    arc_load(tservers[2]->arc, tkey, strlen(tkey), "tracked_value1", 14);
+    uint64_t tracked = test_counter(tservers[0], "tracked_evictions");
+    shardcache_set(tservers[0], tkey, strlen(tkey), "tracked_value2", 14);
+    usleep(500000);
+    if (!fetched)
+        ut_failure("The copy of the key has not been kept");
+    else if (test_counter(tservers[0], "tracked_evictions") != tracked + 1)
+        ut_failure("The eviction has not been tracked");
+    else if (test_cached(tservers[1], tkey))
+        ut_failure("The copy of the peer which fetched the key has not been evicted");
+    else if (!test_cached(tservers[2], tkey))
+        ut_failure("The eviction has been notified to a peer which didn't fetch the key");
+    else
+        ut_success();
+
+    ut_testing("an eviction of a key which nobody fetched is skipped");
+    test_find_key(tservers[0], "skipped_key", 1, tkey, sizeof(tkey));
+    uint64_t skipped = test_counter(tservers[0], "skipped_evictions");
+    shardcache_set(tservers[0], tkey, strlen(tkey), "skipped_value", 13);
+    if (test_counter(tservers[0], "skipped_evictions") != skipped + 1)
+        ut_failure("The eviction has not been skipped");
+    else
+        ut_success();
+
+    ut_testing("a peer which didn't identify itself to the owner doesn't keep a stale copy");
+    test_find_key(tservers[0], "untracked_key", 1, tkey, sizeof(tkey));
+    test_storage_store(tkey, strlen(tkey), "untracked_value1", 16, &tstorages[0]);
+    tvalue = shardcache_get(tservers[2], tkey, strlen(tkey), &tlen, NULL);
+    free(tvalue);
+    usleep(100000);
+    int kept = test_cached(tservers[2], tkey);
+    shardcache_set(tservers[0], tkey, strlen(tkey), "untracked_value2", 16);
+    usleep(500000);
+    tvalue = shardcache_get(tservers[2], tkey, strlen(tkey), &tlen, NULL);
+    if (kept)
+        ut_failure("The copy fetched without identifying the peer has been kept");
+    else if (!tvalue)
+        ut_failure("Can't fetch the key from the owner");
+    else
+        ut_validate_buffer(tvalue, tlen, "untracked_value2", 16);
+    free(tvalue);
+
+    ut_testing("the evictions are broadcast during a migration");
+    test_find_key(tservers[0], "migration_key", 1, tkey, sizeof(tkey));
+    arc_load(tservers[2]->arc, tkey, strlen(tkey), "migration_value1", 16);
+    tracked = test_counter(tservers[0], "tracked_evictions");
+    skipped = test_counter(tservers[0], "skipped_evictions");
+    shardcache_migration_begin(tservers[0], tnodes, 3, 0);
+    shardcache_set(tservers[0], tkey, strlen(tkey), "migration_value2", 16);
+    usleep(500000);
+    shardcache_migration_abort(tservers[0]);
+    if (test_counter(tservers[0], "tracked_evictions") != tracked ||
+        test_counter(tservers[0], "skipped_evictions") != skipped)
+        ut_failure("The eviction has not been broadcast");
+    else if (test_cached(tservers[2], tkey))
+        ut_failure("The copy of the peer has not been evicted");
+    else
+        ut_success();
+
+    ut_testing("the evictions are broadcast once the subscriptions have been reset");
+    test_find_key(tservers[0], "reset_key", 1, tkey, sizeof(tkey));
+    arc_load(tservers[2]->arc, tkey, strlen(tkey), "reset_value1", 12);
+    shardcache_tracked_evictions(tservers[0], 0);
+    shardcache_tracked_evictions(tservers[0], 1024);
+    tracked = test_counter(tservers[0], "tracked_evictions");
+    skipped = test_counter(tservers[0], "skipped_evictions");
+    shardcache_set(tservers[0], tkey, strlen(tkey), "reset_value2", 12);
+    usleep(500000);
+    if (test_counter(tservers[0], "tracked_evictions") != tracked ||
+        test_counter(tservers[0], "skipped_evictions") != skipped)
+        ut_failure("The eviction has not been broadcast");
+    else if (test_cached(tservers[2], tkey))
+        ut_failure("The copy of the peer has not been evicted");
+    else
+        ut_success();
+
+    for (i = 0; i < 3; i++) {
+        shardcache_destroy(tservers[i]);
+        shardcache_node_destroy(tnodes[i]);
+        test_storage_destroy(&tstorages[i]);
+    }
+
+    ut_testing("the weight of a node follows the last '@' of its label");
+    shardcache_node_t *wnodes[4] = {
+        shardcache_node_create_from_string("wnode@3:127.0.0.1:9800"),
+        shardcache_node_create_from_string("user@host:127.0.0.1:9801"),
+        shardcache_node_create_from_string("user@host@2:127.0.0.1:9802"),
+        shardcache_node_create("wnode@5", (char *[]){ "127.0.0.1:9803" }, 1)
+    };
+    // the string of a node labeled like a weighted one must be parsed back as is
+    shardcache_node_t *wcopy = shardcache_node_create_from_string(shardcache_node_get_string(wnodes[3]));
+    if (!wnodes[0] || !wnodes[1] || !wnodes[2] || !wcopy)
+        ut_failure("Can't parse the node strings");
+    else if (strcmp(shardcache_node_get_label(wnodes[0]), "wnode") != 0 ||
+             shardcache_node_get_weight(wnodes[0]) != 3)
+        ut_failure("Bad weighted node %s", shardcache_node_get_string(wnodes[0]));
+    else if (strcmp(shardcache_node_get_label(wnodes[1]), "user@host") != 0 ||
+             shardcache_node_get_weight(wnodes[1]) != 1)
+        ut_failure("Bad node %s", shardcache_node_get_string(wnodes[1]));
+    else if (strcmp(shardcache_node_get_label(wnodes[2]), "user@host") != 0 ||
+             shardcache_node_get_weight(wnodes[2]) != 2)
+        ut_failure("Bad weighted node %s", shardcache_node_get_string(wnodes[2]));
+    else if (strcmp(shardcache_node_get_label(wcopy), "wnode@5") != 0 ||
+             shardcache_node_get_weight(wcopy) != 1)
+        ut_failure("Bad node %s", shardcache_node_get_string(wcopy));
+    else
+        ut_success();
+    for (i = 0; i < 4; i++) {
+        if (wnodes[i])
+            shardcache_node_destroy(wnodes[i]);
+    }
+    if (wcopy)
+        shardcache_node_destroy(wcopy);
+
+    // the share of the keys owned by each node is measured on a sample
+    // of the keys (distinct from the one used to compute the bound)
+    char *clabels[8] = { "cnode0", "cnode1", "cnode2", "cnode3",
+                         "cnode4", "cnode5", "cnode6", "cnode7" };
+    int cweights[4] = { 1, 1, 1, 3 };
+    int cowned[8];
+    int num_ckeys = 100000;
+
+    ut_testing("the keys are distributed proportionally to the weights of the nodes");
+    continuum_t *wcontinuum = continuum_create(clabels, cweights, 4, NULL, 0);
+    memset(cowned, 0, sizeof(cowned));
+    for (i = 0; i < num_ckeys; i++) {
+        char ckey[32];
+        snprintf(ckey, sizeof(ckey), "continuum_key%d", i);
+        cowned[continuum_lookup(wcontinuum, ckey, strlen(ckey))]++;
+    }
+    continuum_destroy(wcontinuum);
+    // the node with weight 3 must own about half of the keys
+    if (cowned[3] < num_ckeys * 40 / 100 || cowned[3] > num_ckeys * 60 / 100)
+        ut_failure("The node with weight 3 owns %d keys out of %d", cowned[3], num_ckeys);
+    else if (cowned[0] < num_ckeys * 10 / 100 || cowned[1] < num_ckeys * 10 / 100 ||
+             cowned[2] < num_ckeys * 10 / 100)
+        ut_failure("The nodes with weight 1 own %d, %d and %d keys out of %d",
+                   cowned[0], cowned[1], cowned[2], num_ckeys);
+    else
+        ut_success();
+
+    ut_testing("in bounded-load mode the keys above the bound are spilled to the other nodes");
+    continuum_t *bcontinuum = continuum_create(clabels, NULL, 8, "cnode0", 10);
+    continuum_t *bcontinuum2 = continuum_create(clabels, NULL, 8, "cnode1", 10);
+    memset(cowned, 0, sizeof(cowned));
+    int disagree = 0;
+    for (i = 0; i < num_ckeys; i++) {
+        char ckey[32];
+        snprintf(ckey, sizeof(ckey), "continuum_key%d", i);
+        int index = continuum_lookup(bcontinuum, ckey, strlen(ckey));
+        if (continuum_lookup(bcontinuum2, ckey, strlen(ckey)) != index)
+            disagree++;
+        cowned[index]++;
+    }
+    continuum_destroy(bcontinuum);
+    continuum_destroy(bcontinuum2);
+    int most_owned = 0;
+    for (i = 0; i < 8; i++) {
+        if (cowned[i] > most_owned)
+            most_owned = cowned[i];
+    }
+    // a share of 1/8 plus 10% (with some room for the sampling error)
+    if (disagree)
+        ut_failure("The nodes disagree on the owner of %d keys", disagree);
+    else if (most_owned > num_ckeys / 8 * 120 / 100)
+        ut_failure("A node owns %d keys out of %d", most_owned, num_ckeys);
+    else
+        ut_success();
+
+    // closing some connections leaves some workers with less connections than
+    // the others, new connections must be assigned to them (round-robin would
+    // give them to the workers following the last one used instead)
+    ut_testing("new connections are assigned to the least loaded workers");
+    int conns[5];
+    for (i = 0; i < 5; i++)
+        conns[i] = test_connect("127.0.0.1:9761");
+    close(conns[1]);
+    close(conns[3]);
+    usleep(100000);
+    conns[1] = test_connect("127.0.0.1:9761");
+    conns[3] = test_connect("127.0.0.1:9761");
+    usleep(100000);
+    uint64_t worker_fds[5] = { 0, 0, 0, 0, 0 };
+    if (test_worker_fds(servers2[1], worker_fds, 5) != 5) {
+        ut_failure("Can't get the number of connections handled by the workers");
+    } else {
+        uint64_t min_fds = worker_fds[0], max_fds = worker_fds[0];
+        for (i = 1; i < 5; i++) {
+            if (worker_fds[i] < min_fds)
+                min_fds = worker_fds[i];
+            if (worker_fds[i] > max_fds)
+                max_fds = worker_fds[i];
+        }
+        if (max_fds - min_fds > 1)
+            ut_failure("Unbalanced workers (%d - %d connections)", (int)min_fds, (int)max_fds);
+        else
+            ut_success();
+    }
+    for (i = 0; i < 5; i++) {
+        if (conns[i] >= 0)
+            close(conns[i]);
+    }
+
+    // saturate the storage of the second node (a single storage request
+    // allowed and kept busy by a slow fetch), the commands it refuses
+    // must be reported as busy also when forwarded by the other node
+    char busy_key[32];
+    test_find_key(servers2[1], "slow_busy_key", 1, slow_key, sizeof(slow_key));
+    test_find_key(servers2[1], "busy_key", 1, busy_key, sizeof(busy_key));
+    test_storage_store(slow_key, strlen(slow_key), "slow_value", 10, &storages2[1]);
+    test_storage_store(busy_key, strlen(busy_key), "busy_value", 10, &storages2[1]);
+    storages2[1].slow_ms = 1000;
+    int max_storage_requests = shardcache_max_storage_requests(servers2[1], 1);
+
+    pthread_t slow_thread;
+    test_slow_get_arg_t slow_arg = { nodes2[1], slow_key };
+    pthread_create(&slow_thread, NULL, test_slow_get, &slow_arg);
+    usleep(200000);
+
+    shardcache_client_t *busy_client = shardcache_client_create(&nodes2[1], 1, NULL);
+    shardcache_client_t *forwarding_client = shardcache_client_create(&nodes2[0], 1, NULL);
+    shardcache_client_busy_retries(busy_client, 0);
+    shardcache_client_busy_retries(forwarding_client, 0);
+
+    ut_testing("shardcache_client_get() on a busy node fails with SHARDCACHE_CLIENT_ERROR_BUSY");
+    value = NULL;
+    shardcache_client_get(busy_client, busy_key, strlen(busy_key), &value);
+    ut_validate_int(shardcache_client_errno(busy_client), SHARDCACHE_CLIENT_ERROR_BUSY);
+    free(value);
+
+    ut_testing("shardcache_client_exists() forwarded to a busy node fails with SHARDCACHE_CLIENT_ERROR_BUSY");
+    shardcache_client_exists(forwarding_client, busy_key, strlen(busy_key));
+    ut_validate_int(shardcache_client_errno(forwarding_client), SHARDCACHE_CLIENT_ERROR_BUSY);
+
+    ut_testing("shardcache_client_touch() forwarded to a busy node fails with SHARDCACHE_CLIENT_ERROR_BUSY");
+    shardcache_client_touch(forwarding_client, busy_key, strlen(busy_key));
+    ut_validate_int(shardcache_client_errno(forwarding_client), SHARDCACHE_CLIENT_ERROR_BUSY);
+
+    ut_testing("shardcache_client_set() forwarded to a busy node fails with SHARDCACHE_CLIENT_ERROR_BUSY");
+    shardcache_client_set(forwarding_client, busy_key, strlen(busy_key), "busy_value2", 11, 0);
+    ut_validate_int(shardcache_client_errno(forwarding_client), SHARDCACHE_CLIENT_ERROR_BUSY);
+
+    ut_testing("shardcache_client_del() forwarded to a busy node fails with SHARDCACHE_CLIENT_ERROR_BUSY");
+    shardcache_client_del(forwarding_client, busy_key, strlen(busy_key));
+    ut_validate_int(shardcache_client_errno(forwarding_client), SHARDCACHE_CLIENT_ERROR_BUSY);
+
+    pthread_join(slow_thread, NULL);
+    storages2[1].slow_ms = 0;
+    shardcache_max_storage_requests(servers2[1], max_storage_requests);
+
+    ut_testing("shardcache_client_get() succeeds once the node is not busy anymore");
+    size = shardcache_client_get(busy_client, busy_key, strlen(busy_key), &value);
+    ut_validate_buffer(value, size, "busy_value", 10);
+    free(value);
+    shardcache_client_destroy(busy_client);
+    shardcache_client_destroy(forwarding_client);
+
+    // the workers and the async threads never sleep in busy-poll mode
+    // but the requests must be served as usual
+    ut_testing("shardcache_busy_poll(servers2[0], 1) serves requests");
+    shardcache_busy_poll(servers2[0], 1);
+    shardcache_client_t *poll_client = shardcache_client_create(&nodes2[0], 1, NULL);
+    failed = 0;
+    for (i = 0; i < 20 && !failed; i++) {
+        char k[32];
+        char v[32];
+        snprintf(k, sizeof(k), "poll_key%d", i);
+        snprintf(v, sizeof(v), "poll_value%d", i);
+        value = NULL;
+        if (shardcache_client_set(poll_client, k, strlen(k), v, strlen(v), 0) != 0) {
+            ut_failure("Can't set %s", k);
+            failed = 1;
+        } else if (shardcache_client_get(poll_client, k, strlen(k), &value) != strlen(v) ||
+                   memcmp(value, v, strlen(v)) != 0)
+        {
+            ut_failure("Wrong value for %s", k);
+            failed = 1;
+        }
+        free(value);
+    }
+    if (!failed)
+        ut_success();
+
+    ut_testing("shardcache_busy_poll(servers2[0], 0) == 1");
+    ut_validate_int(shardcache_busy_poll(servers2[0], 0), 1);
+    shardcache_client_destroy(poll_client);
+
+    // a client knowing only the first node sends it a GET_MULTI for keys
+    // owned by both nodes, the values fetched from the local storage and
+    // from the other node must be kept in the cache
+    shardcache_client_t *multi_client = shardcache_client_create(&nodes2[0], 1, NULL);
+    shardcache_force_caching(servers2[0], 1);
+    char multi_keys[6][32];
+    shc_multi_item_t *multi_items[7];
+    for (i = 0; i < 6; i++) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "multi_key%d_", i);
+        test_find_key(servers2[0], prefix, (i < 3), multi_keys[i], sizeof(multi_keys[i]));
+        test_storage_store(multi_keys[i], strlen(multi_keys[i]), multi_keys[i], strlen(multi_keys[i]),
+                           (i < 3) ? &storages2[0] : &storages2[1]);
+    }
+    multi_items[6] = NULL;
+
+    int round;
+    int local_fetches = 0;
+    int remote_fetches = 0;
+    for (round = 0; round < 2; round++) {
+        ut_testing("GET_MULTI to a node for local and remote keys (round %d)", round);
+        for (i = 0; i < 6; i++)
+            multi_items[i] = shc_multi_item_create(multi_keys[i], strlen(multi_keys[i]), NULL, 0);
+        shardcache_client_get_multi(multi_client, multi_items);
+        failed = 0;
+        for (i = 0; i < 6; i++) {
+            if (!failed && (multi_items[i]->dlen != strlen(multi_keys[i]) ||
+                            memcmp(multi_items[i]->data, multi_keys[i], multi_items[i]->dlen) != 0))
+            {
+                ut_failure("Wrong value for %s", multi_keys[i]);
+                failed = 1;
+            }
+            shc_multi_item_destroy(multi_items[i]);
+        }
+        if (!failed)
+            ut_success();
+
+        if (round == 0) {
+            local_fetches = test_storage_fetches(&storages2[0]);
+            remote_fetches = test_storage_fetches(&storages2[1]);
+        }
+    }
+
+    ut_testing("The values returned by GET_MULTI are served from the cache");
+    if (test_storage_fetches(&storages2[0]) != local_fetches)
+        ut_failure("%d local keys fetched again", test_storage_fetches(&storages2[0]) - local_fetches);
+    else if (test_storage_fetches(&storages2[1]) != remote_fetches)
+        ut_failure("%d remote keys fetched again", test_storage_fetches(&storages2[1]) - remote_fetches);
+    else
+        ut_success();
+
+    shardcache_force_caching(servers2[0], 0);
+    shardcache_client_destroy(multi_client);
+
+    // the first node keeps a copy of a key owned by the second one and, once
+    // expired, revalidates it (the owner sends the value only if changed)
+    char rev_key[32];
+    test_find_key(servers2[0], "rev_key", 0, rev_key, sizeof(rev_key));
+    test_storage_store(rev_key, strlen(rev_key), "rev_value1", 10, &storages2[1]);
+    shardcache_force_caching(servers2[0], 1);
+    int expire_time = shardcache_expire_time(servers2[0], 1);
+    int lazy_expiration = shardcache_lazy_expiration(servers2[0], 1);
+
+    uint64_t rev_version = 0;
+    void *rev_value = NULL;
+    size_t rev_len = 0;
+    ut_testing("shardcache_get_if_modified() on a non-owner returns the value and its version");
+    rc = shardcache_get_if_modified(servers2[0], rev_key, strlen(rev_key), &rev_version, &rev_value, &rev_len);
+    if (rc != 0 || !rev_version)
+        ut_failure("rc %d, version %llu", rc, (unsigned long long)rev_version);
+    else
+        ut_validate_buffer(rev_value, rev_len, "rev_value1", 10);
+    free(rev_value);
+
+    uint64_t misses = test_counter(servers2[0], "cache_misses");
+    ut_testing("the value fetched by shardcache_get_if_modified() is kept in the cache");
+    value = shardcache_get(servers2[0], rev_key, strlen(rev_key), &size, NULL);
+    if (test_counter(servers2[0], "cache_misses") != misses)
+        ut_failure("The value has been fetched again");
+    else
+        ut_validate_buffer(value, size, "rev_value1", 10);
+    free(value);
+
+    sleep(2);
+
+    ut_testing("an expired copy which didn't change is revalidated");
+    value = shardcache_get(servers2[0], rev_key, strlen(rev_key), &size, NULL);
+    uint64_t current_version = rev_version;
+    rc = shardcache_get_if_modified(servers2[0], rev_key, strlen(rev_key), &current_version, NULL, NULL);
+    if (test_counter(servers2[0], "cache_misses") != misses)
+        ut_failure("The copy has been dropped");
+    else if (rc != 1)
+        ut_failure("The copy has a different version (rc %d)", rc);
+    else
+        ut_validate_buffer(value, size, "rev_value1", 10);
+    free(value);
+
+    // change the value behind the copy (the owner reloads it with a new version)
+    test_storage_store(rev_key, strlen(rev_key), "rev_value2", 10, &storages2[1]);
+    shardcache_evict(servers2[1], rev_key, strlen(rev_key));
+    sleep(2);
+
+    ut_testing("an expired copy which changed is updated in the cache");
+    value = shardcache_get(servers2[0], rev_key, strlen(rev_key), &size, NULL);
+    current_version = rev_version;
+    rev_value = NULL;
+    rc = shardcache_get_if_modified(servers2[0], rev_key, strlen(rev_key), &current_version, &rev_value, &rev_len);
+    if (test_counter(servers2[0], "cache_misses") != misses)
+        ut_failure("The copy has been dropped");
+    else if (rc != 0 || current_version == rev_version)
+        ut_failure("The version didn't change (rc %d)", rc);
+    else if (rev_len != 10 || memcmp(rev_value, "rev_value2", 10) != 0)
+        ut_failure("Wrong value returned by shardcache_get_if_modified()");
+    else
+        ut_validate_buffer(value, size, "rev_value2", 10);
+    free(value);
+    free(rev_value);
+
+    shardcache_lazy_expiration(servers2[0], lazy_expiration);
+    shardcache_expire_time(servers2[0], expire_time);
+    shardcache_force_caching(servers2[0], 0);
+
+    // the blocking reader parses the messages with the async state machine,
+    // they must be read also when arriving in pieces and the data following
+    // a message (which belongs to the next one) must not be lost silently
+    char sync_auth[17] = "0123456789abcdef";
+    shardcache_record_t sync_records[2] = {
+        { .v = "sync_value1", .l = 11 },
+        { .v = "sync_value2", .l = 11 }
+    };
+    fbuf_t sync_msg = FBUF_STATIC_INITIALIZER;
+    fbuf_t sync_out[2] = { FBUF_STATIC_INITIALIZER, FBUF_STATIC_INITIALIZER };
+    fbuf_t *sync_outp[2] = { &sync_out[0], &sync_out[1] };
+    int sync_sigs[3] = { 0, SHC_HDR_SIGNATURE_SIP, SHC_HDR_SIGNATURE_SIP|SHC_SIG_WIDE_RECORDS };
+    int sync_pieces[2] = { 0, 1 };
+    int s, p;
+    for (s = 0; s < 3; s++) {
+        for (p = 0; p < 2; p++) {
+            char *auth = sync_sigs[s] ? sync_auth : NULL;
+            ut_testing("read_message() of a message %s (signature %02x, %s)",
+                       sync_pieces[p] ? "sent one byte at a time" : "followed by a noop",
+                       SHC_SIG_HDR(sync_sigs[s]), (sync_sigs[s] & SHC_SIG_WIDE_RECORDS) ? "wide" : "16bit");
+            fbuf_clear(&sync_msg);
+            build_message(auth, sync_sigs[s], SHC_HDR_RESPONSE, sync_records, 2, &sync_msg);
+            if (!sync_pieces[p]) {
+                char noop = SHC_HDR_NOOP;
+                fbuf_add_binary(&sync_msg, &noop, 1);
+            }
+            fbuf_clear(&sync_out[0]);
+            fbuf_clear(&sync_out[1]);
+            rc = test_read_message(&sync_msg, sync_pieces[p], auth, sync_outp, 2);
+            if (rc != 2)
+                ut_failure("read_message() returned %d", rc);
+            else if (fbuf_used(&sync_out[1]) != 11 || memcmp(fbuf_data(&sync_out[1]), "sync_value2", 11) != 0)
+                ut_failure("Wrong second record");
+            else
+                ut_validate_buffer(fbuf_data(&sync_out[0]), fbuf_used(&sync_out[0]), "sync_value1", 11);
+        }
+    }
+
+    fbuf_clear(&sync_msg);
+    build_message(sync_auth, SHC_HDR_SIGNATURE_SIP, SHC_HDR_RESPONSE, sync_records, 2, &sync_msg);
+
+    ut_testing("read_message() consumes the records the caller is not interested in");
+    fbuf_clear(&sync_out[0]);
+    rc = test_read_message(&sync_msg, 0, sync_auth, sync_outp, 1);
+    if (rc != 2)
+        ut_failure("read_message() returned %d", rc);
+    else
+        ut_validate_buffer(fbuf_data(&sync_out[0]), fbuf_used(&sync_out[0]), "sync_value1", 11);
+
+    ut_testing("read_message() fails if the signature can't be verified");
+    rc = test_read_message(&sync_msg, 0, "fedcba9876543210", sync_outp, 2);
+    ut_validate_int(rc, -1);
+
+    ut_testing("read_message() fails if the data of another message follows");
+    build_message(sync_auth, SHC_HDR_SIGNATURE_SIP, SHC_HDR_RESPONSE, sync_records, 2, &sync_msg);
+    rc = test_read_message(&sync_msg, 0, sync_auth, sync_outp, 2);
+    ut_validate_int(rc, -1);
+
+    fbuf_destroy(&sync_msg);
+    fbuf_destroy(&sync_out[0]);
+    fbuf_destroy(&sync_out[1]);
+
+    // the async reader doesn't buffer whole chunks anymore, records bigger
+    // than a chunk (and than the input buffer) must be decoded as they arrive,
+    // including the chunk-signed and the compressed ones
+    size_t big_len = 300000;
+    char *big_value = malloc(big_len);
+    for (i = 0; i < (int)big_len; i++)
+        big_value[i] = (i / 100) % 251;
+    shardcache_record_t big_record = { .v = big_value, .l = big_len };
+    int big_sigs[4] = {
+        SHC_HDR_SIGNATURE_SIP,
+        SHC_HDR_CSIGNATURE_SIP,
+        SHC_HDR_CSIGNATURE_SIP|SHC_SIG_WIDE_RECORDS,
+        SHC_HDR_SIGNATURE_SIP|SHC_SIG_COMPRESSION(SHARDCACHE_COMPRESSION_LZ4)
+    };
+    int big_pieces[3] = { 1000, 65536, 1000000 };
+    for (s = 0; s < 4; s++) {
+        int algo = SHC_SIG_COMPRESSION_ALGO(big_sigs[s]);
+        if (algo && !shc_compression_supported(algo))
+            continue;
+        fbuf_t big_msg = FBUF_STATIC_INITIALIZER;
+        build_message(sync_auth, big_sigs[s], SHC_HDR_RESPONSE, &big_record, 1, &big_msg);
+        for (p = 0; p < 3; p++) {
+            ut_testing("async reader of a %zu bytes record (signature %02x%s%s) in pieces of %d bytes",
+                       big_len, SHC_SIG_HDR(big_sigs[s]),
+                       (big_sigs[s] & SHC_SIG_WIDE_RECORDS) ? ", wide" : "",
+                       algo ? ", compressed" : "", big_pieces[p]);
+            test_async_value_t big_arg;
+            memset(&big_arg, 0, sizeof(big_arg));
+            if (test_async_read(sync_auth, &big_msg, big_pieces[p], &big_arg) != 0)
+                ut_failure("Can't parse the message");
+            else
+                ut_validate_buffer(fbuf_data(&big_arg.value), fbuf_used(&big_arg.value), big_value, big_len);
+            fbuf_destroy(&big_arg.value);
+        }
+        fbuf_destroy(&big_msg);
+    }
+    free(big_value);
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    int allowed_cpus[CPU_SETSIZE];
+    int num_allowed = 0;
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed))
+            allowed_cpus[num_allowed++] = i;
+    }
+
+    // the threads can be told apart only if they could run on other cpus
+    int pinned = test_threads_pinned_to(allowed_cpus[0]);
+    ut_testing("shardcache_workers_cpu_affinity(servers2[0], cpu%d) pins the 5 workers", allowed_cpus[0]);
+    rc = shardcache_workers_cpu_affinity(servers2[0], allowed_cpus, 1);
+    if (rc != 0)
+        ut_failure("shardcache_workers_cpu_affinity() returned %d", rc);
+    else if (num_allowed > 1 && test_threads_pinned_to(allowed_cpus[0]) != pinned + 5)
+        ut_failure("%d threads pinned to cpu%d instead of %d",
+                   test_threads_pinned_to(allowed_cpus[0]), allowed_cpus[0], pinned + 5);
+    else
+        ut_success();
+
+    pinned = test_threads_pinned_to(allowed_cpus[0]);
+    ut_testing("shardcache_async_cpu_affinity(servers2[0], cpu%d) pins the async threads", allowed_cpus[0]);
+    rc = shardcache_async_cpu_affinity(servers2[0], allowed_cpus, 1);
+    if (rc != 0)
+        ut_failure("shardcache_async_cpu_affinity() returned %d", rc);
+    else if (num_allowed > 1 && test_threads_pinned_to(allowed_cpus[0]) <= pinned)
+        ut_failure("No async thread pinned to cpu%d", allowed_cpus[0]);
+    else
+        ut_success();
+
+    // spread the threads again over all the cpus
+    shardcache_workers_cpu_affinity(servers2[0], allowed_cpus, num_allowed);
+    shardcache_async_cpu_affinity(servers2[0], allowed_cpus, num_allowed);
+#endif
+
     ut_testing("destroying all clients");
     shardcache_client_destroy(client);
     shardcache_client_destroy(client1);
@@ -336,6 +1841,14 @@ int main(int argc, char **argv)
         ut_success();
     }
 
+    for (i = 0; i < num_nodes; i++) {
+        ut_testing("destroying server2 %d", i);
+        shardcache_destroy(servers2[i]);
+        shardcache_node_destroy(nodes2[i]);
+        test_storage_destroy(&storages2[i]);
+        ut_success();
+    }
+
     free(nodes);
 
     ut_summary();
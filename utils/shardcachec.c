@@ -39,14 +39,13 @@ static int parse_nodes_string(char *str)
     while (s && *s) {
         char *tok = strsep(&s, ",");
         if(tok) {
-            char *label = strsep(&tok, ":");
-            char *addr = tok;
-            if (!addr) {
+            // label[@weight]:address
+            shardcache_node_t *node = shardcache_node_create_from_string(tok);
+            if (!node) {
                 free(copy);
                 return -1;
             }
             nodes = realloc(nodes, (num_nodes + 1) * sizeof(shardcache_node_t *));
-            shardcache_node_t *node = shardcache_node_create(label, &addr, 1);
             nodes[num_nodes++] = node;
         } 
     }
@@ -44,6 +44,15 @@ static uint64_t num_sets = 0;
 static uint64_t num_responses = 0;
 static uint64_t num_running_clients = 0;
 char *index_file = NULL;
+
+// response latencies histogram (LATENCY_RESOLUTION microsecs per bucket,
+// the last bucket collects all the slower responses)
+#define LATENCY_RESOLUTION 10
+#define LATENCY_BUCKETS 10000
+static uint64_t latencies[LATENCY_BUCKETS];
+
+// max number of requests pipelined ahead on a connection
+#define MAX_PIPELINED 128
 shardcache_counters_t *counters = NULL;
 hashtable_t *prev_counts = NULL;
 
@@ -54,6 +63,7 @@ typedef struct {
     uint64_t num_responses;
     char *node;
     struct timeval last_update;
+    struct timeval sent_at[MAX_PIPELINED]; // responses arrive in order
 } client_ctx;
 
 static void
@@ -124,8 +134,8 @@ send_command(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
     client_ctx *ctx = (client_ctx *)priv;
     fbuf_t *output_buffer = ctx->output;
 
-    // don't pipeline more than 1024 requests ahead
-    if (__sync_fetch_and_add(&ctx->num_requests, 0) - __sync_fetch_and_add(&ctx->num_responses, 0) < 128 &&
+    // don't pipeline more than MAX_PIPELINED requests ahead
+    if (__sync_fetch_and_add(&ctx->num_requests, 0) - __sync_fetch_and_add(&ctx->num_responses, 0) < MAX_PIPELINED &&
        (!max_requests || max_requests > __sync_fetch_and_add(&ctx->num_requests, 0)))
     {
         uint32_t idx = random() % ((num_keys && num_keys < keys_index->size) ? num_keys : keys_index->size);
@@ -171,7 +181,8 @@ send_command(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
             else
                 __sync_add_and_fetch(&num_sets, 1);
 
-            __sync_fetch_and_add(&ctx->num_requests, 1);
+            uint64_t slot = __sync_fetch_and_add(&ctx->num_requests, 1) % MAX_PIPELINED;
+            gettimeofday(&ctx->sent_at[slot], NULL);
         } else {
             fprintf(stderr, "Can't create new command!\n");
         }
@@ -195,8 +206,15 @@ discard_response(iomux_t *iomux, int fd, unsigned char *data, int len, void *pri
     //printf("received %d\n", len);
     async_read_context_state_t state = async_read_context_input_data(ctx->reader, data, len, &processed);
     while (state == SHC_STATE_READING_DONE) {
+        struct timeval now, diff;
+        gettimeofday(&now, NULL);
+        uint64_t slot = __sync_fetch_and_add(&ctx->num_responses, 1) % MAX_PIPELINED;
+        timersub(&now, &ctx->sent_at[slot], &diff);
+        uint64_t bucket = ((diff.tv_sec * 1000000) + diff.tv_usec) / LATENCY_RESOLUTION;
+        if (bucket >= LATENCY_BUCKETS)
+            bucket = LATENCY_BUCKETS - 1;
+        __sync_add_and_fetch(&latencies[bucket], 1);
         __sync_add_and_fetch(&num_responses, 1);
-        __sync_add_and_fetch(&ctx->num_responses, 1);
         state = async_read_context_update(ctx->reader);
     }
     if (state == SHC_STATE_READING_ERR) {
@@ -253,6 +271,35 @@ timeout_connection(iomux_t *iomux, int fd, void *priv)
     }
 }
 
+// collect (and reset) the latencies measured since the last call
+// and compute the requested percentiles (in microsecs)
+static void
+latency_percentiles(uint64_t *p50, uint64_t *p99)
+{
+    static uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = __sync_lock_test_and_set(&latencies[i], 0);
+        total += counts[i];
+    }
+
+    *p50 = *p99 = 0;
+    if (!total)
+        return;
+
+    uint64_t seen = 0;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (!*p50 && seen * 100 >= total * 50)
+            *p50 = (i + 1) * LATENCY_RESOLUTION;
+        if (seen * 100 >= total * 99) {
+            *p99 = (i + 1) * LATENCY_RESOLUTION;
+            break;
+        }
+    }
+}
+
 static void
 *worker(void *priv)
 {
@@ -521,7 +568,8 @@ main (int argc, char **argv)
 
     if (stats_file) {
         char *columns = "num_clients,gets,sets,num_responses,total_responses/s,"
-                        "avg_responses/s,slowest,fastest,stuck_clients\n";
+                        "avg_responses/s,slowest,fastest,stuck_clients,"
+                        "p50_latency_us,p99_latency_us\n";
         fwrite(columns, strlen(columns), 1, stats_file);
     }
 
@@ -572,6 +620,8 @@ main (int argc, char **argv)
         uint64_t gets_total = __sync_fetch_and_add(&num_gets, 0);
         uint64_t sets_total = __sync_fetch_and_add(&num_sets, 0);
         uint64_t responses_total = __sync_fetch_and_add(&num_responses, 0);
+        uint64_t p50_latency, p99_latency;
+        latency_percentiles(&p50_latency, &p99_latency);
         if (print_stats) {
             
             printf("\033[H\033[J"
@@ -583,7 +633,9 @@ main (int argc, char **argv)
                    "\navg_responses/s: %" PRIu64
                    "\nslowest: %" PRIu64 " (%s)"
                    "\nfastest: %" PRIu64
-                   "\nstuck_clients: %" PRIu64,
+                   "\nstuck_clients: %" PRIu64
+                   "\np50_latency: %" PRIu64 " us"
+                   "\np99_latency: %" PRIu64 " us",
                    running_clients,
                    gets_total,
                    sets_total,
@@ -593,16 +645,18 @@ main (int argc, char **argv)
                    slowest_client,
                    slowest_label,
                    fastest_client,
-                   stuck_clients);
+                   stuck_clients,
+                   p50_latency,
+                   p99_latency);
         }
         if (slowest_label)
             free(slowest_label);
 
         if (stats_file) {
-            char line[(10*9) + 10];
+            char line[(20*11) + 12];
             snprintf(line, sizeof(line),
                      "%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"
-                     PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",\n",
+                     PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
                      running_clients,
                      gets_total,
                      sets_total,
@@ -611,7 +665,9 @@ main (int argc, char **argv)
                      avg_responses,
                      slowest_client,
                      fastest_client,
-                     stuck_clients);
+                     stuck_clients,
+                     p50_latency,
+                     p99_latency);
             if (fwrite(line, strlen(line), 1, stats_file) != 1) {
                 fprintf(stderr, "Can't dump the new line to the stats file: %s\n", strerror(errno));
                 exit(-2);